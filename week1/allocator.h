@@ -0,0 +1,597 @@
+// Allocators for rtl::vector, or any container that takes a std-style
+// allocator:
+//
+//   arena_allocator    bumps a pointer through big blocks, and frees it all
+//                      at once with arena::reset().
+//   pool_allocator     keeps freed blocks on a free list per size class.
+//   caching_allocator  malloc, with a per-thread cache of freed blocks in
+//                      front of it.
+//   huge_page_allocator  cache line aligned blocks; big ones are mapped
+//                        straight from the kernel onto huge pages, and
+//                        grow in place with mremap.
+//
+// Arenas and pools aren't thread safe; give each thread its own.
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace rtl {
+
+// Blocks are rounded up to a power of two from 16 bytes up. Index 0 is 16
+// bytes, 1 is 32 and so on.
+inline size_t size_class_index(size_t bytes)
+{
+    if (bytes <= 16)
+        return 0;
+    return 64 - __builtin_clzll((unsigned long long) (bytes - 1)) - 4;
+}
+
+inline size_t size_class_bytes(size_t index)
+{
+    return size_t(16) << index;
+}
+
+// Memory for short-lived objects. Allocating bumps a pointer through blocks of
+// 'blockSize' (or bigger, for a big allocation). Freeing does nothing, except
+// for the most recent allocation, which is given back; reset() frees
+// everything at once, keeping the first block for reuse.
+class arena {
+public:
+    explicit arena(size_t blockSize = 64 << 10)
+      : _blockSize(blockSize), _blocks(NULL), _next(NULL), _end(NULL)
+    {}
+
+    ~arena()
+    {
+        free_blocks(NULL);
+    }
+
+    void* allocate(size_t bytes, size_t alignment)
+    {
+        // Aligning can take 'p' past the end of the block.
+        char* p = align(_next, alignment);
+        if (_blocks == NULL || p > _end || size_t(_end - p) < bytes) {
+            add_block(bytes + alignment);
+            p = align(_next, alignment);
+        }
+        _next = p + bytes;
+        return p;
+    }
+
+    void deallocate(void* p, size_t bytes)
+    {
+        if ((char*) p + bytes == _next)
+            _next = (char*) p;
+    }
+
+    // Free everything that was allocated. The oldest block is kept.
+    void reset()
+    {
+        if (_blocks == NULL)
+            return;
+
+        block* first = _blocks;
+        while (first->next != NULL)
+            first = first->next;
+        free_blocks(first);
+
+        _blocks = first;
+        _next = first->data();
+        _end = _next + first->size;
+    }
+
+    // Bytes taken from malloc, including block headers.
+    size_t reserved() const
+    {
+        size_t total = 0;
+        for (block* b = _blocks; b != NULL; b = b->next)
+            total += sizeof(block) + b->size;
+        return total;
+    }
+
+private:
+    arena(arena const&);
+    arena& operator=(arena const&);
+
+    // The block's memory follows the header, which is padded to keep it
+    // aligned like malloc's.
+    struct alignas(16) block {
+        block* next;
+        size_t size;
+
+        char* data()
+        {
+            return (char*) (this + 1);
+        }
+    };
+
+    static char* align(char* p, size_t alignment)
+    {
+        size_t address = (size_t) p;
+        return (char*) ((address + alignment - 1) & ~(alignment - 1));
+    }
+
+    void add_block(size_t minSize)
+    {
+        size_t size = minSize > _blockSize ? minSize : _blockSize;
+        block* b = (block*) malloc(sizeof(block) + size);
+        if (b == NULL)
+            throw std::bad_alloc();
+        b->next = _blocks;
+        b->size = size;
+        _blocks = b;
+        _next = b->data();
+        _end = _next + size;
+    }
+
+    // Free every block newer than 'keep' (all of them, for NULL).
+    void free_blocks(block* keep)
+    {
+        while (_blocks != keep) {
+            block* next = _blocks->next;
+            free(_blocks);
+            _blocks = next;
+        }
+        if (keep != NULL)
+            keep->next = NULL;
+    }
+
+    size_t _blockSize;
+    block* _blocks;         // Newest first.
+    char* _next;
+    char* _end;
+};
+
+template <typename T>
+class arena_allocator {
+public:
+    typedef T value_type;
+
+    explicit arena_allocator(arena& a)
+      : _arena(&a)
+    {}
+
+    template <typename U>
+    arena_allocator(arena_allocator<U> const& other)
+      : _arena(other.get_arena())
+    {}
+
+    T* allocate(size_t n)
+    {
+        return (T*) _arena->allocate(n * sizeof(T), alignof(T));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        _arena->deallocate(p, n * sizeof(T));
+    }
+
+    arena* get_arena() const
+    {
+        return _arena;
+    }
+
+private:
+    arena* _arena;
+};
+
+template <typename T, typename U>
+bool operator==(arena_allocator<T> const& a, arena_allocator<U> const& b)
+{
+    return a.get_arena() == b.get_arena();
+}
+
+template <typename T, typename U>
+bool operator!=(arena_allocator<T> const& a, arena_allocator<U> const& b)
+{
+    return !(a == b);
+}
+
+// Hands out blocks by size class, each class carved out of big slabs and
+// keeping its own free list. Freed blocks go back on their list, and the
+// slabs are only freed along with the pool. Blocks bigger than the biggest
+// class come straight from malloc.
+class pool {
+public:
+    static const size_t num_classes = 13;    // Up to 64KB.
+
+    explicit pool(size_t slabSize = 256 << 10)
+      : _slabSize(slabSize), _slabs(NULL)
+    {
+        for (size_t i=0; i < num_classes; i++)
+            _free[i] = NULL;
+    }
+
+    ~pool()
+    {
+        while (_slabs != NULL) {
+            free_block* next = _slabs->next;
+            free(_slabs);
+            _slabs = next;
+        }
+    }
+
+    void* allocate(size_t bytes)
+    {
+        size_t index = size_class_index(bytes);
+        if (index >= num_classes) {
+            void* p = malloc(bytes);
+            if (p == NULL)
+                throw std::bad_alloc();
+            return p;
+        }
+
+        if (_free[index] == NULL)
+            add_slab(index);
+
+        free_block* b = _free[index];
+        _free[index] = b->next;
+        return b;
+    }
+
+    void deallocate(void* p, size_t bytes)
+    {
+        size_t index = size_class_index(bytes);
+        if (index >= num_classes) {
+            free(p);
+            return;
+        }
+
+        free_block* b = (free_block*) p;
+        b->next = _free[index];
+        _free[index] = b;
+    }
+
+private:
+    pool(pool const&);
+    pool& operator=(pool const&);
+
+    struct free_block {
+        free_block* next;
+    };
+
+    // Carve a new slab into blocks for class 'index'. The first 16 bytes
+    // link the slab into _slabs.
+    void add_slab(size_t index)
+    {
+        size_t blockSize = size_class_bytes(index);
+        size_t numBlocks = _slabSize / blockSize;
+        if (numBlocks == 0)
+            numBlocks = 1;
+
+        char* slab = (char*) malloc(16 + numBlocks * blockSize);
+        if (slab == NULL)
+            throw std::bad_alloc();
+        ((free_block*) slab)->next = _slabs;
+        _slabs = (free_block*) slab;
+
+        for (size_t i = numBlocks; i > 0; i--) {
+            free_block* b = (free_block*) (slab + 16 + (i - 1) * blockSize);
+            b->next = _free[index];
+            _free[index] = b;
+        }
+    }
+
+    size_t _slabSize;
+    free_block* _slabs;
+    free_block* _free[num_classes];
+};
+
+template <typename T>
+class pool_allocator {
+public:
+    typedef T value_type;
+
+    explicit pool_allocator(pool& p)
+      : _pool(&p)
+    {}
+
+    template <typename U>
+    pool_allocator(pool_allocator<U> const& other)
+      : _pool(other.get_pool())
+    {}
+
+    T* allocate(size_t n)
+    {
+        return (T*) _pool->allocate(n * sizeof(T));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        _pool->deallocate(p, n * sizeof(T));
+    }
+
+    pool* get_pool() const
+    {
+        return _pool;
+    }
+
+private:
+    pool* _pool;
+};
+
+template <typename T, typename U>
+bool operator==(pool_allocator<T> const& a, pool_allocator<U> const& b)
+{
+    return a.get_pool() == b.get_pool();
+}
+
+template <typename T, typename U>
+bool operator!=(pool_allocator<T> const& a, pool_allocator<U> const& b)
+{
+    return !(a == b);
+}
+
+// Each thread's cache of freed blocks for caching_allocator, a free list per
+// size class. A class holds on to at most 'cache_bytes' worth of blocks
+// (and at least 4); beyond that they go back to malloc.
+class thread_block_cache {
+public:
+    static const size_t num_classes = 17;    // Up to 1MB.
+    static const size_t cache_bytes = 1 << 20;
+
+    thread_block_cache()
+    {
+        for (size_t i=0; i < num_classes; i++) {
+            _free[i] = NULL;
+            _count[i] = 0;
+        }
+    }
+
+    ~thread_block_cache()
+    {
+        for (size_t i=0; i < num_classes; i++) {
+            while (_free[i] != NULL) {
+                free_block* next = _free[i]->next;
+                free(_free[i]);
+                _free[i] = next;
+            }
+        }
+        gone() = true;
+    }
+
+    // This thread's cache, or NULL while the thread is exiting and the cache
+    // has already been destroyed (other thread-locals can still free memory
+    // then).
+    static thread_block_cache* current()
+    {
+        if (gone())
+            return NULL;
+        static thread_local thread_block_cache cache;
+        return &cache;
+    }
+
+    void* allocate(size_t index)
+    {
+        free_block* b = _free[index];
+        if (b == NULL)
+            return NULL;
+        _free[index] = b->next;
+        _count[index]--;
+        return b;
+    }
+
+    // Returns false if the class's cache is full.
+    bool deallocate(void* p, size_t index)
+    {
+        size_t limit = cache_bytes / size_class_bytes(index);
+        if (_count[index] >= (limit < 4 ? 4 : limit))
+            return false;
+
+        free_block* b = (free_block*) p;
+        b->next = _free[index];
+        _free[index] = b;
+        _count[index]++;
+        return true;
+    }
+
+private:
+    thread_block_cache(thread_block_cache const&);
+    thread_block_cache& operator=(thread_block_cache const&);
+
+    struct free_block {
+        free_block* next;
+    };
+
+    static bool& gone()
+    {
+        static thread_local bool gone = false;
+        return gone;
+    }
+
+    free_block* _free[num_classes];
+    size_t _count[num_classes];
+};
+
+// malloc with a per-thread cache in front. Blocks are rounded up to their size
+// class so any thread's cache can take them back, whichever thread they came
+// from. Stateless, so all caching_allocators are equal.
+template <typename T>
+class caching_allocator {
+public:
+    typedef T value_type;
+
+    caching_allocator()
+    {}
+
+    template <typename U>
+    caching_allocator(caching_allocator<U> const&)
+    {}
+
+    T* allocate(size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        size_t index = size_class_index(bytes);
+        if (index < thread_block_cache::num_classes) {
+            thread_block_cache* cache = thread_block_cache::current();
+            void* p = cache != NULL ? cache->allocate(index) : NULL;
+            if (p != NULL)
+                return (T*) p;
+            bytes = size_class_bytes(index);
+        }
+
+        void* p = malloc(bytes);
+        if (p == NULL)
+            throw std::bad_alloc();
+        return (T*) p;
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        size_t index = size_class_index(n * sizeof(T));
+        if (index < thread_block_cache::num_classes) {
+            thread_block_cache* cache = thread_block_cache::current();
+            if (cache != NULL && cache->deallocate(p, index))
+                return;
+        }
+        free(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(caching_allocator<T> const&, caching_allocator<U> const&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(caching_allocator<T> const&, caching_allocator<U> const&)
+{
+    return false;
+}
+
+// Blocks for big arrays. Everything is aligned to a cache line, so SIMD
+// loops never straddle one. Blocks from huge_page_threshold up are mapped
+// directly, page aligned and marked for transparent huge pages, which saves
+// TLB misses when walking many gigabytes. Stateless, so all
+// huge_page_allocators are equal.
+//
+// reallocate() grows a block, keeping its bytes. Mapped blocks grow with
+// mremap, which moves page table entries rather than data, so vector uses it
+// for elements that are trivially relocatable.
+template <typename T>
+class huge_page_allocator {
+public:
+    typedef T value_type;
+
+    static const size_t alignment = 64;
+    static const size_t huge_page_threshold = size_t(2) << 20;
+
+    huge_page_allocator()
+    {}
+
+    template <typename U>
+    huge_page_allocator(huge_page_allocator<U> const&)
+    {}
+
+    T* allocate(size_t n)
+    {
+        return (T*) allocate_bytes(n * sizeof(T));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        deallocate_bytes(p, n * sizeof(T));
+    }
+
+    // Grow or shrink 'p' from 'oldN' to 'newN' elements, keeping the first
+    // min(oldN, newN) elements' bytes. The block may move. If it throws, 'p'
+    // is still good.
+    T* reallocate(T* p, size_t oldN, size_t newN)
+    {
+        size_t oldBytes = oldN * sizeof(T);
+        size_t newBytes = newN * sizeof(T);
+        if (p == NULL)
+            return allocate(newN);
+
+#ifdef MREMAP_MAYMOVE
+        if (is_mapped(oldBytes) && is_mapped(newBytes)) {
+            void* q = mremap(p, mapped_bytes(oldBytes), mapped_bytes(newBytes), MREMAP_MAYMOVE);
+            if (q == MAP_FAILED)
+                throw std::bad_alloc();
+            advise_huge_pages(q, mapped_bytes(newBytes));
+            return (T*) q;
+        }
+#endif
+
+        void* q = allocate_bytes(newBytes);
+        memcpy(q, (const void*) p, oldBytes < newBytes ? oldBytes : newBytes);
+        deallocate_bytes(p, oldBytes);
+        return (T*) q;
+    }
+
+    // Whether a block of 'bytes' is mapped straight from the kernel.
+    static bool is_mapped(size_t bytes)
+    {
+        return bytes >= huge_page_threshold;
+    }
+
+private:
+    static size_t mapped_bytes(size_t bytes)
+    {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        return (bytes + page - 1) / page * page;
+    }
+
+    static void advise_huge_pages(void* p, size_t bytes)
+    {
+#ifdef MADV_HUGEPAGE
+        // Only a hint; without THP support the pages just stay small.
+        madvise(p, bytes, MADV_HUGEPAGE);
+#else
+        (void) p;
+        (void) bytes;
+#endif
+    }
+
+    static void* allocate_bytes(size_t bytes)
+    {
+        if (is_mapped(bytes)) {
+            void* p = mmap(NULL, mapped_bytes(bytes), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                throw std::bad_alloc();
+            advise_huge_pages(p, mapped_bytes(bytes));
+            return p;
+        }
+
+        void* p = NULL;
+        if (posix_memalign(&p, alignment, bytes == 0 ? alignment : bytes) != 0)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    static void deallocate_bytes(void* p, size_t bytes)
+    {
+        if (is_mapped(bytes))
+            munmap(p, mapped_bytes(bytes));
+        else
+            free(p);
+    }
+};
+
+template <typename T>
+const size_t huge_page_allocator<T>::alignment;
+
+template <typename T>
+const size_t huge_page_allocator<T>::huge_page_threshold;
+
+template <typename T, typename U>
+bool operator==(huge_page_allocator<T> const&, huge_page_allocator<U> const&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(huge_page_allocator<T> const&, huge_page_allocator<U> const&)
+{
+    return false;
+}
+
+}  // namespace rtl
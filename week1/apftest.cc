@@ -1,7 +1,37 @@
 
 #include "vector.h"
 #include "sort.h"
-
+#include "allocator.h"
+#include "btree.h"
+#include "concurrent_vector.h"
+#include "data_file.h"
+#include "external_sort.h"
+#include "hash_map.h"
+#include "indirect_sort.h"
+#include "instrument.h"
+#include "loser_tree.h"
+#include "merge.h"
+#include "parallel_sort.h"
+#include "persistent_vector.h"
+#include "radix_sort.h"
+#include "segmented_vector.h"
+#include "small_vector.h"
+#include "thread_pool.h"
+
+#include "apftest.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <map>
+#include <set>
+#include <memory>
+#include <limits>
 #include <sstream>
 #include <iostream>
 
@@ -49,7 +79,160 @@ void run_test_with_name(void(*func)(), std::string const& name)
 #define test_equals(a,b) test_equals_with_location((a),(b), SourceLocation(__LINE__, __FILE__))
 #define run_test(name) run_test_with_name(name, #name)
 
-std::string to_string(vector<std::string> const& v)
+// Benchmarks are functions that do what they measure 'iterations' times,
+// and return how many seconds that took, leaving out any setup.
+typedef double (*bench_function)(size_t iterations);
+
+// Each sample runs for at least this long, once calibrated.
+const double apf_bench_sample_seconds = 0.01;
+const int apf_bench_max_samples = 30;
+const int apf_bench_min_samples = 5;
+const double apf_bench_time_limit = 1.0;
+
+// Nanoseconds per iteration, over the samples that weren't outliers.
+struct apf_bench_result {
+    std::string name;
+    size_t iterations;
+    int samples;
+    int outliers;
+    double mean;
+    double median;
+    double stddev;
+};
+
+double apf_now_seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Mean, median and standard deviation of 'times', leaving out the ones past
+// Tukey's fences: 1.5 times the interquartile range outside the quartiles.
+void apf_bench_summarize(vector<double> times, apf_bench_result& result)
+{
+    std::sort(times.begin(), times.end());
+    size_t n = times.size();
+    double q1 = times[n / 4];
+    double q3 = times[(3 * n) / 4 < n ? (3 * n) / 4 : n - 1];
+    double low = q1 - 1.5 * (q3 - q1);
+    double high = q3 + 1.5 * (q3 - q1);
+
+    vector<double> kept;
+    for (size_t i=0; i < n; i++)
+        if (times[i] >= low && times[i] <= high)
+            kept.push_back(times[i]);
+
+    double sum = 0;
+    for (size_t i=0; i < kept.size(); i++)
+        sum += kept[i];
+    result.mean = sum / kept.size();
+
+    double squares = 0;
+    for (size_t i=0; i < kept.size(); i++)
+        squares += (kept[i] - result.mean) * (kept[i] - result.mean);
+    result.stddev = kept.size() > 1 ? std::sqrt(squares / (kept.size() - 1)) : 0;
+
+    size_t middle = kept.size() / 2;
+    result.median = kept.size() % 2 == 1 ? kept[middle] : (kept[middle - 1] + kept[middle]) / 2;
+    result.samples = int(kept.size());
+    result.outliers = int(n - kept.size());
+}
+
+// Warm up and calibrate 'func', doubling the iterations until a sample takes
+// long enough, then take samples until there are plenty or time runs out.
+apf_bench_result run_bench_with_name(bench_function func, std::string const& name)
+{
+    apf_bench_result result;
+    result.name = name;
+
+    size_t iterations = 1;
+    while (func(iterations) < apf_bench_sample_seconds)
+        iterations *= 2;
+    func(iterations);
+    result.iterations = iterations;
+
+    vector<double> times;
+    double start = apf_now_seconds();
+    for (int i=0; i < apf_bench_max_samples; i++) {
+        times.push_back(func(iterations) * 1e9 / iterations);
+        if (i + 1 >= apf_bench_min_samples && apf_now_seconds() - start > apf_bench_time_limit)
+            break;
+    }
+
+    apf_bench_summarize(times, result);
+    return result;
+}
+
+#define run_bench(name) results.push_back(run_bench_with_name(name, #name))
+
+void apf_bench_write_json(const char* path, vector<apf_bench_result> const& results)
+{
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+        throw std::runtime_error(std::string("can't write ") + path);
+
+    fprintf(file, "{\n  \"benchmarks\": [\n");
+    for (size_t i=0; i < results.size(); i++) {
+        apf_bench_result const& r = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"iterations\": %zu, \"samples\": %d, \"outliers\": %d, "
+                "\"mean_ns\": %.3f, \"median_ns\": %.3f, \"stddev_ns\": %.3f}%s\n",
+                r.name.c_str(), r.iterations, r.samples, r.outliers, r.mean, r.median, r.stddev,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+// Reads back what apf_bench_write_json() writes: median_ns by name, from
+// every object that has both. Anything else in the file is skipped over.
+std::map<std::string, double> apf_bench_read_json(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        throw std::runtime_error(std::string("can't read ") + path);
+    std::string text;
+    char buffer[4096];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, got);
+    fclose(file);
+
+    std::map<std::string, double> medians;
+    std::string key, name;
+    double median = -1;
+    for (size_t i=0; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '{') {
+            name.clear();
+            median = -1;
+        } else if (c == '}') {
+            if (!name.empty() && median >= 0)
+                medians[name] = median;
+        } else if (c == '"') {
+            size_t end = text.find('"', i + 1);
+            if (end == std::string::npos)
+                break;
+            std::string str = text.substr(i + 1, end - i - 1);
+            size_t next = text.find_first_not_of(" \t\r\n", end + 1);
+            if (next != std::string::npos && text[next] == ':')
+                key = str;
+            else if (key == "name")
+                name = str;
+            i = end;
+        } else if ((c >= '0' && c <= '9') || c == '-') {
+            char* end;
+            double value = strtod(&text[i], &end);
+            if (end == &text[i])
+                continue;
+            if (key == "median_ns")
+                median = value;
+            i = end - &text[0] - 1;
+        }
+    }
+    return medians;
+}
+
+template <typename T, typename Alloc, typename Instrument>
+std::string to_string(vector<T, Alloc, Instrument> const& v)
 {
     std::stringstream strm;
     strm << "[";
@@ -89,7 +272,9 @@ std::string to_string_reversed_iterator(vector<std::string> const& v)
 }
 
 
-vector<std::string> gSpyLog;
+// Never counted, even with RTL_INSTRUMENT, so that logging doesn't show up in
+// the counts of the tests that are watching Spies.
+vector<std::string, std::allocator<std::string>, no_instrument> gSpyLog;
 int gNextAnonSpy = 1;
 
 void spy_clear()
@@ -103,6 +288,16 @@ std::string spy_log()
     return to_string(gSpyLog);
 }
 
+int spy_count(std::string const& prefix)
+{
+    // Number of log entries starting with 'prefix'.
+    int count = 0;
+    for (size_t i=0; i < gSpyLog.size(); i++)
+        if (gSpyLog[i].compare(0, prefix.size(), prefix) == 0)
+            count++;
+    return count;
+}
+
 struct Spy
 {
     // The Spy class keeps a global log of all calls made to its constructor and destructor.
@@ -138,6 +333,25 @@ struct Spy
         const_cast<Spy&>(copy)._numCopies++;
     }
 
+    Spy(Spy&& move) noexcept {
+        // A move keeps the name; the leftover husk gets renamed so that its
+        // eventual destructor call is distinguishable.
+        _numCopies = move._numCopies;
+        _name = move._name;
+        gSpyLog.push_back(std::string("move:") + _name);
+
+        move._name += "_moved";
+    }
+
+    Spy& operator=(Spy&& move) noexcept {
+        _numCopies = move._numCopies;
+        _name = move._name;
+        gSpyLog.push_back(std::string("assign:") + _name);
+
+        move._name += "_moved";
+        return *this;
+    }
+
     ~Spy() {
         gSpyLog.push_back(std::string("dtor:") + _name);
     }
@@ -231,17 +445,505 @@ void test_copy()
     vector<Spy> v;
     test_equals(spy_log(), "[]");
 
+    // Temporaries are moved in, not copied.
     v.push_back(Spy("a"));
-    test_equals(spy_log(), "[ctor:a, ctor:a_copy1, dtor:a]");
+    test_equals(spy_log(), "[ctor:a, move:a, dtor:a_moved]");
     spy_clear();
 
     v.push_back(Spy("b"));
-    test_equals(spy_log(), "[ctor:b, ctor:b_copy1, dtor:b]");
+    test_equals(spy_log(), "[ctor:b, move:b, dtor:b_moved]");
     spy_clear();
 
     // Make the copy, ensure the values are each copy constructed.
     vector<Spy> v_copy(v);
-    test_equals(spy_log(), "[ctor:a_copy1_copy1, ctor:b_copy1_copy1]");
+    test_equals(spy_log(), "[ctor:a_copy1, ctor:b_copy1]");
+}
+
+void test_growth_moves()
+{
+    spy_clear();
+
+    vector<Spy> v;
+    v.push_back(Spy("a"));
+    v.push_back(Spy("b"));
+    spy_clear();
+
+    // Growing the buffer should move elements over, not copy them.
+    v.reserve(100);
+    test_equals(spy_log(), "[move:a, dtor:a_moved, move:b, dtor:b_moved]");
+    test_equals(v[0]._name, "a");
+    test_equals(v[1]._name, "b");
+    spy_clear();
+
+    // Same when growth is triggered by push_back.
+    vector<Spy> v2;
+    for (int i=0; i < 8; i++)
+        v2.push_back(v[0]);
+    spy_clear();
+
+    v2.push_back(v[1]);
+    test_assert(v2.size() == 9);
+    test_assert(spy_count("ctor:") == 1);
+    test_assert(spy_count("move:") == 8);
+
+    // The new element is built before the old ones move out from under it.
+    test_equals(gSpyLog.front(), "ctor:b_copy1");
+}
+
+void test_insert_erase_moves()
+{
+    spy_clear();
+
+    vector<Spy> v;
+    v.push_back(Spy("a"));
+    v.push_back(Spy("b"));
+    Spy z("z");
+    spy_clear();
+
+    // Shifting elements to make room should move them, last one first.
+    v.insert(v.begin(), z);
+    test_equals(spy_log(), "[move:b, dtor:b_moved, move:a, dtor:a_moved, ctor:z_copy1]");
+    spy_clear();
+
+    v.erase(v.begin());
+    test_equals(spy_log(), "[dtor:z_copy1, move:a, dtor:a_moved, move:b, dtor:b_moved]");
+    test_equals(v[0]._name, "a");
+    test_equals(v[1]._name, "b");
+}
+
+void test_emplace_moves()
+{
+    spy_clear();
+
+    // Built in place, no copies or moves.
+    vector<Spy> v;
+    v.emplace_back("a");
+    v.emplace_back("c");
+    test_equals(spy_log(), "[ctor:a, ctor:c]");
+    spy_clear();
+
+    // In the middle it's built first, then moved into the gap.
+    v.emplace(v.begin() + 1, "b");
+    test_equals(spy_log(), "[ctor:b, move:c, dtor:c_moved, move:b, dtor:b_moved]");
+    spy_clear();
+
+    Spy d("d");
+    Spy z("z");
+    spy_clear();
+    v.push_back(std::move(d));
+    v.insert(v.begin(), std::move(z));
+    test_assert(spy_count("ctor:") == 0);
+    test_equals(v[0]._name, "z");
+    test_equals(v[4]._name, "d");
+    spy_clear();
+
+    // Moving a vector takes its buffer.
+    Spy* data = v.begin();
+    vector<Spy> moved(std::move(v));
+    test_assert(moved.begin() == data);
+    test_assert(v.size() == 0);
+
+    vector<Spy> assigned;
+    assigned.emplace_back("x");
+    spy_clear();
+    assigned = std::move(moved);
+    test_equals(spy_log(), "[dtor:x]");
+    test_assert(assigned.begin() == data);
+    test_assert(assigned.size() == 5);
+    test_assert(moved.size() == 0);
+
+    // Appending one of our own elements while growing.
+    vector<std::string> strings;
+    for (int i=0; i < 8; i++)
+        strings.push_back(std::to_string(i));
+    strings.push_back(strings[3]);
+    strings.emplace_back(strings[4]);
+    strings.insert(strings.begin(), strings[5]);
+    test_equals(strings[0], "5");
+    test_equals(strings[9], "3");
+    test_equals(strings[10], "4");
+}
+
+void test_move_only_elements()
+{
+    vector<std::unique_ptr<int> > v;
+    for (int i=0; i < 20; i++)
+        v.push_back(std::unique_ptr<int>(new int(i)));
+    v.emplace(v.begin(), new int(-1));
+    v.insert(v.begin() + 1, std::unique_ptr<int>(new int(-2)));
+    v.erase(v.begin() + 2);
+    v.pop_back();
+
+    test_assert(v.size() == 20);
+    test_assert(*v[0] == -1);
+    test_assert(*v[1] == -2);
+    test_assert(*v[2] == 1);
+    test_assert(*v[19] == 18);
+
+    vector<std::unique_ptr<int> > other(std::move(v));
+    test_assert(*other[19] == 18);
+
+    small_vector<std::unique_ptr<int>, 4> small;
+    for (int i=0; i < 6; i++)
+        small.emplace_back(new int(i));
+    small_vector<std::unique_ptr<int>, 4> smallMoved(std::move(small));
+    test_assert(*smallMoved[5] == 5);
+    test_assert(small.size() == 0);
+}
+
+int gRelocatableCopies = 0;
+
+struct Relocatable
+{
+    // Not trivially copyable, but declared safe to memmove below.
+    int _value;
+
+    Relocatable(int value) : _value(value) {}
+    Relocatable(Relocatable const& copy) : _value(copy._value) { gRelocatableCopies++; }
+};
+
+namespace rtl {
+template <> struct is_trivially_relocatable<Relocatable> : std::true_type {};
+}
+
+void test_trivially_relocatable()
+{
+    vector<Relocatable> v;
+    for (int i=0; i < 5; i++)
+        v.push_back(Relocatable(i));
+
+    gRelocatableCopies = 0;
+
+    v.reserve(100);
+    v.insert(v.begin() + 1, 2, Relocatable(10));
+    v.erase(v.begin());
+
+    // Only the two inserted values were copied, nothing else was.
+    test_assert(gRelocatableCopies == 2);
+
+    test_assert(v.size() == 6);
+    test_assert(v[0]._value == 10);
+    test_assert(v[1]._value == 10);
+    for (int i=1; i < 5; i++)
+        test_assert(v[i + 1]._value == i);
+}
+
+// Counts the blocks it has out, and carries an id to check which allocator a
+// container ended up with.
+int gLiveAllocations = 0;
+
+template <typename T>
+struct CountingAllocator {
+    typedef T value_type;
+
+    int id;
+
+    explicit CountingAllocator(int id = 0) : id(id) {}
+    template <typename U> CountingAllocator(CountingAllocator<U> const& other) : id(other.id) {}
+
+    T* allocate(size_t n)
+    {
+        gLiveAllocations++;
+        return (T*) malloc(n * sizeof(T));
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        gLiveAllocations--;
+        free(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(CountingAllocator<T> const& a, CountingAllocator<U> const& b) { return a.id == b.id; }
+template <typename T, typename U>
+bool operator!=(CountingAllocator<T> const& a, CountingAllocator<U> const& b) { return a.id != b.id; }
+
+void test_vector_allocator()
+{
+    gLiveAllocations = 0;
+    {
+        vector<Spy, CountingAllocator<Spy> > v((CountingAllocator<Spy>(1)));
+        for (int i=0; i < 20; i++)
+            v.push_back(Spy("a"));
+        test_assert(gLiveAllocations == 1);
+        test_assert(v.get_allocator().id == 1);
+
+        vector<Spy, CountingAllocator<Spy> > copy(v);
+        test_assert(gLiveAllocations == 2);
+        test_assert(copy.get_allocator().id == 1);
+
+        vector<Spy, CountingAllocator<Spy> > other((CountingAllocator<Spy>(2)));
+        other.push_back(Spy("b"));
+        other.swap(v);
+        test_assert(v.get_allocator().id == 2);
+        test_assert(other.get_allocator().id == 1);
+        test_assert(other.size() == 20);
+
+        v.clear();
+        test_assert(gLiveAllocations == 2);
+    }
+    test_assert(gLiveAllocations == 0);
+}
+
+void test_arena_allocator()
+{
+    arena a(4096);
+    for (int round=0; round < 3; round++) {
+        // Lots of short lived vectors, which outgrow the first block.
+        for (int i=0; i < 100; i++) {
+            vector<int, arena_allocator<int> > v((arena_allocator<int>(a)));
+            for (int j=0; j < 100; j++)
+                v.push_back(i + j);
+            test_assert(v[99] == i + 99);
+            test_assert(size_t(&v[0]) % alignof(int) == 0);
+        }
+        test_assert(a.reserved() > 4096);
+
+        a.reset();
+        test_assert(a.reserved() == 4096 + 16);
+    }
+
+    // The most recent allocation can be given back.
+    void* p = a.allocate(100, 64);
+    test_assert(size_t(p) % 64 == 0);
+    a.deallocate(p, 100);
+    test_assert(a.allocate(100, 64) == p);
+
+    // Odd sizes leave the next allocation misaligned, and aligning it can
+    // go past the end of the block.
+    arena odd(64);
+    for (int i=0; i < 200; i++) {
+        size_t bytes = 1 + (i * 37) % 100;
+        size_t alignment = i % 2 == 0 ? 8 : 16;
+        char* q = (char*) odd.allocate(bytes, alignment);
+        test_assert(size_t(q) % alignment == 0);
+        memset(q, i, bytes);
+    }
+
+    // Bigger than a block.
+    vector<double, arena_allocator<double> > big((arena_allocator<double>(a)));
+    big.resize(10000, 1.5);
+    test_assert(big[9999] == 1.5);
+}
+
+void test_pool_allocator()
+{
+    pool p;
+
+    // Freed blocks are handed out again, by size class.
+    void* a = p.allocate(100);
+    void* b = p.allocate(100);
+    test_assert(a != b);
+    p.deallocate(a, 100);
+    test_assert(p.allocate(128) == a);
+    test_assert(size_t(b) % 16 == 0);
+
+    // Too big for a class.
+    void* huge = p.allocate(1 << 20);
+    p.deallocate(huge, 1 << 20);
+
+    vector<std::string, pool_allocator<std::string> > v((pool_allocator<std::string>(p)));
+    for (int i=0; i < 1000; i++)
+        v.push_back(std::string(40, char('a' + i % 26)));
+    test_assert(v.size() == 1000);
+    test_equals(v[27], std::string(40, 'b'));
+}
+
+void test_caching_allocator()
+{
+    caching_allocator<int> alloc;
+    int* a = alloc.allocate(10);
+    alloc.deallocate(a, 10);
+    test_assert(alloc.allocate(12) == a);
+    alloc.deallocate(a, 12);
+
+    // Blocks freed on another thread go to that thread's cache.
+    int* shared = alloc.allocate(1000);
+    std::thread([&]() {
+        caching_allocator<int> other;
+        other.deallocate(shared, 1000);
+        test_assert(other.allocate(1000) == shared);
+        other.deallocate(shared, 1000);
+    }).join();
+
+    vector<int, caching_allocator<int> > v;
+    for (int i=0; i < 100000; i++)
+        v.push_back(i);
+    test_assert(v[99999] == 99999);
+}
+
+void test_huge_page_allocator()
+{
+    huge_page_allocator<int> alloc;
+    int* small = alloc.allocate(10);
+    test_assert(size_t(small) % 64 == 0);
+    for (int i=0; i < 10; i++)
+        small[i] = i;
+
+    // Growing past the threshold maps the block, growing further remaps it.
+    size_t bigCount = huge_page_allocator<int>::huge_page_threshold / sizeof(int);
+    int* big = alloc.reallocate(small, 10, bigCount);
+    test_assert(size_t(big) % 4096 == 0);
+    big[bigCount - 1] = -1;
+    big = alloc.reallocate(big, bigCount, 4 * bigCount);
+    for (int i=0; i < 10; i++)
+        test_assert(big[i] == i);
+    test_assert(big[bigCount - 1] == -1);
+    alloc.deallocate(big, 4 * bigCount);
+
+    // The elements stay put when the vector grows. Only the one being added
+    // when it does is moved.
+    typedef vector<int, huge_page_allocator<int>, counting_instrument> IntVector;
+    instrument_site site("huge pages");
+    {
+        instrument_scope scope(site);
+        IntVector v;
+        for (int i=0; i < 3000000; i++)
+            v.push_back(i);
+        test_assert(size_t(&v[0]) % 4096 == 0);
+        for (int i=0; i < 3000000; i += 999)
+            test_assert(v[i] == i);
+
+        instrument_counts c = site.counts();
+        test_assert(c.reallocations > 10);
+        test_assert(c.moves == c.reallocations);
+
+        v.insert(v.begin() + 2500000, 3, -1);
+        v.erase(v.begin() + 10, v.begin() + 20);
+        test_assert(v.size() == 3000000 - 7);
+        test_assert(v[2500000 - 10] == -1);
+        test_assert(v[2500000 - 10 + 3] == 2500000);
+    }
+}
+
+void test_small_vector_inline()
+{
+    gLiveAllocations = 0;
+    spy_clear();
+    {
+        small_vector<Spy, 2, CountingAllocator<Spy> > v;
+        v.push_back(Spy("a"));
+        v.push_back(Spy("b"));
+        test_assert(v.is_inline());
+        test_assert(v.capacity() == 2);
+        test_assert(gLiveAllocations == 0);
+        test_equals(spy_log(), "[ctor:a, move:a, dtor:a_moved, ctor:b, move:b, dtor:b_moved]");
+        spy_clear();
+
+        // Copying a small one doesn't allocate either.
+        {
+            small_vector<Spy, 2, CountingAllocator<Spy> > copy(v);
+            test_assert(copy.is_inline());
+            test_assert(gLiveAllocations == 0);
+        }
+        spy_clear();
+
+        // Spilling to the heap adds the new element, then moves the inline
+        // ones out.
+        Spy c("c");
+        spy_clear();
+        v.push_back(c);
+        test_assert(!v.is_inline());
+        test_assert(v.capacity() == 8);
+        test_assert(gLiveAllocations == 1);
+        test_equals(spy_log(), "[ctor:c_copy1, move:a, dtor:a_moved, move:b, dtor:b_moved]");
+        spy_clear();
+
+        // Inserting and erasing work the same either way.
+        v.insert(v.begin(), c);
+        v.erase(v.begin() + 1);
+        test_assert(v.size() == 3);
+        test_equals(v[0]._name, "c_copy2");
+        test_equals(v[1]._name, "b");
+        test_equals(v[2]._name, "c_copy1");
+        spy_clear();
+
+        // Clearing goes back inline.
+        v.clear();
+        test_assert(v.is_inline());
+        test_assert(gLiveAllocations == 0);
+        test_equals(spy_log(), "[dtor:c_copy2, dtor:b, dtor:c_copy1]");
+        spy_clear();
+    }
+    test_assert(gLiveAllocations == 0);
+}
+
+void test_small_vector_swap()
+{
+    small_vector<std::string, 4> small;
+    small.push_back("a");
+    small.push_back("b");
+
+    small_vector<std::string, 4> big;
+    for (int i=0; i < 10; i++)
+        big.push_back(std::to_string(i));
+
+    // Inline with heap.
+    small.swap(big);
+    test_assert(!small.is_inline());
+    test_assert(big.is_inline());
+    test_assert(small.size() == 10);
+    test_equals(small[9], "9");
+    test_equals(big[1], "b");
+
+    // Heap with heap just swaps pointers.
+    small_vector<std::string, 4> other(6, "x");
+    std::string* data = other.begin();
+    small.swap(other);
+    test_assert(small.begin() == data);
+    test_equals(other[9], "9");
+
+    // Inline with inline.
+    small_vector<std::string, 4> one(1, "y");
+    big.swap(one);
+    test_equals(big[0], "y");
+    test_assert(one.size() == 2);
+
+    small_vector<int, 8> numbers;
+    int values[] = { 5, 3, 9 };
+    numbers.assign(values, values + 3);
+    numbers = small_vector<int, 8>(numbers);
+    quicksort(numbers.begin(), numbers.end(), std::less<int>());
+    test_assert(numbers[0] == 3 && numbers[1] == 5 && numbers[2] == 9);
+}
+
+void test_range_insert()
+{
+    // Forward iterators: one allocation for the lot.
+    std::list<std::string> words;
+    for (int i=0; i < 100; i++)
+        words.push_back(std::to_string(i));
+
+    gLiveAllocations = 0;
+    {
+        vector<std::string, CountingAllocator<std::string> > v;
+        v.push_back("first");
+        v.push_back("last");
+        v.insert(v.begin() + 1, words.begin(), words.end());
+        test_assert(gLiveAllocations == 1);
+        test_assert(v.size() == 102);
+        test_equals(v[0], "first");
+        test_equals(v[1], "0");
+        test_equals(v[100], "99");
+        test_equals(v[101], "last");
+    }
+
+    // Input iterators can only be read once.
+    std::istringstream input("3 4 5");
+    vector<int> numbers;
+    numbers.push_back(1);
+    numbers.push_back(6);
+    numbers.insert(numbers.begin() + 1, std::istream_iterator<int>(input), std::istream_iterator<int>());
+    test_assert(numbers.size() == 5);
+    for (int i=0; i < 5; i++)
+        test_assert(numbers[i] == (i == 0 ? 1 : i + 2));
+
+    // Two integers mean a count and a value, not a range.
+    vector<int> fives(3, 5);
+    test_assert(fives.size() == 3 && fives[2] == 5);
+    fives.insert(fives.begin(), 2, 7);
+    test_assert(fives.size() == 5 && fives[1] == 7);
 }
 
 void test_clear()
@@ -252,11 +954,11 @@ void test_clear()
 
     v.push_back(Spy("a"));
     v.push_back(Spy("b"));
-    test_equals(spy_log(), "[ctor:a, ctor:a_copy1, dtor:a, ctor:b, ctor:b_copy1, dtor:b]");
+    test_equals(spy_log(), "[ctor:a, move:a, dtor:a_moved, ctor:b, move:b, dtor:b_moved]");
 
     spy_clear();
     v.clear();
-    test_equals(spy_log(), "[dtor:a_copy1, dtor:b_copy1]");
+    test_equals(spy_log(), "[dtor:a, dtor:b]");
 }
 
 void test_accessors()
@@ -294,11 +996,11 @@ void test_swap()
     v1.swap(v2);
     test_equals(spy_log(), "[]");
 
-    test_equals(v1[0]._name, "d_copy1");
-    test_equals(v1[1]._name, "e_copy1");
-    test_equals(v2[0]._name, "a_copy1");
-    test_equals(v2[1]._name, "b_copy1");
-    test_equals(v2[2]._name, "c_copy1");
+    test_equals(v1[0]._name, "d");
+    test_equals(v1[1]._name, "e");
+    test_equals(v2[0]._name, "a");
+    test_equals(v2[1]._name, "b");
+    test_equals(v2[2]._name, "c");
 }
 
 void test_big_list()
@@ -373,6 +1075,44 @@ void test_erase()
     test_equals(to_string(v), "[3, 4]");
 }
 
+void test_instrument_vector()
+{
+    typedef vector<Spy, std::allocator<Spy>, counting_instrument> SpyVector;
+
+    instrument_site site("vector");
+    {
+        instrument_scope scope(site);
+        spy_clear();
+
+        // Growing to 9 reallocates twice, moving the first 8 over. The copy
+        // allocates once, and the insert fits.
+        SpyVector v;
+        Spy a("a");
+        for (int i=0; i < 9; i++)
+            v.push_back(a);
+        SpyVector copy(v);
+        v.erase(v.begin());
+        v.insert(v.begin(), Spy("b"));
+
+        instrument_counts c = site.counts();
+        test_assert(c.copies == 18);
+        test_assert(spy_count("ctor:") == 18 + 2);
+        test_assert(c.moves == 8 + 8 + 1 + 8);
+        test_assert(c.moves == uint64_t(spy_count("move:")));
+        test_assert(c.reallocations == 3);
+        test_assert(c.bytesAllocated == (8 + 16 + 16) * sizeof(Spy));
+        test_assert(c.comparisons == 0);
+    }
+
+    // Nothing is counted once the scope is gone, or by an ordinary vector.
+    site.reset();
+    vector<Spy> plain;
+    plain.push_back(Spy("c"));
+    SpyVector counted;
+    counted.push_back(Spy("d"));
+    test_assert(site.counts().moves == 0);
+}
+
 vector<std::string> get_sample_0_1_2_3_4()
 {
     vector<std::string> v;
@@ -431,38 +1171,2451 @@ void test_merge_sort()
     test_equals(to_string(v), "[4, 1, 2, 3, 0]");
 }
 
-void test_quick_sort()
+struct KeyValue
 {
-    vector<std::string> v = get_sample_0_1_2_3_4();
-    quicksort(v.begin(), v.end(), string_compare);
-    test_equals(to_string(v), "[0, 1, 2, 3, 4]");
+    int key;
+    int value;
+};
 
-    v = get_sample_4_3_2_1_0();
-    quicksort(v.begin(), v.end(), string_compare);
-    test_equals(to_string(v), "[0, 1, 2, 3, 4]");
+bool key_compare(KeyValue const& left, KeyValue const& right)
+{
+    return left.key < right.key;
+}
 
-    v = get_sample_1_4_0_3_2();
-    quicksort(v.begin(), v.end(), string_compare);
-    test_equals(to_string(v), "[0, 1, 2, 3, 4]");
+// Sorted by key, and by value within a key.
+bool is_stably_sorted(vector<KeyValue> const& v, size_t expectedSize)
+{
+    if (v.size() != expectedSize)
+        return false;
+    for (size_t i=1; i < v.size(); i++) {
+        if (v[i-1].key > v[i].key)
+            return false;
+        if (v[i-1].key == v[i].key && v[i-1].value > v[i].value)
+            return false;
+    }
+    return true;
+}
 
-    // Try just sorting a sublist
-    v = get_sample_4_3_2_1_0();
-    quicksort(v.begin() + 1, v.end() - 1, string_compare);
-    test_equals(to_string(v), "[4, 1, 2, 3, 0]");
+unsigned gRandomState = 1;
+
+int next_random()
+{
+    // Small deterministic LCG, so that failures are reproducible.
+    gRandomState = gRandomState * 1103515245 + 12345;
+    return (gRandomState >> 16) & 0x7fff;
 }
 
-void apf_run_tests()
+void test_segmented_vector_growth()
 {
-    run_test(test_with_to_string);
-    run_test(test_the_spy);
-    run_test(test_copy);
-    run_test(test_clear);
-    run_test(test_accessors);
-    run_test(test_swap);
-    run_test(test_big_list);
-    run_test(test_insert);
-    run_test(test_erase);
-    run_test(test_merge_sort);
-    run_test(test_quick_sort);
+    gLiveAllocations = 0;
+    spy_clear();
+    {
+        // Growing never moves anything, so pointers stay good.
+        segmented_vector<Spy, 4, CountingAllocator<Spy> > v;
+        v.push_back(Spy("a"));
+        Spy* a = &v[0];
+        for (int i=0; i < 9; i++)
+            v.emplace_back();
+        test_assert(&v[0] == a);
+        test_assert(v.size() == 10);
+        test_assert(v.segment_count() == 3);
+        test_assert(gLiveAllocations == 4);   // Three chunks and the table.
+        test_assert(spy_count("move:") == 1);
+        test_equals(v[9]._name, "Anon9");
+        test_equals(v.back()._name, "Anon9");
+
+        // Each chunk is a plain array.
+        test_assert(v.segment_end(0) - v.segment_begin(0) == 4);
+        test_assert(v.segment_end(2) - v.segment_begin(2) == 2);
+        test_assert(v.segment_begin(1) == &v[4]);
+
+        // Copies come out packed, whatever the original went through.
+        v.erase(v.begin() + 1);
+        segmented_vector<Spy, 4, CountingAllocator<Spy> > copy(v);
+        test_assert(copy.size() == 9);
+        test_assert(copy.segment_count() == 3);
+        test_equals(copy[1]._name, "Anon2_copy1");
+
+        // Emptied chunks are freed.
+        while (v.size() > 1)
+            v.pop_back();
+        test_assert(v.segment_count() == 1);
+        test_assert(&v.front() == a);
+        spy_clear();
+    }
+    test_assert(gLiveAllocations == 0);
+    test_assert(spy_count("dtor:") == 10);
+}
+
+void test_segmented_vector_insert_erase()
+{
+    segmented_vector<int, 8> v;
+    vector<int> expected;
+    for (int i=0; i < 3000; i++) {
+        size_t n = v.size();
+        switch (next_random() % 4) {
+        case 0:
+        case 1:
+            v.push_back(i);
+            expected.push_back(i);
+            break;
+        case 2: {
+            size_t at = next_random() % (n + 1);
+            v.insert(v.begin() + at, -i);
+            expected.insert(expected.begin() + at, -i);
+            break;
+        }
+        case 3:
+            if (n > 0) {
+                size_t at = next_random() % n;
+                size_t count = std::min<size_t>(next_random() % 20, n - at);
+                v.erase(v.begin() + at, v.begin() + at + count);
+                expected.erase(expected.begin() + at, expected.begin() + at + count);
+            }
+            break;
+        }
+        test_assert(v.size() == expected.size());
+    }
+
+    test_assert(std::equal(expected.begin(), expected.end(), v.begin()));
+    for (size_t i=0; i < v.size(); i++)
+        test_assert(v[i] == expected[i]);
+    test_assert(v.end() - v.begin() == ptrdiff_t(v.size()));
+
+    // Inserting into a full chunk splits it, and only that chunk's elements
+    // move.
+    segmented_vector<int, 4> w;
+    for (int i=0; i < 12; i++)
+        w.push_back(i);
+    int* first = &w[0];
+    int* last = &w[8];
+    w.insert(w.begin() + 5, 100);
+    test_assert(w.segment_count() == 4);
+    test_assert(&w[0] == first && &w[9] == last);
+    test_assert(w[4] == 4 && w[5] == 100 && w[6] == 5 && w[12] == 11);
+
+    // Walking backwards crosses chunks too.
+    int expect = 11;
+    segmented_vector<int, 4>::iterator it = w.end();
+    while (it != w.begin()) {
+        --it;
+        if (*it != 100)
+            test_assert(*it == expect--);
+    }
+}
+
+void test_segmented_vector_sort()
+{
+    vector<int> input;
+    for (int i=0; i < 10000; i++)
+        input.push_back(int(next_random() % 1000));
+    vector<int> expected(input);
+    std::sort(expected.begin(), expected.end());
+
+    segmented_vector<int, 64> v(input.begin(), input.end());
+    quicksort(v.begin(), v.end(), std::less<int>());
+    test_assert(std::equal(expected.begin(), expected.end(), v.begin()));
+
+    // With chunks that aren't all full.
+    segmented_vector<int, 64> gappy(input.begin(), input.end());
+    for (int i=0; i < 100; i++)
+        gappy.insert(gappy.begin() + next_random() % gappy.size(), 0);
+    mergesort(gappy.begin(), gappy.end(), std::greater<int>());
+    for (size_t i=1; i < gappy.size(); i++)
+        test_assert(gappy[i-1] >= gappy[i]);
+    test_assert(gappy[gappy.size() - 1] == 0);
+}
+
+void test_hash_map()
+{
+    hash_map<int, int> m;
+    std::map<int, int> expected;
+    test_assert(m.find(1) == m.end());
+    test_assert(m.erase(1) == 0);
+
+    for (int i=0; i < 20000; i++) {
+        int key = next_random() % 3000;
+        switch (next_random() % 3) {
+        case 0:
+            m[key] += i;
+            expected[key] += i;
+            break;
+        case 1:
+            test_assert(m.erase(key) == expected.erase(key));
+            break;
+        case 2:
+            test_assert(m.contains(key) == (expected.count(key) == 1));
+            if (m.contains(key))
+                test_assert(m.at(key) == expected[key]);
+            break;
+        }
+        test_assert(m.size() == expected.size());
+    }
+    test_assert(m.load_factor() <= m.max_load_factor());
+
+    // Every element once.
+    size_t seen = 0;
+    for (hash_map<int, int>::const_iterator it = m.begin(); it != m.end(); ++it) {
+        test_assert(expected[it->first] == it->second);
+        seen++;
+    }
+    test_assert(seen == expected.size());
+
+    // try_emplace leaves what's there alone.
+    std::pair<hash_map<int, int>::iterator, bool> result = m.try_emplace(-5, 7);
+    test_assert(result.second && result.first->second == 7);
+    result = m.try_emplace(-5, 8);
+    test_assert(!result.second && result.first->second == 7);
+    bool threw = false;
+    try {
+        m.at(-6);
+    } catch (std::out_of_range const&) {
+        threw = true;
+    }
+    test_assert(threw);
+
+    // Copies are separate; erasing while iterating empties it.
+    hash_map<int, int> copy(m);
+    for (hash_map<int, int>::iterator it = m.begin(); it != m.end(); )
+        it = m.erase(it);
+    test_assert(m.empty() && m.begin() == m.end());
+    test_assert(copy.size() == expected.size() + 1);
+    m = std::move(copy);
+    test_assert(m.at(-5) == 7);
+
+    // Churning through keys reuses slots rather than growing for ever.
+    hash_map<int, int> churn;
+    for (int i=0; i < 100000; i++) {
+        churn[i] = i;
+        if (i >= 100)
+            churn.erase(i - 100);
+    }
+    test_assert(churn.size() == 100);
+    test_assert(churn.capacity() <= 256);
+
+    // Bulk inserts: the first of each key wins.
+    vector<int> keys;
+    vector<int> values;
+    for (int i=0; i < 1000; i++) {
+        keys.push_back(i % 300);
+        values.push_back(i);
+    }
+    hash_map<int, int> bulk;
+    bulk.insert(keys, values);
+    test_assert(bulk.size() == 300);
+    test_assert(bulk.at(10) == 10 && bulk.at(299) == 299);
+    hash_map<int, uint32_t> positions;
+    positions.insert_positions(keys);
+    test_assert(positions.size() == 300 && positions.at(42) == 42);
+}
+
+void test_hash_set()
+{
+    gLiveAllocations = 0;
+    spy_clear();
+    {
+        // Elements are moved when the table grows, and all destroyed at the
+        // end.
+        hash_map<int, Spy, rtl::hash<int>, rtl::equal_to<int>,
+                 CountingAllocator<std::pair<const int, Spy> > > spies;
+        for (int i=0; i < 100; i++)
+            spies.try_emplace(i, "spy");
+        test_assert(spy_count("ctor:") == 100);
+        spies.erase(5);
+        spies.clear();
+        test_assert(spy_count("dtor:") == spy_count("ctor:") + spy_count("move:"));
+    }
+    test_assert(gLiveAllocations == 0);
+
+    // Distinct keys of a vector, in bulk.
+    vector<int> numbers;
+    for (int i=0; i < 5000; i++)
+        numbers.push_back(next_random() % 1000);
+    hash_set<int> distinct(numbers);
+    std::set<int> expected(numbers.begin(), numbers.end());
+    test_assert(distinct.size() == expected.size());
+    for (hash_set<int>::iterator it = distinct.begin(); it != distinct.end(); ++it)
+        test_assert(expected.count(*it) == 1);
+
+    // Strings can be looked up without making one.
+    hash_set<std::string> words;
+    test_assert(words.insert(std::string("apple")).second);
+    test_assert(!words.insert(std::string("apple")).second);
+    words.insert(std::string(""));
+    test_assert(words.contains("apple"));
+    test_assert(words.count("pear") == 0);
+    test_assert(words.find("") != words.end());
+    test_assert(words.erase("apple") == 1);
+    test_assert(words.size() == 1);
+}
+
+void test_btree_map()
+{
+    btree_map<int, int> m;
+    std::map<int, int> expected;
+    test_assert(m.find(1) == m.end());
+    test_assert(m.erase(1) == 0);
+    test_assert(m.lower_bound(1) == m.end());
+
+    for (int i=0; i < 30000; i++) {
+        int key = next_random() % 5000;
+        switch (next_random() % 3) {
+        case 0:
+            m[key] += i;
+            expected[key] += i;
+            break;
+        case 1:
+            test_assert(m.erase(key) == expected.erase(key));
+            break;
+        case 2:
+            test_assert(m.contains(key) == (expected.count(key) == 1));
+            if (m.contains(key))
+                test_assert(m.at(key) == expected[key]);
+            break;
+        }
+        test_assert(m.size() == expected.size());
+    }
+    test_assert(m.height() > 0);
+
+    // In order, both ways.
+    test_assert(std::equal(m.begin(), m.end(), expected.begin()));
+    std::map<int, int>::reverse_iterator r = expected.rbegin();
+    for (btree_map<int, int>::iterator it = m.end(); it != m.begin(); ++r) {
+        --it;
+        test_assert(it->first == r->first && it->second == r->second);
+    }
+
+    // Bounds, including keys that aren't there, and ranges that cross
+    // leaves.
+    for (int key=-1; key <= 5001; key += 7) {
+        btree_map<int, int>::iterator lo = m.lower_bound(key);
+        std::map<int, int>::iterator expectedLo = expected.lower_bound(key);
+        test_assert((lo == m.end()) == (expectedLo == expected.end()));
+        if (lo != m.end())
+            test_assert(lo->first == expectedLo->first);
+        btree_map<int, int>::iterator hi = m.upper_bound(key + 500);
+        test_assert(size_t(std::distance(lo, hi)) ==
+                    size_t(std::distance(expectedLo, expected.upper_bound(key + 500))));
+    }
+
+    // try_emplace leaves what's there alone.
+    std::pair<btree_map<int, int>::iterator, bool> result = m.try_emplace(-5, 7);
+    test_assert(result.second && result.first->second == 7);
+    result = m.try_emplace(-5, 8);
+    test_assert(!result.second && result.first->second == 7);
+    test_assert(m.begin()->first == -5);
+    bool threw = false;
+    try {
+        m.at(-6);
+    } catch (std::out_of_range const&) {
+        threw = true;
+    }
+    test_assert(threw);
+
+    // Copies are separate; erasing while iterating empties it, and the
+    // tree shrinks back down.
+    btree_map<int, int> copy(m);
+    for (btree_map<int, int>::iterator it = m.begin(); it != m.end(); )
+        it = m.erase(it);
+    test_assert(m.empty() && m.begin() == m.end() && m.height() == 0);
+    test_assert(copy.size() == expected.size() + 1);
+    m = std::move(copy);
+    test_assert(m.at(-5) == 7);
+
+    // Keys inserted in order (the worst case for splitting) and in reverse.
+    btree_map<int, int> ascending;
+    btree_map<int, int> descending;
+    for (int i=0; i < 20000; i++) {
+        ascending[i] = i;
+        descending[20000 - i] = i;
+    }
+    test_assert(ascending.size() == 20000 && descending.size() == 20000);
+    test_assert(ascending.at(12345) == 12345 && descending.at(1) == 19999);
+    int previous = -1;
+    for (btree_map<int, int>::iterator it = ascending.begin(); it != ascending.end(); ++it) {
+        test_assert(it->first == previous + 1);
+        previous = it->first;
+    }
+
+    // Bulk load from pairs sorted by key.
+    vector<std::pair<int, int> > pairs;
+    for (int i=0; i < 1000; i++)
+        pairs.push_back(std::make_pair(i * 2, i));
+    btree_map<int, int> loaded(pairs);
+    test_assert(loaded.size() == 1000);
+    test_assert(loaded.at(998) == 499 && !loaded.contains(999));
+    test_assert(loaded.lower_bound(999)->first == 1000);
+}
+
+// Counts live instances and copies. The copy that brings gKeyCopiesLeft
+// down to zero throws.
+int gLiveKeys = 0;
+int gKeyCopies = 0;
+int gKeyCopiesLeft = -1;
+
+struct ThrowingKey {
+    int key;
+
+    explicit ThrowingKey(int key) : key(key) { gLiveKeys++; }
+    ThrowingKey(ThrowingKey const& copy) : key(copy.key)
+    {
+        gKeyCopies++;
+        if (gKeyCopiesLeft > 0 && --gKeyCopiesLeft == 0)
+            throw std::runtime_error("copy failed");
+        gLiveKeys++;
+    }
+    ThrowingKey(ThrowingKey&& move) noexcept : key(move.key) { gLiveKeys++; }
+    ThrowingKey& operator=(ThrowingKey const& copy) { key = copy.key; return *this; }
+    ~ThrowingKey() { gLiveKeys--; }
+
+    bool operator<(ThrowingKey const& other) const { return key < other.key; }
+};
+
+void test_btree_bulk_load_throws()
+{
+    typedef btree_set<ThrowingKey, std::less<ThrowingKey>, CountingAllocator<ThrowingKey> > KeySet;
+
+    vector<ThrowingKey> sorted;
+    for (int i=0; i < 20000; i++)
+        sorted.push_back(ThrowingKey(i));
+
+    gLiveAllocations = 0;
+    gKeyCopies = 0;
+    {
+        KeySet all(sorted);
+        test_assert(all.size() == 20000);
+    }
+    int copies = gKeyCopies;
+
+    // The last copies are of keys for the inner nodes: whatever's been
+    // built is freed, leaves and inner nodes alike.
+    const int fromEnd[] = { 1, 5, 30, 200 };
+    for (int f=0; f < 4; f++) {
+        gKeyCopiesLeft = copies - fromEnd[f] + 1;
+        bool threw = false;
+        try {
+            KeySet partial(sorted);
+        } catch (std::runtime_error const&) {
+            threw = true;
+        }
+        test_assert(threw);
+        test_assert(gLiveKeys == 20000);
+        test_assert(gLiveAllocations == 0);
+    }
+    gKeyCopiesLeft = -1;
+}
+
+void test_btree_set()
+{
+    // Bulk load from a vector sorted by quicksort, duplicates and all.
+    vector<int> numbers;
+    for (int i=0; i < 50000; i++)
+        numbers.push_back(next_random() % 20000);
+    vector<int> sorted(numbers);
+    quicksort(sorted.begin(), sorted.end(), std::less<int>());
+    btree_set<int> loaded(sorted);
+    std::set<int> expected(numbers.begin(), numbers.end());
+    test_assert(loaded.size() == expected.size());
+    test_assert(std::equal(loaded.begin(), loaded.end(), expected.begin()));
+
+    // Building it one at a time gets the same set.
+    btree_set<int> inserted;
+    inserted.insert(numbers.begin(), numbers.end());
+    test_assert(inserted.size() == expected.size());
+    test_assert(std::equal(inserted.begin(), inserted.end(), loaded.begin()));
+
+    // A packed tree still takes inserts and erases.
+    for (int i=0; i < 20000; i++) {
+        int key = next_random() % 25000;
+        if (next_random() % 2) {
+            test_assert(loaded.insert(key).second == expected.insert(key).second);
+        } else {
+            test_assert(loaded.erase(key) == expected.erase(key));
+        }
+    }
+    test_assert(loaded.size() == expected.size());
+    test_assert(std::equal(loaded.begin(), loaded.end(), expected.begin()));
+
+    bool threw = false;
+    vector<int> unsorted;
+    unsorted.push_back(2);
+    unsorted.push_back(1);
+    try {
+        btree_set<int> bad(unsorted);
+    } catch (std::invalid_argument const&) {
+        threw = true;
+    }
+    test_assert(threw);
+
+    // Floats take the SIMD search; strings don't.
+    vector<float> floats;
+    for (int i=0; i < 3000; i++)
+        floats.push_back(float(i) / 4);
+    btree_set<float> fs(floats);
+    test_assert(fs.contains(2.25f) && !fs.contains(2.3f));
+    test_assert(*fs.upper_bound(2.3f) == 2.5f);
+    btree_set<std::string> words;
+    for (int i=0; i < 2000; i++)
+        words.insert(to_string(i));
+    test_assert(words.size() == 2000);
+    test_assert(*words.lower_bound("1999") == "1999");
+    test_assert(*words.upper_bound("1999") == "2");
+    test_assert(words.erase("5") == 1 && !words.contains("5"));
+
+    // Elements are all destroyed, and every node freed.
+    gLiveAllocations = 0;
+    spy_clear();
+    {
+        btree_map<int, Spy, std::less<int>, CountingAllocator<std::pair<const int, Spy> > > spies;
+        for (int i=0; i < 500; i++)
+            spies.try_emplace(i, "spy");
+        test_assert(spy_count("ctor:") == 500);
+        for (int i=0; i < 500; i += 3)
+            spies.erase(i);
+        test_assert(spy_count("dtor:") == 167 + spy_count("move:"));
+    }
+    test_assert(spy_count("dtor:") == spy_count("ctor:") + spy_count("move:"));
+    test_assert(gLiveAllocations == 0);
+}
+
+void check_persistent_vector(persistent_vector<int> const& v, vector<int> const& expected)
+{
+    test_assert(v.size() == expected.size());
+    test_assert(v.empty() == (expected.size() == 0));
+    for (size_t i=0; i < expected.size(); i++)
+        test_assert(v[i] == expected[i]);
+    test_assert(std::equal(v.begin(), v.end(), expected.begin()));
+    test_assert(size_t(v.end() - v.begin()) == expected.size());
+}
+
+void test_persistent_vector()
+{
+    persistent_vector<int> empty;
+    check_persistent_vector(empty, vector<int>());
+    test_assert(empty.slice(0, 0).empty() && empty.concat(empty).empty());
+
+    // Built in one go, leaves are full and the tree is as short as it can
+    // be.
+    vector<int> numbers;
+    for (int i=0; i < 40000; i++)
+        numbers.push_back(i);
+    persistent_vector<int> v(numbers);
+    check_persistent_vector(v, numbers);
+    test_assert(v.height() == 3);
+
+    // Changes leave the original alone.
+    persistent_vector<int> changed = v.set(5, -1).set(39999, -2);
+    test_assert(v[5] == 5 && changed[5] == -1 && changed[39999] == -2);
+    persistent_vector<int> longer = v.push_back(40000);
+    test_assert(v.size() == 40000 && longer.size() == 40001 && longer.back() == 40000);
+    persistent_vector<int> shorter = v.pop_back();
+    test_assert(shorter.size() == 39999 && shorter.back() == 39998 && v.back() == 39999);
+
+    bool threw = false;
+    try {
+        v.at(40000);
+    } catch (std::out_of_range const&) {
+        threw = true;
+    }
+    test_assert(threw);
+
+    // One push_back at a time still packs the leaves.
+    persistent_vector<int> pushed;
+    for (int i=0; i < 2000; i++)
+        pushed = pushed.push_back(i);
+    check_persistent_vector(pushed, vector<int>(numbers.begin(), numbers.begin() + 2000));
+    test_assert(pushed.height() == 2);
+    test_assert(pushed.set(1999, -1)[1999] == -1 && pushed[1999] == 1999);
+    check_persistent_vector(pushed.slice(1990, 2000), vector<int>(numbers.begin() + 1990, numbers.begin() + 2000));
+
+    // Random slices, joins and updates, against a plain vector.
+    persistent_vector<int> p = v.slice(100, 3100);
+    vector<int> expected(numbers.begin() + 100, numbers.begin() + 3100);
+    for (int i=0; i < 300; i++) {
+        size_t a = next_random() % (expected.size() + 1);
+        size_t b = next_random() % (expected.size() + 1);
+        if (a > b)
+            std::swap(a, b);
+        switch (next_random() % 5) {
+        case 0: {
+            // Keep the middle.
+            p = p.slice(a, b);
+            expected = vector<int>(expected.begin() + a, expected.begin() + b);
+            break;
+        }
+        case 1: {
+            // Append a piece of the original.
+            size_t first = next_random() % 30000;
+            size_t count = next_random() % 3000;
+            p = p.concat(v.slice(first, first + count));
+            expected.insert(expected.end(), numbers.begin() + first, numbers.begin() + first + count);
+            break;
+        }
+        case 2: {
+            // Prepend a piece of itself.
+            p = p.slice(a, b).concat(p);
+            vector<int> piece(expected.begin() + a, expected.begin() + b);
+            expected.insert(expected.begin(), piece.begin(), piece.end());
+            break;
+        }
+        case 3:
+            if (a < expected.size()) {
+                p = p.set(a, -int(i));
+                expected[a] = -int(i);
+            }
+            break;
+        case 4:
+            // Grow the tail, and maybe push it into the tree.
+            for (size_t j = next_random() % 40; j > 0; j--) {
+                p = p.push_back(int(j));
+                expected.push_back(int(j));
+            }
+            break;
+        }
+        check_persistent_vector(p, expected);
+        if (expected.size() > 20000) {
+            p = p.slice(0, 5000);
+            expected.erase(expected.begin() + 5000, expected.end());
+        }
+    }
+    check_persistent_vector(persistent_vector<int>(p.to_vector()), expected);
+
+    // A builder can start from an existing vector.
+    persistent_vector<int>::builder b(v.slice(0, 10));
+    for (int i=10; i < 100; i++)
+        b.push_back(i);
+    test_assert(b.size() == 100);
+    check_persistent_vector(b.build(), vector<int>(numbers.begin(), numbers.begin() + 100));
+    test_assert(b.size() == 0 && b.build().empty());
+
+    // Elements are shared between versions, never copied into them, and
+    // all destroyed once the last version goes.
+    spy_clear();
+    {
+        persistent_vector<Spy>::builder spies;
+        for (int i=0; i < 100; i++)
+            spies.emplace_back("spy");
+        persistent_vector<Spy> all = spies.build();
+        persistent_vector<Spy> snapshot = all;
+        test_assert(spy_count("ctor:") == 100);
+        persistent_vector<Spy> joined = all.slice(0, 64).concat(snapshot.slice(64, 100));
+        test_assert(joined.size() == 100);
+        test_assert(spy_count("ctor:") == 100);
+        persistent_vector<Spy> cut = all.slice(10, 90);
+        test_assert(cut.size() == 80);
+    }
+    test_assert(spy_count("dtor:") == spy_count("ctor:") + spy_count("move:"));
+}
+
+void test_persistent_vector_parallel()
+{
+    thread_pool pool(4);
+
+    // Enough for several blocks.
+    vector<int> numbers;
+    for (int i=0; i < 300000; i++)
+        numbers.push_back(int(next_random() % 1000));
+    persistent_vector<int> v(numbers);
+
+    persistent_vector<double> halves = v.map([](int x) { return x / 2.0; }, pool);
+    test_assert(halves.size() == numbers.size());
+    for (size_t i=0; i < numbers.size(); i += 997)
+        test_assert(halves[i] == numbers[i] / 2.0);
+
+    persistent_vector<int> odd = v.filter([](int x) { return x % 2 == 1; }, pool);
+    vector<int> expectedOdd;
+    for (size_t i=0; i < numbers.size(); i++) {
+        if (numbers[i] % 2 == 1)
+            expectedOdd.push_back(numbers[i]);
+    }
+    check_persistent_vector(odd, expectedOdd);
+
+    long sum = 0;
+    for (size_t i=0; i < numbers.size(); i++)
+        sum += numbers[i];
+    test_assert(v.reduce(0, [](int a, int b) { return a + b; }, pool) == sum);
+    test_assert(v.reduce(7, [](int a, int b) { return std::max(a, b); }, pool) == 999);
+
+    // The two sides of a zip needn't have the same shape.
+    persistent_vector<int> shifted = v.slice(1, v.size()).push_back(5);
+    persistent_vector<int> sums = v.zip(shifted, [](int a, int b) { return a + b; }, pool);
+    test_assert(sums.size() == numbers.size());
+    for (size_t i=0; i + 1 < numbers.size(); i += 991)
+        test_assert(sums[i] == numbers[i] + numbers[i + 1]);
+    test_assert(sums.back() == numbers.back() + 5);
+
+    bool threw = false;
+    try {
+        v.zip(odd, [](int a, int b) { return a + b; }, pool);
+    } catch (std::invalid_argument const&) {
+        threw = true;
+    }
+    test_assert(threw);
+
+    // Nothing in, nothing out.
+    persistent_vector<int> empty;
+    test_assert(empty.map([](int x) { return x; }, pool).empty());
+    test_assert(empty.filter([](int) { return true; }, pool).empty());
+    test_assert(empty.reduce(3, [](int a, int b) { return a + b; }, pool) == 3);
+    test_assert(v.filter([](int) { return false; }, pool).empty());
+}
+
+void test_concurrent_vector()
+{
+    concurrent_vector<int> v;
+    test_assert(v.empty() && v.published_size() == 0 && v.begin() == v.end());
+
+    // Elements never move as it grows.
+    v.push_back(42);
+    const int* first = &v[0];
+    for (int i=1; i < 100000; i++)
+        test_assert(v.push_back(i) == size_t(i));
+    test_assert(&v[0] == first && v[0] == 42);
+    test_assert(v.size() == 100000 && v.published_size() == 100000);
+    test_assert(v.capacity() >= v.size());
+    for (int i=1; i < 100000; i++)
+        test_assert(v[i] == i);
+
+    // The next segment is installed once the middle of the last one is
+    // claimed, before anyone needs it.
+    const size_t first_segment = segmented_vector_chunk_size<int>::value;
+    concurrent_vector<int> halves;
+    for (size_t i=0; i < first_segment / 2; i++)
+        halves.push_back(int(i));
+    test_assert(halves.capacity() == first_segment);
+    halves.push_back(0);
+    test_assert(halves.capacity() == 3 * first_segment);
+    halves.grow_by(2 * first_segment, 0);
+    test_assert(halves.capacity() == 7 * first_segment);
+
+    size_t at = v.grow_by(5, -1);
+    test_assert(at == 100000 && v.size() == 100005 && v[100004] == -1);
+    vector<int> more;
+    more.push_back(7);
+    more.push_back(8);
+    test_assert(v.grow_by(more.begin(), more.end()) == 100005 && v[100006] == 8);
+
+    // The sorts work on it in place.
+    concurrent_vector<int> shuffled;
+    vector<int> expected;
+    for (int i=0; i < 50000; i++) {
+        int x = int(next_random() % 100000);
+        shuffled.push_back(x);
+        expected.push_back(x);
+    }
+    concurrent_vector<int> merged(shuffled);
+    concurrent_vector<int> parallel(shuffled);
+    quicksort(shuffled.begin(), shuffled.end(), std::less<int>());
+    mergesort(merged.begin(), merged.end(), std::less<int>());
+    thread_pool pool(4);
+    parallel_sort(parallel.begin(), parallel.end(), std::less<int>(), pool);
+    quicksort(expected.begin(), expected.end(), std::less<int>());
+    test_assert(std::equal(expected.begin(), expected.end(), shuffled.begin()));
+    test_assert(std::equal(expected.begin(), expected.end(), merged.begin()));
+    test_assert(std::equal(expected.begin(), expected.end(), parallel.begin()));
+    vector<int> flat = parallel.to_vector();
+    test_assert(flat.size() == expected.size() && std::equal(flat.begin(), flat.end(), expected.begin()));
+
+    // Clearing keeps the segments.
+    size_t capacity = v.capacity();
+    v.clear();
+    test_assert(v.empty() && v.capacity() == capacity);
+    v.push_back(1);
+    test_assert(v.size() == 1 && v[0] == 1);
+
+    // Every element built is destroyed, once.
+    gLiveAllocations = 0;
+    spy_clear();
+    {
+        concurrent_vector<Spy, CountingAllocator<Spy> > spies;
+        spies.grow_by(3000, Spy("spy"));
+        spies.emplace_back("last");
+        concurrent_vector<Spy, CountingAllocator<Spy> > moved(std::move(spies));
+        test_assert(moved.size() == 3001 && spies.size() == 0);
+        test_assert(spy_count("move:") == 0);
+    }
+    test_assert(spy_count("dtor:") == spy_count("ctor:"));
+    test_assert(gLiveAllocations == 0);
+}
+
+void test_concurrent_vector_threads()
+{
+    const int numThreads = 4;
+    const int perThread = 50000;
+    concurrent_vector<int> v;
+    std::atomic<bool> done(false);
+
+    // Writers tag each element with its thread; half go one at a time, half
+    // in blocks. A reader checks that everything published is readable.
+    std::atomic<bool> readerOk(true);
+    std::thread reader([&]() {
+        while (!done) {
+            size_t published = v.published_size();
+            for (size_t i = published > 1000 ? published - 1000 : 0; i < published; i++) {
+                if (v[i] < 0 || v[i] >= numThreads * perThread)
+                    readerOk = false;
+            }
+        }
+    });
+
+    vector<std::thread> writers;
+    for (int t=0; t < numThreads; t++) {
+        writers.push_back(std::thread([&v, t, perThread]() {
+            int i = 0;
+            for (; i < perThread / 2; i++)
+                v.push_back(t * perThread + i);
+            while (i < perThread) {
+                vector<int> block;
+                for (int j=0; j < 100 && i < perThread; j++, i++)
+                    block.push_back(t * perThread + i);
+                v.grow_by(block.begin(), block.end());
+            }
+        }));
+    }
+    for (size_t t=0; t < writers.size(); t++)
+        writers[t].join();
+    done = true;
+    reader.join();
+
+    test_assert(readerOk);
+    test_assert(v.size() == size_t(numThreads * perThread));
+    test_assert(v.published_size() == v.size());
+
+    // Each value exactly once, and each thread's in the order it added them.
+    vector<int> last(numThreads, -1);
+    for (size_t i=0; i < v.size(); i++) {
+        int t = v[i] / perThread;
+        test_assert(v[i] > last[t]);
+        last[t] = v[i];
+    }
+    parallel_sort(v.begin(), v.end(), std::less<int>());
+    for (size_t i=0; i < v.size(); i++)
+        test_assert(v[i] == int(i));
+}
+
+int gNumComparisons = 0;
+
+bool counting_int_compare(int left, int right)
+{
+    gNumComparisons++;
+    return left < right;
+}
+
+void test_merge_sort_large()
+{
+    vector<int> v;
+    for (int i=0; i < 10000; i++)
+        v.push_back(next_random());
+
+    vector<int> expected(v);
+    std::sort(expected.begin(), expected.end());
+
+    mergesort(v.begin(), v.end(), counting_int_compare);
+
+    for (size_t i=0; i < v.size(); i++)
+        test_assert(v[i] == expected[i]);
+}
+
+void test_merge_sort_stable()
+{
+    // Lots of duplicate keys; values record the original order.
+    vector<KeyValue> v;
+    for (int i=0; i < 5000; i++) {
+        KeyValue kv = { next_random() % 20, i };
+        v.push_back(kv);
+    }
+
+    mergesort(v.begin(), v.end(), key_compare);
+
+    for (size_t i=1; i < v.size(); i++) {
+        test_assert(v[i-1].key <= v[i].key);
+        if (v[i-1].key == v[i].key)
+            test_assert(v[i-1].value < v[i].value);
+    }
+}
+
+void test_merge_sort_runs()
+{
+    // Sorted and reversed input should take a single linear scan.
+    vector<int> v;
+    for (int i=0; i < 10000; i++)
+        v.push_back(10000 - i);
+
+    gNumComparisons = 0;
+    mergesort(v.begin(), v.end(), counting_int_compare);
+    test_assert(gNumComparisons < 10000);
+
+    gNumComparisons = 0;
+    mergesort(v.begin(), v.end(), counting_int_compare);
+    test_assert(gNumComparisons < 10000);
+
+    for (int i=0; i < 10000; i++)
+        test_assert(v[i] == i + 1);
+
+    // Two presorted halves only need one merge.
+    vector<int> halves;
+    for (int i=0; i < 5000; i++)
+        halves.push_back(i * 2);
+    for (int i=0; i < 5000; i++)
+        halves.push_back(i * 2 + 1);
+
+    gNumComparisons = 0;
+    mergesort(halves.begin(), halves.end(), counting_int_compare);
+    test_assert(gNumComparisons < 20000);
+
+    for (int i=0; i < 10000; i++)
+        test_assert(halves[i] == i);
+}
+
+void test_merge_sort_allocator()
+{
+    // Strings, so the SIMD path doesn't take over.
+    vector<std::string> v;
+    for (int i=0; i < 1000; i++)
+        v.push_back(std::to_string(next_random()));
+    vector<std::string> expected(v);
+    std::sort(expected.begin(), expected.end());
+
+    // Scratch and run list both come from the allocator, and go back to it.
+    gLiveAllocations = 0;
+    CountingAllocator<int> counting;
+    vector<std::string> sorted(v);
+    mergesort(sorted.begin(), sorted.end(), std::less<std::string>(), counting);
+    test_assert(gLiveAllocations == 0);
+    test_assert(std::equal(sorted.begin(), sorted.end(), expected.begin()));
+
+    arena a;
+    mergesort(v.begin(), v.end(), std::less<std::string>(), arena_allocator<char>(a));
+    test_assert(a.reserved() > 0);
+    test_assert(std::equal(v.begin(), v.end(), expected.begin()));
+}
+
+void test_quick_sort()
+{
+    vector<std::string> v = get_sample_0_1_2_3_4();
+    quicksort(v.begin(), v.end(), string_compare);
+    test_equals(to_string(v), "[0, 1, 2, 3, 4]");
+
+    v = get_sample_4_3_2_1_0();
+    quicksort(v.begin(), v.end(), string_compare);
+    test_equals(to_string(v), "[0, 1, 2, 3, 4]");
+
+    v = get_sample_1_4_0_3_2();
+    quicksort(v.begin(), v.end(), string_compare);
+    test_equals(to_string(v), "[0, 1, 2, 3, 4]");
+
+    // Try just sorting a sublist
+    v = get_sample_4_3_2_1_0();
+    quicksort(v.begin() + 1, v.end() - 1, string_compare);
+    test_equals(to_string(v), "[4, 1, 2, 3, 0]");
+}
+
+bool is_sorted_ints(vector<int> const& v)
+{
+    for (size_t i=1; i < v.size(); i++)
+        if (v[i] < v[i-1])
+            return false;
+    return true;
+}
+
+void test_quick_sort_large()
+{
+    vector<int> v;
+    for (int i=0; i < 10000; i++)
+        v.push_back(next_random());
+
+    vector<int> expected(v);
+    std::sort(expected.begin(), expected.end());
+
+    quicksort(v.begin(), v.end(), counting_int_compare);
+
+    for (size_t i=0; i < v.size(); i++)
+        test_assert(v[i] == expected[i]);
+}
+
+void test_quick_sort_patterns()
+{
+    // Inputs that used to be quadratic. Each should stay well within
+    // O(n log n) comparisons.
+    const int n = 100000;
+    const int maxComparisons = 4 * n * 17;
+
+    for (int pattern=0; pattern < 5; pattern++) {
+        vector<int> v;
+        for (int i=0; i < n; i++) {
+            switch (pattern) {
+            case 0: v.push_back(i); break;                      // sorted
+            case 1: v.push_back(n - i); break;                  // reversed
+            case 2: v.push_back(7); break;                      // all equal
+            case 3: v.push_back(i < n/2 ? i : n - i); break;    // organ pipe
+            case 4: v.push_back(i % 2 ? i : n - i); break;      // sawtooth
+            }
+        }
+
+        gNumComparisons = 0;
+        quicksort(v.begin(), v.end(), counting_int_compare);
+        test_assert(is_sorted_ints(v));
+        test_assert(gNumComparisons < maxComparisons);
+    }
+}
+
+void test_heap_sort()
+{
+    vector<int> v;
+    for (int i=0; i < 1000; i++)
+        v.push_back(next_random() % 100);
+
+    heapsort(v.begin(), v.end(), counting_int_compare);
+    test_assert(is_sorted_ints(v));
+
+    vector<std::string> strings = get_sample_1_4_0_3_2();
+    heapsort(strings.begin(), strings.end(), string_compare);
+    test_equals(to_string(strings), "[0, 1, 2, 3, 4]");
+}
+
+void test_instrument_sorts()
+{
+    vector<int> input;
+    for (int i=0; i < 5000; i++)
+        input.push_back(next_random());
+
+    instrument_site quick("quicksort");
+    vector<int> v(input);
+    {
+        instrument_scope scope(quick);
+        gNumComparisons = 0;
+        quicksort<counting_instrument>(v.begin(), v.end(), counting_int_compare);
+    }
+    test_assert(is_sorted_ints(v));
+    instrument_counts q = quick.counts();
+    test_assert(q.comparisons == (uint64_t) gNumComparisons);
+    test_assert(q.swaps > 0);
+    test_assert(q.moves > 0);
+    test_assert(q.maxDepth > 1 && q.maxDepth < 30);
+    test_assert(q.reallocations == 0);
+
+    instrument_site merge("mergesort");
+    v = input;
+    {
+        instrument_scope scope(merge);
+        gNumComparisons = 0;
+        mergesort<counting_instrument>(v.begin(), v.end(), counting_int_compare);
+    }
+    test_assert(is_sorted_ints(v));
+    instrument_counts m = merge.counts();
+    test_assert(m.comparisons == (uint64_t) gNumComparisons);
+    test_assert(m.moves > 5000 * 8);
+
+    // 157 runs of 32 take 8 passes.
+    test_assert(m.maxDepth == 8);
+
+    // Sorted input is one run: no merging, so no moves.
+    merge.reset();
+    {
+        instrument_scope scope(merge);
+        mergesort<counting_instrument>(v.begin(), v.end(), counting_int_compare);
+    }
+    test_assert(merge.counts().comparisons == 4999);
+    test_assert(merge.counts().moves == 0);
+
+    // Uninstrumented sorts leave the site alone.
+    merge.reset();
+    {
+        instrument_scope scope(merge);
+        v = input;
+        quicksort<no_instrument>(v.begin(), v.end(), counting_int_compare);
+    }
+    test_assert(merge.counts().comparisons == 0);
+}
+
+void test_nth_element()
+{
+    const size_t sizes[] = { 1, 2, 3, 10, 17, 100, 1000, 20000 };
+
+    for (size_t s=0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t n = sizes[s];
+        vector<int> input;
+        for (size_t i=0; i < n; i++)
+            input.push_back(next_random() % (n / 2 + 1));
+        vector<int> sorted(input);
+        std::sort(sorted.begin(), sorted.end());
+
+        size_t positions[] = { 0, n / 3, n / 2, n - 1 };
+        for (size_t p=0; p < 4; p++) {
+            size_t nth = positions[p];
+            vector<int> v(input);
+            rtl::nth_element(v.begin(), v.begin() + nth, v.end(), std::less<int>());
+            test_assert(v[nth] == sorted[nth]);
+            for (size_t i=0; i < nth; i++)
+                test_assert(v[i] <= v[nth]);
+            for (size_t i=nth; i < n; i++)
+                test_assert(v[i] >= v[nth]);
+        }
+    }
+
+    // Sorted, reversed and all-equal input, with strings.
+    vector<std::string> strings;
+    for (int i=0; i < 1000; i++)
+        strings.push_back(std::to_string(10000 + i));
+    vector<std::string> reversed;
+    for (int i=999; i >= 0; i--)
+        reversed.push_back(strings[i]);
+    rtl::nth_element(reversed.begin(), reversed.begin() + 500, reversed.end(), string_compare);
+    test_equals(reversed[500], "10500");
+    rtl::nth_element(strings.begin(), strings.begin() + 10, strings.end(), string_compare);
+    test_equals(strings[10], "10010");
+
+    vector<int> same(5000, 7);
+    rtl::nth_element(same.begin(), same.begin() + 2500, same.end(), std::less<int>());
+    test_assert(same[2500] == 7);
+
+    // A median needs far fewer comparisons than a sort.
+    vector<int> v;
+    for (int i=0; i < 100000; i++)
+        v.push_back(next_random());
+    gNumComparisons = 0;
+    rtl::nth_element(v.begin(), v.begin() + 50000, v.end(), counting_int_compare);
+    test_assert(gNumComparisons < 100000 * 6);
+}
+
+// McIlroy's "killer adversary" for quicksort: values are decided only as
+// they get compared, so that whatever the pivot choice, median-of-3 or the
+// ninther, the pivot turns out to be nearly the smallest. Items start out as
+// "gas", bigger than anything solid; when two gas items meet, one of them
+// freezes into the next smallest value.
+struct KillerAdversary {
+    vector<int> values;
+    int gas;
+    int numSolid;
+    int candidate;
+    size_t comparisons;
+
+    explicit KillerAdversary(size_t n)
+      : values(n, int(n)), gas(int(n)), numSolid(0), candidate(0), comparisons(0)
+    {}
+};
+
+struct killer_compare {
+    KillerAdversary* adversary;
+
+    bool operator()(int x, int y) const
+    {
+        KillerAdversary& a = *adversary;
+        a.comparisons++;
+        if (a.values[x] == a.gas && a.values[y] == a.gas)
+            a.values[x == a.candidate ? x : y] = a.numSolid++;
+        if (a.values[x] == a.gas)
+            a.candidate = x;
+        else if (a.values[y] == a.gas)
+            a.candidate = y;
+        return a.values[x] < a.values[y];
+    }
+};
+
+void test_nth_element_adversary()
+{
+    // After running out of good pivots it has to stay O(n log n), wherever
+    // 'nth' is.
+    const size_t n = 20000;
+    const size_t positions[] = { 10, n / 4, n / 2, n - 10 };
+    for (size_t p=0; p < 4; p++) {
+        size_t nth = positions[p];
+        KillerAdversary adversary(n);
+        killer_compare comp = { &adversary };
+        vector<int> v;
+        for (size_t i=0; i < n; i++)
+            v.push_back(int(i));
+        rtl::nth_element(v.begin(), v.begin() + nth, v.end(), comp);
+        test_assert(adversary.comparisons < n * 60);
+
+        // Whatever values the adversary settled on, the order is right.
+        vector<int> values = adversary.values;
+        int pivot = values[v[nth]];
+        for (size_t i=0; i < nth; i++)
+            test_assert(values[v[i]] <= pivot);
+        for (size_t i=nth; i < n; i++)
+            test_assert(values[v[i]] >= pivot);
+    }
+}
+
+void test_partial_sort()
+{
+    vector<int> input;
+    for (int i=0; i < 10000; i++)
+        input.push_back(next_random());
+    vector<int> sorted(input);
+    std::sort(sorted.begin(), sorted.end());
+
+    // Both the heap (small k) and the nth_element (big k) ways.
+    const size_t ks[] = { 0, 1, 10, 100, 5000, 9999, 10000 };
+    for (size_t i=0; i < sizeof(ks) / sizeof(ks[0]); i++) {
+        size_t k = ks[i];
+        vector<int> v(input);
+        rtl::partial_sort(v.begin(), v.begin() + k, v.end(), counting_int_compare);
+        test_assert(std::equal(v.begin(), v.begin() + k, sorted.begin()));
+
+        std::sort(v.begin() + k, v.end());
+        test_assert(std::equal(v.begin() + k, v.end(), sorted.begin() + k));
+    }
+
+    vector<std::string> strings = get_sample_1_4_0_3_2();
+    rtl::partial_sort(strings.begin(), strings.begin() + 2, strings.end(), string_compare);
+    test_equals(strings[0], "0");
+    test_equals(strings[1], "1");
+}
+
+void test_top_k()
+{
+    vector<int> input;
+    for (int i=0; i < 50000; i++)
+        input.push_back(next_random());
+    vector<int> sorted(input);
+    std::sort(sorted.begin(), sorted.end(), std::greater<int>());
+
+    // Fed one at a time, and in ranges.
+    top_k<int, std::greater<int> > largest(100);
+    for (size_t i=0; i < 20000; i++)
+        largest.push(input[i]);
+    largest.push(input.begin() + 20000, input.end());
+    test_assert(largest.size() == 100);
+    vector<int> top = largest.sorted();
+    test_assert(top.size() == 100);
+    test_assert(std::equal(top.begin(), top.end(), sorted.begin()));
+
+    // Fewer elements than k.
+    top_k<std::string> smallest(10);
+    vector<std::string> strings = get_sample_1_4_0_3_2();
+    smallest.push(strings.begin(), strings.end());
+    smallest.push(std::string("5"));
+    test_assert(smallest.size() == 6);
+    test_equals(to_string(smallest.sorted()), "[0, 1, 2, 3, 4, 5]");
+
+    smallest.clear();
+    test_assert(smallest.size() == 0);
+    smallest.push(std::string("x"));
+    test_equals(to_string(smallest.sorted()), "[x]");
+
+    top_k<int> none(0);
+    none.push(1);
+    test_assert(none.sorted().size() == 0);
+}
+
+void test_argsort()
+{
+    vector<std::string> v = get_sample_1_4_0_3_2();
+    vector<uint32_t> perm = argsort(v.begin(), v.end(), string_compare);
+    test_equals(to_string(perm), "[2, 0, 4, 3, 1]");
+
+    // Stable, and the input stays put.
+    vector<KeyValue> kvs;
+    for (int i=0; i < 5000; i++) {
+        KeyValue kv = { next_random() % 50, i };
+        kvs.push_back(kv);
+    }
+    perm = argsort(kvs.begin(), kvs.end(), key_compare);
+    test_assert(perm.size() == kvs.size());
+    for (size_t i=0; i < kvs.size(); i++)
+        test_assert(kvs[i].value == int(i));
+    for (size_t i=1; i < perm.size(); i++) {
+        test_assert(kvs[perm[i-1]].key <= kvs[perm[i]].key);
+        if (kvs[perm[i-1]].key == kvs[perm[i]].key)
+            test_assert(perm[i-1] < perm[i]);
+    }
+
+    vector<int> empty;
+    test_assert(argsort(empty.begin(), empty.end(), std::less<int>()).size() == 0);
+}
+
+void test_apply_permutation()
+{
+    // One permutation applied to two columns.
+    vector<int> keys;
+    vector<std::string> names;
+    for (int i=0; i < 1000; i++) {
+        keys.push_back(next_random() % 100);
+        names.push_back(std::to_string(keys[i]));
+    }
+    vector<uint32_t> perm = argsort(keys.begin(), keys.end(), std::less<int>());
+    apply_permutation(keys.begin(), keys.end(), perm);
+    apply_permutation(names.begin(), names.end(), perm);
+    test_assert(is_sorted_ints(keys));
+    for (size_t i=0; i < keys.size(); i++)
+        test_equals(names[i], std::to_string(keys[i]));
+
+    // Every element moves once, plus once per cycle. This one is a single
+    // cycle of 4, and c stays put.
+    vector<Spy> spies;
+    spies.push_back(Spy("a"));
+    spies.push_back(Spy("b"));
+    spies.push_back(Spy("c"));
+    spies.push_back(Spy("d"));
+    spies.push_back(Spy("e"));
+    vector<uint32_t> rotate;
+    rotate.push_back(1);
+    rotate.push_back(3);
+    rotate.push_back(2);
+    rotate.push_back(4);
+    rotate.push_back(0);
+    spy_clear();
+    apply_permutation(spies.begin(), spies.end(), rotate);
+    test_assert(spy_count("move:") + spy_count("assign:") == 5);
+    std::string order;
+    for (size_t i=0; i < spies.size(); i++)
+        order += spies[i]._name.substr(0, 1);
+    test_equals(order, "bdcea");
+}
+
+void test_sort_by()
+{
+    // Sort some of the rows of a key column, by key.
+    vector<std::string> column = get_sample_4_3_2_1_0();
+    vector<uint32_t> rows;
+    rows.push_back(4);
+    rows.push_back(0);
+    rows.push_back(2);
+    sort_by(rows.begin(), rows.end(), column.begin(), string_compare);
+    test_equals(to_string(rows), "[4, 2, 0]");
+
+    // Sorting whole elements through indices.
+    vector<std::string> v;
+    for (int i=0; i < 3000; i++)
+        v.push_back(std::to_string(next_random()));
+    vector<std::string> expected(v);
+    std::sort(expected.begin(), expected.end());
+    indirect_sort(v.begin(), v.end(), std::less<std::string>());
+    test_assert(std::equal(v.begin(), v.end(), expected.begin()));
+}
+
+int gNumKeyCalls = 0;
+
+int value_key(KeyValue const& kv)
+{
+    gNumKeyCalls++;
+    return kv.key;
+}
+
+void test_sort_by_key()
+{
+    vector<KeyValue> input;
+    for (int i=0; i < 5000; i++) {
+        KeyValue kv = { int(next_random() % 200) - 100, i };
+        input.push_back(kv);
+    }
+
+    // Number keys get radix sorted, so both kinds are stable, and every key
+    // is computed once.
+    vector<KeyValue> v(input);
+    gNumKeyCalls = 0;
+    sort_by_key(v.begin(), v.end(), value_key);
+    test_assert(gNumKeyCalls == 5000);
+    test_assert(is_stably_sorted(v, 5000));
+
+    v = input;
+    gNumKeyCalls = 0;
+    stable_sort_by_key(v.begin(), v.end(), value_key);
+    test_assert(gNumKeyCalls == 5000);
+    test_assert(is_stably_sorted(v, 5000));
+
+    // Float keys, descending.
+    vector<float> floats;
+    for (int i=0; i < 1000; i++)
+        floats.push_back(float(next_random()) / 7 - 2000);
+    sort_by_key(floats.begin(), floats.end(), [](float f) { return -f; });
+    for (size_t i=1; i < floats.size(); i++)
+        test_assert(floats[i-1] >= floats[i]);
+
+    // String keys that share long prefixes, so the cached prefix often ties.
+    vector<std::string> names;
+    for (int i=0; i < 3000; i++)
+        names.push_back("/var/log/" + std::to_string(next_random() % 500));
+    names.push_back("");
+    names.push_back(std::string("/var/log\0", 9));
+    vector<std::string> expected(names);
+    std::sort(expected.begin(), expected.end());
+    int calls = 0;
+    auto identity = [&](std::string const& s) { calls++; return s; };
+    sort_by_key(names.begin(), names.end(), identity);
+    test_assert(calls == 3002);
+    test_assert(std::equal(names.begin(), names.end(), expected.begin()));
+
+    // Stable with string keys: the key is a suffix of the element.
+    vector<std::string> tagged;
+    for (int i=0; i < 1000; i++)
+        tagged.push_back(std::to_string(i) + ":" + std::to_string(next_random() % 10));
+    stable_sort_by_key(tagged.begin(), tagged.end(),
+                       [](std::string const& s) { return s.substr(s.find(':')); });
+    for (size_t i=1; i < tagged.size(); i++) {
+        std::string a = tagged[i-1].substr(tagged[i-1].find(':'));
+        std::string b = tagged[i].substr(tagged[i].find(':'));
+        test_assert(a <= b);
+        if (a == b)
+            test_assert(atoi(tagged[i-1].c_str()) < atoi(tagged[i].c_str()));
+    }
+
+    // Anything else with operator<.
+    vector<std::pair<int, int> > pairs;
+    for (int i=0; i < 1000; i++)
+        pairs.push_back(std::make_pair(int(next_random() % 10), int(next_random() % 10)));
+    sort_by_key(pairs.begin(), pairs.end(),
+                [](std::pair<int, int> const& p) { return std::make_pair(p.second, p.first); });
+    for (size_t i=1; i < pairs.size(); i++) {
+        test_assert(pairs[i-1].second <= pairs[i].second);
+        if (pairs[i-1].second == pairs[i].second)
+            test_assert(pairs[i-1].first <= pairs[i].first);
+    }
+}
+
+// string_sort() gives the same order as std::sort.
+void check_string_sort(vector<std::string> v)
+{
+    vector<std::string> expected(v);
+    std::sort(expected.begin(), expected.end());
+    string_sort(v.begin(), v.end());
+    test_assert(v.size() == expected.size());
+    test_assert(std::equal(v.begin(), v.end(), expected.begin()));
+}
+
+void test_string_sort()
+{
+    check_string_sort(vector<std::string>());
+    check_string_sort(vector<std::string>(1, "one"));
+
+    // URLs sharing a long prefix, with lots of duplicates, of every length
+    // around the 8-byte chunks.
+    vector<std::string> urls;
+    for (int i=0; i < 5000; i++) {
+        std::string url = "https://example.com/api/v1/";
+        url += std::to_string(next_random() % 300);
+        url += std::string(next_random() % 20, char('a' + next_random() % 3));
+        urls.push_back(url);
+    }
+    check_string_sort(urls);
+
+    // Already sorted, reversed, and all the same.
+    std::sort(urls.begin(), urls.end());
+    check_string_sort(urls);
+    vector<std::string> reversed;
+    for (size_t i=urls.size(); i > 0; i--)
+        reversed.push_back(urls[i-1]);
+    check_string_sort(reversed);
+    check_string_sort(vector<std::string>(1000, "https://example.com/"));
+
+    // Empty strings, embedded NULs (which sort before everything else, not
+    // like the end of the string), and bytes with the top bit set.
+    vector<std::string> odd;
+    for (int i=0; i < 2000; i++) {
+        std::string s;
+        size_t length = next_random() % 12;
+        for (size_t j=0; j < length; j++) {
+            const char bytes[] = { '\0', 'a', 'b', '\xff' };
+            s += bytes[next_random() % 4];
+        }
+        odd.push_back(s);
+    }
+    check_string_sort(odd);
+
+    // Every string a prefix of the next, so each chunk only finishes a few.
+    vector<std::string> prefixes;
+    for (int i=0; i < 3000; i++)
+        prefixes.push_back(std::string(next_random() % 3000, 'a'));
+    check_string_sort(prefixes);
+
+    // Moves the strings, not their copies.
+    vector<std::string> big(100, std::string(100, 'x'));
+    big[50] = std::string(100, 'a');
+    const char* data = big[50].data();
+    string_sort(big.begin(), big.end());
+    test_assert(big[0].data() == data);
+}
+
+template <typename T>
+T random_number()
+{
+    // Mix of signs, big and small values, and plenty of duplicates.
+    long long bits = ((long long) next_random() << 45) ^ ((long long) next_random() << 30)
+        ^ ((long long) next_random() << 15) ^ next_random();
+    switch (next_random() % 4) {
+    case 0: return T(next_random() % 16);
+    case 1: return T(-(long long) (next_random() % 1000)) / T(3);
+    case 2: return T(bits);
+    default: return T(-bits) / T(7);
+    }
+}
+
+template <typename T, typename Comp>
+bool check_sorts_like_std(vector<T> const& input, Comp comp)
+{
+    vector<T> expected(input);
+    std::sort(expected.begin(), expected.end(), comp);
+
+    vector<T> quick(input);
+    quicksort(quick.begin(), quick.end(), comp);
+
+    vector<T> merge(input);
+    mergesort(merge.begin(), merge.end(), comp);
+
+    for (size_t i=0; i < input.size(); i++) {
+        // Compare by ordering, since 0.0 and -0.0 may come out either way.
+        if (comp(quick[i], expected[i]) || comp(expected[i], quick[i]))
+            return false;
+        if (comp(merge[i], expected[i]) || comp(expected[i], merge[i]))
+            return false;
+    }
+    return true;
+}
+
+template <typename T>
+void check_simd_sort_type()
+{
+    const size_t sizes[] = { 0, 1, 2, 7, 8, 9, 16, 17, 33, 100, 129, 1000, 100000 };
+
+    for (size_t s=0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        vector<T> v;
+        for (size_t i=0; i < sizes[s]; i++)
+            v.push_back(random_number<T>());
+
+        test_assert(check_sorts_like_std(v, std::less<T>()));
+        test_assert(check_sorts_like_std(v, std::greater<T>()));
+    }
+
+    // Few distinct values, and presorted input.
+    vector<T> v;
+    for (size_t i=0; i < 50000; i++)
+        v.push_back(T(next_random() % 3));
+    test_assert(check_sorts_like_std(v, std::less<T>()));
+
+    std::sort(v.begin(), v.end());
+    test_assert(check_sorts_like_std(v, std::less<T>()));
+    test_assert(check_sorts_like_std(v, std::greater<T>()));
+}
+
+void test_simd_sort()
+{
+    check_simd_sort_type<int>();
+    check_simd_sort_type<unsigned>();
+    check_simd_sort_type<float>();
+    check_simd_sort_type<long>();
+    check_simd_sort_type<long long>();
+    check_simd_sort_type<unsigned long long>();
+    check_simd_sort_type<double>();
+
+    // Special float values.
+    vector<float> v;
+    v.push_back(0.0f);
+    v.push_back(-0.0f);
+    v.push_back(std::numeric_limits<float>::infinity());
+    v.push_back(-std::numeric_limits<float>::infinity());
+    v.push_back(std::numeric_limits<float>::min());
+    v.push_back(-std::numeric_limits<float>::max());
+    v.push_back(1.5f);
+    v.push_back(-1.5f);
+    test_assert(check_sorts_like_std(v, std::less<float>()));
+    test_assert(check_sorts_like_std(v, std::greater<float>()));
+}
+
+template <typename T>
+void check_radix_sort_type()
+{
+    const size_t sizes[] = { 0, 1, 2, 100, 10000 };
+
+    for (size_t s=0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        vector<T> v;
+        for (size_t i=0; i < sizes[s]; i++)
+            v.push_back(random_number<T>());
+
+        vector<T> expected(v);
+        std::stable_sort(expected.begin(), expected.end());
+
+        radix_sort(v.begin(), v.end());
+        for (size_t i=0; i < v.size(); i++)
+            test_assert(!(v[i] < expected[i]) && !(expected[i] < v[i]));
+    }
+}
+
+void test_radix_sort_numbers()
+{
+    check_radix_sort_type<char>();
+    check_radix_sort_type<short>();
+    check_radix_sort_type<int>();
+    check_radix_sort_type<unsigned>();
+    check_radix_sort_type<long long>();
+    check_radix_sort_type<unsigned long long>();
+    check_radix_sort_type<float>();
+    check_radix_sort_type<double>();
+
+    // Like data/set2: small values, so most of the passes get skipped.
+    vector<int> v;
+    for (int i=0; i < 10000; i++)
+        v.push_back(next_random() % 1000);
+    radix_sort(v.begin(), v.end());
+    test_assert(is_sorted_ints(v));
+
+    vector<float> f;
+    f.push_back(1.0f);
+    f.push_back(-std::numeric_limits<float>::infinity());
+    f.push_back(-0.0f);
+    f.push_back(-2.5f);
+    f.push_back(std::numeric_limits<float>::max());
+    radix_sort(f.begin(), f.end());
+    test_assert(f[0] == -std::numeric_limits<float>::infinity());
+    test_assert(f[1] == -2.5f);
+    test_assert(f[2] == 0.0f);
+    test_assert(f[3] == 1.0f);
+    test_assert(f[4] == std::numeric_limits<float>::max());
+}
+
+struct key_value_key {
+    int operator()(KeyValue const& kv) const
+    {
+        return kv.key;
+    }
+};
+
+void test_radix_sort_by_key()
+{
+    vector<KeyValue> v;
+    for (int i=0; i < 5000; i++) {
+        KeyValue kv = { next_random() % 50 - 25, i };
+        v.push_back(kv);
+    }
+
+    radix_sort(v.begin(), v.end(), key_value_key());
+
+    // Stable, like mergesort.
+    for (size_t i=1; i < v.size(); i++) {
+        test_assert(v[i-1].key <= v[i].key);
+        if (v[i-1].key == v[i].key)
+            test_assert(v[i-1].value < v[i].value);
+    }
+}
+
+void test_radix_sort_strings()
+{
+    vector<std::string> v = get_sample_1_4_0_3_2();
+    radix_sort(v.begin(), v.end());
+    test_equals(to_string(v), "[0, 1, 2, 3, 4]");
+
+    // Shared prefixes, empty strings, prefixes of each other and high bytes.
+    v.clear();
+    for (int i=0; i < 5000; i++) {
+        std::string s = "http://example.com/";
+        int length = next_random() % 6;
+        for (int c=0; c < length; c++)
+            s += char(next_random() % 3 == 0 ? 0xe9 : 'a' + next_random() % 4);
+        if (i % 100 == 0)
+            s.clear();
+        v.push_back(s);
+    }
+
+    vector<std::string> expected(v);
+    std::sort(expected.begin(), expected.end());
+
+    radix_sort(v.begin(), v.end());
+    for (size_t i=0; i < v.size(); i++)
+        test_equals(v[i], expected[i]);
+}
+
+void test_loser_tree()
+{
+    // Merge three sorted lists, one of them empty.
+    int lists[3][4] = { { 1, 4, 4, 9 }, { 0, 0, 0, 0 }, { 2, 4, 8, 10 } };
+    int lengths[3] = { 4, 0, 4 };
+    int positions[3] = { 0, 0, 0 };
+
+    loser_tree<int, std::less<int> > tree(3);
+    for (int i=0; i < 3; i++)
+        if (lengths[i] > 0)
+            tree.set(i, lists[i][positions[i]++]);
+    tree.start();
+
+    vector<std::string> merged;
+    while (!tree.empty()) {
+        size_t source = tree.top();
+        std::stringstream strm;
+        strm << tree.top_value() << "/" << source;
+        merged.push_back(strm.str());
+
+        if (positions[source] < lengths[source])
+            tree.replace_top(lists[source][positions[source]++]);
+        else
+            tree.pop_top();
+    }
+
+    // Ties come from the lower numbered source first.
+    test_equals(to_string(merged), "[1/0, 2/2, 4/0, 4/0, 4/2, 8/2, 9/0, 10/2]");
+}
+
+void write_file(const char* path, std::string const& contents)
+{
+    FILE* file = fopen(path, "wb");
+    test_assert(file != NULL);
+    fwrite(contents.data(), 1, contents.size(), file);
+    fclose(file);
+}
+
+std::string read_file(const char* path)
+{
+    std::string contents;
+    FILE* file = fopen(path, "rb");
+    test_assert(file != NULL);
+    char buffer[4096];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        contents.append(buffer, got);
+    fclose(file);
+    return contents;
+}
+
+const char* gExternalInput = "/tmp/rtl_external_sort_in.txt";
+const char* gExternalOutput = "/tmp/rtl_external_sort_out.txt";
+
+// 'numShards' sorted shards of KeyValues with keys below 'numKeys'. Values
+// count up across all the shards, so a stable merge keeps them in order
+// within a key.
+vector<vector<KeyValue> > make_shards(size_t numShards, int numKeys)
+{
+    vector<vector<KeyValue> > shards;
+    shards.resize(numShards);
+    int value = 0;
+    for (size_t s=0; s < numShards; s++) {
+        size_t length = next_random() % 2000;
+        for (size_t i=0; i < length; i++) {
+            KeyValue kv = { next_random() % numKeys, 0 };
+            shards[s].push_back(kv);
+        }
+        mergesort(shards[s].begin(), shards[s].end(), key_compare);
+        for (size_t i=0; i < length; i++)
+            shards[s][i].value = value++;
+    }
+    return shards;
+}
+
+vector<std::pair<KeyValue*, KeyValue*> > shard_ranges(vector<vector<KeyValue> >& shards)
+{
+    vector<std::pair<KeyValue*, KeyValue*> > ranges;
+    for (size_t s=0; s < shards.size(); s++)
+        ranges.push_back(std::make_pair(shards[s].begin(), shards[s].end()));
+    return ranges;
+}
+
+void test_merge()
+{
+    vector<std::string> left = get_sample_0_1_2_3_4();
+    vector<std::string> right;
+    right.push_back("1");
+    right.push_back("3");
+    right.push_back("5");
+
+    vector<std::string> out(8, std::string());
+    std::string* end = rtl::merge(left.begin(), left.end(), right.begin(), right.end(),
+                                  out.begin(), string_compare);
+    test_assert(end == out.end());
+    test_equals(to_string(out), "[0, 1, 1, 2, 3, 3, 4, 5]");
+
+    // Ties are taken from the left.
+    KeyValue a[] = { { 1, 0 }, { 2, 2 } };
+    KeyValue b[] = { { 1, 1 }, { 2, 3 }, { 3, 4 } };
+    KeyValue merged[5];
+    rtl::merge(a, a + 2, b, b + 3, merged, key_compare);
+    for (int i=0; i < 5; i++)
+        test_assert(merged[i].value == i);
+
+    rtl::merge(a, a, b, b + 3, merged, key_compare);
+    test_assert(merged[0].value == 1);
+
+    // Moving from one side and copying from the other moves, rather than
+    // copying both.
+    std::string longA(40, 'a'), longB(40, 'b'), longC(40, 'c');
+    std::string moved[] = { longA, longC };
+    std::string kept[] = { longB };
+    std::string out3[3];
+    rtl::merge(std::make_move_iterator(moved), std::make_move_iterator(moved + 2), kept, kept + 1,
+               out3, std::less<std::string>());
+    test_assert(out3[0] == longA && out3[1] == longB && out3[2] == longC);
+    test_assert(moved[0].empty() && moved[1].empty());
+    test_assert(kept[0] == longB);
+
+    // Lists only go forwards.
+    std::list<int> odds, evens;
+    for (int i=0; i < 10; i++)
+        (i % 2 == 0 ? evens : odds).push_back(i);
+    vector<int> ints(10, 0);
+    rtl::merge(evens.begin(), evens.end(), odds.begin(), odds.end(), ints.begin(), std::less<int>());
+    test_equals(to_string(ints), "[0, 1, 2, 3, 4, 5, 6, 7, 8, 9]");
+}
+
+void test_kway_merge()
+{
+    // 0, 1, 2 and 40 shards, some of them empty.
+    const size_t counts[] = { 0, 1, 2, 40 };
+    for (size_t c=0; c < 4; c++) {
+        vector<vector<KeyValue> > shards = make_shards(counts[c], 500);
+        if (counts[c] > 2)
+            shards[7].clear();
+        vector<std::pair<KeyValue*, KeyValue*> > ranges = shard_ranges(shards);
+
+        size_t total = 0;
+        for (size_t s=0; s < shards.size(); s++)
+            total += shards[s].size();
+
+        vector<KeyValue> out;
+        out.resize(total);
+        KeyValue* end = kway_merge(ranges, out.begin(), key_compare);
+        test_assert(end == out.end());
+        test_assert(is_stably_sorted(out, total));
+    }
+
+    // Lazily, through the iterator, stopping halfway.
+    vector<vector<KeyValue> > shards = make_shards(10, 50);
+    vector<std::pair<KeyValue*, KeyValue*> > ranges = shard_ranges(shards);
+    kway_merger<KeyValue*, bool (*)(KeyValue const&, KeyValue const&)> merger(ranges, key_compare);
+
+    vector<KeyValue> streamed;
+    for (auto it = merger.begin(); it != merger.end() && streamed.size() < 1000; ++it)
+        streamed.push_back(*it);
+    test_assert(is_stably_sorted(streamed, 1000));
+
+    auto rest = merger.begin();
+    KeyValue next = *rest++;
+    test_assert(!key_compare(next, streamed.back()));
+    for (; rest != merger.end(); ++rest)
+        streamed.push_back(*rest);
+    test_assert(merger.empty());
+
+    vector<std::string> words = get_sample_0_1_2_3_4();
+    vector<std::pair<std::string*, std::string*> > wordRanges;
+    wordRanges.push_back(std::make_pair(words.begin() + 2, words.end()));
+    wordRanges.push_back(std::make_pair(words.begin(), words.begin() + 2));
+    auto wordMerger = make_kway_merger(wordRanges, string_compare);
+    std::string joined;
+    for (auto it = wordMerger.begin(); it != wordMerger.end(); ++it)
+        joined += *it;
+    test_equals(joined, "01234");
+
+    // Moving rather than copying.
+    typedef std::move_iterator<std::string*> MoveIter;
+    vector<std::pair<MoveIter, MoveIter> > moveRanges;
+    for (size_t i=0; i < wordRanges.size(); i++) {
+        moveRanges.push_back(std::make_pair(MoveIter(wordRanges[i].first),
+                                            MoveIter(wordRanges[i].second)));
+    }
+    vector<std::string> moved(5, std::string());
+    kway_merge(moveRanges, moved.begin(), string_compare);
+    test_equals(to_string(moved), "[0, 1, 2, 3, 4]");
+}
+
+void test_parallel_kway_merge()
+{
+    thread_pool pool(4);
+
+    // Lots of duplicates across shards, so splits land in runs of equal keys.
+    vector<vector<KeyValue> > shards = make_shards(100, 20);
+    vector<std::pair<KeyValue*, KeyValue*> > ranges = shard_ranges(shards);
+    size_t total = 0;
+    for (size_t s=0; s < shards.size(); s++)
+        total += shards[s].size();
+    test_assert(total > parallel_merge_cutoff);
+
+    vector<KeyValue> out;
+    out.resize(total);
+    KeyValue* end = parallel_kway_merge(ranges, out.begin(), key_compare, pool);
+    test_assert(end == out.end());
+    test_assert(is_stably_sorted(out, total));
+
+    // Co-ranks split off exactly the first elements of the merge.
+    const size_t ranks[] = { 0, 1, 12345, total / 2, total - 1, total };
+    for (size_t r=0; r < sizeof(ranks) / sizeof(ranks[0]); r++) {
+        vector<char> inFirst(total, 0);
+        for (size_t i=0; i < ranks[r]; i++)
+            inFirst[out[i].value] = 1;
+
+        vector<size_t> splits;
+        kway_merge_corank(ranges, ranks[r], key_compare, splits);
+        size_t sum = 0;
+        for (size_t s=0; s < splits.size(); s++) {
+            sum += splits[s];
+            if (splits[s] > 0)
+                test_assert(inFirst[shards[s][splits[s] - 1].value]);
+            if (splits[s] < shards[s].size())
+                test_assert(!inFirst[shards[s][splits[s]].value]);
+        }
+        test_assert(sum == ranks[r]);
+    }
+}
+
+void test_external_sort_small()
+{
+    // Same as data/set1. Fits in memory, so no runs get spilled.
+    write_file(gExternalInput, "10, 9, 8, 7, 6, 5, 4, 3, 2, 1\n");
+
+    external_sort_stats stats = external_sort(gExternalInput, gExternalOutput);
+    test_equals(read_file(gExternalOutput), "1, 2, 3, 4, 5, 6, 7, 8, 9, 10\n");
+    test_assert(stats.numValues == 10);
+    test_assert(stats.numRuns == 1);
+    test_assert(stats.numMergePasses == 0);
+
+    write_file(gExternalInput, "");
+    external_sort(gExternalInput, gExternalOutput);
+    test_equals(read_file(gExternalOutput), "");
+}
+
+void test_external_sort_tiny_budget()
+{
+    vector<int> values;
+    std::stringstream input;
+    for (int i=0; i < 20000; i++) {
+        values.push_back(next_random() - 16384);
+        if (i != 0)
+            input << ", ";
+        input << values.back();
+    }
+    write_file(gExternalInput, input.str());
+
+    // A 2KB budget leaves room for under 500 numbers per run, and about a
+    // dozen runs per merge, so it takes two merge passes.
+    external_sort_options options;
+    options.memoryBudget = 2048;
+    options.tempDirectory = "/tmp";
+    external_sort_stats stats = external_sort(gExternalInput, gExternalOutput, options);
+
+    test_assert(stats.numValues == 20000);
+    test_assert(stats.numRuns > 20);
+    test_assert(stats.numMergePasses > 1);
+    test_assert(stats.peakMemory <= options.memoryBudget);
+
+    std::sort(values.begin(), values.end());
+    std::stringstream expected;
+    for (size_t i=0; i < values.size(); i++) {
+        if (i != 0)
+            expected << ", ";
+        expected << values[i];
+    }
+    expected << "\n";
+    test_assert(read_file(gExternalOutput) == expected.str());
+}
+
+void test_external_sort_errors()
+{
+    external_sort_options options;
+    options.memoryBudget = 100;
+
+    bool caught = false;
+    try {
+        external_sort(gExternalInput, gExternalOutput, options);
+    } catch (std::invalid_argument const&) {
+        caught = true;
+    }
+    test_assert(caught);
+
+    caught = false;
+    try {
+        external_sort("/nonexistent/input", gExternalOutput);
+    } catch (std::runtime_error const&) {
+        caught = true;
+    }
+    test_assert(caught);
+
+    remove(gExternalInput);
+    remove(gExternalOutput);
+}
+
+std::string load_data_string(std::string const& contents)
+{
+    write_file(gExternalInput, contents);
+    vector<int> values;
+    load_data_file(gExternalInput, values);
+    return to_string(values);
+}
+
+void test_data_file_parse()
+{
+    test_equals(load_data_string(""), "[]");
+    test_equals(load_data_string("\n"), "[]");
+    test_equals(load_data_string("7"), "[7]");
+    test_equals(load_data_string("10, 9, 8\n"), "[10, 9, 8]");
+    test_equals(load_data_string("-5, 0, -0, 12"), "[-5, 0, 0, 12]");
+
+    // Lengths around the eight digits a single load covers, right up against
+    // the end of the file as well as with something after them.
+    test_equals(load_data_string("1234567, 12345678, 123456789, 1234567890"),
+                "[1234567, 12345678, 123456789, 1234567890]");
+    test_equals(load_data_string("12345678"), "[12345678]");
+    test_equals(load_data_string("123456789\n"), "[123456789]");
+    test_equals(load_data_string("2147483647, -2147483648, 00000000042"),
+                "[2147483647, -2147483648, 42]");
+
+    // Any other separators work too, and a minus sign on its own is one.
+    test_equals(load_data_string("1,2;;3 - 4\n\n5-"), "[1, 2, 3, 4, 5]");
+
+    const char* text = "1, 22, 333, 4444, 55555, 666666";
+    test_assert(data_count_values(text, text + strlen(text)) == 6);
+
+    bool caught = false;
+    try {
+        vector<int> values;
+        load_data_file("/nonexistent/input", values);
+    } catch (std::runtime_error const&) {
+        caught = true;
+    }
+    test_assert(caught);
+
+    remove(gExternalInput);
+}
+
+void test_data_file_round_trip()
+{
+    // Big enough that loading and saving are split between threads.
+    vector<int> values;
+    for (int i=0; i < 300000; i++)
+        values.push_back((next_random() << 17) ^ (next_random() << 2) ^ next_random());
+    values.push_back(std::numeric_limits<int>::min());
+    values.push_back(std::numeric_limits<int>::max());
+    values.push_back(0);
+
+    thread_pool pool(4);
+    save_data_file(gExternalOutput, values, pool);
+
+    std::string text = read_file(gExternalOutput);
+    test_assert(text.size() > data_file_parallel_cutoff);
+    test_assert(text.compare(0, text.find(',') + 2, to_string(values[0]) + ", ") == 0);
+    test_assert(text.compare(text.size() - 16, 16, ", 2147483647, 0\n") == 0);
+
+    vector<int> loaded;
+    load_data_file(gExternalOutput, loaded, pool);
+    test_assert(loaded.size() == values.size());
+    test_assert(std::equal(values.begin(), values.end(), loaded.begin()));
+
+    // Matches what the external sort writes.
+    vector<int> small;
+    small.push_back(3);
+    small.push_back(-20);
+    save_data_file(gExternalOutput, small, pool);
+    test_equals(read_file(gExternalOutput), "3, -20\n");
+
+    save_data_file(gExternalOutput, vector<int>(), pool);
+    test_equals(read_file(gExternalOutput), "");
+
+    remove(gExternalOutput);
+}
+
+void test_data_file_sets()
+{
+    // Run from week1, like "make && ./main".
+    vector<int> values;
+    load_data_file("data/set1", values);
+    test_equals(to_string(values), "[10, 9, 8, 7, 6, 5, 4, 3, 2, 1]");
+
+    load_data_file("data/set2", values);
+    test_assert(values.size() == 500);
+    test_assert(values[values.size() - 1] == 516);
+}
+
+void test_thread_pool()
+{
+    thread_pool pool(4);
+    test_assert(pool.size() == 4);
+
+    std::atomic<int> counter(0);
+    task_group group(pool);
+    for (int i=0; i < 1000; i++)
+        group.run([&counter]() { counter++; });
+    group.wait();
+    test_assert(counter == 1000);
+
+    // Tasks that fork more tasks into the same group.
+    counter = 0;
+    std::function<void(int)> fork = [&](int depth) {
+        counter++;
+        if (depth > 0) {
+            group.run([&fork, depth]() { fork(depth - 1); });
+            group.run([&fork, depth]() { fork(depth - 1); });
+        }
+    };
+    group.run([&fork]() { fork(9); });
+    group.wait();
+    test_assert(counter == 1023);
+
+    // Exceptions come back out of wait().
+    group.run([]() { throw std::runtime_error("oops"); });
+    bool caught = false;
+    try {
+        group.wait();
+    } catch (std::runtime_error const&) {
+        caught = true;
+    }
+    test_assert(caught);
+}
+
+bool int_compare(int left, int right)
+{
+    return left < right;
+}
+
+void test_parallel_sort()
+{
+    thread_pool pool(4);
+
+    // Big enough to get partitioned in parallel.
+    vector<int> v;
+    for (int i=0; i < 3000000; i++)
+        v.push_back(next_random() * 32768 + next_random());
+
+    vector<int> expected(v);
+    std::sort(expected.begin(), expected.end());
+
+    parallel_sort(v.begin(), v.end(), int_compare, pool);
+    for (size_t i=0; i < v.size(); i++)
+        test_assert(v[i] == expected[i]);
+
+    // Sorted, and all equal.
+    parallel_sort(v.begin(), v.end(), int_compare, pool);
+    test_assert(is_sorted_ints(v));
+
+    vector<int> same;
+    same.resize(3000000, 5);
+    parallel_sort(same.begin(), same.end(), int_compare, pool);
+    test_assert(is_sorted_ints(same));
+
+    // Few distinct values.
+    for (size_t i=0; i < v.size(); i++)
+        v[i] = next_random() % 3;
+    parallel_sort(v.begin(), v.end(), int_compare, pool);
+    test_assert(is_sorted_ints(v));
+
+    // Small ranges go straight to quicksort.
+    vector<std::string> strings = get_sample_1_4_0_3_2();
+    parallel_sort(strings.begin(), strings.end(), string_compare);
+    test_equals(to_string(strings), "[0, 1, 2, 3, 4]");
+}
+
+void test_parallel_stable_sort()
+{
+    thread_pool pool(4);
+
+    vector<KeyValue> v;
+    for (int i=0; i < 1000000; i++) {
+        KeyValue kv = { next_random() % 1000, i };
+        v.push_back(kv);
+    }
+
+    parallel_stable_sort(v.begin(), v.end(), key_compare, pool);
+
+    for (size_t i=1; i < v.size(); i++) {
+        test_assert(v[i-1].key <= v[i].key);
+        if (v[i-1].key == v[i].key)
+            test_assert(v[i-1].value < v[i].value);
+    }
+
+    vector<std::string> strings = get_sample_4_3_2_1_0();
+    parallel_stable_sort(strings.begin(), strings.end(), string_compare);
+    test_equals(to_string(strings), "[0, 1, 2, 3, 4]");
+}
+
+// Counts live instances, and throws the first time the one with
+// gThrowingMoveKey is moved.
+std::atomic<int> gLiveThrowingMoves(0);
+std::atomic<int> gThrowingMoveKey(-1);
+
+struct ThrowingMove {
+    int key;
+
+    explicit ThrowingMove(int key) : key(key) { gLiveThrowingMoves++; }
+    ThrowingMove(ThrowingMove const& copy) : key(copy.key) { gLiveThrowingMoves++; }
+    ThrowingMove(ThrowingMove&& move) : key(move.key)
+    {
+        int expected = key;
+        if (gThrowingMoveKey.compare_exchange_strong(expected, -1))
+            throw std::runtime_error("move failed");
+        gLiveThrowingMoves++;
+    }
+    ThrowingMove& operator=(ThrowingMove const& copy) { key = copy.key; return *this; }
+    ~ThrowingMove() { gLiveThrowingMoves--; }
+};
+
+bool operator<(ThrowingMove const& a, ThrowingMove const& b)
+{
+    return a.key < b.key;
+}
+
+void test_parallel_stable_sort_throws()
+{
+    thread_pool pool(4);
+    {
+        vector<ThrowingMove> v;
+        for (int i=0; i < 200000; i++)
+            v.push_back(ThrowingMove(199999 - i));
+
+        // Thrown while the blocks are moving into scratch space: only the
+        // elements that got there are destroyed.
+        gThrowingMoveKey = 50000;
+        bool threw = false;
+        try {
+            parallel_stable_sort(v.begin(), v.end(), std::less<ThrowingMove>(), pool);
+        } catch (std::runtime_error const&) {
+            threw = true;
+        }
+        test_assert(threw);
+        test_assert(gLiveThrowingMoves == 200000);
+    }
+    test_assert(gLiveThrowingMoves == 0);
+}
+
+void test_bench_harness()
+{
+    // The slow sample is an outlier, and doesn't count.
+    vector<double> times;
+    for (int i=0; i < 9; i++)
+        times.push_back(100 + i % 3);
+    times.push_back(1000);
+    apf_bench_result result;
+    result.name = "bench_fake";
+    result.iterations = 64;
+    apf_bench_summarize(times, result);
+    test_assert(result.samples == 9);
+    test_assert(result.outliers == 1);
+    test_assert(result.median == 101);
+    test_assert(result.mean == 101);
+    test_assert(std::fabs(result.stddev - std::sqrt(6.0 / 8)) < 1e-9);
+
+    vector<apf_bench_result> results;
+    results.push_back(result);
+    result.name = "bench_other";
+    result.median = 2.5;
+    results.push_back(result);
+
+    const char* path = "/tmp/rtl_bench_baseline.json";
+    apf_bench_write_json(path, results);
+    std::map<std::string, double> medians = apf_bench_read_json(path);
+    test_assert(medians.size() == 2);
+    test_assert(medians["bench_fake"] == 101);
+    test_assert(medians["bench_other"] == 2.5);
+    remove(path);
+}
+
+void apf_run_tests()
+{
+    run_test(test_with_to_string);
+    run_test(test_the_spy);
+    run_test(test_copy);
+    run_test(test_growth_moves);
+    run_test(test_insert_erase_moves);
+    run_test(test_emplace_moves);
+    run_test(test_move_only_elements);
+    run_test(test_trivially_relocatable);
+    run_test(test_vector_allocator);
+    run_test(test_arena_allocator);
+    run_test(test_pool_allocator);
+    run_test(test_caching_allocator);
+    run_test(test_huge_page_allocator);
+    run_test(test_small_vector_inline);
+    run_test(test_small_vector_swap);
+    run_test(test_segmented_vector_growth);
+    run_test(test_segmented_vector_insert_erase);
+    run_test(test_segmented_vector_sort);
+    run_test(test_hash_map);
+    run_test(test_hash_set);
+    run_test(test_btree_map);
+    run_test(test_btree_set);
+    run_test(test_btree_bulk_load_throws);
+    run_test(test_persistent_vector);
+    run_test(test_persistent_vector_parallel);
+    run_test(test_concurrent_vector);
+    run_test(test_concurrent_vector_threads);
+    run_test(test_range_insert);
+    run_test(test_clear);
+    run_test(test_accessors);
+    run_test(test_swap);
+    run_test(test_big_list);
+    run_test(test_insert);
+    run_test(test_erase);
+    run_test(test_instrument_vector);
+    run_test(test_merge_sort);
+    run_test(test_merge_sort_large);
+    run_test(test_merge_sort_stable);
+    run_test(test_merge_sort_runs);
+    run_test(test_merge_sort_allocator);
+    run_test(test_quick_sort);
+    run_test(test_quick_sort_large);
+    run_test(test_quick_sort_patterns);
+    run_test(test_heap_sort);
+    run_test(test_instrument_sorts);
+    run_test(test_nth_element);
+    run_test(test_nth_element_adversary);
+    run_test(test_partial_sort);
+    run_test(test_top_k);
+    run_test(test_argsort);
+    run_test(test_apply_permutation);
+    run_test(test_sort_by);
+    run_test(test_sort_by_key);
+    run_test(test_string_sort);
+    run_test(test_simd_sort);
+    run_test(test_radix_sort_numbers);
+    run_test(test_radix_sort_by_key);
+    run_test(test_radix_sort_strings);
+    run_test(test_loser_tree);
+    run_test(test_merge);
+    run_test(test_kway_merge);
+    run_test(test_parallel_kway_merge);
+    run_test(test_external_sort_small);
+    run_test(test_external_sort_tiny_budget);
+    run_test(test_external_sort_errors);
+    run_test(test_data_file_parse);
+    run_test(test_data_file_round_trip);
+    run_test(test_data_file_sets);
+    run_test(test_thread_pool);
+    run_test(test_parallel_sort);
+    run_test(test_parallel_stable_sort);
+    run_test(test_parallel_stable_sort_throws);
+    run_test(test_bench_harness);
+}
+
+// Benchmarks for vector.h and sort.h, for apf_run_benches(). Results are
+// summed into a global so that the work can't be optimized away.
+long gBenchSink = 0;
+
+double bench_vector_push_back(size_t iterations)
+{
+    double start = apf_now_seconds();
+    for (size_t it=0; it < iterations; it++) {
+        vector<int> v;
+        for (int i=0; i < 10000; i++)
+            v.push_back(i);
+        gBenchSink += v.back();
+    }
+    return apf_now_seconds() - start;
+}
+
+double bench_vector_insert_erase(size_t iterations)
+{
+    vector<int> v(10000, 1);
+    double start = apf_now_seconds();
+    for (size_t it=0; it < iterations; it++) {
+        v.insert(v.begin() + 5000, int(it));
+        v.erase(v.begin() + 5000);
+    }
+    gBenchSink += v[5000];
+    return apf_now_seconds() - start;
+}
+
+double bench_vector_copy_strings(size_t iterations)
+{
+    vector<std::string> v;
+    for (int i=0; i < 1000; i++)
+        v.push_back(std::string(40, char('a' + i % 26)));
+
+    double start = apf_now_seconds();
+    for (size_t it=0; it < iterations; it++) {
+        vector<std::string> copy(v);
+        gBenchSink += copy.size();
+    }
+    return apf_now_seconds() - start;
+}
+
+vector<int> bench_random_ints(size_t n)
+{
+    gRandomState = 1;
+    vector<int> v;
+    for (size_t i=0; i < n; i++)
+        v.push_back((next_random() << 15) ^ next_random());
+    return v;
+}
+
+// Sort a fresh copy of 'input' each iteration, only timing the sort.
+template <typename T, typename Sort>
+double bench_sort(vector<T> const& input, size_t iterations, Sort sort)
+{
+    double elapsed = 0;
+    for (size_t it=0; it < iterations; it++) {
+        vector<T> v(input);
+        double start = apf_now_seconds();
+        sort(v);
+        elapsed += apf_now_seconds() - start;
+    }
+    return elapsed;
+}
+
+double bench_quicksort_ints(size_t iterations)
+{
+    static const vector<int> input = bench_random_ints(100000);
+    return bench_sort(input, iterations, [](vector<int>& v) {
+        quicksort(v.begin(), v.end(), std::less<int>());
+    });
+}
+
+double bench_mergesort_ints(size_t iterations)
+{
+    static const vector<int> input = bench_random_ints(100000);
+    return bench_sort(input, iterations, [](vector<int>& v) {
+        mergesort(v.begin(), v.end(), std::less<int>());
+    });
+}
+
+double bench_heapsort_ints(size_t iterations)
+{
+    static const vector<int> input = bench_random_ints(100000);
+    return bench_sort(input, iterations, [](vector<int>& v) {
+        heapsort(v.begin(), v.end(), std::less<int>());
+    });
+}
+
+double bench_quicksort_strings(size_t iterations)
+{
+    static vector<std::string> input;
+    if (input.empty()) {
+        vector<int> numbers = bench_random_ints(10000);
+        for (size_t i=0; i < numbers.size(); i++)
+            input.push_back("/log/" + std::to_string(numbers[i]));
+    }
+    return bench_sort(input, iterations, [](vector<std::string>& v) {
+        quicksort(v.begin(), v.end(), std::less<std::string>());
+    });
+}
+
+bool apf_run_benches(apf_bench_options const& options)
+{
+    std::map<std::string, double> baseline;
+    try {
+        if (!options.baselinePath.empty())
+            baseline = apf_bench_read_json(options.baselinePath.c_str());
+    } catch (std::exception const& e) {
+        std::cout << "benchmarks failed: \n  " << e.what() << std::endl;
+        return false;
+    }
+
+    vector<apf_bench_result> results;
+    run_bench(bench_vector_push_back);
+    run_bench(bench_vector_insert_erase);
+    run_bench(bench_vector_copy_strings);
+    run_bench(bench_quicksort_ints);
+    run_bench(bench_mergesort_ints);
+    run_bench(bench_heapsort_ints);
+    run_bench(bench_quicksort_strings);
+
+    bool ok = true;
+    printf("  %-26s %12s %12s %10s %8s %10s\n", "benchmark", "median ns", "mean ns", "stddev",
+           "samples", "baseline");
+    for (size_t i=0; i < results.size(); i++) {
+        apf_bench_result const& r = results[i];
+        printf("  %-26s %12.1f %12.1f %10.1f %5d/%-2d", r.name.c_str(), r.median, r.mean, r.stddev,
+               r.samples, r.samples + r.outliers);
+
+        std::map<std::string, double>::const_iterator it = baseline.find(r.name);
+        if (it != baseline.end()) {
+            double change = r.median / it->second - 1;
+            bool slower = change > options.threshold;
+            printf(" %+9.1f%%%s", change * 100, slower ? "  slower than baseline" : "");
+            ok = ok && !slower;
+        }
+        printf("\n");
+    }
+
+    try {
+        if (!options.jsonPath.empty())
+            apf_bench_write_json(options.jsonPath.c_str(), results);
+    } catch (std::exception const& e) {
+        std::cout << "benchmarks failed: \n  " << e.what() << std::endl;
+        return false;
+    }
+    return ok;
 }
 
@@ -1,2 +1,21 @@
+#pragma once
+
+#include <string>
 
 void apf_run_tests();
+
+// Options for apf_run_benches().
+struct apf_bench_options {
+    std::string jsonPath;       // Where to write the results, if anywhere.
+    std::string baselinePath;   // Earlier results to compare against.
+    double threshold;           // Allowed slowdown of a median; 0.2 is 20%.
+
+    apf_bench_options()
+      : threshold(0.2)
+    {}
+};
+
+// Times the benchmarks in apftest.cc and prints mean, median and standard
+// deviation for each. Returns false if any is slower than its baseline by
+// more than the threshold.
+bool apf_run_benches(apf_bench_options const& options);
@@ -0,0 +1,1319 @@
+// Benchmarks. Build and run with "make bench && ./bench".
+//
+// Every benchmark runs a few warmup samples and then up to --repetitions
+// timed ones, and reports the median and 95th percentile time per element.
+// Small inputs are timed in batches of many copies so the clock's resolution
+// doesn't matter.
+//
+// Options:
+//   --max-size N      largest input, up to 100000000 (default 1000000)
+//   --repetitions N   timed samples per benchmark (default 15)
+//   --filter TEXT     only run benchmarks whose "group/name/input" has TEXT
+//   --csv FILE        where the machine readable results go (default
+//                     bench.csv, "" for none)
+
+#include "vector.h"
+#include "sort.h"
+#include "allocator.h"
+#include "btree.h"
+#include "concurrent_vector.h"
+#include "hash_map.h"
+#include "indirect_sort.h"
+#include "merge.h"
+#include "persistent_vector.h"
+#include "radix_sort.h"
+#include "segmented_vector.h"
+#include "small_vector.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Not "using namespace std", since bench code also talks about std::vector.
+using namespace rtl;
+
+double now_seconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct bench_options {
+    size_t maxSize;
+    int repetitions;
+    std::string filter;
+    std::string csvPath;
+
+    bench_options()
+      : maxSize(1000000), repetitions(15), csvPath("bench.csv")
+    {}
+};
+
+bench_options gOptions;
+FILE* gCsv = NULL;
+
+// Nanoseconds per element.
+struct bench_stats {
+    double median;
+    double p95;
+    int samples;
+};
+
+// Each sample covers at least this many elements, over several copies of
+// the input if it's small.
+const size_t bench_sample_elements = 1 << 16;
+
+// Stop taking samples after this long, once there are enough of them.
+const double bench_time_limit = 2.0;
+const int bench_min_samples = 5;
+
+bool bench_selected(const char* group, const char* name, const char* input)
+{
+    std::string key = std::string(group) + "/" + name + "/" + input;
+    return key.find(gOptions.filter) != std::string::npos;
+}
+
+// Time 'sample', which does 'batch' runs over 'n' elements and returns how
+// many seconds they took (leaving out any setup).
+template <typename Sample>
+bench_stats bench_measure(size_t n, Sample sample)
+{
+    size_t batch = std::max<size_t>(1, bench_sample_elements / n);
+
+    sample(batch);
+    if (n * batch < 1000000)
+        sample(batch);
+
+    std::vector<double> times;
+    double start = now_seconds();
+    for (int r=0; r < gOptions.repetitions; r++) {
+        times.push_back(sample(batch) * 1e9 / double(n * batch));
+        if (r + 1 >= bench_min_samples && now_seconds() - start > bench_time_limit)
+            break;
+    }
+
+    // Nearest rank percentiles.
+    std::sort(times.begin(), times.end());
+    bench_stats stats;
+    stats.samples = int(times.size());
+    stats.median = times[(times.size() - 1) / 2];
+    stats.p95 = times[size_t(std::ceil(0.95 * times.size())) - 1];
+    return stats;
+}
+
+void bench_report(const char* group, const char* name, const char* input, size_t n,
+                  bench_stats const& stats)
+{
+    printf("  %-22s %-12s %10zu %10.2f %10.2f\n", name, input, n, stats.median, stats.p95);
+    fflush(stdout);
+
+    if (gCsv != NULL)
+        fprintf(gCsv, "%s,%s,%s,%zu,%.3f,%.3f,%d\n", group, name, input, n, stats.median,
+                stats.p95, stats.samples);
+}
+
+void bench_heading(const char* title)
+{
+    printf("%s\n  %-22s %-12s %10s %10s %10s\n", title, "benchmark", "input", "n",
+           "median ns", "p95 ns");
+}
+
+template <typename Sample>
+void bench_run(const char* group, const char* name, const char* input, size_t n, Sample sample)
+{
+    if (bench_selected(group, name, input))
+        bench_report(group, name, input, n, bench_measure(n, sample));
+}
+
+// Sort a fresh copy of 'input' 'batch' times, and return the time spent sorting.
+template <typename Container, typename Sort>
+double bench_sort_sample(Container const& input, Sort sort, size_t batch)
+{
+    std::vector<Container> copies(batch);
+    for (size_t b=0; b < batch; b++)
+        copies[b] = input;
+
+    double start = now_seconds();
+    for (size_t b=0; b < batch; b++)
+        sort(copies[b]);
+    return now_seconds() - start;
+}
+
+// The rtl sorts on rtl::vector against the std ones on std::vector.
+template <typename T, typename Comp>
+void bench_sorts(const char* input, std::vector<T> const& data, Comp comp)
+{
+    vector<T> ours(data.begin(), data.end());
+    size_t n = data.size();
+
+    bench_run("sort", "rtl::quicksort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<T>& v) { quicksort(v.begin(), v.end(), comp); }, batch);
+    });
+    bench_run("sort", "std::sort", input, n, [&](size_t batch) {
+        return bench_sort_sample(data, [&](std::vector<T>& v) { std::sort(v.begin(), v.end(), comp); }, batch);
+    });
+    bench_run("sort", "rtl::mergesort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<T>& v) { mergesort(v.begin(), v.end(), comp); }, batch);
+    });
+    bench_run("sort", "std::stable_sort", input, n, [&](size_t batch) {
+        return bench_sort_sample(data, [&](std::vector<T>& v) { std::stable_sort(v.begin(), v.end(), comp); }, batch);
+    });
+}
+
+// The inputs sorts get tested on.
+std::vector<int> make_ints(const char* pattern, size_t n, std::mt19937& random)
+{
+    std::vector<int> v(n);
+    for (size_t i=0; i < n; i++) {
+        if (strcmp(pattern, "random") == 0)
+            v[i] = int(random());
+        else if (strcmp(pattern, "sorted") == 0)
+            v[i] = int(i);
+        else if (strcmp(pattern, "reversed") == 0)
+            v[i] = int(n - i);                      // Like data/set1.
+        else if (strcmp(pattern, "few_unique") == 0)
+            v[i] = int(random() % 8);
+        else                                        // "organ_pipe"
+            v[i] = int(i < n / 2 ? i : n - i);
+    }
+    return v;
+}
+
+std::vector<std::string> make_strings(size_t n, std::mt19937& random)
+{
+    std::vector<std::string> v(n);
+    for (size_t i=0; i < n; i++) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "/log/%u/%u", unsigned(random() % 100), unsigned(random()));
+        v[i] = buffer;
+    }
+    return v;
+}
+
+// 10, 100, ... up to --max-size.
+std::vector<size_t> bench_sizes(size_t limit)
+{
+    std::vector<size_t> sizes;
+    for (size_t n = 10; n <= std::min(limit, gOptions.maxSize); n *= 10)
+        sizes.push_back(n);
+    return sizes;
+}
+
+// Strings with a long prefix in common, like the URLs in a crawl log.
+std::vector<std::string> make_urls(size_t n, std::mt19937& random)
+{
+    std::vector<std::string> v(n);
+    for (size_t i=0; i < n; i++) {
+        char buffer[96];
+        snprintf(buffer, sizeof(buffer), "https://www.example.com/catalog/%u/item/%u",
+                 unsigned(random() % 1000), unsigned(random()));
+        v[i] = buffer;
+    }
+    return v;
+}
+
+void bench_string_sorts(const char* input, std::vector<std::string> const& data)
+{
+    vector<std::string> ours(data.begin(), data.end());
+    size_t n = data.size();
+
+    bench_run("string_sort", "rtl::string_sort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<std::string>& v) { string_sort(v.begin(), v.end()); }, batch);
+    });
+    bench_run("string_sort", "rtl::quicksort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<std::string>& v) {
+            quicksort(v.begin(), v.end(), std::less<std::string>());
+        }, batch);
+    });
+    bench_run("string_sort", "std::sort", input, n, [&](size_t batch) {
+        return bench_sort_sample(data, [&](std::vector<std::string>& v) { std::sort(v.begin(), v.end()); }, batch);
+    });
+}
+
+void bench_sort_suite()
+{
+    const char* patterns[] = { "random", "sorted", "reversed", "few_unique", "organ_pipe" };
+    std::vector<size_t> sizes = bench_sizes(100000000);
+    std::mt19937 random(1);
+
+    bench_heading("sorting (ns per element)");
+    for (size_t p=0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        for (size_t s=0; s < sizes.size(); s++)
+            bench_sorts(patterns[p], make_ints(patterns[p], sizes[s], random), std::less<int>());
+    }
+
+    // Strings take far more memory per element.
+    sizes = bench_sizes(10000000);
+    for (size_t s=0; s < sizes.size(); s++)
+        bench_sorts("strings", make_strings(sizes[s], random), std::less<std::string>());
+    for (size_t s=0; s < sizes.size(); s++) {
+        bench_string_sorts("strings", make_strings(sizes[s], random));
+        bench_string_sorts("urls", make_urls(sizes[s], random));
+    }
+}
+
+// The median and the smallest 1000 of random ints, picked out by selection
+// against a full sort.
+void bench_select_suite()
+{
+    std::vector<size_t> sizes = bench_sizes(100000000);
+    std::mt19937 random(1);
+
+    bench_heading("selection (ns per element)");
+    for (size_t s=0; s < sizes.size(); s++) {
+        size_t n = sizes[s];
+        std::vector<int> data = make_ints("random", n, random);
+        vector<int> ours(data.begin(), data.end());
+        size_t k = std::min(n, size_t(1000));
+
+        bench_run("select", "rtl::nth_element", "median", n, [&](size_t batch) {
+            return bench_sort_sample(ours, [&](vector<int>& v) {
+                rtl::nth_element(v.begin(), v.begin() + n / 2, v.end(), std::less<int>());
+            }, batch);
+        });
+        bench_run("select", "std::nth_element", "median", n, [&](size_t batch) {
+            return bench_sort_sample(data, [&](std::vector<int>& v) {
+                std::nth_element(v.begin(), v.begin() + n / 2, v.end(), std::less<int>());
+            }, batch);
+        });
+        bench_run("select", "rtl::partial_sort", "top_1000", n, [&](size_t batch) {
+            return bench_sort_sample(ours, [&](vector<int>& v) {
+                rtl::partial_sort(v.begin(), v.begin() + k, v.end(), std::less<int>());
+            }, batch);
+        });
+        bench_run("select", "std::partial_sort", "top_1000", n, [&](size_t batch) {
+            return bench_sort_sample(data, [&](std::vector<int>& v) {
+                std::partial_sort(v.begin(), v.begin() + k, v.end(), std::less<int>());
+            }, batch);
+        });
+        bench_run("select", "rtl::top_k", "top_1000", n, [&](size_t batch) {
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                top_k<int> top(k);
+                top.push(data.begin(), data.end());
+                if (top.size() != k)
+                    abort();
+            }
+            return now_seconds() - start;
+        });
+        bench_run("select", "rtl::quicksort", "top_1000", n, [&](size_t batch) {
+            return bench_sort_sample(ours, [&](vector<int>& v) {
+                quicksort(v.begin(), v.end(), std::less<int>());
+            }, batch);
+        });
+    }
+}
+
+// 'data' cut into sorted shards and merged back into one, against sorting
+// the concatenation.
+template <typename T>
+void bench_merge_shards(const char* kind, std::vector<T> const& data, size_t numShards)
+{
+    size_t n = data.size();
+    char input[32];
+    snprintf(input, sizeof(input), "%s_%zu_shards", kind, numShards);
+
+    vector<T> concatenated(data.begin(), data.end());
+    vector<std::pair<const T*, const T*> > shards;
+    for (size_t i=0; i < numShards; i++) {
+        size_t lo = n * i / numShards;
+        size_t hi = n * (i + 1) / numShards;
+        std::sort(concatenated.begin() + lo, concatenated.begin() + hi);
+        shards.push_back(std::make_pair(concatenated.begin() + lo, concatenated.begin() + hi));
+    }
+    vector<T> out(n, T());
+
+    bench_run("merge", "rtl::kway_merge", input, n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++)
+            kway_merge(shards, out.begin(), std::less<T>());
+        return now_seconds() - start;
+    });
+    bench_run("merge", "rtl::parallel_kway_merge", input, n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++)
+            parallel_kway_merge(shards, out.begin(), std::less<T>());
+        return now_seconds() - start;
+    });
+    bench_run("merge", "rtl::mergesort", input, n, [&](size_t batch) {
+        return bench_sort_sample(concatenated, [&](vector<T>& v) {
+            mergesort(v.begin(), v.end(), std::less<T>());
+        }, batch);
+    });
+}
+
+void bench_merge_suite()
+{
+    const size_t shardCounts[] = { 2, 16, 256 };
+    std::mt19937 random(1);
+
+    bench_heading("merging sorted shards (ns per element)");
+    for (size_t c=0; c < sizeof(shardCounts) / sizeof(shardCounts[0]); c++) {
+        std::vector<size_t> sizes = bench_sizes(10000000);
+        for (size_t s=0; s < sizes.size(); s++) {
+            if (sizes[s] >= shardCounts[c])
+                bench_merge_shards("ints", make_ints("random", sizes[s], random), shardCounts[c]);
+        }
+
+        sizes = bench_sizes(1000000);
+        for (size_t s=0; s < sizes.size(); s++) {
+            if (sizes[s] >= shardCounts[c])
+                bench_merge_shards("strings", make_strings(sizes[s], random), shardCounts[c]);
+        }
+    }
+}
+
+// push_back, insert, erase and copy on rtl::vector and std::vector.
+template <typename Vector>
+void bench_vector_ops(const char* name, size_t n)
+{
+    std::string pushBack = std::string(name) + " push_back";
+    bench_run("vector", pushBack.c_str(), "ints", n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            Vector v;
+            for (size_t i=0; i < n; i++)
+                v.push_back(int(i));
+        }
+        return now_seconds() - start;
+    });
+
+    std::string copy = std::string(name) + " copy";
+    Vector source;
+    for (size_t i=0; i < n; i++)
+        source.push_back(int(i));
+    bench_run("vector", copy.c_str(), "ints", n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            Vector v(source);
+            if (v.size() != n)
+                abort();
+        }
+        return now_seconds() - start;
+    });
+
+    // Inserting and erasing in the middle moves half the vector each time, so
+    // these are per operation, and only on smaller sizes.
+    if (n > 100000)
+        return;
+
+    std::string insert = std::string(name) + " insert";
+    bench_run("vector", insert.c_str(), "middle", n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            Vector v;
+            for (size_t i=0; i < n; i++)
+                v.insert(v.begin() + v.size() / 2, int(i));
+        }
+        return now_seconds() - start;
+    });
+
+    std::string erase = std::string(name) + " erase";
+    bench_run("vector", erase.c_str(), "middle", n, [&](size_t batch) {
+        std::vector<Vector> copies(batch, source);
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            Vector& v = copies[b];
+            while (v.size() > 0)
+                v.erase(v.begin() + v.size() / 2);
+        }
+        return now_seconds() - start;
+    });
+}
+
+// Reading every element of a segmented_vector by index, by iterator and a
+// chunk at a time, against a plain vector; and sorting it.
+void bench_segmented_reads(size_t n)
+{
+    std::mt19937 random(1);
+    std::vector<int> data = make_ints("random", n, random);
+    vector<int> flat(data.begin(), data.end());
+    segmented_vector<int> chunked(data.begin(), data.end());
+
+    auto sum = [&](size_t batch, std::function<long long()> f) {
+        long long total = 0;
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++)
+            total += f();
+        double elapsed = now_seconds() - start;
+        if (total == 1)
+            abort();
+        return elapsed;
+    };
+
+    bench_run("vector", "rtl::vector sum", "ints", n, [&](size_t batch) {
+        return sum(batch, [&]() {
+            long long total = 0;
+            for (size_t i=0; i < n; i++)
+                total += flat[i];
+            return total;
+        });
+    });
+    bench_run("vector", "rtl::segmented_vector sum []", "ints", n, [&](size_t batch) {
+        return sum(batch, [&]() {
+            long long total = 0;
+            for (size_t i=0; i < n; i++)
+                total += chunked[i];
+            return total;
+        });
+    });
+    bench_run("vector", "rtl::segmented_vector sum iterator", "ints", n, [&](size_t batch) {
+        return sum(batch, [&]() {
+            long long total = 0;
+            for (segmented_vector<int>::iterator it = chunked.begin(); it != chunked.end(); ++it)
+                total += *it;
+            return total;
+        });
+    });
+    bench_run("vector", "rtl::segmented_vector sum chunks", "ints", n, [&](size_t batch) {
+        return sum(batch, [&]() {
+            long long total = 0;
+            for (size_t c=0; c < chunked.segment_count(); c++) {
+                for (const int* p = chunked.segment_begin(c); p != chunked.segment_end(c); ++p)
+                    total += *p;
+            }
+            return total;
+        });
+    });
+
+    bench_run("vector", "rtl::vector quicksort", "random", n, [&](size_t batch) {
+        return bench_sort_sample(flat, [&](vector<int>& v) {
+            quicksort(v.begin(), v.end(), [](int a, int b) { return a < b; });
+        }, batch);
+    });
+    bench_run("vector", "rtl::segmented_vector quicksort", "random", n, [&](size_t batch) {
+        return bench_sort_sample(chunked, [&](segmented_vector<int>& v) {
+            quicksort(v.begin(), v.end(), [](int a, int b) { return a < b; });
+        }, batch);
+    });
+}
+
+void bench_vector_suite()
+{
+    std::vector<size_t> sizes = bench_sizes(100000000);
+
+    bench_heading("vector (ns per element)");
+    for (size_t s=0; s < sizes.size(); s++) {
+        bench_vector_ops<vector<int> >("rtl::vector", sizes[s]);
+        bench_vector_ops<std::vector<int> >("std::vector", sizes[s]);
+        bench_vector_ops<segmented_vector<int> >("rtl::segmented_vector", sizes[s]);
+        bench_segmented_reads(sizes[s]);
+    }
+}
+
+// Build 'n' short lived vectors of 'length' ints each, all from 'alloc'.
+// Returns the time per vector element.
+template <typename Alloc>
+double bench_short_vectors(Alloc const& alloc, size_t n, size_t length)
+{
+    double start = now_seconds();
+    for (size_t i=0; i < n; i++) {
+        vector<int, Alloc> v(alloc);
+        for (size_t j=0; j < length; j++)
+            v.push_back(int(j));
+        if (v.size() != length)
+            abort();
+    }
+    return now_seconds() - start;
+}
+
+// Push 'n' ints onto a 'Vector', then sum them in a random order.
+template <typename Vector>
+void bench_big_vector(const char* name, size_t n, std::mt19937& random)
+{
+    bench_run("allocator", name, "push_back", n, [&](size_t batch) {
+        double elapsed = 0;
+        for (size_t b=0; b < batch; b++) {
+            double start = now_seconds();
+            Vector v;
+            for (size_t i=0; i < n; i++)
+                v.push_back(int(i));
+            elapsed += now_seconds() - start;
+        }
+        return elapsed;
+    });
+
+    Vector v;
+    for (size_t i=0; i < n; i++)
+        v.push_back(int(i));
+    std::vector<uint32_t> order(n);
+    for (size_t i=0; i < n; i++)
+        order[i] = uint32_t(random() % n);
+
+    volatile int sink = 0;
+    bench_run("allocator", name, "random_reads", n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            int sum = 0;
+            for (size_t i=0; i < n; i++)
+                sum += v[order[i]];
+            sink = sum;
+        }
+        return now_seconds() - start;
+    });
+}
+
+void bench_allocator_suite()
+{
+    const size_t lengths[] = { 4, 32, 256 };
+    const size_t numVectors = 1000;
+
+    bench_heading("short lived vectors (ns per element)");
+    for (size_t l=0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        size_t length = lengths[l];
+        char input[32];
+        snprintf(input, sizeof(input), "length_%zu", length);
+
+        // n counts vector elements; each batch builds 'numVectors' vectors.
+        size_t n = numVectors * length;
+        bench_run("allocator", "std::allocator", input, n, [&](size_t batch) {
+            double elapsed = 0;
+            for (size_t b=0; b < batch; b++)
+                elapsed += bench_short_vectors(std::allocator<int>(), numVectors, length);
+            return elapsed;
+        });
+
+        arena a;
+        bench_run("allocator", "arena_allocator", input, n, [&](size_t batch) {
+            double elapsed = 0;
+            for (size_t b=0; b < batch; b++) {
+                elapsed += bench_short_vectors(arena_allocator<int>(a), numVectors, length);
+                a.reset();
+            }
+            return elapsed;
+        });
+
+        pool p;
+        bench_run("allocator", "pool_allocator", input, n, [&](size_t batch) {
+            double elapsed = 0;
+            for (size_t b=0; b < batch; b++)
+                elapsed += bench_short_vectors(pool_allocator<int>(p), numVectors, length);
+            return elapsed;
+        });
+
+        bench_run("allocator", "caching_allocator", input, n, [&](size_t batch) {
+            double elapsed = 0;
+            for (size_t b=0; b < batch; b++)
+                elapsed += bench_short_vectors(caching_allocator<int>(), numVectors, length);
+            return elapsed;
+        });
+    }
+
+    // One big vector: growing it by push_back, then reading it at random,
+    // where huge pages save TLB misses.
+    std::vector<size_t> sizes = bench_sizes(100000000);
+    std::mt19937 random(1);
+
+    bench_heading("one big vector (ns per element)");
+    for (size_t s=0; s < sizes.size(); s++) {
+        size_t n = sizes[s];
+        bench_big_vector<vector<int> >("std::allocator", n, random);
+        bench_big_vector<vector<int, huge_page_allocator<int> > >("huge_page_allocator", n, random);
+    }
+}
+
+// std::allocator, counting how many times it's called.
+size_t gAllocations = 0;
+
+template <typename T>
+struct counting_allocator : std::allocator<T> {
+    typedef T value_type;
+
+    counting_allocator() {}
+    template <typename U> counting_allocator(counting_allocator<U> const&) {}
+
+    template <typename U> struct rebind {
+        typedef counting_allocator<U> other;
+    };
+
+    T* allocate(size_t n)
+    {
+        gAllocations++;
+        return std::allocator<T>::allocate(n);
+    }
+};
+
+// Build 'numVectors' vectors of 'length' ints and copy each one. Returns
+// the time taken.
+template <typename Vector>
+double bench_build_and_copy(size_t numVectors, size_t length)
+{
+    double start = now_seconds();
+    for (size_t i=0; i < numVectors; i++) {
+        Vector v;
+        for (size_t j=0; j < length; j++)
+            v.push_back(int(j));
+        Vector copy(v);
+        if (copy.size() != length)
+            abort();
+    }
+    return now_seconds() - start;
+}
+
+template <typename Vector>
+void bench_small_vector_case(const char* name, const char* input, size_t length)
+{
+    const size_t numVectors = 1000;
+
+    gAllocations = 0;
+    bench_build_and_copy<Vector>(1, length);
+    printf("  %-22s %-12s %10zu allocations per vector and copy\n", name, input, gAllocations);
+
+    bench_run("small_vector", name, input, numVectors * length, [&](size_t batch) {
+        double elapsed = 0;
+        for (size_t b=0; b < batch; b++)
+            elapsed += bench_build_and_copy<Vector>(numVectors, length);
+        return elapsed;
+    });
+}
+
+void bench_small_vector_suite()
+{
+    const size_t lengths[] = { 1, 4, 16, 64 };
+
+    bench_heading("small_vector<int, 16> against vector (ns per element)");
+    for (size_t l=0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        char input[32];
+        snprintf(input, sizeof(input), "length_%zu", lengths[l]);
+        bench_small_vector_case<vector<int, counting_allocator<int> > >("rtl::vector", input, lengths[l]);
+        bench_small_vector_case<small_vector<int, 16, counting_allocator<int> > >("rtl::small_vector", input, lengths[l]);
+    }
+}
+
+struct Record {
+    int key;
+    int payload[3];
+};
+
+// A record too big to be worth moving around much.
+struct BigRecord {
+    int key;
+    char payload[252];
+};
+
+template <typename T, typename Comp>
+void bench_indirect(const char* input, std::vector<T> const& data, Comp comp)
+{
+    vector<T> ours(data.begin(), data.end());
+    size_t n = data.size();
+
+    bench_run("indirect", "rtl::quicksort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<T>& v) { quicksort(v.begin(), v.end(), comp); }, batch);
+    });
+    bench_run("indirect", "rtl::mergesort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<T>& v) { mergesort(v.begin(), v.end(), comp); }, batch);
+    });
+    bench_run("indirect", "rtl::argsort", input, n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++)
+            argsort(ours.begin(), ours.end(), comp);
+        return now_seconds() - start;
+    });
+    bench_run("indirect", "rtl::indirect_sort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<T>& v) { indirect_sort(v.begin(), v.end(), comp); }, batch);
+    });
+}
+
+// The number at the end of a make_strings() string.
+unsigned parse_last_number(std::string const& s)
+{
+    return unsigned(strtoul(s.c_str() + s.rfind('/') + 1, NULL, 10));
+}
+
+// Sorting by a key that has to be worked out from each element, comparing
+// through the key function against computing each key once.
+template <typename Key, typename KeyFn>
+void bench_key_projection(const char* input, std::vector<std::string> const& data, KeyFn keyFn)
+{
+    vector<std::string> ours(data.begin(), data.end());
+    size_t n = data.size();
+    auto compare = [&](std::string const& a, std::string const& b) { return keyFn(a) < keyFn(b); };
+
+    bench_run("indirect", "rtl::quicksort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<std::string>& v) { quicksort(v.begin(), v.end(), compare); }, batch);
+    });
+    bench_run("indirect", "rtl::mergesort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<std::string>& v) { mergesort(v.begin(), v.end(), compare); }, batch);
+    });
+    bench_run("indirect", "rtl::sort_by_key", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<std::string>& v) { sort_by_key(v.begin(), v.end(), keyFn); }, batch);
+    });
+    bench_run("indirect", "rtl::stable_sort_by_key", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<std::string>& v) { stable_sort_by_key(v.begin(), v.end(), keyFn); }, batch);
+    });
+}
+
+void bench_indirect_suite()
+{
+    std::mt19937 random(1);
+
+    bench_heading("sorting through indices (ns per element)");
+    std::vector<size_t> sizes = bench_sizes(1000000);
+    for (size_t s=0; s < sizes.size(); s++) {
+        std::vector<BigRecord> records(sizes[s]);
+        for (size_t i=0; i < records.size(); i++)
+            records[i].key = int(random());
+        bench_indirect("records_256b", records,
+                       [](BigRecord const& a, BigRecord const& b) { return a.key < b.key; });
+        bench_indirect("strings", make_strings(sizes[s], random), std::less<std::string>());
+    }
+
+    for (size_t s=0; s < sizes.size(); s++) {
+        std::vector<std::string> strings = make_strings(sizes[s], random);
+        bench_key_projection<unsigned>("parsed_number", strings, parse_last_number);
+        bench_key_projection<std::string>("whole_string", strings,
+                                          [](std::string const& s) { return s; });
+    }
+}
+
+template <typename T, typename Comp>
+void bench_comparison_vs_radix(const char* input, std::vector<T> const& data, Comp comp)
+{
+    vector<T> ours(data.begin(), data.end());
+    size_t n = data.size();
+
+    bench_run("radix", "quicksort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<T>& v) { quicksort(v.begin(), v.end(), comp); }, batch);
+    });
+    bench_run("radix", "mergesort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [&](vector<T>& v) { mergesort(v.begin(), v.end(), comp); }, batch);
+    });
+    bench_run("radix", "radix_sort", input, n, [&](size_t batch) {
+        return bench_sort_sample(ours, [](vector<T>& v) { radix_sort(v.begin(), v.end()); }, batch);
+    });
+}
+
+void bench_radix_suite()
+{
+    const size_t n = std::min<size_t>(1000000, gOptions.maxSize);
+    std::mt19937 random(1);
+
+    std::vector<int> ints;
+    std::vector<int> smallInts;
+    std::vector<float> floats;
+    std::vector<Record> records;
+
+    for (size_t i=0; i < n; i++) {
+        ints.push_back(int(random()));
+
+        // Like data/set2.
+        smallInts.push_back(random() % 1000);
+
+        floats.push_back(float(int(random())) / 1000.0f);
+
+        Record record = { int(random()), { 0, 0, 0 } };
+        records.push_back(record);
+    }
+
+    bench_heading("radix sort against comparison sorts (ns per element)");
+    bench_comparison_vs_radix("random", ints, std::less<int>());
+    bench_comparison_vs_radix("0_to_1000", smallInts, std::less<int>());
+    bench_comparison_vs_radix("floats", floats, std::less<float>());
+    bench_comparison_vs_radix("strings", make_strings(n, random), std::less<std::string>());
+
+    vector<Record> ourRecords(records.begin(), records.end());
+    auto recordLess = [](Record const& a, Record const& b) { return a.key < b.key; };
+    bench_run("radix", "quicksort", "records", n, [&](size_t batch) {
+        return bench_sort_sample(ourRecords, [&](vector<Record>& v) {
+            quicksort(v.begin(), v.end(), recordLess);
+        }, batch);
+    });
+    bench_run("radix", "mergesort", "records", n, [&](size_t batch) {
+        return bench_sort_sample(ourRecords, [&](vector<Record>& v) {
+            mergesort(v.begin(), v.end(), recordLess);
+        }, batch);
+    });
+    bench_run("radix", "radix_sort", "records", n, [&](size_t batch) {
+        return bench_sort_sample(ourRecords, [](vector<Record>& v) {
+            radix_sort(v.begin(), v.end(), [](Record const& r) { return r.key; });
+        }, batch);
+    });
+}
+
+// Counting the keys in a map (one lookup or insert per key), then looking
+// each of them up again, and looking up keys that aren't there.
+template <typename Map>
+void bench_hash_map_ops(const char* name, const char* input, vector<int> const& keys)
+{
+    size_t n = keys.size();
+
+    std::string count = std::string(name) + " count";
+    bench_run("hash", count.c_str(), input, n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            Map m;
+            for (size_t i=0; i < n; i++)
+                m[keys[i]]++;
+            if (m.size() == 0)
+                abort();
+        }
+        return now_seconds() - start;
+    });
+
+    Map built;
+    for (size_t i=0; i < n; i++)
+        built[keys[i]]++;
+
+    std::string hit = std::string(name) + " find";
+    bench_run("hash", hit.c_str(), input, n, [&](size_t batch) {
+        size_t found = 0;
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            for (size_t i=0; i < n; i++)
+                found += built.find(keys[i]) != built.end();
+        }
+        double elapsed = now_seconds() - start;
+        if (found != n * batch)
+            abort();
+        return elapsed;
+    });
+
+    // Negative keys are never there.
+    std::string miss = std::string(name) + " miss";
+    bench_run("hash", miss.c_str(), input, n, [&](size_t batch) {
+        size_t found = 0;
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            for (size_t i=0; i < n; i++)
+                found += built.find(-1 - keys[i]) != built.end();
+        }
+        double elapsed = now_seconds() - start;
+        if (found != 0)
+            abort();
+        return elapsed;
+    });
+}
+
+// Finding the distinct keys.
+void bench_hash_sets(const char* input, vector<int> const& keys)
+{
+    size_t n = keys.size();
+
+    bench_run("hash", "std::unordered_set dedup", input, n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            std::unordered_set<int> set(keys.begin(), keys.end());
+            if (set.size() == 0)
+                abort();
+        }
+        return now_seconds() - start;
+    });
+    bench_run("hash", "rtl::hash_set dedup", input, n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            hash_set<int> set;
+            for (size_t i=0; i < n; i++)
+                set.insert(keys[i]);
+            if (set.size() == 0)
+                abort();
+        }
+        return now_seconds() - start;
+    });
+    bench_run("hash", "rtl::hash_set bulk dedup", input, n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            hash_set<int> set(keys);
+            if (set.size() == 0)
+                abort();
+        }
+        return now_seconds() - start;
+    });
+}
+
+void bench_hash_suite()
+{
+    std::vector<size_t> sizes = bench_sizes(10000000);
+    std::mt19937 random(1);
+
+    bench_heading("hash tables (ns per key)");
+    for (size_t s=0; s < sizes.size(); s++) {
+        size_t n = sizes[s];
+
+        // Like data/set2: lots of repeats of a few keys.
+        vector<int> small;
+        vector<int> distinct;
+        for (size_t i=0; i < n; i++) {
+            small.push_back(int(random() % 1000));
+            distinct.push_back(int(random() & 0x7fffffff));
+        }
+
+        bench_hash_map_ops<std::unordered_map<int, int> >("std::unordered_map", "0_to_1000", small);
+        bench_hash_map_ops<hash_map<int, int> >("rtl::hash_map", "0_to_1000", small);
+        bench_hash_sets("0_to_1000", small);
+        bench_hash_map_ops<std::unordered_map<int, int> >("std::unordered_map", "random", distinct);
+        bench_hash_map_ops<hash_map<int, int> >("rtl::hash_map", "random", distinct);
+        bench_hash_sets("random", distinct);
+    }
+}
+
+// Building an ordered map one key at a time, looking each key up, and
+// scanning the 100 keys from each one onwards.
+template <typename Map>
+void bench_tree_ops(const char* name, const char* input, vector<int> const& keys)
+{
+    size_t n = keys.size();
+
+    std::string insert = std::string(name) + " insert";
+    bench_run("tree", insert.c_str(), input, n, [&](size_t batch) {
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            Map m;
+            for (size_t i=0; i < n; i++)
+                m[keys[i]] = int(i);
+            if (m.size() == 0)
+                abort();
+        }
+        return now_seconds() - start;
+    });
+
+    Map built;
+    for (size_t i=0; i < n; i++)
+        built[keys[i]] = int(i);
+
+    std::string find = std::string(name) + " find";
+    bench_run("tree", find.c_str(), input, n, [&](size_t batch) {
+        size_t found = 0;
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            for (size_t i=0; i < n; i++)
+                found += built.find(keys[i]) != built.end();
+        }
+        double elapsed = now_seconds() - start;
+        if (found != n * batch)
+            abort();
+        return elapsed;
+    });
+
+    std::string range = std::string(name) + " range 100";
+    bench_run("tree", range.c_str(), input, n, [&](size_t batch) {
+        long sum = 0;
+        double start = now_seconds();
+        for (size_t b=0; b < batch; b++) {
+            for (size_t i=0; i < n; i++) {
+                typename Map::const_iterator it = built.lower_bound(keys[i]);
+                for (int k=0; k < 100 && it != built.end(); k++, ++it)
+                    sum += it->second;
+            }
+        }
+        double elapsed = now_seconds() - start;
+        if (sum == 42)
+            abort();
+        return elapsed;
+    });
+}
+
+void bench_tree_suite()
+{
+    std::vector<size_t> sizes = bench_sizes(1000000);
+    std::mt19937 random(1);
+
+    bench_heading("ordered maps (ns per key)");
+    for (size_t s=0; s < sizes.size(); s++) {
+        size_t n = sizes[s];
+
+        vector<int> keys;
+        for (size_t i=0; i < n; i++)
+            keys.push_back(int(random() & 0x7fffffff));
+
+        bench_tree_ops<std::map<int, int> >("std::map", "random", keys);
+        bench_tree_ops<btree_map<int, int> >("rtl::btree_map", "random", keys);
+
+        // From a sorted vector: the packed build, against inserting.
+        vector<std::pair<int, int> > sorted;
+        for (size_t i=0; i < n; i++)
+            sorted.push_back(std::make_pair(keys[i], int(i)));
+        quicksort(sorted.begin(), sorted.end(), std::less<std::pair<int, int> >());
+        bench_run("tree", "std::map from sorted", "random", n, [&](size_t batch) {
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                std::map<int, int> m(sorted.begin(), sorted.end());
+                if (m.size() == 0)
+                    abort();
+            }
+            return now_seconds() - start;
+        });
+        bench_run("tree", "rtl::btree_map bulk load", "random", n, [&](size_t batch) {
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                btree_map<int, int> m(sorted);
+                if (m.size() == 0)
+                    abort();
+            }
+            return now_seconds() - start;
+        });
+    }
+}
+
+// Taking a snapshot and changing one element, which for an rtl::vector
+// means copying it; building by appending; and summing.
+void bench_persistent_suite()
+{
+    std::vector<size_t> sizes = bench_sizes(1000000);
+    std::mt19937 random(1);
+
+    bench_heading("persistent_vector (ns per element, or per update)");
+    for (size_t s=0; s < sizes.size(); s++) {
+        size_t n = sizes[s];
+        std::vector<int> data = make_ints("random", n, random);
+        vector<int> numbers(data.begin(), data.end());
+        persistent_vector<int> persistent(numbers);
+        const size_t updates = 100;
+
+        bench_run("persistent", "rtl::vector copy and set", "random", updates, [&](size_t batch) {
+            long sum = 0;
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                for (size_t u=0; u < updates; u++) {
+                    vector<int> copy(numbers);
+                    copy[u * 7919 % n] = int(u);
+                    sum += copy[0];
+                }
+            }
+            double elapsed = now_seconds() - start;
+            if (sum == 42)
+                abort();
+            return elapsed;
+        });
+        bench_run("persistent", "persistent_vector set", "random", updates, [&](size_t batch) {
+            long sum = 0;
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                for (size_t u=0; u < updates; u++) {
+                    persistent_vector<int> changed = persistent.set(u * 7919 % n, int(u));
+                    sum += changed[0];
+                }
+            }
+            double elapsed = now_seconds() - start;
+            if (sum == 42)
+                abort();
+            return elapsed;
+        });
+
+        bench_run("persistent", "rtl::vector push_back", "random", n, [&](size_t batch) {
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                vector<int> v;
+                for (size_t i=0; i < n; i++)
+                    v.push_back(numbers[i]);
+                if (v.size() != n)
+                    abort();
+            }
+            return now_seconds() - start;
+        });
+        bench_run("persistent", "persistent_vector builder", "random", n, [&](size_t batch) {
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                persistent_vector<int>::builder builder;
+                for (size_t i=0; i < n; i++)
+                    builder.push_back(numbers[i]);
+                if (builder.build().size() != n)
+                    abort();
+            }
+            return now_seconds() - start;
+        });
+        bench_run("persistent", "persistent_vector push_back", "random", n, [&](size_t batch) {
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                persistent_vector<int> v;
+                for (size_t i=0; i < n; i++)
+                    v = v.push_back(numbers[i]);
+                if (v.size() != n)
+                    abort();
+            }
+            return now_seconds() - start;
+        });
+
+        bench_run("persistent", "rtl::vector sum", "random", n, [&](size_t batch) {
+            long sum = 0;
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                for (size_t i=0; i < n; i++)
+                    sum += numbers[i];
+            }
+            double elapsed = now_seconds() - start;
+            if (sum == 42)
+                abort();
+            return elapsed;
+        });
+        bench_run("persistent", "persistent_vector iterate", "random", n, [&](size_t batch) {
+            long sum = 0;
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                for (persistent_vector<int>::const_iterator it = persistent.begin(); it != persistent.end(); ++it)
+                    sum += *it;
+            }
+            double elapsed = now_seconds() - start;
+            if (sum == 42)
+                abort();
+            return elapsed;
+        });
+        bench_run("persistent", "persistent_vector reduce", "random", n, [&](size_t batch) {
+            long sum = 0;
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++)
+                sum += persistent.reduce(0, [](int a, int x) { return a ^ x; });
+            double elapsed = now_seconds() - start;
+            if (sum == 42)
+                abort();
+            return elapsed;
+        });
+    }
+}
+
+// Four threads appending at once, and then sorting what they appended.
+void bench_concurrent_suite()
+{
+    std::vector<size_t> sizes = bench_sizes(10000000);
+    std::mt19937 random(1);
+    const size_t numThreads = 4;
+
+    bench_heading("concurrent appends, 4 threads (ns per element)");
+    for (size_t s=0; s < sizes.size(); s++) {
+        size_t n = sizes[s];
+        std::vector<int> data = make_ints("random", n, random);
+
+        // Runs append(thread, first, last) on each thread's share.
+        auto ingest = [&](std::function<void(size_t, size_t)> append) {
+            vector<std::thread> threads;
+            for (size_t t=0; t < numThreads; t++)
+                threads.push_back(std::thread(append, n * t / numThreads, n * (t + 1) / numThreads));
+            for (size_t t=0; t < numThreads; t++)
+                threads[t].join();
+        };
+
+        bench_run("concurrent", "mutex + rtl::vector", "random", n, [&](size_t batch) {
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                std::mutex mutex;
+                vector<int> v;
+                ingest([&](size_t first, size_t last) {
+                    for (size_t i=first; i < last; i++) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        v.push_back(data[i]);
+                    }
+                });
+                if (v.size() != n)
+                    abort();
+            }
+            return now_seconds() - start;
+        });
+        bench_run("concurrent", "concurrent_vector push_back", "random", n, [&](size_t batch) {
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                concurrent_vector<int> v;
+                ingest([&](size_t first, size_t last) {
+                    for (size_t i=first; i < last; i++)
+                        v.push_back(data[i]);
+                });
+                if (v.size() != n)
+                    abort();
+            }
+            return now_seconds() - start;
+        });
+        bench_run("concurrent", "concurrent_vector grow_by 256", "random", n, [&](size_t batch) {
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                concurrent_vector<int> v;
+                ingest([&](size_t first, size_t last) {
+                    for (size_t i=first; i < last; i += 256)
+                        v.grow_by(data.begin() + i, data.begin() + std::min(last, i + 256));
+                });
+                if (v.size() != n)
+                    abort();
+            }
+            return now_seconds() - start;
+        });
+
+        // Sorting in place, through the segments, against copying out to
+        // one array first.
+        concurrent_vector<int> ingested;
+        ingested.grow_by(data.begin(), data.end());
+        bench_run("concurrent", "quicksort in place", "random", n, [&](size_t batch) {
+            double elapsed = 0;
+            for (size_t b=0; b < batch; b++) {
+                concurrent_vector<int> v(ingested);
+                double start = now_seconds();
+                quicksort(v.begin(), v.end(), std::less<int>());
+                elapsed += now_seconds() - start;
+            }
+            return elapsed;
+        });
+        bench_run("concurrent", "to_vector + quicksort", "random", n, [&](size_t batch) {
+            double start = now_seconds();
+            for (size_t b=0; b < batch; b++) {
+                vector<int> v = ingested.to_vector();
+                quicksort(v.begin(), v.end(), std::less<int>());
+            }
+            return now_seconds() - start;
+        });
+    }
+}
+
+bool parse_options(int argc, char** argv)
+{
+    for (int i=1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            fprintf(stderr, "bench: %s needs a value\n", arg.c_str());
+            return false;
+        }
+
+        const char* value = argv[++i];
+        if (arg == "--max-size") {
+            gOptions.maxSize = strtoull(value, NULL, 10);
+        } else if (arg == "--repetitions") {
+            gOptions.repetitions = std::max(1, atoi(value));
+        } else if (arg == "--filter") {
+            gOptions.filter = value;
+        } else if (arg == "--csv") {
+            gOptions.csvPath = value;
+        } else {
+            fprintf(stderr, "bench: unknown option %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (!parse_options(argc, argv))
+        return 1;
+
+    if (!gOptions.csvPath.empty()) {
+        gCsv = fopen(gOptions.csvPath.c_str(), "w");
+        if (gCsv == NULL) {
+            fprintf(stderr, "bench: couldn't write %s\n", gOptions.csvPath.c_str());
+            return 1;
+        }
+        fprintf(gCsv, "group,benchmark,input,n,median_ns,p95_ns,samples\n");
+    }
+
+    bench_vector_suite();
+    bench_allocator_suite();
+    bench_small_vector_suite();
+    bench_sort_suite();
+    bench_select_suite();
+    bench_merge_suite();
+    bench_indirect_suite();
+    bench_radix_suite();
+    bench_hash_suite();
+    bench_tree_suite();
+    bench_persistent_suite();
+    bench_concurrent_suite();
+
+    if (gCsv != NULL)
+        fclose(gCsv);
+    return 0;
+}
@@ -0,0 +1,1020 @@
+// Ordered containers as B+ trees: btree_map and btree_set.
+//
+// Nodes are a few cache lines wide: NodeBytes (256 by default) of elements,
+// or of keys and child pointers, plus a small header. So a lookup touches a
+// handful of nodes rather than the dozens a red-black tree of the same size
+// would. Elements all live in the leaves, which are linked in
+// order, so iterating over a range just walks along arrays. The inner nodes
+// only hold keys to steer by, and searching one is a single pass over its
+// keys (with SSE2 for ints and floats).
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "vector.h"
+
+namespace rtl {
+
+// How many of 'keys' are less than 'key', which for sorted keys is where
+// lower_bound would be. Short arrays of numbers are counted without
+// branching; anything else is a binary search.
+template <typename K, typename Comp>
+size_t btree_count_less(const K* keys, size_t n, K const& key, Comp const& comp)
+{
+    if (std::is_arithmetic<K>::value) {
+        size_t count = 0;
+        for (size_t i=0; i < n; i++)
+            count += comp(keys[i], key);
+        return count;
+    }
+    return std::lower_bound(keys, keys + n, key, comp) - keys;
+}
+
+// How many of 'keys' are no greater than 'key': where upper_bound would be.
+template <typename K, typename Comp>
+size_t btree_count_not_greater(const K* keys, size_t n, K const& key, Comp const& comp)
+{
+    if (std::is_arithmetic<K>::value) {
+        size_t count = 0;
+        for (size_t i=0; i < n; i++)
+            count += !comp(key, keys[i]);
+        return count;
+    }
+    return std::upper_bound(keys, keys + n, key, comp) - keys;
+}
+
+#if defined(__SSE2__)
+// Each compare leaves -1 in the lanes where it's true, so subtracting the
+// results counts them, four lanes at a time.
+inline size_t btree_sum_lanes(__m128i counts)
+{
+    counts = _mm_add_epi32(counts, _mm_shuffle_epi32(counts, _MM_SHUFFLE(1, 0, 3, 2)));
+    counts = _mm_add_epi32(counts, _mm_shuffle_epi32(counts, _MM_SHUFFLE(2, 3, 0, 1)));
+    return size_t(_mm_cvtsi128_si32(counts));
+}
+
+inline size_t btree_count_less(const int32_t* keys, size_t n, int32_t const& key, std::less<int32_t> const&)
+{
+    __m128i k = _mm_set1_epi32(key);
+    __m128i counts = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        counts = _mm_sub_epi32(counts, _mm_cmplt_epi32(v, k));
+    }
+    size_t count = btree_sum_lanes(counts);
+    for (; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+
+inline size_t btree_count_not_greater(const int32_t* keys, size_t n, int32_t const& key,
+                                      std::less<int32_t> const&)
+{
+    __m128i k = _mm_set1_epi32(key);
+    __m128i greater = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        greater = _mm_sub_epi32(greater, _mm_cmpgt_epi32(v, k));
+    }
+    size_t count = i - btree_sum_lanes(greater);
+    for (; i < n; i++)
+        count += keys[i] <= key;
+    return count;
+}
+
+inline size_t btree_count_less(const float* keys, size_t n, float const& key, std::less<float> const&)
+{
+    __m128 k = _mm_set1_ps(key);
+    __m128i counts = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        counts = _mm_sub_epi32(counts, _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(keys + i), k)));
+    size_t count = btree_sum_lanes(counts);
+    for (; i < n; i++)
+        count += keys[i] < key;
+    return count;
+}
+
+inline size_t btree_count_not_greater(const float* keys, size_t n, float const& key, std::less<float> const&)
+{
+    __m128 k = _mm_set1_ps(key);
+    __m128i counts = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        counts = _mm_sub_epi32(counts, _mm_castps_si128(_mm_cmple_ps(_mm_loadu_ps(keys + i), k)));
+    size_t count = btree_sum_lanes(counts);
+    for (; i < n; i++)
+        count += keys[i] <= key;
+    return count;
+}
+#endif
+
+template <typename K>
+struct btree_set_policy {
+    typedef K key_type;
+    typedef K value_type;
+
+    static K const& key(K const& k)
+    {
+        return k;
+    }
+};
+
+template <typename K, typename V>
+struct btree_map_policy {
+    typedef K key_type;
+    typedef std::pair<const K, V> value_type;
+
+    static K const& key(value_type const& kv)
+    {
+        return kv.first;
+    }
+};
+
+// The tree btree_map and btree_set share. 'Policy' says what's stored and
+// how to get its key.
+//
+// Leaves hold elements, and inner nodes hold keys and children: child i has
+// the keys from keys[i-1] up to (not including) keys[i]. Inserting into a
+// full node splits it in two. Erasing doesn't merge nodes back together;
+// a node is only freed once it's empty, so a tree that's had most of its
+// elements erased can be sparse until it's rebuilt (copying one packs it).
+template <typename Policy, typename Comp, typename Alloc, size_t NodeBytes>
+class btree {
+public:
+    typedef typename Policy::key_type key_type;
+    typedef typename Policy::value_type value_type;
+    typedef Comp key_compare;
+    typedef Alloc allocator_type;
+    typedef size_t size_type;
+
+private:
+    typedef std::allocator_traits<Alloc> alloc_traits;
+
+    // An inner node has a child pointer per key, plus one more, all in
+    // NodeBytes.
+    static const size_t leafSlots = NodeBytes / sizeof(value_type) > 4 ? NodeBytes / sizeof(value_type) : 4;
+    static const size_t innerFit = (NodeBytes - sizeof(void*)) / (sizeof(key_type) + sizeof(void*));
+    static const size_t innerSlots = innerFit > 4 ? innerFit : 4;
+
+    struct node {
+        bool isLeaf;
+        size_t count;   // Elements in a leaf, keys in an inner node.
+    };
+
+    struct leaf : node {
+        leaf* prev;
+        leaf* next;
+        typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type slots[leafSlots];
+
+        value_type* values()
+        {
+            return reinterpret_cast<value_type*>(slots);
+        }
+    };
+
+    struct inner : node {
+        typename std::aligned_storage<sizeof(key_type), alignof(key_type)>::type slots[innerSlots];
+        node* children[innerSlots + 1];
+
+        key_type* keys()
+        {
+            return reinterpret_cast<key_type*>(slots);
+        }
+    };
+
+    typedef typename alloc_traits::template rebind_alloc<leaf> LeafAlloc;
+    typedef typename alloc_traits::template rebind_alloc<inner> InnerAlloc;
+
+public:
+    template <typename V>
+    class basic_iterator {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef typename std::remove_const<V>::type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+        basic_iterator()
+          : _tree(NULL), _leaf(NULL), _index(0)
+        {}
+
+        template <typename U, typename = typename std::enable_if<std::is_convertible<U*, V*>::value>::type>
+        basic_iterator(basic_iterator<U> const& it)
+          : _tree(it._tree), _leaf(it._leaf), _index(it._index)
+        {}
+
+        reference operator*() const
+        {
+            return _leaf->values()[_index];
+        }
+
+        pointer operator->() const
+        {
+            return &_leaf->values()[_index];
+        }
+
+        basic_iterator& operator++()
+        {
+            if (++_index == _leaf->count) {
+                _leaf = _leaf->next;
+                _index = 0;
+            }
+            return *this;
+        }
+
+        basic_iterator operator++(int)
+        {
+            basic_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        basic_iterator& operator--()
+        {
+            if (_leaf == NULL) {
+                _leaf = _tree->_last;
+                _index = _leaf->count;
+            } else if (_index == 0) {
+                _leaf = _leaf->prev;
+                _index = _leaf->count;
+            }
+            --_index;
+            return *this;
+        }
+
+        basic_iterator operator--(int)
+        {
+            basic_iterator old = *this;
+            --*this;
+            return old;
+        }
+
+        bool operator==(basic_iterator const& other) const
+        {
+            return _leaf == other._leaf && _index == other._index;
+        }
+
+        bool operator!=(basic_iterator const& other) const
+        {
+            return !(*this == other);
+        }
+
+    private:
+        friend class btree;
+        template <typename U> friend class basic_iterator;
+
+        // The end is a NULL leaf.
+        basic_iterator(btree const* tree, leaf* l, size_t index)
+          : _tree(tree), _leaf(l), _index(index)
+        {
+            if (_leaf != NULL && _index == _leaf->count) {
+                _leaf = _leaf->next;
+                _index = 0;
+            }
+        }
+
+        btree const* _tree;
+        leaf* _leaf;
+        size_t _index;
+    };
+
+    typedef basic_iterator<value_type> iterator;
+    typedef basic_iterator<const value_type> const_iterator;
+
+    explicit btree(Comp const& comp = Comp(), Alloc const& alloc = Alloc())
+      : _comp(comp), _alloc(alloc), _root(NULL), _first(NULL), _last(NULL), _size(0), _height(0)
+    {}
+
+    btree(btree const& other)
+      : _comp(other._comp), _alloc(alloc_traits::select_on_container_copy_construction(other._alloc)),
+        _root(NULL), _first(NULL), _last(NULL), _size(0), _height(0)
+    {
+        assign_sorted(other.begin(), other.end());
+    }
+
+    btree(btree&& other)
+      : _comp(other._comp), _alloc(other._alloc), _root(NULL), _first(NULL), _last(NULL), _size(0),
+        _height(0)
+    {
+        swap(other);
+    }
+
+    btree& operator=(btree const& rhs)
+    {
+        if (this != &rhs) {
+            btree copy(rhs);
+            swap(copy);
+        }
+        return *this;
+    }
+
+    btree& operator=(btree&& rhs)
+    {
+        if (this != &rhs) {
+            clear();
+            swap(rhs);
+        }
+        return *this;
+    }
+
+    ~btree()
+    {
+        clear();
+    }
+
+    iterator begin()
+    {
+        return iterator(this, _first, 0);
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, _first, 0);
+    }
+
+    iterator end()
+    {
+        return iterator(this, NULL, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, NULL, 0);
+    }
+
+    size_type size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    // Levels of inner nodes above the leaves.
+    size_type height() const
+    {
+        return _height;
+    }
+
+    key_compare key_comp() const
+    {
+        return _comp;
+    }
+
+    allocator_type get_allocator() const
+    {
+        return _alloc;
+    }
+
+    void clear()
+    {
+        if (_root != NULL) {
+            free_node(_root);
+        } else {
+            // A bulk load that failed part way: leaves, but no tree yet.
+            while (_first != NULL) {
+                leaf* next = _first->next;
+                free_leaf(_first);
+                _first = next;
+            }
+        }
+        _root = NULL;
+        _first = NULL;
+        _last = NULL;
+        _size = 0;
+        _height = 0;
+    }
+
+    void swap(btree& other)
+    {
+        std::swap(_comp, other._comp);
+        std::swap(_alloc, other._alloc);
+        std::swap(_root, other._root);
+        std::swap(_first, other._first);
+        std::swap(_last, other._last);
+        std::swap(_size, other._size);
+        std::swap(_height, other._height);
+    }
+
+    // The first element not less than 'key'.
+    iterator lower_bound(key_type const& key)
+    {
+        leaf* l = find_leaf(key);
+        return l == NULL ? end() : iterator(this, l, leaf_lower_bound(l, key));
+    }
+
+    const_iterator lower_bound(key_type const& key) const
+    {
+        return const_cast<btree*>(this)->lower_bound(key);
+    }
+
+    // The first element greater than 'key'.
+    iterator upper_bound(key_type const& key)
+    {
+        leaf* l = find_leaf(key);
+        return l == NULL ? end() : iterator(this, l, leaf_upper_bound(l, key));
+    }
+
+    const_iterator upper_bound(key_type const& key) const
+    {
+        return const_cast<btree*>(this)->upper_bound(key);
+    }
+
+    std::pair<iterator, iterator> equal_range(key_type const& key)
+    {
+        return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    iterator find(key_type const& key)
+    {
+        iterator it = lower_bound(key);
+        return it != end() && !_comp(key, Policy::key(*it)) ? it : end();
+    }
+
+    const_iterator find(key_type const& key) const
+    {
+        return const_cast<btree*>(this)->find(key);
+    }
+
+    bool contains(key_type const& key) const
+    {
+        return find(key) != end();
+    }
+
+    size_type count(key_type const& key) const
+    {
+        return contains(key) ? 1 : 0;
+    }
+
+    // Insert an element with the key 'key', built from 'args', unless
+    // there's one already. Returns where it is, and whether it's new.
+    template <typename... Args>
+    std::pair<iterator, bool> emplace_key(key_type const& key, Args&&... args)
+    {
+        if (_root == NULL) {
+            leaf* l = new_leaf();
+            _root = _first = _last = l;
+        }
+
+        leaf* where = NULL;
+        size_t index = 0;
+        bool inserted = false;
+        split s = insert_into(_root, key, where, index, inserted, std::forward<Args>(args)...);
+        if (!inserted)
+            return std::make_pair(iterator(this, where, index), false);
+
+        if (s.right != NULL) {
+            // The root split: the tree grows a level.
+            inner* root = new_inner();
+            new (&root->keys()[0]) key_type(std::move(s.key));
+            root->children[0] = _root;
+            root->children[1] = s.right;
+            root->count = 1;
+            _root = root;
+            _height++;
+        }
+        _size++;
+        return std::make_pair(iterator(this, where, index), true);
+    }
+
+    size_type erase(key_type const& key)
+    {
+        if (_root == NULL)
+            return 0;
+
+        bool erased = false;
+        if (erase_from(_root, key, erased)) {
+            _root = NULL;
+            _height = 0;
+        }
+        while (_height > 0 && _root->count == 0) {
+            // An inner root with only one child left.
+            inner* old = static_cast<inner*>(_root);
+            _root = old->children[0];
+            free_inner(old);
+            _height--;
+        }
+        if (erased)
+            _size--;
+        return erased ? 1 : 0;
+    }
+
+    iterator erase(iterator it)
+    {
+        return erase(const_iterator(it));
+    }
+
+    iterator erase(const_iterator it)
+    {
+        key_type key = Policy::key(*it);
+        erase(key);
+        return lower_bound(key);
+    }
+
+    // Replace the contents with [first, last), which must be sorted by key
+    // (throws std::invalid_argument if it isn't). Equal keys after the
+    // first are skipped. Leaves are filled right up and each level is built
+    // from the one below, so it's O(n).
+    template <typename Iter>
+    void assign_sorted(Iter first, Iter last)
+    {
+        clear();
+        try {
+            build(first, last);
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+private:
+    template <typename Iter>
+    void build(Iter first, Iter last)
+    {
+
+        // The leaves, and the smallest key in each.
+        vector<node*> level;
+        vector<key_type> lowest;
+        for (; first != last; ++first) {
+            if (_last != NULL) {
+                key_type const& previous = Policy::key(_last->values()[_last->count - 1]);
+                if (_comp(Policy::key(*first), previous))
+                    throw std::invalid_argument("btree: bulk load input isn't sorted");
+                if (!_comp(previous, Policy::key(*first)))
+                    continue;
+            }
+
+            if (_last == NULL || _last->count == leafSlots) {
+                leaf* l = new_leaf();
+                l->prev = _last;
+                if (_last != NULL)
+                    _last->next = l;
+                else
+                    _first = l;
+                _last = l;
+                level.push_back(l);
+                lowest.push_back(Policy::key(*first));
+            }
+            new (&_last->values()[_last->count]) value_type(*first);
+            _last->count++;
+            _size++;
+        }
+
+        if (level.size() == 0)
+            return;
+
+        // Each level up takes as many children per node as fit. Until there's
+        // a root, clear() only knows about the leaves, so if copying a key
+        // throws, the inner nodes built so far are freed here.
+        vector<inner*> built;
+        try {
+            while (level.size() > 1) {
+                vector<node*> parents;
+                vector<key_type> parentLowest;
+                for (size_t i=0; i < level.size(); i += innerSlots + 1) {
+                    size_t n = std::min(innerSlots + 1, level.size() - i);
+                    built.push_back(NULL);
+                    inner* p = new_inner();
+                    built.back() = p;
+                    p->children[0] = level[i];
+                    for (size_t c=1; c < n; c++) {
+                        p->children[c] = level[i + c];
+                        new (&p->keys()[c - 1]) key_type(lowest[i + c]);
+                        p->count++;
+                    }
+                    parents.push_back(p);
+                    parentLowest.push_back(lowest[i]);
+                }
+                level.swap(parents);
+                lowest.swap(parentLowest);
+                _height++;
+            }
+        } catch (...) {
+            for (size_t i=0; i < built.size(); i++)
+                if (built[i] != NULL)
+                    free_inner(built[i]);
+            _height = 0;
+            throw;
+        }
+        _root = level[0];
+    }
+
+    template <typename V> friend class basic_iterator;
+
+    // What a node sends up when it splits: the new node to its right, and
+    // the smallest key in it.
+    struct split {
+        node* right;
+        key_type key;
+    };
+
+    leaf* new_leaf()
+    {
+        LeafAlloc alloc(_alloc);
+        leaf* l = std::allocator_traits<LeafAlloc>::allocate(alloc, 1);
+        l->isLeaf = true;
+        l->count = 0;
+        l->prev = NULL;
+        l->next = NULL;
+        return l;
+    }
+
+    inner* new_inner()
+    {
+        InnerAlloc alloc(_alloc);
+        inner* n = std::allocator_traits<InnerAlloc>::allocate(alloc, 1);
+        n->isLeaf = false;
+        n->count = 0;
+        return n;
+    }
+
+    void free_leaf(leaf* l)
+    {
+        for (size_t i=0; i < l->count; i++)
+            l->values()[i].~value_type();
+        LeafAlloc alloc(_alloc);
+        std::allocator_traits<LeafAlloc>::deallocate(alloc, l, 1);
+    }
+
+    void free_inner(inner* n)
+    {
+        for (size_t i=0; i < n->count; i++)
+            n->keys()[i].~key_type();
+        InnerAlloc alloc(_alloc);
+        std::allocator_traits<InnerAlloc>::deallocate(alloc, n, 1);
+    }
+
+    void free_node(node* n)
+    {
+        if (n->isLeaf) {
+            free_leaf(static_cast<leaf*>(n));
+        } else {
+            inner* in = static_cast<inner*>(n);
+            for (size_t i=0; i <= in->count; i++)
+                free_node(in->children[i]);
+            free_inner(in);
+        }
+    }
+
+    // Which child of 'n' to follow for 'key'.
+    size_t child_index(inner* n, key_type const& key) const
+    {
+        return btree_count_not_greater(n->keys(), n->count, key, _comp);
+    }
+
+    // The leaf 'key' belongs in.
+    leaf* find_leaf(key_type const& key) const
+    {
+        node* n = _root;
+        if (n == NULL)
+            return NULL;
+        while (!n->isLeaf) {
+            inner* in = static_cast<inner*>(n);
+            n = in->children[child_index(in, key)];
+        }
+        return static_cast<leaf*>(n);
+    }
+
+    // Sets store their keys in the leaves, so the same search works there.
+    size_t leaf_lower_bound(leaf* l, key_type const& key, std::true_type) const
+    {
+        return btree_count_less(l->values(), l->count, key, _comp);
+    }
+
+    // Map leaves interleave keys and values, so there's no SIMD, but
+    // numbers are still counted without branching.
+    size_t leaf_lower_bound(leaf* l, key_type const& key, std::false_type) const
+    {
+        if (std::is_arithmetic<key_type>::value) {
+            size_t count = 0;
+            for (size_t i=0; i < l->count; i++)
+                count += _comp(Policy::key(l->values()[i]), key);
+            return count;
+        }
+        Comp const& comp = _comp;
+        return std::lower_bound(l->values(), l->values() + l->count, key,
+            [&comp](value_type const& v, key_type const& k) { return comp(Policy::key(v), k); }) - l->values();
+    }
+
+    size_t leaf_lower_bound(leaf* l, key_type const& key) const
+    {
+        return leaf_lower_bound(l, key, std::is_same<key_type, value_type>());
+    }
+
+    size_t leaf_upper_bound(leaf* l, key_type const& key, std::true_type) const
+    {
+        return btree_count_not_greater(l->values(), l->count, key, _comp);
+    }
+
+    size_t leaf_upper_bound(leaf* l, key_type const& key, std::false_type) const
+    {
+        if (std::is_arithmetic<key_type>::value) {
+            size_t count = 0;
+            for (size_t i=0; i < l->count; i++)
+                count += !_comp(key, Policy::key(l->values()[i]));
+            return count;
+        }
+        Comp const& comp = _comp;
+        return std::upper_bound(l->values(), l->values() + l->count, key,
+            [&comp](key_type const& k, value_type const& v) { return comp(k, Policy::key(v)); }) - l->values();
+    }
+
+    size_t leaf_upper_bound(leaf* l, key_type const& key) const
+    {
+        return leaf_upper_bound(l, key, std::is_same<key_type, value_type>());
+    }
+
+    // Insert into the subtree under 'n', unless 'key' is there already.
+    // Either way, 'where' and 'index' are set to the element with that key.
+    // If 'n' had to split, returns the new node.
+    template <typename... Args>
+    split insert_into(node* n, key_type const& key, leaf*& where, size_t& index, bool& inserted,
+                      Args&&... args)
+    {
+        split result = split();
+        if (n->isLeaf) {
+            leaf* l = static_cast<leaf*>(n);
+            size_t pos = leaf_lower_bound(l, key);
+            if (pos < l->count && !_comp(key, Policy::key(l->values()[pos]))) {
+                where = l;
+                index = pos;
+                return result;
+            }
+
+            // Build it first, since 'args' may refer to an element that's
+            // about to move.
+            value_type x(std::forward<Args>(args)...);
+            if (l->count == leafSlots) {
+                leaf* right = split_leaf(l);
+                if (pos > l->count) {
+                    pos -= l->count;
+                    l = right;
+                }
+                result.right = right;
+                result.key = Policy::key(right->values()[0]);
+            }
+
+            value_type* values = l->values();
+            relocate_backward(&values[pos + 1], &values[pos], l->count - pos);
+            new (&values[pos]) value_type(std::move(x));
+            l->count++;
+            where = l;
+            index = pos;
+            inserted = true;
+            return result;
+        }
+
+        inner* in = static_cast<inner*>(n);
+        size_t c = child_index(in, key);
+        split below = insert_into(in->children[c], key, where, index, inserted, std::forward<Args>(args)...);
+        if (below.right == NULL)
+            return result;
+
+        // Put the child's new sibling in after it.
+        if (in->count == innerSlots) {
+            inner* right = split_inner(in, result.key);
+            result.right = right;
+            if (c > in->count) {
+                c -= in->count + 1;
+                in = right;
+            }
+        }
+
+        key_type* keys = in->keys();
+        relocate_backward(&keys[c + 1], &keys[c], in->count - c);
+        new (&keys[c]) key_type(std::move(below.key));
+        std::copy_backward(&in->children[c + 1], &in->children[in->count + 1], &in->children[in->count + 2]);
+        in->children[c + 1] = below.right;
+        in->count++;
+        return result;
+    }
+
+    // Move the top half of a full leaf into a new one after it.
+    leaf* split_leaf(leaf* l)
+    {
+        leaf* right = new_leaf();
+        size_t keep = leafSlots / 2;
+        relocate(right->values(), &l->values()[keep], leafSlots - keep);
+        right->count = leafSlots - keep;
+        l->count = keep;
+
+        right->prev = l;
+        right->next = l->next;
+        if (l->next != NULL)
+            l->next->prev = right;
+        else
+            _last = right;
+        l->next = right;
+        return right;
+    }
+
+    // Move the top half of a full inner node into a new one. The key
+    // between the halves goes up, into 'middle'.
+    inner* split_inner(inner* n, key_type& middle)
+    {
+        inner* right = new_inner();
+        size_t keep = innerSlots / 2;
+        middle = std::move(n->keys()[keep]);
+        n->keys()[keep].~key_type();
+        relocate(right->keys(), &n->keys()[keep + 1], innerSlots - keep - 1);
+        std::copy(&n->children[keep + 1], &n->children[innerSlots + 1], right->children);
+        right->count = innerSlots - keep - 1;
+        n->count = keep;
+        return right;
+    }
+
+    // Erase 'key' from the subtree under 'n', setting 'erased' if it was
+    // there. Returns true if that left 'n' empty, in which case it's been
+    // freed.
+    bool erase_from(node* n, key_type const& key, bool& erased)
+    {
+        if (n->isLeaf) {
+            leaf* l = static_cast<leaf*>(n);
+            size_t pos = leaf_lower_bound(l, key);
+            if (pos == l->count || _comp(key, Policy::key(l->values()[pos])))
+                return false;
+
+            value_type* values = l->values();
+            values[pos].~value_type();
+            relocate(&values[pos], &values[pos + 1], l->count - pos - 1);
+            l->count--;
+            erased = true;
+            if (l->count > 0)
+                return false;
+
+            if (l->prev != NULL)
+                l->prev->next = l->next;
+            else
+                _first = l->next;
+            if (l->next != NULL)
+                l->next->prev = l->prev;
+            else
+                _last = l->prev;
+            free_leaf(l);
+            return true;
+        }
+
+        inner* in = static_cast<inner*>(n);
+        size_t c = child_index(in, key);
+        if (!erase_from(in->children[c], key, erased))
+            return false;
+
+        // Drop the empty child, and a key next to it. The keys either side
+        // are still good bounds for its neighbors.
+        if (in->count == 0) {
+            free_inner(in);
+            return true;
+        }
+        size_t k = c > 0 ? c - 1 : 0;
+        key_type* keys = in->keys();
+        keys[k].~key_type();
+        relocate(&keys[k], &keys[k + 1], in->count - k - 1);
+        std::copy(&in->children[c + 1], &in->children[in->count + 1], &in->children[c]);
+        in->count--;
+        return false;
+    }
+
+    Comp _comp;
+    Alloc _alloc;
+    node* _root;
+    leaf* _first;
+    leaf* _last;
+    size_t _size;
+    size_t _height;
+};
+
+// A set of unique keys, kept in order.
+template <typename K, typename Comp = std::less<K>, typename Alloc = std::allocator<K>, size_t NodeBytes = 256>
+class btree_set : public btree<btree_set_policy<K>, Comp, Alloc, NodeBytes> {
+    typedef btree<btree_set_policy<K>, Comp, Alloc, NodeBytes> tree;
+
+public:
+    typedef typename tree::iterator iterator;
+    typedef typename tree::const_iterator const_iterator;
+
+    explicit btree_set(Comp const& comp = Comp(), Alloc const& alloc = Alloc())
+      : tree(comp, alloc)
+    {}
+
+    // The keys of 'sorted', which is already in order (as mergesort or
+    // quicksort leave it), built straight into a packed tree.
+    explicit btree_set(vector<K> const& sorted, Comp const& comp = Comp(), Alloc const& alloc = Alloc())
+      : tree(comp, alloc)
+    {
+        this->assign_sorted(sorted.begin(), sorted.end());
+    }
+
+    std::pair<iterator, bool> insert(K const& key)
+    {
+        return this->emplace_key(key, key);
+    }
+
+    std::pair<iterator, bool> insert(K&& key)
+    {
+        return this->emplace_key(key, std::move(key));
+    }
+
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    void insert(I first, I last)
+    {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+};
+
+// A map from unique keys to values, kept in key order. Elements are
+// std::pair<const K, V>.
+template <typename K, typename V, typename Comp = std::less<K>,
+          typename Alloc = std::allocator<std::pair<const K, V> >, size_t NodeBytes = 256>
+class btree_map : public btree<btree_map_policy<K, V>, Comp, Alloc, NodeBytes> {
+    typedef btree<btree_map_policy<K, V>, Comp, Alloc, NodeBytes> tree;
+
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef typename tree::value_type value_type;
+    typedef typename tree::iterator iterator;
+    typedef typename tree::const_iterator const_iterator;
+
+    explicit btree_map(Comp const& comp = Comp(), Alloc const& alloc = Alloc())
+      : tree(comp, alloc)
+    {}
+
+    // The pairs in 'sorted', which is already in key order, built straight
+    // into a packed tree.
+    explicit btree_map(vector<std::pair<K, V> > const& sorted, Comp const& comp = Comp(),
+                       Alloc const& alloc = Alloc())
+      : tree(comp, alloc)
+    {
+        this->assign_sorted(sorted.begin(), sorted.end());
+    }
+
+    std::pair<iterator, bool> insert(value_type const& kv)
+    {
+        return this->emplace_key(kv.first, kv);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& kv)
+    {
+        return this->emplace_key(kv.first, std::move(kv));
+    }
+
+    // Insert (key, V(args...)) unless the key is there already, in which
+    // case nothing is built or moved.
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(K const& key, Args&&... args)
+    {
+        return this->emplace_key(key, std::piecewise_construct, std::forward_as_tuple(key),
+                                 std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+
+    V& operator[](K const& key)
+    {
+        return try_emplace(key).first->second;
+    }
+
+    V& at(K const& key)
+    {
+        iterator it = this->find(key);
+        if (it == this->end())
+            throw std::out_of_range("btree_map::at: no such key");
+        return it->second;
+    }
+
+    V const& at(K const& key) const
+    {
+        const_iterator it = this->find(key);
+        if (it == this->end())
+            throw std::out_of_range("btree_map::at: no such key");
+        return it->second;
+    }
+
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    void insert(I first, I last)
+    {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+};
+
+}  // namespace rtl
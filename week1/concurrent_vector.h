@@ -0,0 +1,599 @@
+// A vector that many threads can append to at once.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "segmented_vector.h"
+#include "vector.h"
+
+namespace rtl {
+
+constexpr size_t log2_floor(size_t n)
+{
+    return n <= 1 ? 0 : 1 + log2_floor(n / 2);
+}
+
+// Appending claims slots with one atomic add to the size, so no thread ever
+// waits for another. The slots are in segments that double in size
+// (segment k holds F << k elements, F being 4KB worth), so nothing is ever
+// moved and finding an element's segment is a count of leading zeros. A
+// segment is installed with a compare-and-swap; if several threads race to
+// install one, the losers free theirs. Racing is rare: whichever thread
+// claims the slot halfway through segment k installs segment k+1 ahead of
+// time, so it's normally there before anyone needs it, rather than several
+// threads allocating a copy of what may be gigabytes.
+//
+// Each slot has a flag that's set once its element has been built.
+// published_size() is how many elements from the start are built, and
+// those can be read while other threads go on appending. size() counts
+// the slots claimed so far, some of which may still be being filled. If
+// building an element throws, its slot stays empty, and published_size()
+// stops short of it.
+//
+// Everything else (iterating, clear, copying, swapping) is for after the
+// appending stops. The iterators are random access, so quicksort,
+// mergesort and parallel_sort can sort the elements where they are.
+// to_vector() copies them out a segment at a time, into one array, which
+// is worth it for numbers: quicksort sorts those with SIMD when they're
+// contiguous.
+template <typename T, typename Alloc = std::allocator<T> >
+class concurrent_vector {
+    typedef std::allocator_traits<Alloc> alloc_traits;
+    typedef typename alloc_traits::template rebind_alloc<char> ByteAlloc;
+    static_assert(std::is_same<typename Alloc::value_type, T>::value,
+                  "the allocator's value_type must be T");
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "concurrent_vector doesn't support over-aligned elements");
+
+    static const size_t firstSegmentBits = log2_floor(segmented_vector_chunk_size<T>::value);
+    static const size_t maxSegments = 64 - firstSegmentBits;
+
+public:
+    typedef T value_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef Alloc allocator_type;
+    typedef size_t size_type;
+
+    template <typename V>
+    class basic_iterator {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+        basic_iterator()
+          : _owner(NULL), _segment(0), _start(0), _pos(NULL), _begin(NULL), _end(NULL)
+        {}
+
+        // iterator to const_iterator.
+        template <typename U, typename = typename std::enable_if<std::is_convertible<U*, V*>::value>::type>
+        basic_iterator(basic_iterator<U> const& it)
+          : _owner(it._owner), _segment(it._segment), _start(it._start), _pos(it._pos), _begin(it._begin),
+            _end(it._end)
+        {}
+
+        reference operator*() const
+        {
+            return *_pos;
+        }
+
+        pointer operator->() const
+        {
+            return _pos;
+        }
+
+        reference operator[](difference_type n) const
+        {
+            return *(*this + n);
+        }
+
+        basic_iterator& operator++()
+        {
+            if (++_pos == _end && _segment + 1 < maxSegments && _owner->segment_data(_segment + 1) != NULL)
+                enter(index());
+            return *this;
+        }
+
+        basic_iterator operator++(int)
+        {
+            basic_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        basic_iterator& operator--()
+        {
+            if (_pos == _begin)
+                enter(index() - 1);
+            else
+                --_pos;
+            return *this;
+        }
+
+        basic_iterator operator--(int)
+        {
+            basic_iterator old = *this;
+            --*this;
+            return old;
+        }
+
+        basic_iterator& operator+=(difference_type n)
+        {
+            // Steps within the segment don't need to look at the table.
+            difference_type offset = (_pos - _begin) + n;
+            if (offset >= 0 && offset < _end - _begin)
+                _pos = _begin + offset;
+            else
+                enter(index() + n);
+            return *this;
+        }
+
+        basic_iterator& operator-=(difference_type n)
+        {
+            return *this += -n;
+        }
+
+        basic_iterator operator+(difference_type n) const
+        {
+            basic_iterator it = *this;
+            return it += n;
+        }
+
+        friend basic_iterator operator+(difference_type n, basic_iterator const& it)
+        {
+            return it + n;
+        }
+
+        basic_iterator operator-(difference_type n) const
+        {
+            basic_iterator it = *this;
+            return it += -n;
+        }
+
+        difference_type operator-(basic_iterator const& other) const
+        {
+            return difference_type(index()) - difference_type(other.index());
+        }
+
+        // The end of one segment and the start of the next are the same
+        // place, so compare indices.
+        bool operator==(basic_iterator const& other) const
+        {
+            return index() == other.index();
+        }
+
+        bool operator!=(basic_iterator const& other) const
+        {
+            return index() != other.index();
+        }
+
+        bool operator<(basic_iterator const& other) const
+        {
+            return index() < other.index();
+        }
+
+        bool operator>(basic_iterator const& other) const
+        {
+            return index() > other.index();
+        }
+
+        bool operator<=(basic_iterator const& other) const
+        {
+            return index() <= other.index();
+        }
+
+        bool operator>=(basic_iterator const& other) const
+        {
+            return index() >= other.index();
+        }
+
+    private:
+        friend class concurrent_vector;
+        template <typename U> friend class basic_iterator;
+
+        basic_iterator(concurrent_vector const* owner, size_t index)
+          : _owner(owner)
+        {
+            enter(index);
+        }
+
+        size_t index() const
+        {
+            return _start + (_pos - _begin);
+        }
+
+        // Point at 'index'. An index just past the last segment there is
+        // stays at the end of that segment.
+        void enter(size_t index)
+        {
+            _segment = segment_of(index);
+            _start = segment_start(_segment);
+            _begin = _owner->segment_data(_segment);
+            if (_begin == NULL && _segment > 0) {
+                _segment--;
+                _start = segment_start(_segment);
+                _begin = _owner->segment_data(_segment);
+            }
+            _end = _begin == NULL ? NULL : _begin + segment_size(_segment);
+            _pos = _begin + (index - _start);
+        }
+
+        concurrent_vector const* _owner;
+        size_t _segment;
+        size_t _start;  // Index of the segment's first element.
+        V* _pos;
+        V* _begin;
+        V* _end;
+    };
+
+    typedef basic_iterator<T> iterator;
+    typedef basic_iterator<const T> const_iterator;
+
+    explicit concurrent_vector(Alloc const& alloc = Alloc())
+      : _alloc(alloc)
+    {
+        init();
+    }
+
+    // Not while anyone's appending to 'other'.
+    concurrent_vector(concurrent_vector const& other)
+      : _alloc(alloc_traits::select_on_container_copy_construction(other._alloc))
+    {
+        init();
+        grow_by(other.begin(), other.end());
+    }
+
+    concurrent_vector(concurrent_vector&& other)
+      : _alloc(other._alloc)
+    {
+        init();
+        swap(other);
+    }
+
+    concurrent_vector& operator=(concurrent_vector const& rhs)
+    {
+        if (this != &rhs) {
+            concurrent_vector copy(rhs);
+            swap(copy);
+        }
+        return *this;
+    }
+
+    concurrent_vector& operator=(concurrent_vector&& rhs)
+    {
+        if (this != &rhs) {
+            clear();
+            swap(rhs);
+        }
+        return *this;
+    }
+
+    ~concurrent_vector()
+    {
+        destroy_all();
+        for (size_t k=0; k < maxSegments; k++) {
+            char* s = _segments[k].load(std::memory_order_relaxed);
+            if (s != NULL)
+                free_segment(s, k);
+        }
+    }
+
+    // Safe from any number of threads at once. Returns the new element's
+    // index.
+    size_t push_back(T const& x)
+    {
+        return emplace_back(x);
+    }
+
+    size_t push_back(T&& x)
+    {
+        return emplace_back(std::move(x));
+    }
+
+    template <typename... Args>
+    size_t emplace_back(Args&&... args)
+    {
+        size_t index = _size.fetch_add(1, std::memory_order_relaxed);
+        size_t k = segment_of(index);
+        char* s = install_segment(k);
+        size_t offset = index - segment_start(k);
+        new (&reinterpret_cast<T*>(s)[offset]) T(std::forward<Args>(args)...);
+        segment_flags(s, k)[offset].store(1, std::memory_order_release);
+        if (offset == segment_size(k) / 2)
+            prepare_segment(k + 1);
+        return index;
+    }
+
+    // Append 'n' copies of 'x' as one block. Safe from any number of threads
+    // at once. Returns the index of the first.
+    size_t grow_by(size_t n, T const& x = T())
+    {
+        size_t start = _size.fetch_add(n, std::memory_order_relaxed);
+        fill(start, n, [&](T* p) { new (p) T(x); });
+        return start;
+    }
+
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    size_t grow_by(I first, I last)
+    {
+        size_t n = std::distance(first, last);
+        size_t start = _size.fetch_add(n, std::memory_order_relaxed);
+        fill(start, n, [&](T* p) { new (p) T(*first++); });
+        return start;
+    }
+
+    // Allocate the segments for the first 'n' elements now, so appending
+    // won't have to. Safe while others append.
+    void reserve(size_t n)
+    {
+        if (n == 0)
+            return;
+        for (size_t k=0; k <= segment_of(n - 1); k++)
+            install_segment(k);
+    }
+
+    // How many slots have been claimed, built or not.
+    size_type size() const
+    {
+        return _size.load(std::memory_order_acquire);
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    // How many elements from the start are built: they can be read while
+    // others are still appending.
+    size_type published_size() const
+    {
+        size_t claimed = _size.load(std::memory_order_acquire);
+        size_t known = _published.load(std::memory_order_acquire);
+        size_t n = known;
+        while (n < claimed && is_built(n))
+            n++;
+
+        // Save the next caller the scan.
+        while (known < n && !_published.compare_exchange_weak(known, n))
+            ;
+        return n;
+    }
+
+    size_type capacity() const
+    {
+        size_t k = 0;
+        while (k < maxSegments && _segments[k].load(std::memory_order_acquire) != NULL)
+            k++;
+        return k == 0 ? 0 : segment_start(k);
+    }
+
+    T& operator[](size_type n)
+    {
+        size_t k = segment_of(n);
+        return segment_data(k)[n - segment_start(k)];
+    }
+
+    const T& operator[](size_type n) const
+    {
+        size_t k = segment_of(n);
+        return segment_data(k)[n - segment_start(k)];
+    }
+
+    iterator begin()
+    {
+        return iterator(this, 0);
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+
+    iterator end()
+    {
+        return iterator(this, size());
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, size());
+    }
+
+    // The elements, in one contiguous vector.
+    vector<T> to_vector() const
+    {
+        vector<T> v;
+        size_t n = size();
+        v.reserve(n);
+        for (size_t k=0; n > 0 && k <= segment_of(n - 1); k++) {
+            const T* data = segment_data(k);
+            size_t count = std::min(segment_size(k), n - segment_start(k));
+            v.insert(v.end(), data, data + count);
+        }
+        return v;
+    }
+
+    // Destroys the elements but keeps the segments. Not while anyone's
+    // appending.
+    void clear()
+    {
+        destroy_all();
+        _size.store(0, std::memory_order_relaxed);
+        _published.store(0, std::memory_order_relaxed);
+    }
+
+    // Not while anyone's appending to either.
+    void swap(concurrent_vector& other)
+    {
+        std::swap(_alloc, other._alloc);
+        for (size_t k=0; k < maxSegments; k++) {
+            char* s = _segments[k].load(std::memory_order_relaxed);
+            _segments[k].store(other._segments[k].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            other._segments[k].store(s, std::memory_order_relaxed);
+        }
+        size_t size = _size.load(std::memory_order_relaxed);
+        _size.store(other._size.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other._size.store(size, std::memory_order_relaxed);
+        size_t published = _published.load(std::memory_order_relaxed);
+        _published.store(other._published.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other._published.store(published, std::memory_order_relaxed);
+    }
+
+    allocator_type get_allocator() const
+    {
+        return _alloc;
+    }
+
+private:
+    template <typename V> friend class basic_iterator;
+
+    // Segment k holds elements [F * (2^k - 1), F * (2^(k+1) - 1)).
+    static size_t segment_of(size_t index)
+    {
+        return 63 - __builtin_clzll((index >> firstSegmentBits) + 1);
+    }
+
+    static size_t segment_start(size_t k)
+    {
+        return ((size_t(1) << k) - 1) << firstSegmentBits;
+    }
+
+    static size_t segment_size(size_t k)
+    {
+        return size_t(1) << (k + firstSegmentBits);
+    }
+
+    // A segment is its elements, followed by a byte per element saying
+    // whether it's been built.
+    static std::atomic<uint8_t>* segment_flags(char* s, size_t k)
+    {
+        return reinterpret_cast<std::atomic<uint8_t>*>(s + segment_size(k) * sizeof(T));
+    }
+
+    T* segment_data(size_t k) const
+    {
+        return reinterpret_cast<T*>(_segments[k].load(std::memory_order_acquire));
+    }
+
+    void init()
+    {
+        for (size_t k=0; k < maxSegments; k++)
+            _segments[k].store(NULL, std::memory_order_relaxed);
+        _size.store(0, std::memory_order_relaxed);
+        _published.store(0, std::memory_order_relaxed);
+    }
+
+    char* allocate_segment(size_t k)
+    {
+        ByteAlloc alloc(_alloc);
+        size_t n = segment_size(k);
+        char* s = std::allocator_traits<ByteAlloc>::allocate(alloc, n * sizeof(T) + n);
+        memset((void*) segment_flags(s, k), 0, n);
+        return s;
+    }
+
+    void free_segment(char* s, size_t k)
+    {
+        ByteAlloc alloc(_alloc);
+        size_t n = segment_size(k);
+        std::allocator_traits<ByteAlloc>::deallocate(alloc, s, n * sizeof(T) + n);
+    }
+
+    // Segment k, allocating it if nobody has yet.
+    char* install_segment(size_t k)
+    {
+        char* s = _segments[k].load(std::memory_order_acquire);
+        if (s != NULL)
+            return s;
+
+        char* fresh = allocate_segment(k);
+        if (_segments[k].compare_exchange_strong(s, fresh, std::memory_order_acq_rel, std::memory_order_acquire))
+            return fresh;
+        free_segment(fresh, k);
+        return s;
+    }
+
+    // Install segment k ahead of time. Failing is left for whoever needs it
+    // to find out about; the elements this thread built are fine.
+    void prepare_segment(size_t k)
+    {
+        if (k >= maxSegments || _segments[k].load(std::memory_order_relaxed) != NULL)
+            return;
+        try {
+            install_segment(k);
+        } catch (...) {
+        }
+    }
+
+    bool is_built(size_t index) const
+    {
+        size_t k = segment_of(index);
+        char* s = _segments[k].load(std::memory_order_acquire);
+        return s != NULL && segment_flags(s, k)[index - segment_start(k)].load(std::memory_order_acquire) != 0;
+    }
+
+    // Build the claimed slots [start, start + n) with make(p), a segment at
+    // a time.
+    template <typename Make>
+    void fill(size_t start, size_t n, Make make)
+    {
+        size_t index = start;
+        while (index < start + n) {
+            size_t k = segment_of(index);
+            char* s = install_segment(k);
+            T* data = reinterpret_cast<T*>(s);
+            std::atomic<uint8_t>* flags = segment_flags(s, k);
+            size_t offset = index - segment_start(k);
+            size_t count = std::min(segment_size(k) - offset, start + n - index);
+            for (size_t i=offset; i < offset + count; i++) {
+                make(&data[i]);
+                flags[i].store(1, std::memory_order_release);
+            }
+
+            // Only one claim holds the middle slot.
+            size_t middle = segment_size(k) / 2;
+            if (offset <= middle && middle < offset + count)
+                prepare_segment(k + 1);
+            index += count;
+        }
+    }
+
+    // Destroy every element that was built, and clear the flags.
+    void destroy_all()
+    {
+        size_t n = _size.load(std::memory_order_relaxed);
+        for (size_t k=0; n > 0 && k <= segment_of(n - 1); k++) {
+            char* s = _segments[k].load(std::memory_order_relaxed);
+            if (s == NULL)
+                continue;
+            T* data = reinterpret_cast<T*>(s);
+            std::atomic<uint8_t>* flags = segment_flags(s, k);
+            size_t count = std::min(segment_size(k), n - segment_start(k));
+            for (size_t i=0; i < count; i++) {
+                if (flags[i].load(std::memory_order_relaxed) != 0) {
+                    data[i].~T();
+                    flags[i].store(0, std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    Alloc _alloc;
+    std::atomic<char*> _segments[maxSegments];
+    std::atomic<size_t> _size;
+    mutable std::atomic<size_t> _published;
+};
+
+}  // namespace rtl
@@ -0,0 +1,388 @@
+// Loading and saving the data/ file format: integers separated by ", ",
+// with a newline at the end, like data/set1 and data/set2.
+//
+// Loading memory-maps the file and parses it in place, eight bytes at a time
+// (SWAR: a 64-bit register treated as eight byte lanes). Big files are split
+// at separators and parsed by several threads at once, first to count the
+// numbers in each piece, then to parse each piece straight into its own part
+// of the output vector.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "thread_pool.h"
+#include "vector.h"
+
+namespace rtl {
+
+// Files up to this size (in bytes) are loaded by a single thread.
+const size_t data_file_parallel_cutoff = 1 << 20;
+
+// How many numbers each task formats at a time when saving.
+const size_t data_file_write_grain = 1 << 16;
+
+// A file mapped read-only into memory, unmapped on destruction.
+class mapped_file {
+public:
+    explicit mapped_file(const char* path)
+      : _data(NULL), _size(0)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error(std::string("mapped_file: couldn't open ") + path);
+
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error(std::string("mapped_file: couldn't stat ") + path);
+        }
+
+        // mmap won't map an empty file.
+        _size = size_t(info.st_size);
+        if (_size > 0) {
+            void* p = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error(std::string("mapped_file: couldn't map ") + path);
+            }
+            madvise(p, _size, MADV_SEQUENTIAL);
+            _data = (const char*) p;
+        }
+        close(fd);
+    }
+
+    ~mapped_file()
+    {
+        if (_data != NULL)
+            munmap((void*) _data, _size);
+    }
+
+    const char* data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    mapped_file(mapped_file const&);
+    mapped_file& operator=(mapped_file const&);
+
+    const char* _data;
+    size_t _size;
+};
+
+const uint64_t data_high_bits = 0x8080808080808080ull;
+
+// Eight bytes of text as one number, first byte lowest.
+inline uint64_t data_load8(const char* p)
+{
+    uint64_t x;
+    memcpy(&x, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+// The high bit of each byte of 'x' that's an ASCII digit. Every byte is
+// tested on its own (nothing carries between lanes), so the whole mask is
+// exact, not just the lowest byte.
+inline uint64_t data_digit_mask(uint64_t x)
+{
+    uint64_t low7 = x & ~data_high_bits;
+    uint64_t atLeast0 = (low7 + 0x5050505050505050ull) & data_high_bits;
+    uint64_t above9 = (low7 + 0x4646464646464646ull) & data_high_bits;
+    return atLeast0 & ~above9 & ~x;
+}
+
+inline bool data_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// The value of the first 'length' (1 to 8) digits in 'chunk'. Shifting them up
+// to the top turns the bytes below into leading zeros, then each step adds
+// neighbouring lanes together: 8 one-digit lanes, 4 two-digit, 2 four-digit.
+inline uint32_t data_parse8(uint64_t chunk, unsigned length)
+{
+    chunk <<= 8 * (8 - length);
+    chunk = ((chunk & 0x0f0f0f0f0f0f0f0full) * 2561) >> 8;
+    chunk = ((chunk & 0x00ff00ff00ff00ffull) * 6553601) >> 16;
+    return uint32_t(((chunk & 0x0000ffff0000ffffull) * 42949672960001ull) >> 32);
+}
+
+// Parse the run of digits at 'p' (there's at least one) into 'magnitude', and
+// return the end of it. Up to eight digits take one load, and only longer
+// numbers go on a digit at a time.
+inline const char* data_parse_digits(const char* p, const char* last, uint32_t& magnitude)
+{
+    uint32_t value = 0;
+    if (last - p >= 8) {
+        uint64_t chunk = data_load8(p);
+        uint64_t others = ~data_digit_mask(chunk) & data_high_bits;
+        unsigned length = others != 0 ? unsigned(__builtin_ctzll(others)) / 8 : 8;
+        value = data_parse8(chunk, length);
+        p += length;
+        if (length < 8) {
+            magnitude = value;
+            return p;
+        }
+    }
+
+    for (; p < last && data_is_digit(*p); p++)
+        value = value * 10 + uint32_t(*p - '0');
+    magnitude = value;
+    return p;
+}
+
+// How many numbers there are in [first, last): the runs of digits.
+inline size_t data_count_values(const char* first, const char* last)
+{
+    size_t count = 0;
+    uint64_t previous = 0;
+    const char* p = first;
+
+    for (; last - p >= 8; p += 8) {
+        uint64_t digits = data_digit_mask(data_load8(p));
+        uint64_t starts = digits & ~((digits << 8) | (previous >> 56));
+        count += __builtin_popcountll(starts);
+        previous = digits;
+    }
+
+    bool inNumber = (previous >> 63) != 0;
+    for (; p < last; p++) {
+        bool digit = data_is_digit(*p);
+        if (digit && !inNumber)
+            count++;
+        inNumber = digit;
+    }
+
+    return count;
+}
+
+// Parse the numbers in [first, last) into 'out'. Anything that isn't a digit,
+// or a minus sign right before one, separates numbers. Returns the end of
+// the output.
+inline int* data_parse_values(const char* first, const char* last, int* out)
+{
+    const char* p = first;
+
+    while (p < last) {
+        if (!data_is_digit(*p)) {
+            bool negative = *p == '-' && last - p > 1 && data_is_digit(p[1]);
+            p++;
+            if (!negative)
+                continue;
+
+            uint32_t magnitude;
+            p = data_parse_digits(p, last, magnitude);
+            *out++ = int(0u - magnitude);
+            continue;
+        }
+
+        uint32_t magnitude;
+        p = data_parse_digits(p, last, magnitude);
+        *out++ = int(magnitude);
+    }
+
+    return out;
+}
+
+// Where to split a file near 'pos': the first point at or after it that
+// isn't inside a number.
+inline size_t data_split_point(const char* text, size_t size, size_t pos)
+{
+    while (pos < size && pos > 0 && (data_is_digit(text[pos - 1]) || text[pos - 1] == '-'))
+        pos++;
+    return pos;
+}
+
+// Replace the contents of 'values' with the numbers in the file at 'path'.
+// Throws std::runtime_error if it can't be read.
+inline void load_data_file(const char* path, vector<int>& values,
+                           thread_pool& pool = thread_pool::shared())
+{
+    mapped_file file(path);
+    const char* text = file.data();
+    size_t size = file.size();
+
+    size_t numPieces = 1;
+    if (size > data_file_parallel_cutoff && pool.size() > 1)
+        numPieces = std::min(pool.size(), size / (data_file_parallel_cutoff / 4));
+
+    vector<size_t> cuts;
+    cuts.resize(numPieces + 1);
+    cuts[0] = 0;
+    for (size_t i=1; i < numPieces; i++)
+        cuts[i] = data_split_point(text, size, size / numPieces * i);
+    cuts[numPieces] = size;
+
+    // Count the numbers in each piece, so each one knows where its output
+    // starts.
+    vector<size_t> offsets;
+    offsets.resize(numPieces + 1);
+    if (numPieces == 1) {
+        offsets[1] = data_count_values(text, text + size);
+    } else {
+        task_group group(pool);
+        for (size_t i=0; i < numPieces; i++) {
+            group.run([&, i]() {
+                offsets[i + 1] = data_count_values(text + cuts[i], text + cuts[i + 1]);
+            });
+        }
+        group.wait();
+    }
+
+    offsets[0] = 0;
+    for (size_t i=0; i < numPieces; i++)
+        offsets[i + 1] += offsets[i];
+
+    values.clear();
+    values.resize(offsets[numPieces]);
+    if (values.size() == 0)
+        return;
+
+    int* out = &values[0];
+    if (numPieces == 1) {
+        data_parse_values(text, text + size, out);
+    } else {
+        task_group group(pool);
+        for (size_t i=0; i < numPieces; i++) {
+            group.run([&, i]() {
+                data_parse_values(text + cuts[i], text + cuts[i + 1], out + offsets[i]);
+            });
+        }
+        group.wait();
+    }
+}
+
+// Write 'value' as text at 'out', and return the end of it. Needs room for
+// 11 characters.
+inline char* data_format_value(char* out, int value)
+{
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+    uint32_t magnitude = uint32_t(value);
+    if (value < 0) {
+        *out++ = '-';
+        magnitude = 0u - magnitude;
+    }
+
+    unsigned length = 1;
+    for (uint32_t limit = 10; length < 10 && magnitude >= limit; limit *= 10)
+        length++;
+
+    char* end = out + length;
+    char* p = end;
+    while (magnitude >= 100) {
+        uint32_t pair = magnitude % 100;
+        magnitude /= 100;
+        p -= 2;
+        memcpy(p, pairs + pair * 2, 2);
+    }
+    if (magnitude >= 10) {
+        p -= 2;
+        memcpy(p, pairs + magnitude * 2, 2);
+    } else {
+        *--p = char('0' + magnitude);
+    }
+
+    return end;
+}
+
+// Format values[first, last) into 'out', each one after a ", ". Needs room for
+// 13 characters per value. Returns the end of the text.
+inline char* data_format_values(char* out, int const* values, size_t first, size_t last)
+{
+    for (size_t i = first; i < last; i++) {
+        *out++ = ',';
+        *out++ = ' ';
+        out = data_format_value(out, values[i]);
+    }
+    return out;
+}
+
+inline void data_write_all(int fd, const char* data, size_t bytes, const char* path)
+{
+    while (bytes > 0) {
+        ssize_t written = write(fd, data, bytes);
+        if (written <= 0) {
+            close(fd);
+            throw std::runtime_error(std::string("save_data_file: couldn't write ") + path);
+        }
+        data += written;
+        bytes -= size_t(written);
+    }
+}
+
+// Write 'values' to the file at 'path', replacing it. Several threads format
+// a batch of values at once, each into its own buffer, and the buffers are
+// written out in order. Throws std::runtime_error if it can't be written.
+inline void save_data_file(const char* path, vector<int> const& values,
+                           thread_pool& pool = thread_pool::shared())
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::runtime_error(std::string("save_data_file: couldn't open ") + path);
+
+    // Room for ", ", a sign and 10 digits per value, and a final newline.
+    const size_t bufferSize = data_file_write_grain * 13 + 1;
+    size_t count = values.size();
+    size_t numTasks = count > data_file_write_grain && pool.size() > 1 ? pool.size() : 1;
+    size_t batch = numTasks * data_file_write_grain;
+
+    vector<char> buffers;
+    buffers.resize(numTasks * bufferSize);
+    vector<char*> ends;
+    ends.resize(numTasks);
+
+    for (size_t start = 0; start < count; start += batch) {
+        size_t batchEnd = std::min(count, start + batch);
+        size_t batchTasks = (batchEnd - start + data_file_write_grain - 1) / data_file_write_grain;
+
+        auto format = [&](size_t t) {
+            size_t first = start + t * data_file_write_grain;
+            size_t last = std::min(batchEnd, first + data_file_write_grain);
+            ends[t] = data_format_values(&buffers[t * bufferSize], &values[0], first, last);
+        };
+
+        if (batchTasks == 1) {
+            format(0);
+        } else {
+            task_group group(pool);
+            for (size_t t=0; t < batchTasks; t++)
+                group.run([&, t]() { format(t); });
+            group.wait();
+        }
+
+        if (batchEnd == count)
+            *ends[batchTasks - 1]++ = '\n';
+
+        for (size_t t=0; t < batchTasks; t++) {
+            // The very first value has no separator in front of it.
+            char* text = &buffers[t * bufferSize];
+            if (start == 0 && t == 0)
+                text += 2;
+            data_write_all(fd, text, ends[t] - text, path);
+        }
+    }
+
+    close(fd);
+}
+
+}  // namespace rtl
@@ -0,0 +1,549 @@
+// Sorting files of integers that are too big to sort in memory.
+//
+// The files hold comma-separated integers, like data/set1 and data/set2.
+// Sorting happens in two phases:
+//
+//   1. Read the input a memory-sized chunk at a time, sort each chunk with
+//      parallel_sort, and write it to a temporary file as a sorted "run".
+//   2. Merge the runs with a loser tree, through one buffer per run. If there
+//      are too many runs to give each one a buffer, merge groups of them
+//      into longer runs first.
+//
+// All buffers come out of a fixed memory budget. Every read and write goes
+// through those buffers (stdio's own buffering is turned off), so I/O is in
+// large sequential blocks.
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+#include "data_file.h"
+#include "loser_tree.h"
+#include "parallel_sort.h"
+#include "thread_pool.h"
+#include "vector.h"
+
+namespace rtl {
+
+struct external_sort_options {
+    // The most memory to use, in bytes. Covers every buffer and the merge
+    // tree; only a few words per run of bookkeeping live outside it.
+    size_t memoryBudget;
+
+    // Where the temporary run files go. Empty means the system default.
+    std::string tempDirectory;
+
+    // Threads used to sort each chunk. NULL means thread_pool::shared().
+    thread_pool* pool;
+
+    external_sort_options()
+      : memoryBudget(size_t(256) << 20), pool(NULL)
+    {}
+};
+
+struct external_sort_stats {
+    size_t numValues;
+    size_t numRuns;
+    size_t numMergePasses;
+    size_t peakMemory;
+};
+
+// Hands out memory from a budget, and throws rather than go over it.
+class external_memory {
+public:
+    explicit external_memory(size_t budget)
+      : _budget(budget), _used(0), _peak(0)
+    {}
+
+    size_t available() const
+    {
+        return _budget - _used;
+    }
+
+    size_t peak() const
+    {
+        return _peak;
+    }
+
+    // Count memory that's allocated somewhere else against the budget.
+    void claim(size_t bytes)
+    {
+        if (bytes > available())
+            throw std::runtime_error("external_sort: over the memory budget");
+        _used += bytes;
+        if (_used > _peak)
+            _peak = _used;
+    }
+
+    void unclaim(size_t bytes)
+    {
+        _used -= bytes;
+    }
+
+    void* allocate(size_t bytes)
+    {
+        claim(bytes);
+        void* p = malloc(bytes);
+        if (p == NULL && bytes > 0) {
+            unclaim(bytes);
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    void release(void* p, size_t bytes)
+    {
+        free(p);
+        unclaim(bytes);
+    }
+
+private:
+    size_t _budget;
+    size_t _used;
+    size_t _peak;
+};
+
+// A buffer of plain old data, allocated from an external_memory.
+template <typename T>
+class external_buffer {
+public:
+    external_buffer(external_memory& memory, size_t count)
+      : count(count), _memory(memory)
+    {
+        data = (T*) memory.allocate(count * sizeof(T));
+    }
+
+    ~external_buffer()
+    {
+        _memory.release(data, count * sizeof(T));
+    }
+
+    T* data;
+    size_t count;
+
+private:
+    external_buffer(external_buffer const&);
+    external_buffer& operator=(external_buffer const&);
+
+    external_memory& _memory;
+};
+
+// A stdio file with its own buffering turned off, closed on destruction.
+class external_file {
+public:
+    external_file(const char* path, const char* mode)
+    {
+        _file = fopen(path, mode);
+        if (_file == NULL)
+            throw std::runtime_error(std::string("external_sort: couldn't open ") + path);
+        setvbuf(_file, NULL, _IONBF, 0);
+    }
+
+    // A temporary file, deleted as soon as it's closed.
+    explicit external_file(std::string const& tempDirectory)
+    {
+        if (tempDirectory.empty()) {
+            _file = tmpfile();
+        } else {
+            std::string path = tempDirectory + "/rtl-sort-XXXXXX";
+            int fd = mkstemp(&path[0]);
+            _file = fd < 0 ? NULL : fdopen(fd, "w+b");
+            if (fd >= 0)
+                unlink(path.c_str());
+        }
+        if (_file == NULL)
+            throw std::runtime_error("external_sort: couldn't create a temporary file");
+        setvbuf(_file, NULL, _IONBF, 0);
+    }
+
+    ~external_file()
+    {
+        fclose(_file);
+    }
+
+    FILE* get()
+    {
+        return _file;
+    }
+
+    void write(const void* data, size_t bytes)
+    {
+        if (bytes > 0 && fwrite(data, 1, bytes, _file) != bytes)
+            throw std::runtime_error("external_sort: write failed");
+    }
+
+    size_t read(void* data, size_t bytes)
+    {
+        size_t got = fread(data, 1, bytes, _file);
+        if (got < bytes && ferror(_file))
+            throw std::runtime_error("external_sort: read failed");
+        return got;
+    }
+
+    void rewind()
+    {
+        if (fseek(_file, 0, SEEK_SET) != 0)
+            throw std::runtime_error("external_sort: seek failed");
+    }
+
+private:
+    external_file(external_file const&);
+    external_file& operator=(external_file const&);
+
+    FILE* _file;
+};
+
+// Parses comma-separated integers out of a text file, a buffer at a time.
+// Anything that isn't a digit or a minus sign separates numbers.
+class external_text_reader {
+public:
+    external_text_reader(external_file& file, char* buffer, size_t size)
+      : _file(file), _buffer(buffer), _size(size), _pos(0), _end(0),
+        _inNumber(false), _negative(false), _value(0)
+    {}
+
+    // Read up to 'max' numbers. Returns how many there were.
+    size_t read(int* values, size_t max)
+    {
+        size_t count = 0;
+
+        while (count < max) {
+            if (_pos == _end && !refill()) {
+                // A number right at the end of the file.
+                if (_inNumber)
+                    values[count++] = take_number();
+                break;
+            }
+
+            char c = _buffer[_pos++];
+            if (c >= '0' && c <= '9') {
+                _value = _value * 10 + (c - '0');
+                _inNumber = true;
+            } else if (c == '-' && !_inNumber) {
+                _negative = true;
+            } else {
+                if (_inNumber)
+                    values[count++] = take_number();
+                _negative = false;
+            }
+        }
+
+        return count;
+    }
+
+    // True if there are no more numbers to read.
+    bool at_end()
+    {
+        if (_inNumber)
+            return false;
+
+        while (true) {
+            if (_pos == _end && !refill())
+                return true;
+
+            char c = _buffer[_pos];
+            if ((c >= '0' && c <= '9') || c == '-')
+                return false;
+            _pos++;
+        }
+    }
+
+private:
+    bool refill()
+    {
+        _pos = 0;
+        _end = _file.read(_buffer, _size);
+        return _end > 0;
+    }
+
+    int take_number()
+    {
+        int value = int(_negative ? -_value : _value);
+        _inNumber = false;
+        _negative = false;
+        _value = 0;
+        return value;
+    }
+
+    external_file& _file;
+    char* _buffer;
+    size_t _size;
+    size_t _pos;
+    size_t _end;
+
+    // State of a number that may straddle two buffer loads.
+    bool _inNumber;
+    bool _negative;
+    long long _value;
+};
+
+// Writes integers out as ", "-separated text, through a buffer of at least
+// 32 bytes.
+class external_text_writer {
+public:
+    external_text_writer(external_file& file, char* buffer, size_t size)
+      : _file(file), _buffer(buffer), _size(size), _pos(0), _first(true)
+    {}
+
+    void write(int value)
+    {
+        // Room for a separator, a sign, 10 digits and the final newline.
+        if (_size - _pos < 16)
+            flush();
+
+        if (!_first) {
+            _buffer[_pos++] = ',';
+            _buffer[_pos++] = ' ';
+        }
+        _first = false;
+
+        _pos = data_format_value(_buffer + _pos, value) - _buffer;
+    }
+
+    void finish()
+    {
+        if (!_first)
+            _buffer[_pos++] = '\n';
+        flush();
+    }
+
+private:
+    void flush()
+    {
+        _file.write(_buffer, _pos);
+        _pos = 0;
+    }
+
+    external_file& _file;
+    char* _buffer;
+    size_t _size;
+    size_t _pos;
+    bool _first;
+};
+
+// Writes integers to a run file in binary, through a buffer.
+class external_run_writer {
+public:
+    external_run_writer(external_file& file, int* buffer, size_t size)
+      : _file(file), _buffer(buffer), _size(size), _pos(0)
+    {}
+
+    void write(int value)
+    {
+        if (_pos == _size)
+            flush();
+        _buffer[_pos++] = value;
+    }
+
+    void finish()
+    {
+        flush();
+    }
+
+private:
+    void flush()
+    {
+        _file.write(_buffer, _pos * sizeof(int));
+        _pos = 0;
+    }
+
+    external_file& _file;
+    int* _buffer;
+    size_t _size;
+    size_t _pos;
+};
+
+// Reads a run file back, through a buffer.
+struct external_run_reader {
+    external_file* file;
+    int* buffer;
+    size_t size;
+    size_t pos;
+    size_t count;
+
+    bool next(int& value)
+    {
+        if (pos == count) {
+            count = file->read(buffer, size * sizeof(int)) / sizeof(int);
+            pos = 0;
+            if (count == 0)
+                return false;
+        }
+        value = buffer[pos++];
+        return true;
+    }
+};
+
+// The run files, closed (and so deleted) along with this.
+class external_run_list {
+public:
+    ~external_run_list()
+    {
+        for (size_t i=0; i < runs.size(); i++)
+            delete runs[i];
+    }
+
+    vector<external_file*> runs;
+};
+
+typedef loser_tree<int, std::less<int> > external_merge_tree;
+
+// Memory needed to merge 'k' runs with 'runBuffer' ints of buffer each.
+inline size_t external_merge_memory(size_t k, size_t runBuffer)
+{
+    return k * (sizeof(external_run_reader) + runBuffer * sizeof(int))
+        + external_merge_tree::memory_for(k);
+}
+
+// Merge runs[0, k) into 'writer', splitting whatever memory is left between
+// the runs' buffers.
+template <typename Writer>
+void external_merge(external_file** runs, size_t k, Writer& writer, external_memory& memory)
+{
+    size_t fixed = external_merge_memory(k, 0);
+    size_t runBuffer = (memory.available() - fixed) / k / sizeof(int);
+
+    external_buffer<external_run_reader> readers(memory, k);
+    external_buffer<int> buffers(memory, k * runBuffer);
+
+    memory.claim(external_merge_tree::memory_for(k));
+    {
+        external_merge_tree tree(k);
+
+        for (size_t i=0; i < k; i++) {
+            external_run_reader reader = { runs[i], buffers.data + i * runBuffer, runBuffer, 0, 0 };
+            readers.data[i] = reader;
+            runs[i]->rewind();
+
+            int value;
+            if (readers.data[i].next(value))
+                tree.set(i, value);
+        }
+        tree.start();
+
+        while (!tree.empty()) {
+            writer.write(tree.top_value());
+
+            int value;
+            if (readers.data[tree.top()].next(value))
+                tree.replace_top(value);
+            else
+                tree.pop_top();
+        }
+
+        writer.finish();
+    }
+    memory.unclaim(external_merge_tree::memory_for(k));
+}
+
+// Sort the comma-separated integers in 'inputPath' and write them to
+// 'outputPath' in the same format. Throws std::runtime_error if a file can't
+// be read or written, and std::invalid_argument if the memory budget is too
+// small to work with (it needs to be at least a kilobyte).
+inline external_sort_stats external_sort(const char* inputPath, const char* outputPath,
+    external_sort_options const& options = external_sort_options())
+{
+    const size_t minBuffer = 64;
+
+    if (options.memoryBudget < 16 * minBuffer)
+        throw std::invalid_argument("external_sort: memory budget is too small");
+
+    external_memory memory(options.memoryBudget);
+    thread_pool& pool = options.pool ? *options.pool : thread_pool::shared();
+    size_t textBytes = std::max(minBuffer, options.memoryBudget / 16);
+
+    external_sort_stats stats = { 0, 0, 0, 0 };
+    external_run_list runs;
+    external_file input(inputPath, "rb");
+
+    // Phase 1: sorted runs. Everything that's not the text buffer holds the
+    // chunk being sorted.
+    {
+        external_buffer<char> text(memory, textBytes);
+        external_buffer<int> chunk(memory, memory.available() / sizeof(int));
+        external_text_reader reader(input, text.data, text.count);
+
+        while (true) {
+            size_t count = reader.read(chunk.data, chunk.count);
+            if (count == 0)
+                break;
+
+            stats.numValues += count;
+            parallel_sort(chunk.data, chunk.data + count, std::less<int>(), pool);
+
+            if (runs.runs.empty() && reader.at_end()) {
+                // It all fit in one chunk, so it can go straight out.
+                external_file output(outputPath, "wb");
+                external_text_writer writer(output, text.data, text.count);
+                for (size_t i=0; i < count; i++)
+                    writer.write(chunk.data[i]);
+                writer.finish();
+
+                stats.numRuns = 1;
+                stats.peakMemory = memory.peak();
+                return stats;
+            }
+
+            external_file* run = new external_file(options.tempDirectory);
+            runs.runs.push_back(run);
+            run->write(chunk.data, count * sizeof(int));
+        }
+    }
+
+    stats.numRuns = runs.runs.size();
+
+    if (runs.runs.empty()) {
+        // No numbers at all.
+        external_file output(outputPath, "wb");
+        stats.peakMemory = memory.peak();
+        return stats;
+    }
+
+    // Phase 2: merge. Work out how many runs can be merged at once with at
+    // least minBuffer bytes of buffer each, after the output buffer.
+    size_t mergeBudget = memory.available() - textBytes;
+    size_t maxFanIn = 2;
+    while (external_merge_memory(maxFanIn + 1, minBuffer / sizeof(int)) <= mergeBudget)
+        maxFanIn++;
+
+    if (external_merge_memory(2, minBuffer / sizeof(int)) > mergeBudget)
+        throw std::invalid_argument("external_sort: memory budget is too small");
+
+    // Merge groups of runs into longer runs until they can all be merged at
+    // once.
+    while (runs.runs.size() > maxFanIn) {
+        external_run_list merged;
+
+        for (size_t start = 0; start < runs.runs.size(); start += maxFanIn) {
+            size_t k = std::min(maxFanIn, runs.runs.size() - start);
+
+            external_file* run = new external_file(options.tempDirectory);
+            merged.runs.push_back(run);
+
+            external_buffer<int> outBuffer(memory, textBytes / sizeof(int));
+            external_run_writer writer(*run, outBuffer.data, outBuffer.count);
+            external_merge(&runs.runs[start], k, writer, memory);
+        }
+
+        runs.runs.swap(merged.runs);
+        stats.numMergePasses++;
+    }
+
+    {
+        external_file output(outputPath, "wb");
+        external_buffer<char> outBuffer(memory, textBytes);
+        external_text_writer writer(output, outBuffer.data, outBuffer.count);
+        external_merge(&runs.runs[0], runs.runs.size(), writer, memory);
+        stats.numMergePasses++;
+    }
+
+    stats.peakMemory = memory.peak();
+    return stats;
+}
+
+}  // namespace rtl
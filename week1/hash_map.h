@@ -0,0 +1,962 @@
+// Open addressing hash tables: hash_map and hash_set.
+//
+// The layout is the one SwissTable made popular. Each slot has a control
+// byte: 7 bits of its key's hash when it's full, or a marker for empty or
+// deleted. Lookups compare the 7 bits against a group of 16 control bytes at
+// once (with SSE2 where there is some), so they only look at keys whose bits
+// match, which is nearly always just the right one. Probing moves from
+// group to group. Slots and control bytes live in rtl::vectors.
+//
+// Iterators and pointers to elements are invalidated by anything that
+// makes the table grow, as with vector.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "vector.h"
+
+namespace rtl {
+
+// Spread the bits of a hash around, so both the 7 bits kept in the control
+// byte and the bits that pick the group depend on all of it. std::hash of an
+// integer is usually the integer itself.
+inline uint64_t hash_mix(uint64_t x)
+{
+    x *= 0x9e3779b97f4a7c15ull;
+    return x ^ (x >> 32);
+}
+
+// Hash of a run of bytes, 8 at a time.
+inline uint64_t hash_bytes(const void* data, size_t size)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t h = 0xcbf29ce484222325ull ^ size;
+    for (; size >= 8; size -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        h = (h ^ word) * 0x100000001b3ull;
+        h ^= h >> 29;
+    }
+    if (size > 0) {
+        uint64_t word = 0;
+        memcpy(&word, p, size);
+        h = (h ^ word) * 0x100000001b3ull;
+    }
+    return hash_mix(h);
+}
+
+// The default hash for the tables: std::hash, mixed. Strings are hashed as
+// bytes, and can be looked up by anything with the same characters (a
+// const char*, say) without making a std::string.
+template <typename T>
+struct hash {
+    size_t operator()(T const& x) const
+    {
+        return size_t(hash_mix(std::hash<T>()(x)));
+    }
+};
+
+template <>
+struct hash<std::string> {
+    typedef void is_transparent;
+
+    size_t operator()(std::string const& s) const
+    {
+        return size_t(hash_bytes(s.data(), s.size()));
+    }
+
+    size_t operator()(const char* s) const
+    {
+        return size_t(hash_bytes(s, strlen(s)));
+    }
+};
+
+// std::equal_to, except that strings compare against const char* without
+// converting.
+template <typename T>
+struct equal_to : std::equal_to<T> {};
+
+template <>
+struct equal_to<std::string> {
+    typedef void is_transparent;
+
+    bool operator()(std::string const& a, std::string const& b) const
+    {
+        return a == b;
+    }
+
+    bool operator()(std::string const& a, const char* b) const
+    {
+        return a == b;
+    }
+
+    bool operator()(const char* a, std::string const& b) const
+    {
+        return b == a;
+    }
+};
+
+// Control bytes. Full slots hold the low 7 bits of their hash, so every
+// special value is negative.
+typedef int8_t hash_ctrl;
+const hash_ctrl hash_ctrl_empty = -128;
+const hash_ctrl hash_ctrl_deleted = -2;
+
+// The 16 control bytes starting at some slot, and which of them match what.
+// Masks have bit i set for byte i.
+class hash_group {
+public:
+    static const size_t width = 16;
+
+    explicit hash_group(const hash_ctrl* ctrl)
+    {
+#if defined(__SSE2__)
+        _ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+#else
+        memcpy(_ctrl, ctrl, width);
+#endif
+    }
+
+    uint32_t match(hash_ctrl h2) const
+    {
+#if defined(__SSE2__)
+        return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), _ctrl)));
+#else
+        uint32_t mask = 0;
+        for (size_t i=0; i < width; i++)
+            mask |= uint32_t(_ctrl[i] == h2) << i;
+        return mask;
+#endif
+    }
+
+    uint32_t match_empty() const
+    {
+        return match(hash_ctrl_empty);
+    }
+
+    // Empty and deleted are the only negative bytes.
+    uint32_t match_empty_or_deleted() const
+    {
+#if defined(__SSE2__)
+        return uint32_t(_mm_movemask_epi8(_ctrl));
+#else
+        uint32_t mask = 0;
+        for (size_t i=0; i < width; i++)
+            mask |= uint32_t(_ctrl[i] < 0) << i;
+        return mask;
+#endif
+    }
+
+private:
+#if defined(__SSE2__)
+    __m128i _ctrl;
+#else
+    hash_ctrl _ctrl[width];
+#endif
+};
+
+// Where the probe for a hash goes: the group starting at its slot, then
+// 16, 48, 96, ... slots on (wrapping around). With a power of two slots,
+// that comes to every group before it repeats.
+class hash_probe {
+public:
+    hash_probe(size_t hash, size_t mask)
+      : _mask(mask), _offset(hash & mask), _step(0)
+    {}
+
+    size_t offset() const
+    {
+        return _offset;
+    }
+
+    size_t offset(size_t i) const
+    {
+        return (_offset + i) & _mask;
+    }
+
+    void next()
+    {
+        _step += hash_group::width;
+        _offset = (_offset + _step) & _mask;
+    }
+
+private:
+    size_t _mask;
+    size_t _offset;
+    size_t _step;
+};
+
+// Moves 'from' into the raw memory at 'to' and destroys it, for growing the
+// table. A map's keys are const to users, but the table can still move them
+// out of an element that's about to be destroyed.
+template <typename T>
+void hash_relocate(T* to, T& from)
+{
+    new (to) T(std::move(from));
+    from.~T();
+}
+
+template <typename K, typename V>
+void hash_relocate(std::pair<const K, V>* to, std::pair<const K, V>& from)
+{
+    new (to) std::pair<const K, V>(std::move(const_cast<K&>(from.first)), std::move(from.second));
+    from.~pair();
+}
+
+template <typename K>
+struct hash_set_policy {
+    typedef K key_type;
+    typedef K value_type;
+
+    static K const& key(K const& k)
+    {
+        return k;
+    }
+};
+
+template <typename K, typename V>
+struct hash_map_policy {
+    typedef K key_type;
+    typedef std::pair<const K, V> value_type;
+
+    static K const& key(value_type const& kv)
+    {
+        return kv.first;
+    }
+};
+
+// The table hash_map and hash_set share. 'Policy' says what's stored and
+// how to get its key.
+//
+// There are always at least 16 slots (or none), a power of two, and at most
+// 7/8 of them are used; the table doubles when an insert would take it
+// over. After the last slot come copies of the first 15 control bytes, so a
+// group can be read starting at any slot.
+//
+// Erasing leaves a "deleted" marker only if a probe could have gone past
+// the slot while it was full: if the 16 slots on either side of it have no
+// empty slot within one group's width, some group around it was full, and
+// a probe may have carried on past it. Otherwise the slot just goes back to
+// empty. Deleted slots are reused by inserts, and all of them are cleared
+// out when the table grows.
+template <typename Policy, typename Hash, typename Eq, typename Alloc>
+class hash_table {
+public:
+    typedef typename Policy::key_type key_type;
+    typedef typename Policy::value_type value_type;
+    typedef Hash hasher;
+    typedef Eq key_equal;
+    typedef Alloc allocator_type;
+    typedef size_t size_type;
+
+private:
+    typedef std::allocator_traits<Alloc> alloc_traits;
+    typedef typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type slot_type;
+    typedef typename alloc_traits::template rebind_alloc<slot_type> SlotAlloc;
+    typedef typename alloc_traits::template rebind_alloc<hash_ctrl> CtrlAlloc;
+
+    // Lookups with other types of key need a hash and equality that take
+    // them.
+    template <typename K>
+    struct transparent_key {
+        template <typename H, typename E, typename = typename H::is_transparent,
+                  typename = typename E::is_transparent>
+        static K const& pick(int);
+
+        template <typename H, typename E>
+        static key_type const& pick(...);
+
+        typedef typename std::decay<decltype(pick<Hash, Eq>(0))>::type type;
+    };
+
+public:
+    template <typename V>
+    class basic_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename std::remove_const<V>::type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+        basic_iterator()
+          : _ctrl(NULL), _end(NULL), _slot(NULL)
+        {}
+
+        template <typename U, typename = typename std::enable_if<std::is_convertible<U*, V*>::value>::type>
+        basic_iterator(basic_iterator<U> const& it)
+          : _ctrl(it._ctrl), _end(it._end), _slot(it._slot)
+        {}
+
+        reference operator*() const
+        {
+            return *reinterpret_cast<V*>(_slot);
+        }
+
+        pointer operator->() const
+        {
+            return reinterpret_cast<V*>(_slot);
+        }
+
+        basic_iterator& operator++()
+        {
+            ++_ctrl;
+            ++_slot;
+            skip_empty();
+            return *this;
+        }
+
+        basic_iterator operator++(int)
+        {
+            basic_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator==(basic_iterator const& other) const
+        {
+            return _ctrl == other._ctrl;
+        }
+
+        bool operator!=(basic_iterator const& other) const
+        {
+            return _ctrl != other._ctrl;
+        }
+
+    private:
+        friend class hash_table;
+        template <typename U> friend class basic_iterator;
+
+        basic_iterator(const hash_ctrl* ctrl, const hash_ctrl* end, slot_type const* slot)
+          : _ctrl(ctrl), _end(end), _slot(const_cast<slot_type*>(slot))
+        {}
+
+        void skip_empty()
+        {
+            while (_ctrl != _end && *_ctrl < 0) {
+                ++_ctrl;
+                ++_slot;
+            }
+        }
+
+        const hash_ctrl* _ctrl;
+        const hash_ctrl* _end;
+        slot_type* _slot;
+    };
+
+    typedef basic_iterator<value_type> iterator;
+    typedef basic_iterator<const value_type> const_iterator;
+
+    explicit hash_table(size_t n = 0, Hash const& h = Hash(), Eq const& eq = Eq(),
+                        Alloc const& alloc = Alloc())
+      : _hash(h), _eq(eq), _alloc(alloc), _ctrl(CtrlAlloc(alloc)), _slots(SlotAlloc(alloc)),
+        _size(0), _growthLeft(0)
+    {
+        reserve(n);
+    }
+
+    hash_table(hash_table const& other)
+      : _hash(other._hash), _eq(other._eq),
+        _alloc(alloc_traits::select_on_container_copy_construction(other._alloc)),
+        _ctrl(CtrlAlloc(_alloc)), _slots(SlotAlloc(_alloc)), _size(0), _growthLeft(0)
+    {
+        reserve(other.size());
+        for (const_iterator it = other.begin(); it != other.end(); ++it)
+            insert_unique(*it);
+    }
+
+    hash_table(hash_table&& other)
+      : _hash(other._hash), _eq(other._eq), _alloc(other._alloc),
+        _ctrl(std::move(other._ctrl)), _slots(std::move(other._slots)),
+        _size(other._size), _growthLeft(other._growthLeft)
+    {
+        other._size = 0;
+        other._growthLeft = 0;
+    }
+
+    hash_table& operator=(hash_table const& rhs)
+    {
+        if (this != &rhs) {
+            hash_table copy(rhs);
+            swap(copy);
+        }
+        return *this;
+    }
+
+    hash_table& operator=(hash_table&& rhs)
+    {
+        if (this != &rhs) {
+            clear();
+            swap(rhs);
+        }
+        return *this;
+    }
+
+    ~hash_table()
+    {
+        destroy_all();
+    }
+
+    iterator begin()
+    {
+        iterator it(_ctrl.begin(), ctrl_end(), _slots.begin());
+        it.skip_empty();
+        return it;
+    }
+
+    const_iterator begin() const
+    {
+        const_iterator it(_ctrl.begin(), ctrl_end(), _slots.begin());
+        it.skip_empty();
+        return it;
+    }
+
+    iterator end()
+    {
+        return iterator(ctrl_end(), ctrl_end(), _slots.end());
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(ctrl_end(), ctrl_end(), _slots.end());
+    }
+
+    size_type size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    // The number of slots. Up to 7/8 of them get used before the table
+    // grows.
+    size_type capacity() const
+    {
+        return _slots.size();
+    }
+
+    float load_factor() const
+    {
+        return capacity() == 0 ? 0.0f : float(_size) / float(capacity());
+    }
+
+    float max_load_factor() const
+    {
+        return 7.0f / 8.0f;
+    }
+
+    hasher hash_function() const
+    {
+        return _hash;
+    }
+
+    key_equal key_eq() const
+    {
+        return _eq;
+    }
+
+    allocator_type get_allocator() const
+    {
+        return _alloc;
+    }
+
+    // Make room for 'n' elements in all, so that inserting up to there
+    // doesn't rehash.
+    void reserve(size_t n)
+    {
+        if (n > _size + _growthLeft)
+            resize(capacity_for(n));
+    }
+
+    // Keeps the slots, for filling up again.
+    void clear()
+    {
+        destroy_all();
+    }
+
+    void swap(hash_table& other)
+    {
+        std::swap(_hash, other._hash);
+        std::swap(_eq, other._eq);
+        std::swap(_alloc, other._alloc);
+        _ctrl.swap(other._ctrl);
+        _slots.swap(other._slots);
+        std::swap(_size, other._size);
+        std::swap(_growthLeft, other._growthLeft);
+    }
+
+    template <typename K, typename KeyArg = typename transparent_key<K>::type>
+    iterator find(K const& key)
+    {
+        size_t slot = find_slot(static_cast<KeyArg const&>(key));
+        return slot == not_found() ? end() : iterator_at(slot);
+    }
+
+    template <typename K, typename KeyArg = typename transparent_key<K>::type>
+    const_iterator find(K const& key) const
+    {
+        size_t slot = find_slot(static_cast<KeyArg const&>(key));
+        return slot == not_found() ? end() : const_iterator_at(slot);
+    }
+
+    template <typename K, typename KeyArg = typename transparent_key<K>::type>
+    bool contains(K const& key) const
+    {
+        return find_slot(static_cast<KeyArg const&>(key)) != not_found();
+    }
+
+    template <typename K, typename KeyArg = typename transparent_key<K>::type>
+    size_type count(K const& key) const
+    {
+        return contains<K, KeyArg>(key) ? 1 : 0;
+    }
+
+    // Insert an element with the key 'key', built from 'args', unless
+    // there's one already. Returns where it is, and whether it's new.
+    template <typename K, typename... Args>
+    std::pair<iterator, bool> emplace_key(K const& key, Args&&... args)
+    {
+        size_t h = _hash(key);
+        size_t slot = find_slot(key, h);
+        if (slot != not_found())
+            return std::make_pair(iterator_at(slot), false);
+
+        slot = prepare_insert(h);
+        new (&_slots[slot]) value_type(std::forward<Args>(args)...);
+        return std::make_pair(iterator_at(slot), true);
+    }
+
+    template <typename K, typename KeyArg = typename transparent_key<K>::type>
+    size_type erase(K const& key)
+    {
+        size_t slot = find_slot(static_cast<KeyArg const&>(key));
+        if (slot == not_found())
+            return 0;
+        erase_slot(slot);
+        return 1;
+    }
+
+    // Returns the next element, like other containers. Finding it may have
+    // to skip over empty slots; erase_no_next() doesn't.
+    iterator erase(iterator it)
+    {
+        return erase(const_iterator(it));
+    }
+
+    iterator erase(const_iterator it)
+    {
+        iterator next(it._ctrl, it._end, it._slot);
+        erase_no_next(it);
+        ++next;
+        return next;
+    }
+
+    void erase_no_next(const_iterator it)
+    {
+        erase_slot(it._slot - _slots.begin());
+    }
+
+    // Insert every element of [first, last) that isn't already in the
+    // table. Goes 16 elements at a time: hash them all, prefetch the groups
+    // they go to, then insert them, by which time those groups are on their
+    // way into the cache. Room for a whole batch is made up front, so the
+    // table can't move in the middle of one. (Not for the whole input,
+    // which may be mostly repeats.)
+    template <typename Iter, typename KeyFn, typename MakeFn>
+    void insert_bulk(Iter first, Iter last, KeyFn keyFn, MakeFn make)
+    {
+        const size_t batchSize = 16;
+        size_t hashes[batchSize];
+
+        while (first != last) {
+            size_t n = std::min(batchSize, size_t(last - first));
+            reserve(_size + n);
+            for (size_t i=0; i < n; i++) {
+                hashes[i] = _hash(keyFn(first[i]));
+                __builtin_prefetch(&_ctrl[hashes[i] >> 7 & (capacity() - 1)]);
+            }
+            for (size_t i=0; i < n; i++) {
+                auto const& key = keyFn(first[i]);
+                if (find_slot(key, hashes[i]) == not_found()) {
+                    size_t slot = prepare_insert(hashes[i]);
+                    new (&_slots[slot]) value_type(make(first[i]));
+                }
+            }
+            first += n;
+        }
+    }
+
+protected:
+    value_type& value_at(size_t slot)
+    {
+        return *reinterpret_cast<value_type*>(&_slots[slot]);
+    }
+
+    iterator iterator_at(size_t slot)
+    {
+        return iterator(&_ctrl[slot], ctrl_end(), &_slots[slot]);
+    }
+
+    const_iterator const_iterator_at(size_t slot) const
+    {
+        return const_iterator(&_ctrl[slot], ctrl_end(), &_slots[slot]);
+    }
+
+    static size_t not_found()
+    {
+        return size_t(-1);
+    }
+
+    template <typename K>
+    size_t find_slot(K const& key) const
+    {
+        return find_slot(key, _hash(key));
+    }
+
+    // The slot holding 'key', or not_found(). Stops at the first group with
+    // an empty slot, since an insert would have stopped there too.
+    template <typename K>
+    size_t find_slot(K const& key, size_t h) const
+    {
+        if (_slots.empty())
+            return not_found();
+
+        hash_ctrl h2 = hash_ctrl(h & 0x7f);
+        hash_probe probe(h >> 7, capacity() - 1);
+        while (true) {
+            hash_group group(&_ctrl[probe.offset()]);
+            for (uint32_t match = group.match(h2); match != 0; match &= match - 1) {
+                size_t slot = probe.offset(__builtin_ctz(match));
+                if (_eq(Policy::key(*reinterpret_cast<value_type const*>(&_slots[slot])), key))
+                    return slot;
+            }
+            if (group.match_empty() != 0)
+                return not_found();
+            probe.next();
+        }
+    }
+
+    // Claim a slot for a new element with hash 'h', growing first if need
+    // be. The caller constructs the element there.
+    size_t prepare_insert(size_t h)
+    {
+        if (_slots.empty())
+            grow();
+
+        size_t slot = find_non_full(h);
+        if (_growthLeft == 0 && _ctrl[slot] != hash_ctrl_deleted) {
+            grow();
+            slot = find_non_full(h);
+        }
+
+        if (_ctrl[slot] != hash_ctrl_deleted)
+            _growthLeft--;
+        set_ctrl(slot, hash_ctrl(h & 0x7f));
+        _size++;
+        return slot;
+    }
+
+    void insert_unique(value_type const& x)
+    {
+        size_t h = _hash(Policy::key(x));
+        size_t slot = prepare_insert(h);
+        new (&_slots[slot]) value_type(x);
+    }
+
+private:
+    const hash_ctrl* ctrl_end() const
+    {
+        return _ctrl.begin() + capacity();
+    }
+
+    // Enough slots for 'n' elements, at 7/8 full.
+    static size_t capacity_for(size_t n)
+    {
+        if (n == 0)
+            return 0;
+        size_t capacity = hash_group::width;
+        while (capacity - capacity / 8 < n)
+            capacity *= 2;
+        return capacity;
+    }
+
+    // Set a control byte, and its copy past the end if it has one.
+    void set_ctrl(size_t slot, hash_ctrl c)
+    {
+        _ctrl[slot] = c;
+        if (slot < hash_group::width - 1)
+            _ctrl[capacity() + slot] = c;
+    }
+
+    // The first empty or deleted slot on the probe for 'h'. There's always
+    // one, since the table is never full.
+    size_t find_non_full(size_t h) const
+    {
+        hash_probe probe(h >> 7, capacity() - 1);
+        while (true) {
+            uint32_t mask = hash_group(&_ctrl[probe.offset()]).match_empty_or_deleted();
+            if (mask != 0)
+                return probe.offset(__builtin_ctz(mask));
+            probe.next();
+        }
+    }
+
+    void erase_slot(size_t slot)
+    {
+        value_at(slot).~value_type();
+        _size--;
+
+        size_t mask = capacity() - 1;
+        uint32_t emptyAfter = hash_group(&_ctrl[slot]).match_empty();
+        uint32_t emptyBefore = hash_group(&_ctrl[(slot - hash_group::width) & mask]).match_empty();
+        bool wasNeverFull = emptyBefore != 0 && emptyAfter != 0 &&
+            size_t(__builtin_ctz(emptyAfter)) + size_t(__builtin_clz(emptyBefore) - 16) < hash_group::width;
+
+        if (wasNeverFull) {
+            set_ctrl(slot, hash_ctrl_empty);
+            _growthLeft++;
+        } else {
+            set_ctrl(slot, hash_ctrl_deleted);
+        }
+    }
+
+    // Out of room: double, or if enough of the used slots are only deleted
+    // markers, rehash at the same size to clear them out.
+    void grow()
+    {
+        size_t capacity = this->capacity();
+        if (capacity == 0)
+            resize(hash_group::width);
+        else if (_size <= (capacity - capacity / 8) / 2)
+            resize(capacity);
+        else
+            resize(capacity * 2);
+    }
+
+    void resize(size_t newCapacity)
+    {
+        vector<hash_ctrl, CtrlAlloc> oldCtrl((CtrlAlloc(_alloc)));
+        vector<slot_type, SlotAlloc> oldSlots((SlotAlloc(_alloc)));
+        oldCtrl.swap(_ctrl);
+        oldSlots.swap(_slots);
+        size_t oldCapacity = oldSlots.size();
+
+        _ctrl.resize(newCapacity + hash_group::width - 1, hash_ctrl_empty);
+        _slots.resize(newCapacity);
+        _growthLeft = newCapacity - newCapacity / 8 - _size;
+
+        for (size_t i=0; i < oldCapacity; i++) {
+            if (oldCtrl[i] < 0)
+                continue;
+            value_type& x = *reinterpret_cast<value_type*>(&oldSlots[i]);
+            size_t h = _hash(Policy::key(x));
+            size_t slot = find_non_full(h);
+            set_ctrl(slot, hash_ctrl(h & 0x7f));
+            hash_relocate(reinterpret_cast<value_type*>(&_slots[slot]), x);
+        }
+    }
+
+    void destroy_all()
+    {
+        for (size_t i=0; i < capacity(); i++) {
+            if (_ctrl[i] >= 0)
+                value_at(i).~value_type();
+        }
+        std::fill(_ctrl.begin(), _ctrl.end(), hash_ctrl_empty);
+        _size = 0;
+        _growthLeft = capacity() - capacity() / 8;
+    }
+
+    Hash _hash;
+    Eq _eq;
+    Alloc _alloc;
+    vector<hash_ctrl, CtrlAlloc> _ctrl;
+    vector<slot_type, SlotAlloc> _slots;
+    size_t _size;
+    size_t _growthLeft;   // Empty slots that can be filled before growing.
+};
+
+// A set of unique keys.
+template <typename K, typename Hash = hash<K>, typename Eq = equal_to<K>,
+          typename Alloc = std::allocator<K> >
+class hash_set : public hash_table<hash_set_policy<K>, Hash, Eq, Alloc> {
+    typedef hash_table<hash_set_policy<K>, Hash, Eq, Alloc> table;
+
+public:
+    typedef typename table::iterator iterator;
+    typedef typename table::const_iterator const_iterator;
+
+    explicit hash_set(size_t n = 0, Hash const& h = Hash(), Eq const& eq = Eq(),
+                      Alloc const& alloc = Alloc())
+      : table(n, h, eq, alloc)
+    {}
+
+    // The distinct keys of 'keys'.
+    explicit hash_set(vector<K> const& keys)
+    {
+        insert(keys);
+    }
+
+    std::pair<iterator, bool> insert(K const& key)
+    {
+        return this->emplace_key(key, key);
+    }
+
+    std::pair<iterator, bool> insert(K&& key)
+    {
+        return this->emplace_key(key, std::move(key));
+    }
+
+    void insert(vector<K> const& keys)
+    {
+        this->insert_bulk(keys.begin(), keys.end(), identity(), identity());
+    }
+
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    void insert(I first, I last)
+    {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+
+private:
+    struct identity {
+        K const& operator()(K const& k) const
+        {
+            return k;
+        }
+    };
+};
+
+// A map from unique keys to values. Elements are std::pair<const K, V>.
+template <typename K, typename V, typename Hash = hash<K>, typename Eq = equal_to<K>,
+          typename Alloc = std::allocator<std::pair<const K, V> > >
+class hash_map : public hash_table<hash_map_policy<K, V>, Hash, Eq, Alloc> {
+    typedef hash_table<hash_map_policy<K, V>, Hash, Eq, Alloc> table;
+
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef typename table::value_type value_type;
+    typedef typename table::iterator iterator;
+    typedef typename table::const_iterator const_iterator;
+
+    explicit hash_map(size_t n = 0, Hash const& h = Hash(), Eq const& eq = Eq(),
+                      Alloc const& alloc = Alloc())
+      : table(n, h, eq, alloc)
+    {}
+
+    std::pair<iterator, bool> insert(value_type const& kv)
+    {
+        return this->emplace_key(kv.first, kv);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& kv)
+    {
+        return this->emplace_key(kv.first, std::move(kv));
+    }
+
+    // Insert (key, V(args...)) unless the key is there already, in which
+    // case nothing is built or moved.
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(K const& key, Args&&... args)
+    {
+        return this->emplace_key(key, std::piecewise_construct, std::forward_as_tuple(key),
+                                 std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args)
+    {
+        return this->emplace_key(key, std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+                                 std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+
+    V& operator[](K const& key)
+    {
+        return try_emplace(key).first->second;
+    }
+
+    V& operator[](K&& key)
+    {
+        return try_emplace(std::move(key)).first->second;
+    }
+
+    template <typename Key>
+    V& at(Key const& key)
+    {
+        iterator it = this->find(key);
+        if (it == this->end())
+            throw std::out_of_range("hash_map::at: no such key");
+        return it->second;
+    }
+
+    template <typename Key>
+    V const& at(Key const& key) const
+    {
+        const_iterator it = this->find(key);
+        if (it == this->end())
+            throw std::out_of_range("hash_map::at: no such key");
+        return it->second;
+    }
+
+    // Map keys[i] to values[i], for every key not already in the map. The
+    // first of any duplicate keys wins, as with insert().
+    void insert(vector<K> const& keys, vector<V> const& values)
+    {
+        if (values.size() != keys.size())
+            throw std::invalid_argument("hash_map::insert: keys and values differ in length");
+
+        const V* valueBase = values.begin();
+        const K* keyBase = keys.begin();
+        this->insert_bulk(keys.begin(), keys.end(), identity(), [&](K const& k) {
+            return value_type(k, valueBase[&k - keyBase]);
+        });
+    }
+
+    // Map every distinct key in 'keys' to where it first appears: an index
+    // for joining against them.
+    void insert_positions(vector<K> const& keys)
+    {
+        const K* keyBase = keys.begin();
+        this->insert_bulk(keys.begin(), keys.end(), identity(), [&](K const& k) {
+            return value_type(k, V(&k - keyBase));
+        });
+    }
+
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    void insert(I first, I last)
+    {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+
+private:
+    struct identity {
+        K const& operator()(K const& k) const
+        {
+            return k;
+        }
+    };
+};
+
+}  // namespace rtl
@@ -0,0 +1,262 @@
+// Sorting through 32-bit indices, for elements that are expensive to move:
+// sort the indices, then move every element once, straight to where it
+// belongs.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "radix_sort.h"
+#include "sort.h"
+#include "vector.h"
+
+namespace rtl {
+
+// Compares indices by the keys they point at.
+template <typename KeyIter, typename Comp>
+struct index_compare {
+    KeyIter keys;
+    Comp comp;
+
+    index_compare(KeyIter k, Comp c) : keys(k), comp(c) {}
+
+    bool operator()(uint32_t a, uint32_t b) const
+    {
+        return comp(keys[a], keys[b]);
+    }
+};
+
+// Sort the indices in [first, last) by the keys they point at in the column
+// 'keys', so keys[first[0]], keys[first[1]], ... come out in order. Only the
+// indices move. Stable: indices with equal keys keep their order.
+template <typename IndexIter, typename KeyIter, typename Comp>
+void sort_by(IndexIter first, IndexIter last, KeyIter keys, Comp comp)
+{
+    mergesort(first, last, index_compare<KeyIter, Comp>(keys, comp));
+}
+
+// The permutation that sorts [first, last): element perm[0] comes first, then
+// perm[1], and so on. Equal elements keep their order. Throws
+// std::length_error for ranges of 2^32 elements or more.
+template <typename Iter, typename Comp>
+vector<uint32_t> argsort(Iter first, Iter last, Comp comp)
+{
+    size_t count = last - first;
+    if (count > size_t(uint32_t(-1)))
+        throw std::length_error("argsort: too many elements for 32-bit indices");
+
+    vector<uint32_t> perm;
+    perm.reserve(count);
+    for (size_t i=0; i < count; i++)
+        perm.push_back(uint32_t(i));
+
+    sort_by(perm.begin(), perm.end(), first, comp);
+    return perm;
+}
+
+// Rearrange [first, last) so that element i is the one that was at perm[i],
+// as returned by argsort. Follows each cycle of the permutation, so every
+// element is moved once (plus one extra move per cycle, through a
+// temporary). 'perm' is left as it is, so it can be applied to several
+// columns; a bitmap tracks what's been placed.
+template <typename Iter>
+void apply_permutation(Iter first, Iter last, vector<uint32_t> const& perm)
+{
+    typedef typename std::iterator_traits<Iter>::value_type T;
+
+    size_t count = last - first;
+    vector<uint64_t> placed((count + 63) / 64, 0);
+
+    for (size_t start = 0; start < count; start++) {
+        if ((placed[start / 64] >> (start % 64)) & 1)
+            continue;
+        if (perm[start] == start)
+            continue;
+
+        // Pull each element into the hole left by the previous one, until
+        // the cycle comes back around to the start.
+        T value = std::move(first[start]);
+        size_t hole = start;
+        while (true) {
+            size_t from = perm[hole];
+            placed[hole / 64] |= uint64_t(1) << (hole % 64);
+            if (from == start)
+                break;
+            first[hole] = std::move(first[from]);
+            hole = from;
+        }
+        first[hole] = std::move(value);
+    }
+}
+
+// Sort [first, last) by sorting indices, then moving each element into place
+// once. Worth it when elements are big, or slow to move. Stable.
+template <typename Iter, typename Comp>
+void indirect_sort(Iter first, Iter last, Comp comp)
+{
+    vector<uint32_t> perm = argsort(first, last, comp);
+    apply_permutation(first, last, perm);
+}
+
+// An element's key, and where the element was.
+template <typename Key>
+struct keyed_index {
+    Key key;
+    uint32_t index;
+};
+
+// A string key, with its first 8 bytes packed into a number that compares
+// the same way, so most comparisons never look at the string itself.
+struct string_keyed_index {
+    std::string key;
+    uint64_t prefix;
+    uint32_t index;
+};
+
+// The first 8 bytes of 's' as a big-endian number, padded with zeros. If one
+// string's prefix is less than another's, so is the string.
+inline uint64_t string_key_prefix(std::string const& s)
+{
+    return string_chunk(s, 0);
+}
+
+struct string_keyed_less {
+    bool operator()(string_keyed_index const& a, string_keyed_index const& b) const
+    {
+        if (a.prefix != b.prefix)
+            return a.prefix < b.prefix;
+        return a.key < b.key;
+    }
+};
+
+template <typename Key>
+struct keyed_less {
+    bool operator()(keyed_index<Key> const& a, keyed_index<Key> const& b) const
+    {
+        return a.key < b.key;
+    }
+};
+
+struct keyed_radix_key {
+    template <typename Key>
+    Key operator()(keyed_index<Key> const& k) const
+    {
+        return k.key;
+    }
+};
+
+// Sort the keys of sort_by_key, then read off the permutation. Numbers are
+// radix sorted, which is stable anyway.
+template <typename Key>
+vector<uint32_t> sort_keyed(vector<keyed_index<Key> >& keyed, bool, std::true_type)
+{
+    radix_sort(keyed.begin(), keyed.end(), keyed_radix_key());
+
+    vector<uint32_t> perm;
+    perm.reserve(keyed.size());
+    for (size_t i=0; i < keyed.size(); i++)
+        perm.push_back(keyed[i].index);
+    return perm;
+}
+
+template <typename Key>
+vector<uint32_t> sort_keyed(vector<keyed_index<Key> >& keyed, bool stable, std::false_type)
+{
+    if (stable)
+        mergesort(keyed.begin(), keyed.end(), keyed_less<Key>());
+    else
+        quicksort(keyed.begin(), keyed.end(), keyed_less<Key>());
+
+    vector<uint32_t> perm;
+    perm.reserve(keyed.size());
+    for (size_t i=0; i < keyed.size(); i++)
+        perm.push_back(keyed[i].index);
+    return perm;
+}
+
+template <typename Iter, typename KeyFn>
+vector<uint32_t> sort_by_key_perm(Iter first, Iter last, KeyFn keyFn, bool stable, std::string*)
+{
+    size_t count = last - first;
+    vector<string_keyed_index> keyed;
+    keyed.reserve(count);
+    for (size_t i=0; i < count; i++) {
+        string_keyed_index k;
+        k.key = keyFn(first[i]);
+        k.prefix = string_key_prefix(k.key);
+        k.index = uint32_t(i);
+        keyed.push_back(std::move(k));
+    }
+
+    if (stable)
+        mergesort(keyed.begin(), keyed.end(), string_keyed_less());
+    else
+        quicksort(keyed.begin(), keyed.end(), string_keyed_less());
+
+    vector<uint32_t> perm;
+    perm.reserve(count);
+    for (size_t i=0; i < count; i++)
+        perm.push_back(keyed[i].index);
+    return perm;
+}
+
+template <typename Iter, typename KeyFn, typename Key>
+vector<uint32_t> sort_by_key_perm(Iter first, Iter last, KeyFn keyFn, bool stable, Key*)
+{
+    size_t count = last - first;
+    vector<keyed_index<Key> > keyed;
+    keyed.reserve(count);
+    for (size_t i=0; i < count; i++) {
+        keyed_index<Key> k = { keyFn(first[i]), uint32_t(i) };
+        keyed.push_back(std::move(k));
+    }
+
+    // The numbers radix_key() knows how to sort.
+    typedef std::integral_constant<bool,
+        (std::is_integral<Key>::value && !std::is_same<Key, bool>::value) ||
+        std::is_same<Key, float>::value || std::is_same<Key, double>::value> IsNumber;
+    return sort_keyed(keyed, stable, IsNumber());
+}
+
+template <typename Iter, typename KeyFn>
+void sort_by_key_apply(Iter first, Iter last, KeyFn keyFn, bool stable)
+{
+    typedef typename std::decay<decltype(keyFn(*first))>::type Key;
+
+    size_t count = last - first;
+    if (count < 2)
+        return;
+    if (count > size_t(uint32_t(-1)))
+        throw std::length_error("sort_by_key: too many elements for 32-bit indices");
+
+    vector<uint32_t> perm = sort_by_key_perm(first, last, keyFn, stable, (Key*) NULL);
+    apply_permutation(first, last, perm);
+}
+
+// Sort [first, last) by keyFn(element), calling keyFn exactly once per
+// element. The keys go into an array of (key, index) pairs, which gets the
+// fastest sort that fits: radix sort for numbers, a comparison sort on a
+// cached 8-byte prefix for std::strings (with the strings only compared when
+// the prefixes tie), and quicksort or mergesort on the keys for anything
+// else, with operator<. Then the elements are each moved once into place.
+//
+// sort_by_key doesn't promise to keep equal elements in order (though with
+// number keys it does); stable_sort_by_key does.
+template <typename Iter, typename KeyFn>
+void sort_by_key(Iter first, Iter last, KeyFn keyFn)
+{
+    sort_by_key_apply(first, last, keyFn, false);
+}
+
+template <typename Iter, typename KeyFn>
+void stable_sort_by_key(Iter first, Iter last, KeyFn keyFn)
+{
+    sort_by_key_apply(first, last, keyFn, true);
+}
+
+}  // namespace rtl
@@ -0,0 +1,336 @@
+// Counting what containers and sorts do: comparisons, swaps, element copies
+// and moves, reallocations, bytes allocated and recursion depth.
+//
+// vector, quicksort and mergesort take an instrumentation policy as a
+// template parameter. The default, no_instrument, does nothing and compiles
+// away. counting_instrument adds everything up in the current instrument_site,
+// a named set of counters that a scope makes current for its thread:
+//
+//     RTL_INSTRUMENT_SCOPE("load users");
+//     quicksort<counting_instrument>(v.begin(), v.end(), compareUsers);
+//     ...
+//     instrument_report(stderr);
+//
+// Building with RTL_INSTRUMENT defined makes counting_instrument the default
+// everywhere (and RTL_INSTRUMENT_SCOPE does nothing without it). Counting
+// uses relaxed atomics, cheap enough to leave in a staging build.
+//
+// Numbers that quicksort and mergesort hand to the SIMD kernels aren't
+// counted, since they never call the comparator.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+namespace rtl {
+
+struct instrument_counts {
+    uint64_t comparisons;
+    uint64_t swaps;
+    uint64_t copies;
+    uint64_t moves;
+    uint64_t reallocations;
+    uint64_t bytesAllocated;
+    uint64_t maxDepth;
+};
+
+// One set of counters, usually for one place in the code. Sites add
+// themselves to a global list when they're created, for instrument_report().
+class instrument_site {
+public:
+    instrument_site(const char* name, const char* file = "", int line = 0)
+      : _name(name), _file(file), _line(line)
+    {
+        reset();
+
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        _next = registry();
+        registry() = this;
+    }
+
+    ~instrument_site()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        for (instrument_site** p = &registry(); *p != NULL; p = &(*p)->_next) {
+            if (*p == this) {
+                *p = _next;
+                break;
+            }
+        }
+    }
+
+    const char* name() const
+    {
+        return _name;
+    }
+
+    // Where the site is, if it has a place in the code.
+    const char* file() const
+    {
+        return _file;
+    }
+
+    int line() const
+    {
+        return _line;
+    }
+
+    instrument_counts counts() const
+    {
+        instrument_counts c;
+        c.comparisons = _comparisons.load(std::memory_order_relaxed);
+        c.swaps = _swaps.load(std::memory_order_relaxed);
+        c.copies = _copies.load(std::memory_order_relaxed);
+        c.moves = _moves.load(std::memory_order_relaxed);
+        c.reallocations = _reallocations.load(std::memory_order_relaxed);
+        c.bytesAllocated = _bytesAllocated.load(std::memory_order_relaxed);
+        c.maxDepth = _maxDepth.load(std::memory_order_relaxed);
+        return c;
+    }
+
+    void reset()
+    {
+        _comparisons = 0;
+        _swaps = 0;
+        _copies = 0;
+        _moves = 0;
+        _reallocations = 0;
+        _bytesAllocated = 0;
+        _maxDepth = 0;
+    }
+
+    void add_comparisons(uint64_t n)  { _comparisons.fetch_add(n, std::memory_order_relaxed); }
+    void add_swaps(uint64_t n)        { _swaps.fetch_add(n, std::memory_order_relaxed); }
+    void add_copies(uint64_t n)       { _copies.fetch_add(n, std::memory_order_relaxed); }
+    void add_moves(uint64_t n)        { _moves.fetch_add(n, std::memory_order_relaxed); }
+
+    void add_reallocation(uint64_t bytes)
+    {
+        _reallocations.fetch_add(1, std::memory_order_relaxed);
+        _bytesAllocated.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void note_depth(uint64_t depth)
+    {
+        uint64_t seen = _maxDepth.load(std::memory_order_relaxed);
+        while (depth > seen && !_maxDepth.compare_exchange_weak(seen, depth, std::memory_order_relaxed))
+            ;
+    }
+
+    // The site counts go to on this thread: the innermost instrument_scope,
+    // or a catch-all site outside of any.
+    static instrument_site& current()
+    {
+        instrument_site* site = current_pointer();
+        return site != NULL ? *site : unscoped();
+    }
+
+    // Call 'f' on every site that exists.
+    template <typename F>
+    static void for_each(F f)
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        for (instrument_site* site = registry(); site != NULL; site = site->_next)
+            f(*site);
+    }
+
+    static instrument_site*& current_pointer()
+    {
+        static thread_local instrument_site* site = NULL;
+        return site;
+    }
+
+private:
+    instrument_site(instrument_site const&);
+    instrument_site& operator=(instrument_site const&);
+
+    static instrument_site& unscoped()
+    {
+        static instrument_site site("(no scope)");
+        return site;
+    }
+
+    static instrument_site*& registry()
+    {
+        static instrument_site* head = NULL;
+        return head;
+    }
+
+    static std::mutex& registry_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    const char* _name;
+    const char* _file;
+    int _line;
+    instrument_site* _next;
+
+    std::atomic<uint64_t> _comparisons;
+    std::atomic<uint64_t> _swaps;
+    std::atomic<uint64_t> _copies;
+    std::atomic<uint64_t> _moves;
+    std::atomic<uint64_t> _reallocations;
+    std::atomic<uint64_t> _bytesAllocated;
+    std::atomic<uint64_t> _maxDepth;
+};
+
+// Makes 'site' current on this thread until the end of the scope.
+class instrument_scope {
+public:
+    explicit instrument_scope(instrument_site& site)
+      : _previous(instrument_site::current_pointer())
+    {
+        instrument_site::current_pointer() = &site;
+    }
+
+    ~instrument_scope()
+    {
+        instrument_site::current_pointer() = _previous;
+    }
+
+private:
+    instrument_scope(instrument_scope const&);
+    instrument_scope& operator=(instrument_scope const&);
+
+    instrument_site* _previous;
+};
+
+// Print a line for every site that counted anything.
+inline void instrument_report(FILE* out)
+{
+    fprintf(out, "%-24s %12s %10s %10s %12s %8s %14s %6s\n", "site", "comparisons", "swaps",
+            "copies", "moves", "reallocs", "bytes", "depth");
+    instrument_site::current();   // Make sure the catch-all site exists.
+    instrument_site::for_each([out](instrument_site const& site) {
+        instrument_counts c = site.counts();
+        if (c.comparisons + c.swaps + c.copies + c.moves + c.reallocations + c.maxDepth == 0)
+            return;
+        fprintf(out, "%-24s %12llu %10llu %10llu %12llu %8llu %14llu %6llu", site.name(),
+                (unsigned long long) c.comparisons, (unsigned long long) c.swaps,
+                (unsigned long long) c.copies, (unsigned long long) c.moves,
+                (unsigned long long) c.reallocations, (unsigned long long) c.bytesAllocated,
+                (unsigned long long) c.maxDepth);
+        if (site.line() != 0)
+            fprintf(out, "  %s:%d", site.file(), site.line());
+        fprintf(out, "\n");
+    });
+}
+
+// The policy that counts nothing.
+struct no_instrument {
+    static void compare() {}
+    static void swap() {}
+    static void copy(size_t) {}
+    static void move(size_t) {}
+    static void reallocation(size_t) {}
+    static void enter() {}
+    static void leave() {}
+    static void depth(size_t) {}
+};
+
+// The policy that counts into instrument_site::current().
+struct counting_instrument {
+    static void compare()               { instrument_site::current().add_comparisons(1); }
+    static void swap()                  { instrument_site::current().add_swaps(1); }
+    static void copy(size_t n)          { instrument_site::current().add_copies(n); }
+    static void move(size_t n)          { instrument_site::current().add_moves(n); }
+    static void reallocation(size_t n)  { instrument_site::current().add_reallocation(n); }
+
+    // Recursion depth, kept per thread.
+    static void enter()
+    {
+        depth(++current_depth());
+    }
+
+    static void leave()
+    {
+        --current_depth();
+    }
+
+    static void depth(size_t d)
+    {
+        instrument_site::current().note_depth(d);
+    }
+
+private:
+    static size_t& current_depth()
+    {
+        static thread_local size_t depth = 0;
+        return depth;
+    }
+};
+
+#ifdef RTL_INSTRUMENT
+typedef counting_instrument default_instrument;
+
+#define RTL_INSTRUMENT_CONCAT2(a, b) a##b
+#define RTL_INSTRUMENT_CONCAT(a, b) RTL_INSTRUMENT_CONCAT2(a, b)
+#define RTL_INSTRUMENT_SCOPE(name) \
+    static ::rtl::instrument_site RTL_INSTRUMENT_CONCAT(rtlSite, __LINE__)(name, __FILE__, __LINE__); \
+    ::rtl::instrument_scope RTL_INSTRUMENT_CONCAT(rtlScope, __LINE__)(RTL_INSTRUMENT_CONCAT(rtlSite, __LINE__))
+#else
+typedef no_instrument default_instrument;
+
+#define RTL_INSTRUMENT_SCOPE(name) do {} while (0)
+#endif
+
+// A comparator that counts its calls. Sorts wrap theirs in one when they're
+// instrumented, and the helpers find the policy through it (see
+// instrument_swap() and friends), so they don't need a parameter of their own.
+template <typename Comp, typename Instrument>
+struct instrumented_compare {
+    mutable Comp comp;
+
+    explicit instrumented_compare(Comp c) : comp(c) {}
+
+    template <typename A, typename B>
+    bool operator()(A const& a, B const& b) const
+    {
+        Instrument::compare();
+        return comp(a, b);
+    }
+};
+
+template <typename Instrument>
+struct instrument_comparator {
+    template <typename Comp>
+    static instrumented_compare<Comp, Instrument> wrap(Comp comp)
+    {
+        return instrumented_compare<Comp, Instrument>(comp);
+    }
+};
+
+template <>
+struct instrument_comparator<no_instrument> {
+    template <typename Comp>
+    static Comp wrap(Comp comp)
+    {
+        return comp;
+    }
+};
+
+// Hooks for sorting code to call with its comparator. They do nothing unless
+// the comparator is instrumented.
+template <typename Comp> void instrument_swap(Comp const&) {}
+template <typename Comp> void instrument_moves(Comp const&, size_t) {}
+template <typename Comp> void instrument_enter(Comp const&) {}
+template <typename Comp> void instrument_leave(Comp const&) {}
+template <typename Comp> void instrument_depth(Comp const&, size_t) {}
+
+template <typename Comp, typename I>
+void instrument_swap(instrumented_compare<Comp, I> const&) { I::swap(); }
+template <typename Comp, typename I>
+void instrument_moves(instrumented_compare<Comp, I> const&, size_t n) { I::move(n); }
+template <typename Comp, typename I>
+void instrument_enter(instrumented_compare<Comp, I> const&) { I::enter(); }
+template <typename Comp, typename I>
+void instrument_leave(instrumented_compare<Comp, I> const&) { I::leave(); }
+template <typename Comp, typename I>
+void instrument_depth(instrumented_compare<Comp, I> const&, size_t d) { I::depth(d); }
+
+}  // namespace rtl
@@ -0,0 +1,143 @@
+// A tournament tree of losers, for merging many sorted sources at once.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+#include "vector.h"
+
+namespace rtl {
+
+// Keeps track of which of 'k' sources has the smallest current value. Each
+// internal node remembers the loser of the match played there and the
+// winner moves on up, so replacing the winner's value only replays the
+// matches on its own path: log2(k) comparisons, and no swapping around of
+// values like a heap would do.
+//
+// Ties go to the lower numbered source, so merging runs in order is stable.
+template <typename T, typename Comp>
+class loser_tree {
+public:
+    explicit loser_tree(size_t k, Comp comp = Comp())
+      : _comp(comp), _k(k)
+    {
+        _values.resize(k);
+        _exhausted.resize(k, 1);
+        _tree.resize(k, k);
+    }
+
+    size_t size() const
+    {
+        return _k;
+    }
+
+    // Give source 'i' its first value. Call for each source that has one,
+    // then call start().
+    void set(size_t i, T const& value)
+    {
+        _values[i] = value;
+        _exhausted[i] = 0;
+    }
+
+    // Play the initial tournament.
+    void start()
+    {
+        // Every node starts out empty (k). The first source to reach a node
+        // waits there, the second plays it and the winner carries on.
+        for (size_t i=0; i < _k; i++)
+            _tree[i] = _k;
+
+        for (size_t i=0; i < _k; i++) {
+            size_t winner = i;
+            size_t node = (i + _k) / 2;
+            bool waiting = false;
+
+            for (; node > 0; node /= 2) {
+                if (_tree[node] == _k) {
+                    _tree[node] = winner;
+                    waiting = true;
+                    break;
+                }
+                if (beats(_tree[node], winner))
+                    std::swap(_tree[node], winner);
+            }
+
+            if (!waiting)
+                _tree[0] = winner;
+        }
+    }
+
+    // True once every source has run out.
+    bool empty() const
+    {
+        return _k == 0 || _exhausted[_tree[0]];
+    }
+
+    // The source holding the smallest value, and that value.
+    size_t top() const
+    {
+        return _tree[0];
+    }
+
+    T const& top_value() const
+    {
+        return _values[_tree[0]];
+    }
+
+    // Replace the top source's value with its next one.
+    void replace_top(T const& value)
+    {
+        _values[_tree[0]] = value;
+        replay(_tree[0]);
+    }
+
+    // The top source has run out.
+    void pop_top()
+    {
+        _exhausted[_tree[0]] = 1;
+        replay(_tree[0]);
+    }
+
+    // An upper bound on the memory a tree for 'k' sources allocates. (Vectors
+    // round their capacity up to a power of two, at least 8.)
+    static size_t memory_for(size_t k)
+    {
+        size_t capacity = k < 8 ? 8 : k * 2;
+        return capacity * (sizeof(T) + sizeof(char) + sizeof(size_t));
+    }
+
+private:
+    bool beats(size_t a, size_t b) const
+    {
+        if (_exhausted[a])
+            return false;
+        if (_exhausted[b])
+            return true;
+
+        // Ties go to the lower source, so one comparison is enough.
+        if (a < b)
+            return !_comp(_values[b], _values[a]);
+        return _comp(_values[a], _values[b]);
+    }
+
+    void replay(size_t source)
+    {
+        size_t winner = source;
+        for (size_t node = (source + _k) / 2; node > 0; node /= 2) {
+            if (beats(_tree[node], winner))
+                std::swap(_tree[node], winner);
+        }
+        _tree[0] = winner;
+    }
+
+    Comp _comp;
+    size_t _k;
+    vector<T> _values;
+    vector<char> _exhausted;
+
+    // _tree[0] is the overall winner, _tree[1..k-1] are the losers at each
+    // internal node. Source i sits at leaf k + i.
+    vector<size_t> _tree;
+};
+
+}  // namespace rtl
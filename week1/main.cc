@@ -3,13 +3,55 @@
 
 #include "apftest.h"
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
 using namespace std;
 using namespace rtl;
 
+// With no arguments, runs the tests. With --bench, times the benchmarks:
+//
+//   main --bench [--json results.json] [--baseline old.json] [--threshold 0.2]
+//
+// and exits with 1 if any got slower than the baseline by more than the
+// threshold.
 int main(int argc, char **argv) {
   vector<int> v;
 
-  apf_run_tests();
+  if (argc == 1) {
+    apf_run_tests();
+    return 0;
+  }
+
+  apf_bench_options options;
+  bool bench = false;
+  for (int i = 1; i < argc; i++) {
+    const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(argv[i], "--bench") == 0) {
+      bench = true;
+      continue;
+    }
+    if (value == NULL) {
+      fprintf(stderr, "main: %s needs a value\n", argv[i]);
+      return 1;
+    }
+    if (strcmp(argv[i], "--json") == 0)
+      options.jsonPath = value;
+    else if (strcmp(argv[i], "--baseline") == 0)
+      options.baselinePath = value;
+    else if (strcmp(argv[i], "--threshold") == 0)
+      options.threshold = atof(value);
+    else {
+      fprintf(stderr, "main: unknown option %s\n", argv[i]);
+      return 1;
+    }
+    i++;
+  }
 
-  return 0;
+  if (!bench) {
+    fprintf(stderr, "usage: main [--bench [--json PATH] [--baseline PATH] [--threshold FRACTION]]\n");
+    return 1;
+  }
+  return apf_run_benches(options) ? 0 : 1;
 }
@@ -0,0 +1,389 @@
+// Merging sorted ranges: two at a time, K at a time with a loser tree, K at a
+// time across several threads, or lazily, one element at a time.
+//
+// K-way merges take their inputs as a container of ranges, each a std::pair
+// of iterators (first, last), such as a vector of
+// std::make_pair(shard.begin(), shard.end()). All of them are stable: equal
+// elements come out in the order of their ranges. Merging copies elements;
+// ranges of std::move_iterators move them instead.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#include "loser_tree.h"
+#include "thread_pool.h"
+#include "vector.h"
+
+namespace rtl {
+
+// Merges with fewer elements than this in all are done by a single thread.
+const size_t parallel_merge_cutoff = 1 << 16;
+
+// Both kinds of iterator are random access.
+template <typename InLeft, typename InRight>
+struct merge_random_access : std::integral_constant<bool,
+    std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<InLeft>::iterator_category>::value &&
+    std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<InRight>::iterator_category>::value>
+{};
+
+// Store *left or *right in 'out'. When both sides give the same kind of
+// reference, picking one with ?: stays a reference (and compiles to a
+// select); otherwise ?: would make a copy, which would undo a
+// move_iterator, so it's an if.
+template <typename InLeft, typename InRight, typename Out>
+void merge_take(InLeft const& left, InRight const& right, bool takeRight, Out& out, std::true_type)
+{
+    *out = takeRight ? *right : *left;
+}
+
+template <typename InLeft, typename InRight, typename Out>
+void merge_take(InLeft const& left, InRight const& right, bool takeRight, Out& out, std::false_type)
+{
+    if (takeRight)
+        *out = *right;
+    else
+        *out = *left;
+}
+
+// With random access, the loop picks its element and advances its inputs
+// without branching on the comparison, which the CPU couldn't predict anyway.
+template <typename InLeft, typename InRight, typename Out, typename Comp>
+Out merge_loop(InLeft& left, InLeft leftEnd, InRight& right, InRight rightEnd, Out out, Comp comp,
+               std::true_type)
+{
+    typedef std::integral_constant<bool, std::is_same<
+        typename std::iterator_traits<InLeft>::reference,
+        typename std::iterator_traits<InRight>::reference>::value> same_reference;
+
+    while (left != leftEnd && right != rightEnd) {
+        bool takeRight = comp(*right, *left);
+        merge_take(left, right, takeRight, out, same_reference());
+        ++out;
+        right += takeRight;
+        left += !takeRight;
+    }
+    return out;
+}
+
+template <typename InLeft, typename InRight, typename Out, typename Comp>
+Out merge_loop(InLeft& left, InLeft leftEnd, InRight& right, InRight rightEnd, Out out, Comp comp,
+               std::false_type)
+{
+    while (left != leftEnd && right != rightEnd) {
+        if (comp(*right, *left)) {
+            *out = *right;
+            ++right;
+        } else {
+            *out = *left;
+            ++left;
+        }
+        ++out;
+    }
+    return out;
+}
+
+// Merge the sorted ranges [left, leftEnd) and [right, rightEnd) into 'out' by
+// copying elements (or moving them, from std::move_iterators), and return
+// the end of the output. Ties are taken from the left. Any input iterators
+// will do; random access ones get a loop without branches.
+template <typename InLeft, typename InRight, typename Out, typename Comp>
+Out merge(InLeft left, InLeft leftEnd, InRight right, InRight rightEnd, Out out, Comp comp)
+{
+    out = merge_loop(left, leftEnd, right, rightEnd, out, comp, merge_random_access<InLeft, InRight>());
+    out = std::copy(left, leftEnd, out);
+    return std::copy(right, rightEnd, out);
+}
+
+// Compares iterators by what they point at, so a loser tree can hold
+// positions in its sources rather than copies of their values.
+template <typename Comp>
+struct merge_deref_compare {
+    Comp comp;
+
+    explicit merge_deref_compare(Comp c) : comp(c) {}
+
+    template <typename Iter>
+    bool operator()(Iter const& a, Iter const& b) const
+    {
+        return comp(*a, *b);
+    }
+};
+
+// Merges K sorted ranges lazily: front() is the smallest element left, and
+// pop() moves on to the next. Each pop() takes log2(K) comparisons. begin()
+// and end() give an input iterator over what's left, for streaming the merge
+// into something else without storing it. The ranges must stay put while
+// the merger uses them.
+template <typename Iter, typename Comp>
+class kway_merger {
+public:
+    typedef typename std::iterator_traits<Iter>::value_type value_type;
+    typedef typename std::iterator_traits<Iter>::reference reference;
+
+    template <typename Ranges>
+    explicit kway_merger(Ranges const& ranges, Comp comp = Comp())
+      : _tree(ranges.size(), merge_deref_compare<Comp>(comp))
+    {
+        size_t i = 0;
+        for (auto const& range : ranges) {
+            _ends.push_back(range.second);
+            if (range.first != range.second)
+                _tree.set(i, range.first);
+            i++;
+        }
+        _tree.start();
+    }
+
+    bool empty() const
+    {
+        return _tree.empty();
+    }
+
+    // The smallest element left, and which range it comes from.
+    reference front() const
+    {
+        return *_tree.top_value();
+    }
+
+    size_t front_range() const
+    {
+        return _tree.top();
+    }
+
+    void pop()
+    {
+        Iter next = _tree.top_value();
+        ++next;
+        if (next == _ends[_tree.top()])
+            _tree.pop_top();
+        else
+            _tree.replace_top(next);
+    }
+
+    class iterator {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef typename kway_merger::value_type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef typename std::iterator_traits<Iter>::pointer pointer;
+        typedef typename kway_merger::reference reference;
+
+        explicit iterator(kway_merger* merger = NULL)
+          : _merger(merger != NULL && !merger->empty() ? merger : NULL)
+        {}
+
+        reference operator*() const
+        {
+            return _merger->front();
+        }
+
+        pointer operator->() const
+        {
+            return &_merger->front();
+        }
+
+        iterator& operator++()
+        {
+            _merger->pop();
+            if (_merger->empty())
+                _merger = NULL;
+            return *this;
+        }
+
+        // Input iterators only promise that *it++ works.
+        struct proxy {
+            value_type value;
+            value_type const& operator*() const
+            {
+                return value;
+            }
+        };
+
+        proxy operator++(int)
+        {
+            proxy old = { **this };
+            ++*this;
+            return old;
+        }
+
+        bool operator==(iterator const& other) const
+        {
+            return _merger == other._merger;
+        }
+
+        bool operator!=(iterator const& other) const
+        {
+            return _merger != other._merger;
+        }
+
+    private:
+        kway_merger* _merger;   // NULL at the end.
+    };
+
+    iterator begin()
+    {
+        return iterator(this);
+    }
+
+    iterator end()
+    {
+        return iterator();
+    }
+
+private:
+    loser_tree<Iter, merge_deref_compare<Comp> > _tree;
+    vector<Iter> _ends;
+};
+
+template <typename Ranges, typename Comp>
+kway_merger<typename Ranges::value_type::first_type, Comp> make_kway_merger(Ranges const& ranges,
+                                                                            Comp comp)
+{
+    return kway_merger<typename Ranges::value_type::first_type, Comp>(ranges, comp);
+}
+
+// Merge the sorted 'ranges' into 'out' by copying, and return the end of the
+// output. Two ranges take the branch-free merge, more go through a loser
+// tree.
+template <typename Ranges, typename Out, typename Comp>
+Out kway_merge(Ranges const& ranges, Out out, Comp comp)
+{
+    typedef typename Ranges::value_type::first_type Iter;
+
+    // Empty ranges would only make the tree bigger.
+    vector<std::pair<Iter, Iter> > live;
+    for (auto const& range : ranges) {
+        if (range.first != range.second)
+            live.push_back(std::make_pair(range.first, range.second));
+    }
+
+    if (live.size() == 0)
+        return out;
+    if (live.size() == 1)
+        return std::copy(live[0].first, live[0].second, out);
+    if (live.size() == 2) {
+        return rtl::merge(live[0].first, live[0].second, live[1].first, live[1].second, out,
+                          comp);
+    }
+
+    kway_merger<Iter, Comp> merger(live, comp);
+    for (; !merger.empty(); merger.pop())
+        *out++ = merger.front();
+    return out;
+}
+
+// Find where the first 'rank' elements of the merge of 'ranges' end in each
+// range: splits[i] of them come from ranges[i]. This lets a K-way merge be cut
+// into independent pieces, like merge_corank does for two ranges.
+//
+// Elements are ordered by value, then by range, then by position, so every
+// element has a distinct rank. Each range keeps a window that its split is
+// known to be in. Every step takes the middle of the widest window, counts
+// the elements before it in every range with a binary search (within their
+// windows, which is enough), and narrows all the windows to one side of it.
+// That's O(K log n) steps of O(K log n) each.
+template <typename Ranges, typename Comp>
+void kway_merge_corank(Ranges const& ranges, size_t rank, Comp comp, vector<size_t>& splits)
+{
+    typedef typename Ranges::value_type::first_type Iter;
+
+    size_t k = ranges.size();
+    vector<size_t> lo(k, 0);
+    vector<size_t> hi;
+    for (size_t i=0; i < k; i++)
+        hi.push_back(ranges[i].second - ranges[i].first);
+    vector<size_t> before(k, 0);
+
+    while (true) {
+        size_t j = k;
+        size_t widest = 0;
+        for (size_t i=0; i < k; i++) {
+            if (hi[i] - lo[i] > widest) {
+                widest = hi[i] - lo[i];
+                j = i;
+            }
+        }
+        if (j == k)
+            break;
+
+        size_t middle = lo[j] + widest / 2;
+        typename std::iterator_traits<Iter>::reference pivot = ranges[j].first[middle];
+
+        // Equal elements from earlier ranges come before the pivot, and from
+        // later ones after it.
+        size_t pivotRank = 0;
+        for (size_t i=0; i < k; i++) {
+            Iter first = ranges[i].first;
+            if (i < j)
+                before[i] = std::upper_bound(first + lo[i], first + hi[i], pivot, comp) - first;
+            else if (i > j)
+                before[i] = std::lower_bound(first + lo[i], first + hi[i], pivot, comp) - first;
+            else
+                before[i] = middle;
+            pivotRank += before[i];
+        }
+
+        if (pivotRank < rank) {
+            lo = before;
+            lo[j] = middle + 1;
+        } else {
+            hi = before;
+        }
+    }
+
+    splits.swap(lo);
+}
+
+// Parallel version of kway_merge, for a random access 'out'. The output is
+// cut into one piece per thread by kway_merge_corank, and each piece is
+// merged as a separate task.
+template <typename Ranges, typename Out, typename Comp>
+Out parallel_kway_merge(Ranges const& ranges, Out out, Comp comp, thread_pool& pool)
+{
+    typedef typename Ranges::value_type::first_type Iter;
+
+    vector<std::pair<Iter, Iter> > all;
+    size_t total = 0;
+    for (auto const& range : ranges) {
+        all.push_back(std::make_pair(range.first, range.second));
+        total += range.second - range.first;
+    }
+
+    if (total < parallel_merge_cutoff || pool.size() < 2)
+        return kway_merge(all, out, comp);
+
+    size_t numPieces = std::min(pool.size(), total / (parallel_merge_cutoff / 2));
+
+    task_group group(pool);
+    for (size_t p=0; p < numPieces; p++) {
+        size_t r0 = total * p / numPieces;
+        size_t r1 = total * (p + 1) / numPieces;
+
+        group.run([&, r0, r1]() {
+            vector<size_t> starts;
+            vector<size_t> ends;
+            kway_merge_corank(all, r0, comp, starts);
+            kway_merge_corank(all, r1, comp, ends);
+
+            vector<std::pair<Iter, Iter> > piece;
+            for (size_t i=0; i < all.size(); i++)
+                piece.push_back(std::make_pair(all[i].first + starts[i], all[i].first + ends[i]));
+            kway_merge(piece, out + r0, comp);
+        });
+    }
+    group.wait();
+
+    return out + total;
+}
+
+template <typename Ranges, typename Out, typename Comp>
+Out parallel_kway_merge(Ranges const& ranges, Out out, Comp comp)
+{
+    return parallel_kway_merge(ranges, out, comp, thread_pool::shared());
+}
+
+}  // namespace rtl
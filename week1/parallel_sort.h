@@ -0,0 +1,378 @@
+// Parallel sorting algorithms, built on the sequential ones in sort.h.
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+
+#include "sort.h"
+#include "thread_pool.h"
+#include "vector.h"
+
+namespace rtl {
+
+// Ranges up to this size are handed to the sequential sorts.
+const size_t parallel_sort_cutoff = 1 << 15;
+
+// Ranges at least this size are partitioned by several threads at once.
+const size_t parallel_partition_cutoff = 1 << 20;
+
+// How much work (in elements) a single task gets when splitting up a
+// partition or merge.
+const size_t parallel_grain = 1 << 16;
+
+// Uninitialized storage for 'n' elements. Whoever fills it in sets 'count'
+// to how many elements from the start are built; those are destroyed along
+// with the buffer.
+template <typename T>
+struct parallel_sort_buffer {
+    T* data;
+    size_t count;
+
+    explicit parallel_sort_buffer(size_t n)
+    {
+        data = (T*) malloc(n * sizeof(T));
+        if (data == NULL && n > 0)
+            throw std::bad_alloc();
+        count = 0;
+    }
+
+    ~parallel_sort_buffer()
+    {
+        for (size_t i=0; i < count; i++)
+            data[i].~T();
+        free(data);
+    }
+};
+
+// A run of misplaced elements found by parallel_partition. 'offset' is the
+// number of misplaced elements in the spans before this one.
+struct partition_span {
+    size_t start;
+    size_t end;
+    size_t offset;
+};
+
+// Find the position of the 'k'th misplaced element, and which span it's in.
+inline size_t partition_span_locate(vector<partition_span> const& spans, size_t k, size_t& span)
+{
+    span = 0;
+    while (spans[span].offset + (spans[span].end - spans[span].start) <= k)
+        span++;
+    return spans[span].start + (k - spans[span].offset);
+}
+
+// Reorder [first, last) so that the elements matching 'pred' come first, using
+// the pool's threads. Returns the number of matching elements. Not stable.
+//
+// Each block is partitioned on its own. After that, the non-matching elements
+// that ended up left of the final cut are exactly as many as the matching
+// ones right of it, so the two groups are swapped pairwise, also in parallel.
+template <typename Iter, typename Pred>
+size_t parallel_partition(Iter first, Iter last, Pred pred, thread_pool& pool)
+{
+    size_t count = last - first;
+    size_t numBlocks = std::min(pool.size() * 4, count / parallel_grain);
+
+    if (numBlocks < 2)
+        return std::partition(first, last, pred) - first;
+
+    vector<size_t> blockStart;
+    for (size_t b=0; b <= numBlocks; b++)
+        blockStart.push_back(count * b / numBlocks);
+
+    vector<size_t> blockMatches(numBlocks, 0);
+
+    task_group group(pool);
+    for (size_t b=0; b < numBlocks; b++) {
+        group.run([=, &blockStart, &blockMatches]() {
+            Iter blockFirst = first + blockStart[b];
+            Iter blockLast = first + blockStart[b + 1];
+            blockMatches[b] = std::partition(blockFirst, blockLast, pred) - blockFirst;
+        });
+    }
+    group.wait();
+
+    size_t cut = 0;
+    for (size_t b=0; b < numBlocks; b++)
+        cut += blockMatches[b];
+
+    // Collect the misplaced elements on each side of the cut.
+    vector<partition_span> wrongLeft;
+    vector<partition_span> wrongRight;
+    size_t numWrongLeft = 0;
+    size_t numWrongRight = 0;
+
+    for (size_t b=0; b < numBlocks; b++) {
+        size_t lo = blockStart[b];
+        size_t mid = lo + blockMatches[b];
+        size_t hi = blockStart[b + 1];
+
+        if (mid < cut && mid < hi) {
+            partition_span span = { mid, std::min(hi, cut), numWrongLeft };
+            wrongLeft.push_back(span);
+            numWrongLeft += span.end - span.start;
+        }
+
+        if (mid > cut && lo < mid) {
+            partition_span span = { std::max(lo, cut), mid, numWrongRight };
+            wrongRight.push_back(span);
+            numWrongRight += span.end - span.start;
+        }
+    }
+
+    assert(numWrongLeft == numWrongRight);
+
+    size_t numPieces = (numWrongLeft + parallel_grain - 1) / parallel_grain;
+    for (size_t p=0; p < numPieces; p++) {
+        size_t k0 = numWrongLeft * p / numPieces;
+        size_t k1 = numWrongLeft * (p + 1) / numPieces;
+
+        group.run([=, &wrongLeft, &wrongRight]() {
+            size_t leftSpan;
+            size_t rightSpan;
+            size_t leftPos = partition_span_locate(wrongLeft, k0, leftSpan);
+            size_t rightPos = partition_span_locate(wrongRight, k0, rightSpan);
+
+            for (size_t k=k0; k < k1; k++) {
+                if (leftPos == wrongLeft[leftSpan].end)
+                    leftPos = wrongLeft[++leftSpan].start;
+                if (rightPos == wrongRight[rightSpan].end)
+                    rightPos = wrongRight[++rightSpan].start;
+
+                std::iter_swap(first + leftPos++, first + rightPos++);
+            }
+        });
+    }
+    group.wait();
+
+    return cut;
+}
+
+template <typename Iter, typename Comp>
+void parallel_sort_task(Iter first, Iter last, size_t depthLimit, Comp comp, task_group& group)
+{
+    typedef typename std::iterator_traits<Iter>::value_type T;
+
+    while (size_t(last - first) > parallel_sort_cutoff) {
+
+        if (depthLimit == 0) {
+            // Too many bad pivots, let the sequential introsort deal with it.
+            quicksort(first, last, comp);
+            return;
+        }
+        depthLimit--;
+
+        // After partitioning, [first, leftLast) and [rightFirst, last) still
+        // need sorting. Anything in between is in its final place.
+        Iter leftLast;
+        Iter rightFirst;
+
+        if (size_t(last - first) >= parallel_partition_cutoff) {
+            quicksort_choose_pivot(first, last, comp);
+
+            // Partition everything after the pivot, then swap the pivot in
+            // between the two sides.
+            Iter pivot = first;
+            Iter mid = first + 1 + parallel_partition(first + 1, last,
+                [&](T const& x) { return comp(x, *pivot); }, group.pool());
+
+            std::iter_swap(first, mid - 1);
+            leftLast = mid - 1;
+            rightFirst = mid;
+
+            if (leftLast == first) {
+                // Nothing was less than the pivot, which is now at 'first'.
+                // Pull out everything equal to it as well, otherwise a big
+                // run of equal elements would only shrink by one per pass.
+                rightFirst += parallel_partition(rightFirst, last,
+                    [&](T const& x) { return !comp(*first, x); }, group.pool());
+            }
+        } else {
+            leftLast = rightFirst = quicksort_partition(first, last, comp);
+        }
+
+        // Fork the smaller side and keep going on the larger one.
+        if (leftLast - first < last - rightFirst) {
+            Iter forkLast = leftLast;
+            group.run([=, &group]() {
+                parallel_sort_task(first, forkLast, depthLimit, comp, group);
+            });
+            first = rightFirst;
+        } else {
+            Iter forkFirst = rightFirst;
+            group.run([=, &group]() {
+                parallel_sort_task(forkFirst, last, depthLimit, comp, group);
+            });
+            last = leftLast;
+        }
+    }
+
+    quicksort(first, last, comp);
+}
+
+// Parallel version of quicksort: partitions in parallel while ranges are
+// large, then sorts the pieces as separate tasks. Not stable.
+template <typename Iter, typename Comp>
+void parallel_sort(Iter first, Iter last, Comp comp, thread_pool& pool)
+{
+    if (size_t(last - first) <= parallel_sort_cutoff || pool.size() < 2) {
+        quicksort(first, last, comp);
+        return;
+    }
+
+    size_t depthLimit = 0;
+    for (size_t n = last - first; n > 1; n /= 2)
+        depthLimit += 2;
+
+    task_group group(pool);
+    parallel_sort_task(first, last, depthLimit, comp, group);
+    group.wait();
+}
+
+template <typename Iter, typename Comp>
+void parallel_sort(Iter first, Iter last, Comp comp)
+{
+    parallel_sort(first, last, comp, thread_pool::shared());
+}
+
+// Move [src, src + count) over to 'dst', using several threads.
+template <typename Src, typename Dst>
+void parallel_move(Src src, size_t count, Dst dst, task_group& group)
+{
+    for (size_t start = 0; start < count; start += parallel_grain) {
+        size_t end = std::min(count, start + parallel_grain);
+        group.run([=]() {
+            std::move(src + start, src + end, dst + start);
+        });
+    }
+    group.wait();
+}
+
+// One round of parallel_stable_sort: like mergesort_pass, but every merge is
+// split into pieces of about parallel_grain elements by co-rank, and each
+// piece is a separate task.
+template <typename Src, typename Dst, typename Comp>
+void parallel_merge_pass(Src src, Dst dst, vector<size_t>& runs, Comp comp, task_group& group)
+{
+    size_t numRuns = runs.size() - 1;
+    size_t total = runs[numRuns];
+    size_t merged = 0;
+
+    for (size_t i=0; i < numRuns; i += 2) {
+        size_t lo = runs[i];
+
+        if (i + 1 == numRuns) {
+            // Odd one out, carry it over unchanged.
+            for (size_t start = lo; start < total; start += parallel_grain) {
+                size_t end = std::min(total, start + parallel_grain);
+                group.run([=]() {
+                    std::move(src + start, src + end, dst + start);
+                });
+            }
+        } else {
+            size_t mid = runs[i + 1];
+            size_t hi = runs[i + 2];
+            size_t length = hi - lo;
+            size_t numPieces = (length + parallel_grain - 1) / parallel_grain;
+
+            for (size_t p=0; p < numPieces; p++) {
+                size_t k0 = length * p / numPieces;
+                size_t k1 = length * (p + 1) / numPieces;
+
+                group.run([=]() {
+                    Src left = src + lo;
+                    Src right = src + mid;
+                    size_t i0 = merge_corank(k0, left, mid - lo, right, hi - mid, comp);
+                    size_t i1 = merge_corank(k1, left, mid - lo, right, hi - mid, comp);
+                    merge_move(left + i0, left + i1, right + (k0 - i0), right + (k1 - i1),
+                        dst + lo + k0, comp);
+                });
+            }
+        }
+
+        runs[merged++] = lo;
+    }
+    group.wait();
+
+    runs[merged++] = total;
+    runs.resize(merged);
+}
+
+// Parallel version of mergesort. Blocks are mergesorted as separate tasks,
+// then merged pairwise, with each merge split across threads. Stable.
+template <typename Iter, typename Comp>
+void parallel_stable_sort(Iter first, Iter last, Comp comp, thread_pool& pool)
+{
+    typedef typename std::iterator_traits<Iter>::value_type T;
+
+    const size_t count = last - first;
+
+    if (count <= parallel_sort_cutoff || pool.size() < 2) {
+        mergesort(first, last, comp);
+        return;
+    }
+
+    size_t numBlocks = std::min(pool.size(), count / parallel_sort_cutoff);
+
+    vector<size_t> runs;
+    for (size_t b=0; b < numBlocks; b++)
+        runs.push_back(count * b / numBlocks);
+    runs.push_back(count);
+
+    // Each block moves itself into the scratch buffer and gets sorted there,
+    // so the first merge round writes back into the input.
+    parallel_sort_buffer<T> scratch(count);
+    T* scratchData = scratch.data;
+
+    // If a move or a comparison throws, only what got built is destroyed.
+    vector<size_t> built(numBlocks, 0);
+    task_group group(pool);
+    try {
+        for (size_t b=0; b < numBlocks; b++) {
+            size_t lo = runs[b];
+            size_t hi = runs[b + 1];
+            size_t* blockBuilt = &built[b];
+            group.run([=]() {
+                for (size_t i=lo; i < hi; i++) {
+                    new (&scratchData[i]) T(std::move(first[i]));
+                    (*blockBuilt)++;
+                }
+                mergesort(scratchData + lo, scratchData + hi, comp);
+            });
+        }
+        group.wait();
+    } catch (...) {
+        // Tasks may still be running if run() threw.
+        try {
+            group.wait();
+        } catch (...) {
+        }
+        for (size_t b=0; b < numBlocks; b++)
+            for (size_t i=runs[b]; i < runs[b] + built[b]; i++)
+                scratchData[i].~T();
+        throw;
+    }
+    scratch.count = count;
+
+    bool inScratch = true;
+    while (runs.size() > 2) {
+        if (inScratch)
+            parallel_merge_pass(scratchData, first, runs, comp, group);
+        else
+            parallel_merge_pass(first, scratchData, runs, comp, group);
+        inScratch = !inScratch;
+    }
+
+    if (inScratch)
+        parallel_move(scratchData, count, first, group);
+}
+
+template <typename Iter, typename Comp>
+void parallel_stable_sort(Iter first, Iter last, Comp comp)
+{
+    parallel_stable_sort(first, last, comp, thread_pool::shared());
+}
+
+}  // namespace rtl
@@ -0,0 +1,818 @@
+// An immutable vector that's cheap to copy and to change.
+//
+// A persistent_vector never changes once it's built. "Changing" one makes a
+// new vector, which shares everything but the path to the change with the
+// old one, so both stay usable. Copying it just copies a pointer, so a
+// snapshot costs nothing. It's a tree 32 wide: leaves are rtl::vectors of
+// up to 32 elements, and a million elements are four levels deep. The last
+// leaf is kept to one side of the tree, as the tail, so that push_back()
+// only has to copy that, until it fills up.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "parallel_sort.h"
+#include "thread_pool.h"
+#include "vector.h"
+
+namespace rtl {
+
+template <typename T>
+class persistent_vector {
+    struct node;
+    typedef std::shared_ptr<const node> node_ptr;
+
+public:
+    typedef T value_type;
+    typedef size_t size_type;
+    typedef T const& const_reference;
+    class const_iterator;
+    typedef const_iterator iterator;
+    class builder;
+
+    // Elements per leaf, and children per inner node.
+    static const size_t branchBits = 5;
+    static const size_t branching = size_t(1) << branchBits;
+
+    persistent_vector()
+    {}
+
+    explicit persistent_vector(vector<T> const& v)
+    {
+        builder b;
+        for (size_t i=0; i < v.size(); i++)
+            b.push_back(v[i]);
+        *this = b.build();
+    }
+
+    size_type size() const
+    {
+        return root_size() + (_tail ? _tail->items.size() : 0);
+    }
+
+    bool empty() const
+    {
+        return !_root && !_tail;
+    }
+
+    // Levels of inner nodes above the leaves.
+    size_type height() const
+    {
+        return _root ? _root->height : 0;
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(_root.get(), _tail.get(), 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(_root.get(), _tail.get(), size());
+    }
+
+    T const& operator[](size_type index) const
+    {
+        size_t rootSize = root_size();
+        if (index >= rootSize)
+            return _tail->items[index - rootSize];
+        const node* leaf = find_leaf(_root.get(), index);
+        return leaf->items[index];
+    }
+
+    T const& at(size_type index) const
+    {
+        if (index >= size())
+            throw std::out_of_range("persistent_vector::at: index out of range");
+        return (*this)[index];
+    }
+
+    T const& front() const
+    {
+        return (*this)[0];
+    }
+
+    T const& back() const
+    {
+        return (*this)[size() - 1];
+    }
+
+    // This with element 'index' replaced by 'x'. Copies one node per level.
+    persistent_vector set(size_type index, T const& x) const
+    {
+        if (index >= size())
+            throw std::out_of_range("persistent_vector::set: index out of range");
+        size_t rootSize = root_size();
+        if (index >= rootSize) {
+            std::shared_ptr<node> tail = std::make_shared<node>(*_tail);
+            tail->items[index - rootSize] = x;
+            return persistent_vector(_root, tail);
+        }
+        return persistent_vector(set_in(_root, index, x), _tail);
+    }
+
+    // This with 'x' on the end. Copies the tail, and once every 32 elements
+    // the nodes it goes into. To add many elements, a builder is quicker.
+    persistent_vector push_back(T const& x) const
+    {
+        vector<T> items;
+        if (_tail && _tail->items.size() < branching) {
+            items.reserve(_tail->items.size() + 1);
+            items.insert(items.end(), _tail->items.begin(), _tail->items.end());
+            items.push_back(x);
+            return persistent_vector(_root, make_leaf(std::move(items)));
+        }
+        items.push_back(x);
+        return persistent_vector(concat_nodes(_root, _tail), make_leaf(std::move(items)));
+    }
+
+    persistent_vector pop_back() const
+    {
+        if (empty())
+            throw std::out_of_range("persistent_vector::pop_back: empty");
+        return slice(0, size() - 1);
+    }
+
+    // This followed by 'other'. The shorter one is hung off the side of the
+    // taller one, so only the nodes along the seam are copied.
+    persistent_vector concat(persistent_vector const& other) const
+    {
+        if (other.empty())
+            return *this;
+        return persistent_vector(concat_nodes(concat_nodes(_root, _tail), other._root), other._tail);
+    }
+
+    // Elements [first, last). Copies the nodes along the two edges; the
+    // ones in between are shared.
+    persistent_vector slice(size_type first, size_type last) const
+    {
+        if (first > last || last > size())
+            throw std::out_of_range("persistent_vector::slice: range out of range");
+        if (first == last)
+            return persistent_vector();
+
+        size_t rootSize = root_size();
+        node_ptr root;
+        node_ptr tail;
+        if (first < rootSize) {
+            root = slice_node(_root, first, std::min(last, rootSize));
+            while (root->height > 0 && root->children.size() == 1)
+                root = root->children[0];
+        }
+        if (last > rootSize)
+            tail = slice_node(_tail, std::max(first, rootSize) - rootSize, last - rootSize);
+        return persistent_vector(root, tail);
+    }
+
+    vector<T> to_vector() const
+    {
+        vector<T> v;
+        v.reserve(size());
+        vector<const node*> leaves;
+        collect_leaves(leaves);
+        for (size_t i=0; i < leaves.size(); i++)
+            v.insert(v.end(), leaves[i]->items.begin(), leaves[i]->items.end());
+        return v;
+    }
+
+    // f(x) for each element x. Blocks of leaves are mapped in parallel on
+    // 'pool', each into a tree of its own, and then those are joined.
+    template <typename F>
+    persistent_vector<typename std::decay<decltype(std::declval<F&>()(std::declval<T const&>()))>::type>
+    map(F f, thread_pool& pool = thread_pool::shared()) const
+    {
+        typedef typename std::decay<decltype(f(std::declval<T const&>()))>::type U;
+
+        blocks b(*this, pool);
+        vector<persistent_vector<U> > parts(b.count());
+        b.run([&](size_t block, size_t firstLeaf, size_t lastLeaf, size_t) {
+            typename persistent_vector<U>::builder out;
+            for (size_t l=firstLeaf; l < lastLeaf; l++) {
+                vector<T> const& items = b.leaf(l)->items;
+                for (size_t i=0; i < items.size(); i++)
+                    out.push_back(f(items[i]));
+            }
+            parts[block] = out.build();
+        });
+        return persistent_vector<U>::join(parts);
+    }
+
+    // The elements for which pred(x) is true, in order.
+    template <typename Pred>
+    persistent_vector filter(Pred pred, thread_pool& pool = thread_pool::shared()) const
+    {
+        blocks b(*this, pool);
+        vector<persistent_vector> parts(b.count());
+        b.run([&](size_t block, size_t firstLeaf, size_t lastLeaf, size_t) {
+            builder out;
+            for (size_t l=firstLeaf; l < lastLeaf; l++) {
+                vector<T> const& items = b.leaf(l)->items;
+                for (size_t i=0; i < items.size(); i++) {
+                    if (pred(items[i]))
+                        out.push_back(items[i]);
+                }
+            }
+            parts[block] = out.build();
+        });
+        return join(parts);
+    }
+
+    // init op x0 op x1 op ... for an associative 'op'. Each block is folded
+    // on its own, in parallel, and then the results in order.
+    template <typename Op>
+    T reduce(T init, Op op, thread_pool& pool = thread_pool::shared()) const
+    {
+        blocks b(*this, pool);
+        vector<T> partial(b.count(), init);
+        b.run([&](size_t block, size_t firstLeaf, size_t lastLeaf, size_t) {
+            // Leaves are never empty.
+            vector<T> const& first = b.leaf(firstLeaf)->items;
+            T sum = first[0];
+            for (size_t i=1; i < first.size(); i++)
+                sum = op(sum, first[i]);
+            for (size_t l=firstLeaf + 1; l < lastLeaf; l++) {
+                vector<T> const& items = b.leaf(l)->items;
+                for (size_t i=0; i < items.size(); i++)
+                    sum = op(sum, items[i]);
+            }
+            partial[block] = std::move(sum);
+        });
+
+        for (size_t i=0; i < b.count(); i++)
+            init = op(init, partial[i]);
+        return init;
+    }
+
+    // f(x, y) for each element x of this and y of 'other', which must be as
+    // long (throws std::invalid_argument if it isn't).
+    template <typename U, typename F>
+    persistent_vector<typename std::decay<decltype(std::declval<F&>()(std::declval<T const&>(),
+                                                                     std::declval<U const&>()))>::type>
+    zip(persistent_vector<U> const& other, F f, thread_pool& pool = thread_pool::shared()) const
+    {
+        typedef typename std::decay<decltype(f(std::declval<T const&>(), std::declval<U const&>()))>::type R;
+
+        if (other.size() != size())
+            throw std::invalid_argument("persistent_vector::zip: vectors differ in length");
+
+        blocks b(*this, pool);
+        vector<persistent_vector<R> > parts(b.count());
+        b.run([&](size_t block, size_t firstLeaf, size_t lastLeaf, size_t start) {
+            typename persistent_vector<R>::builder out;
+            typename persistent_vector<U>::const_iterator y = other.begin() + start;
+            for (size_t l=firstLeaf; l < lastLeaf; l++) {
+                vector<T> const& items = b.leaf(l)->items;
+                for (size_t i=0; i < items.size(); i++, ++y)
+                    out.push_back(f(items[i], *y));
+            }
+            parts[block] = out.build();
+        });
+        return persistent_vector<R>::join(parts);
+    }
+
+    // A random access iterator. It keeps hold of the leaf it's in, so
+    // walking along only goes back to the tree once per leaf.
+    class const_iterator {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef T const* pointer;
+        typedef T const& reference;
+
+        const_iterator()
+          : _root(NULL), _tail(NULL), _index(0), _chunk(NULL), _chunkBegin(0), _chunkEnd(0)
+        {}
+
+        reference operator*() const
+        {
+            if (_index < _chunkBegin || _index >= _chunkEnd) {
+                size_t offset = _index;
+                const node* leaf = _tail;
+                size_t rootSize = _root != NULL ? _root->size() : 0;
+                if (_index < rootSize)
+                    leaf = find_leaf(_root, offset);
+                else
+                    offset -= rootSize;
+                _chunk = leaf->items.begin();
+                _chunkBegin = _index - offset;
+                _chunkEnd = _chunkBegin + leaf->items.size();
+            }
+            return _chunk[_index - _chunkBegin];
+        }
+
+        pointer operator->() const
+        {
+            return &**this;
+        }
+
+        reference operator[](difference_type n) const
+        {
+            return *(*this + n);
+        }
+
+        const_iterator& operator++()
+        {
+            _index++;
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator old = *this;
+            _index++;
+            return old;
+        }
+
+        const_iterator& operator--()
+        {
+            _index--;
+            return *this;
+        }
+
+        const_iterator operator--(int)
+        {
+            const_iterator old = *this;
+            _index--;
+            return old;
+        }
+
+        const_iterator& operator+=(difference_type n)
+        {
+            _index += n;
+            return *this;
+        }
+
+        const_iterator& operator-=(difference_type n)
+        {
+            _index -= n;
+            return *this;
+        }
+
+        const_iterator operator+(difference_type n) const
+        {
+            const_iterator it = *this;
+            it += n;
+            return it;
+        }
+
+        const_iterator operator-(difference_type n) const
+        {
+            const_iterator it = *this;
+            it -= n;
+            return it;
+        }
+
+        difference_type operator-(const_iterator const& other) const
+        {
+            return difference_type(_index) - difference_type(other._index);
+        }
+
+        bool operator==(const_iterator const& other) const
+        {
+            return _index == other._index;
+        }
+
+        bool operator!=(const_iterator const& other) const
+        {
+            return _index != other._index;
+        }
+
+        bool operator<(const_iterator const& other) const
+        {
+            return _index < other._index;
+        }
+
+        bool operator>(const_iterator const& other) const
+        {
+            return _index > other._index;
+        }
+
+        bool operator<=(const_iterator const& other) const
+        {
+            return _index <= other._index;
+        }
+
+        bool operator>=(const_iterator const& other) const
+        {
+            return _index >= other._index;
+        }
+
+    private:
+        friend class persistent_vector;
+
+        const_iterator(const node* root, const node* tail, size_t index)
+          : _root(root), _tail(tail), _index(index), _chunk(NULL), _chunkBegin(0), _chunkEnd(0)
+        {}
+
+        const node* _root;
+        const node* _tail;
+        size_t _index;
+        mutable T const* _chunk;
+        mutable size_t _chunkBegin;
+        mutable size_t _chunkEnd;
+    };
+
+    // Builds a persistent_vector by appending to it. Elements are gathered
+    // into a leaf's worth at a time, and the tree over the leaves is only
+    // made in build(), so nothing gets copied along the way.
+    class builder {
+    public:
+        builder()
+          : _count(0)
+        {
+            _chunk.reserve(branching);
+        }
+
+        // Appends to 'base'.
+        explicit builder(persistent_vector const& base)
+          : _base(base), _count(0)
+        {
+            _chunk.reserve(branching);
+        }
+
+        size_type size() const
+        {
+            return _base.size() + _count;
+        }
+
+        void push_back(T const& x)
+        {
+            _chunk.push_back(x);
+            added();
+        }
+
+        void push_back(T&& x)
+        {
+            _chunk.push_back(std::move(x));
+            added();
+        }
+
+        template <typename... Args>
+        void emplace_back(Args&&... args)
+        {
+            _chunk.emplace_back(std::forward<Args>(args)...);
+            added();
+        }
+
+        // What's been built, leaving the builder empty.
+        persistent_vector build()
+        {
+            // What's left over is the tail.
+            node_ptr tail;
+            if (!_chunk.empty()) {
+                tail = make_leaf(std::move(_chunk));
+                _chunk = vector<T>();
+                _chunk.reserve(branching);
+            }
+
+            persistent_vector result(_base);
+            if (!_leaves.empty() || tail) {
+                node_ptr base = concat_nodes(_base._root, _base._tail);
+                result = persistent_vector(concat_nodes(base, build_tree(_leaves)), tail);
+            }
+            _base = persistent_vector();
+            _leaves.clear();
+            _count = 0;
+            return result;
+        }
+
+    private:
+        void added()
+        {
+            _count++;
+            if (_chunk.size() == branching) {
+                _leaves.push_back(make_leaf(std::move(_chunk)));
+                _chunk = vector<T>();
+                _chunk.reserve(branching);
+            }
+        }
+
+        persistent_vector _base;
+        vector<node_ptr> _leaves;
+        vector<T> _chunk;
+        size_t _count;
+    };
+
+private:
+    template <typename U> friend class persistent_vector;
+
+    // Leaves hold elements, and inner nodes hold children. An inner node
+    // also counts the elements under its children, so that they needn't be
+    // full: slicing and concatenating leave part-full nodes in the middle
+    // of the tree. Every leaf is at the same depth, and none is empty.
+    struct node {
+        size_t height;          // 0 for a leaf.
+        vector<T> items;
+        vector<node_ptr> children;
+        vector<size_t> ends;    // Elements under children[0] to children[i].
+
+        size_t size() const
+        {
+            return height == 0 ? items.size() : ends.back();
+        }
+    };
+
+    // Blocks of leaves, to work on in parallel. Each is at least
+    // parallel_grain elements, unless there's only one.
+    class blocks {
+    public:
+        blocks(persistent_vector const& v, thread_pool& pool)
+          : _pool(pool)
+        {
+            v.collect_leaves(_leaves);
+            size_t numBlocks = std::min(pool.size() * 4, v.size() / parallel_grain);
+            numBlocks = std::max(size_t(1), std::min(numBlocks, _leaves.size()));
+
+            // Where each block's leaves begin, and its first element.
+            size_t index = 0;
+            size_t l = 0;
+            for (size_t b=0; b < numBlocks; b++) {
+                size_t firstLeaf = _leaves.size() * b / numBlocks;
+                for (; l < firstLeaf; l++)
+                    index += _leaves[l]->items.size();
+                _firstLeaf.push_back(firstLeaf);
+                _firstIndex.push_back(index);
+            }
+            _firstLeaf.push_back(_leaves.size());
+
+            // An empty vector still gets a block, with no leaves.
+            _empty = _leaves.empty();
+        }
+
+        size_t count() const
+        {
+            return _empty ? 0 : _firstIndex.size();
+        }
+
+        const node* leaf(size_t l) const
+        {
+            return _leaves[l];
+        }
+
+        // fn(block, firstLeaf, lastLeaf, firstIndex) for each block.
+        template <typename F>
+        void run(F fn)
+        {
+            if (count() == 1) {
+                fn(0, _firstLeaf[0], _firstLeaf[1], 0);
+                return;
+            }
+
+            task_group group(_pool);
+            for (size_t b=0; b < count(); b++) {
+                group.run([this, &fn, b]() {
+                    fn(b, _firstLeaf[b], _firstLeaf[b + 1], _firstIndex[b]);
+                });
+            }
+            group.wait();
+        }
+
+    private:
+        thread_pool& _pool;
+        vector<const node*> _leaves;
+        vector<size_t> _firstLeaf;
+        vector<size_t> _firstIndex;
+        bool _empty;
+    };
+
+    persistent_vector(node_ptr root, node_ptr tail)
+      : _root(root), _tail(tail)
+    {}
+
+    size_t root_size() const
+    {
+        return _root ? _root->size() : 0;
+    }
+
+    // Every leaf in order, the tail last.
+    void collect_leaves(vector<const node*>& leaves) const
+    {
+        collect_leaves(_root.get(), leaves);
+        if (_tail)
+            leaves.push_back(_tail.get());
+    }
+
+    static node_ptr make_leaf(vector<T>&& items)
+    {
+        std::shared_ptr<node> n = std::make_shared<node>();
+        n->height = 0;
+        n->items = std::move(items);
+        return n;
+    }
+
+    static node_ptr make_inner(vector<node_ptr>&& children)
+    {
+        std::shared_ptr<node> n = std::make_shared<node>();
+        n->height = children[0]->height + 1;
+        n->ends.reserve(children.size());
+        size_t total = 0;
+        for (size_t i=0; i < children.size(); i++) {
+            total += children[i]->size();
+            n->ends.push_back(total);
+        }
+        n->children = std::move(children);
+        return n;
+    }
+
+    // Which child of 'n' element 'index' is under. A child can't hold more
+    // than branching^height elements, so it's at least index >> (bits *
+    // height) along, and exactly there if the children to its left are
+    // full.
+    static size_t child_index(const node* n, size_t index)
+    {
+        size_t shift = branchBits * n->height;
+        size_t c = shift < 64 ? index >> shift : 0;
+        while (n->ends[c] <= index)
+            c++;
+        return c;
+    }
+
+    // The leaf element 'index' is in, leaving 'index' as its position there.
+    static const node* find_leaf(const node* n, size_t& index)
+    {
+        while (n->height > 0) {
+            size_t c = child_index(n, index);
+            if (c > 0)
+                index -= n->ends[c - 1];
+            n = n->children[c].get();
+        }
+        return n;
+    }
+
+    static void collect_leaves(const node* n, vector<const node*>& leaves)
+    {
+        if (n == NULL)
+            return;
+        if (n->height == 0) {
+            leaves.push_back(n);
+            return;
+        }
+        for (size_t i=0; i < n->children.size(); i++)
+            collect_leaves(n->children[i].get(), leaves);
+    }
+
+    static node_ptr set_in(node_ptr const& n, size_t index, T const& x)
+    {
+        std::shared_ptr<node> copy = std::make_shared<node>(*n);
+        if (n->height == 0) {
+            copy->items[index] = x;
+        } else {
+            size_t c = child_index(n.get(), index);
+            size_t begin = c > 0 ? n->ends[c - 1] : 0;
+            copy->children[c] = set_in(n->children[c], index - begin, x);
+        }
+        return copy;
+    }
+
+    // A tree over 'nodes', which are all the same height, packing each
+    // inner node full.
+    static node_ptr build_tree(vector<node_ptr> const& nodes)
+    {
+        if (nodes.empty())
+            return node_ptr();
+
+        vector<node_ptr> level(nodes);
+        while (level.size() > 1) {
+            vector<node_ptr> parents;
+            for (size_t i=0; i < level.size(); i += branching) {
+                size_t n = std::min(branching, level.size() - i);
+                vector<node_ptr> children(level.begin() + i, level.begin() + i + n);
+                parents.push_back(make_inner(std::move(children)));
+            }
+            level.swap(parents);
+        }
+        return level[0];
+    }
+
+    static node_ptr concat_nodes(node_ptr const& left, node_ptr const& right)
+    {
+        if (!left)
+            return right;
+        if (!right)
+            return left;
+
+        vector<node_ptr> joined;
+        if (left->height >= right->height)
+            joined = append_right(left, right);
+        else
+            joined = append_left(right, left);
+        return joined.size() == 1 ? joined[0] : make_inner(std::move(joined));
+    }
+
+    // Two nodes of the same height, side by side: as one node if they fit
+    // in one, otherwise as they are.
+    static vector<node_ptr> join_siblings(node_ptr const& left, node_ptr const& right)
+    {
+        vector<node_ptr> joined;
+        if (left->height == 0 && left->items.size() + right->items.size() <= branching) {
+            vector<T> items;
+            items.reserve(left->items.size() + right->items.size());
+            items.insert(items.end(), left->items.begin(), left->items.end());
+            items.insert(items.end(), right->items.begin(), right->items.end());
+            joined.push_back(make_leaf(std::move(items)));
+        } else if (left->height > 0 && left->children.size() + right->children.size() <= branching) {
+            vector<node_ptr> children(left->children);
+            children.insert(children.end(), right->children.begin(), right->children.end());
+            joined.push_back(make_inner(std::move(children)));
+        } else {
+            joined.push_back(left);
+            joined.push_back(right);
+        }
+        return joined;
+    }
+
+    // Children for one node, or two if there's one too many. The spare
+    // goes on its own on the outside edge, 'right' or left, so the rest
+    // stay full.
+    static vector<node_ptr> pack_children(vector<node_ptr>&& children, bool right)
+    {
+        vector<node_ptr> packed;
+        if (children.size() <= branching) {
+            packed.push_back(make_inner(std::move(children)));
+            return packed;
+        }
+
+        size_t cut = right ? branching : 1;
+        vector<node_ptr> first(children.begin(), children.begin() + cut);
+        vector<node_ptr> second(children.begin() + cut, children.end());
+        packed.push_back(make_inner(std::move(first)));
+        packed.push_back(make_inner(std::move(second)));
+        return packed;
+    }
+
+    // 'n' with 'sub', which is no taller, hung off its right edge at the
+    // level where it fits. One node, or two if 'n' had to split.
+    static vector<node_ptr> append_right(node_ptr const& n, node_ptr const& sub)
+    {
+        if (n->height == sub->height)
+            return join_siblings(n, sub);
+
+        vector<node_ptr> joined = append_right(n->children.back(), sub);
+        vector<node_ptr> children(n->children);
+        children.pop_back();
+        children.insert(children.end(), joined.begin(), joined.end());
+        return pack_children(std::move(children), true);
+    }
+
+    // The same, off the left edge.
+    static vector<node_ptr> append_left(node_ptr const& n, node_ptr const& sub)
+    {
+        if (n->height == sub->height)
+            return join_siblings(sub, n);
+
+        vector<node_ptr> children = append_left(n->children[0], sub);
+        children.insert(children.end(), n->children.begin() + 1, n->children.end());
+        return pack_children(std::move(children), false);
+    }
+
+    // Elements [first, last) of the tree under 'n', as a node of the same
+    // height.
+    static node_ptr slice_node(node_ptr const& n, size_t first, size_t last)
+    {
+        if (first == 0 && last == n->size())
+            return n;
+
+        if (n->height == 0) {
+            vector<T> items(n->items.begin() + first, n->items.begin() + last);
+            return make_leaf(std::move(items));
+        }
+
+        vector<node_ptr> children;
+        for (size_t c = child_index(n.get(), first); ; c++) {
+            size_t begin = c > 0 ? n->ends[c - 1] : 0;
+            size_t end = n->ends[c];
+            children.push_back(slice_node(n->children[c], std::max(first, begin) - begin,
+                                          std::min(last, end) - begin));
+            if (end >= last)
+                break;
+        }
+        return make_inner(std::move(children));
+    }
+
+    // The parts, one after another.
+    static persistent_vector join(vector<persistent_vector> const& parts)
+    {
+        persistent_vector result;
+        for (size_t i=0; i < parts.size(); i++)
+            result = result.concat(parts[i]);
+        return result;
+    }
+
+    node_ptr _root;
+    node_ptr _tail;     // The last leaf, or NULL.
+};
+
+template <typename T>
+const size_t persistent_vector<T>::branchBits;
+
+template <typename T>
+const size_t persistent_vector<T>::branching;
+
+}  // namespace rtl
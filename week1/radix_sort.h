@@ -0,0 +1,213 @@
+// Radix sorting, for keys that are numbers or strings.
+#pragma once
+
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "simd_sort.h"
+#include "sort.h"
+#include "vector.h"
+
+namespace rtl {
+
+// Map a number to an unsigned integer that sorts the same way, so that it
+// can be sorted one byte at a time. Signed integers get their sign bit
+// flipped, floats borrow the mapping the SIMD kernels use.
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value,
+    typename std::make_unsigned<T>::type>::type
+radix_key(T x)
+{
+    typedef typename std::make_unsigned<T>::type Key;
+    Key key = Key(x);
+    if (std::is_signed<T>::value)
+        key ^= Key(1) << (sizeof(Key) * 8 - 1);
+    return key;
+}
+
+inline uint32_t radix_key(float x)
+{
+    return uint32_t(simd_key_traits<float>::to_key(x)) ^ 0x80000000u;
+}
+
+inline uint64_t radix_key(double x)
+{
+    return uint64_t(simd_key_traits<double>::to_key(x)) ^ 0x8000000000000000ull;
+}
+
+struct radix_identity {
+    template <typename T> T const& operator()(T const& x) const
+    {
+        return x;
+    }
+};
+
+// Move every element of 'src' to 'dst', into the bucket for the byte of its
+// key at 'shift'. 'offsets' holds where each bucket starts, and is used up.
+template <typename Src, typename Dst, typename KeyFn>
+void radix_scatter(Src src, size_t count, Dst dst, size_t* offsets, unsigned shift, KeyFn keyFn)
+{
+    for (size_t i=0; i < count; i++) {
+        size_t digit = (radix_key(keyFn(src[i])) >> shift) & 0xff;
+        dst[offsets[digit]++] = std::move(src[i]);
+    }
+}
+
+// LSD radix sort of [first, last) by keyFn(element), which must return a
+// number (integer or float). Stable.
+//
+// The keys are read once up front to count every byte, then each byte gets
+// one pass that moves the elements between the input and a single scratch
+// buffer. A byte that's the same in every key doesn't need a pass.
+template <typename Iter, typename KeyFn>
+void radix_sort(Iter first, Iter last, KeyFn keyFn)
+{
+    typedef typename std::iterator_traits<Iter>::value_type T;
+    typedef decltype(radix_key(keyFn(*first))) Key;
+
+    const size_t numDigits = sizeof(Key);
+    const size_t count = last - first;
+
+    if (count < 2)
+        return;
+
+    size_t counts[numDigits][256] = {};
+    for (Iter it = first; it != last; ++it) {
+        Key key = radix_key(keyFn(*it));
+        for (size_t d=0; d < numDigits; d++)
+            counts[d][(key >> (d * 8)) & 0xff]++;
+    }
+
+    Key firstKey = radix_key(keyFn(*first));
+    size_t passes[numDigits];
+    size_t numPasses = 0;
+    for (size_t d=0; d < numDigits; d++) {
+        if (counts[d][(firstKey >> (d * 8)) & 0xff] != count)
+            passes[numPasses++] = d;
+    }
+
+    if (numPasses == 0)
+        return;
+
+    // Like mergesort, the scratch buffer starts out holding the data.
+    vector<T> scratch(std::make_move_iterator(first), std::make_move_iterator(last));
+    bool inScratch = true;
+
+    for (size_t p=0; p < numPasses; p++) {
+        size_t d = passes[p];
+
+        // Turn the counts into bucket start offsets.
+        size_t offsets[256];
+        size_t total = 0;
+        for (size_t digit=0; digit < 256; digit++) {
+            offsets[digit] = total;
+            total += counts[d][digit];
+        }
+
+        if (inScratch)
+            radix_scatter(scratch.begin(), count, first, offsets, d * 8, keyFn);
+        else
+            radix_scatter(first, count, scratch.begin(), offsets, d * 8, keyFn);
+        inScratch = !inScratch;
+    }
+
+    if (inScratch)
+        std::move(scratch.begin(), scratch.end(), first);
+}
+
+// The byte of 's' at 'depth', plus one. 0 means the string ended before it.
+inline size_t radix_string_digit(std::string const& s, size_t depth)
+{
+    return depth < s.size() ? size_t((unsigned char) s[depth]) + 1 : 0;
+}
+
+// MSD radix sort of strings that all match up to 'depth'. Each level puts the
+// strings into 257 buckets by their next byte, swapping in place (American
+// flag sort), then sorts each bucket on the following byte. Small buckets
+// get a comparison sort instead, and so does anything left after
+// 'recursionLeft' levels, so odd inputs can't run the stack out.
+template <typename Iter>
+void radix_sort_strings(Iter first, Iter last, size_t depth, int recursionLeft)
+{
+    const size_t comparisonSortThreshold = 32;
+
+    while (true) {
+        size_t count = last - first;
+
+        if (count < comparisonSortThreshold) {
+            insertion_sort(first, last, std::less<std::string>());
+            return;
+        }
+
+        if (recursionLeft == 0) {
+            quicksort(first, last, std::less<std::string>());
+            return;
+        }
+
+        size_t ends[257] = {};
+        for (Iter it = first; it != last; ++it)
+            ends[radix_string_digit(*it, depth)]++;
+
+        // Every string has the same byte here, so there's nothing to move.
+        // (If they all ended, they're all equal.)
+        size_t shared = radix_string_digit(*first, depth);
+        if (ends[shared] == count) {
+            if (shared == 0)
+                return;
+            depth++;
+            continue;
+        }
+
+        size_t next[257];
+        size_t total = 0;
+        for (size_t b=0; b < 257; b++) {
+            next[b] = total;
+            total += ends[b];
+            ends[b] = total;
+        }
+
+        // Fill in each bucket, swapping whatever is in the way over to
+        // where it belongs.
+        for (size_t b=0; b < 257; b++) {
+            while (next[b] < ends[b]) {
+                size_t digit = radix_string_digit(first[next[b]], depth);
+                if (digit == b)
+                    next[b]++;
+                else
+                    std::swap(first[next[b]], first[next[digit]++]);
+            }
+        }
+
+        // Bucket 0 holds the strings that ended, which are all equal.
+        for (size_t b=1; b < 257; b++) {
+            size_t start = ends[b - 1];
+            if (ends[b] - start > 1)
+                radix_sort_strings(first + start, first + ends[b], depth + 1, recursionLeft - 1);
+        }
+        return;
+    }
+}
+
+template <typename Iter>
+void radix_sort_values(Iter first, Iter last, std::true_type)
+{
+    radix_sort_strings(first, last, 0, 48);
+}
+
+template <typename Iter>
+void radix_sort_values(Iter first, Iter last, std::false_type)
+{
+    radix_sort(first, last, radix_identity());
+}
+
+// Radix sort of numbers (LSD, stable) or std::strings (MSD, in place).
+template <typename Iter>
+void radix_sort(Iter first, Iter last)
+{
+    typedef typename std::iterator_traits<Iter>::value_type T;
+    radix_sort_values(first, last, std::is_same<T, std::string>());
+}
+
+}  // namespace rtl
@@ -0,0 +1,676 @@
+// A vector made of fixed size chunks, so it never moves its elements to grow.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <cassert>
+
+#include "vector.h"
+
+namespace rtl {
+
+// The biggest power of two that's no more than n (which must be at least 1).
+constexpr size_t round_down_power_of_two(size_t n, size_t p = 1)
+{
+    return p * 2 > n ? p : round_down_power_of_two(n, p * 2);
+}
+
+// The default number of elements per chunk: as many as fit in 4KB, rounded
+// down to a power of two so finding an element's chunk is a shift.
+template <typename T>
+struct segmented_vector_chunk_size {
+    static const size_t value = sizeof(T) >= 4096 ? 1 : round_down_power_of_two(4096 / sizeof(T));
+};
+
+// Like rtl::vector, but the elements live in chunks of N, allocated one at a
+// time (ChunkyString from the README, with chunks in a table rather than a
+// list). Growing allocates another chunk and never moves an element, so
+// push_back takes the same time whatever the size, memory never peaks at
+// more than one chunk over what's needed, and pointers to elements stay
+// good until they're erased. Only the table of chunks is reallocated, and
+// it's N times smaller than the elements.
+//
+// Iterators are random access, so the sorts work on it unchanged, and stay
+// within a chunk between steps. segment_begin() and segment_end() give each
+// chunk as a plain array, for loops that want to go at vector speed.
+//
+// Inserting or erasing in the middle only shifts the elements after it in
+// the same chunk: a full chunk is split in two, and an empty one is freed.
+// That moves those elements (and leaves iterators invalid, as in vector),
+// but no others. Indexing is a shift and a mask while all chunks but the
+// last are full, which is always the case if nothing was inserted or erased
+// in the middle; otherwise it's a binary search of the chunk table.
+template <typename T, size_t N = segmented_vector_chunk_size<T>::value,
+          typename Alloc = std::allocator<T> >
+class segmented_vector {
+    typedef std::allocator_traits<Alloc> alloc_traits;
+    static_assert(N > 0, "segmented_vector needs room for at least one element per chunk");
+    static_assert(std::is_same<typename Alloc::value_type, T>::value,
+                  "the allocator's value_type must be T");
+
+    struct segment {
+        T* data;
+        size_t start;   // Index of its first element.
+        size_t count;
+    };
+    typedef typename alloc_traits::template rebind_alloc<segment> SegmentAlloc;
+
+public:
+    typedef T value_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef Alloc allocator_type;
+    typedef size_t size_type;
+
+    template <typename V>
+    class basic_iterator {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef V* pointer;
+        typedef V& reference;
+
+        basic_iterator()
+          : _owner(NULL), _segment(0), _pos(NULL), _begin(NULL), _end(NULL)
+        {}
+
+        // iterator to const_iterator.
+        template <typename U, typename = typename std::enable_if<std::is_convertible<U*, V*>::value>::type>
+        basic_iterator(basic_iterator<U> const& it)
+          : _owner(it._owner), _segment(it._segment), _pos(it._pos), _begin(it._begin), _end(it._end)
+        {}
+
+        reference operator*() const
+        {
+            return *_pos;
+        }
+
+        pointer operator->() const
+        {
+            return _pos;
+        }
+
+        reference operator[](difference_type n) const
+        {
+            return *(*this + n);
+        }
+
+        basic_iterator& operator++()
+        {
+            ++_pos;
+            if (_pos == _end && _segment + 1 < _owner->_segments.size())
+                enter(_segment + 1, 0);
+            return *this;
+        }
+
+        basic_iterator operator++(int)
+        {
+            basic_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        basic_iterator& operator--()
+        {
+            if (_pos == _begin)
+                enter(_segment - 1, _owner->_segments[_segment - 1].count - 1);
+            else
+                --_pos;
+            return *this;
+        }
+
+        basic_iterator operator--(int)
+        {
+            basic_iterator old = *this;
+            --*this;
+            return old;
+        }
+
+        basic_iterator& operator+=(difference_type n)
+        {
+            // Steps within the chunk don't need to look at the table.
+            difference_type offset = (_pos - _begin) + n;
+            if (offset >= 0 && offset < _end - _begin) {
+                _pos = _begin + offset;
+            } else {
+                size_t s;
+                size_t o;
+                _owner->locate(index() + n, s, o);
+                enter(s, o);
+            }
+            return *this;
+        }
+
+        basic_iterator& operator-=(difference_type n)
+        {
+            return *this += -n;
+        }
+
+        basic_iterator operator+(difference_type n) const
+        {
+            basic_iterator it = *this;
+            return it += n;
+        }
+
+        friend basic_iterator operator+(difference_type n, basic_iterator const& it)
+        {
+            return it + n;
+        }
+
+        basic_iterator operator-(difference_type n) const
+        {
+            basic_iterator it = *this;
+            return it += -n;
+        }
+
+        difference_type operator-(basic_iterator const& other) const
+        {
+            return difference_type(index()) - difference_type(other.index());
+        }
+
+        // Two chunks can sit right next to each other in memory, so the end
+        // of one can have the same address as the start of the next.
+        bool operator==(basic_iterator const& other) const
+        {
+            return _pos == other._pos && _segment == other._segment;
+        }
+
+        bool operator!=(basic_iterator const& other) const
+        {
+            return !(*this == other);
+        }
+
+        bool operator<(basic_iterator const& other) const
+        {
+            return _segment < other._segment || (_segment == other._segment && _pos < other._pos);
+        }
+
+        bool operator>(basic_iterator const& other) const
+        {
+            return other < *this;
+        }
+
+        bool operator<=(basic_iterator const& other) const
+        {
+            return !(other < *this);
+        }
+
+        bool operator>=(basic_iterator const& other) const
+        {
+            return !(*this < other);
+        }
+
+    private:
+        friend class segmented_vector;
+        template <typename U> friend class basic_iterator;
+
+        basic_iterator(segmented_vector const* owner, size_t s, size_t offset)
+          : _owner(owner)
+        {
+            enter(s, offset);
+        }
+
+        void enter(size_t s, size_t offset)
+        {
+            _segment = s;
+            if (s < _owner->_segments.size()) {
+                segment const& seg = _owner->_segments[s];
+                _begin = seg.data;
+                _end = seg.data + seg.count;
+                _pos = _begin + offset;
+            } else {
+                _begin = _end = _pos = NULL;
+            }
+        }
+
+        size_t index() const
+        {
+            return _begin == NULL ? 0 : _owner->_segments[_segment].start + (_pos - _begin);
+        }
+
+        segmented_vector const* _owner;
+        size_t _segment;
+        V* _pos;
+        V* _begin;   // The chunk _pos is in.
+        V* _end;
+    };
+
+    typedef basic_iterator<T> iterator;
+    typedef basic_iterator<const T> const_iterator;
+
+    segmented_vector()
+      : _count(0), _packed(true)
+    {}
+
+    explicit segmented_vector(Alloc const& alloc)
+      : _alloc(alloc), _segments(SegmentAlloc(alloc)), _count(0), _packed(true)
+    {}
+
+    explicit segmented_vector(size_type n, const T& x = T(), Alloc const& alloc = Alloc())
+      : _alloc(alloc), _segments(SegmentAlloc(alloc)), _count(0), _packed(true)
+    {
+        for (size_t i=0; i < n; i++)
+            push_back(x);
+    }
+
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    segmented_vector(I first, I last, Alloc const& alloc = Alloc())
+      : _alloc(alloc), _segments(SegmentAlloc(alloc)), _count(0), _packed(true)
+    {
+        for (; first != last; ++first)
+            emplace_back(*first);
+    }
+
+    segmented_vector(segmented_vector const& v)
+      : _alloc(alloc_traits::select_on_container_copy_construction(v._alloc)),
+        _segments(SegmentAlloc(_alloc)), _count(0), _packed(true)
+    {
+        append(v);
+    }
+
+    segmented_vector(segmented_vector&& v)
+      : _alloc(v._alloc), _segments(std::move(v._segments)), _count(v._count), _packed(v._packed)
+    {
+        v._count = 0;
+        v._packed = true;
+    }
+
+    segmented_vector const& operator=(segmented_vector const& rhs)
+    {
+        if (this != &rhs) {
+            clear();
+            append(rhs);
+        }
+        return *this;
+    }
+
+    segmented_vector& operator=(segmented_vector&& rhs)
+    {
+        if (this != &rhs) {
+            clear();
+            swap(rhs);
+        }
+        return *this;
+    }
+
+    ~segmented_vector()
+    {
+        clear();
+    }
+
+    allocator_type get_allocator() const
+    {
+        return _alloc;
+    }
+
+    iterator begin()
+    {
+        return iterator(this, 0, 0);
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0, 0);
+    }
+
+    iterator end()
+    {
+        return _segments.empty() ? begin() : iterator(this, _segments.size() - 1, _segments.back().count);
+    }
+
+    const_iterator end() const
+    {
+        return _segments.empty() ? begin() : const_iterator(this, _segments.size() - 1, _segments.back().count);
+    }
+
+    size_type size() const
+    {
+        return _count;
+    }
+
+    bool empty() const
+    {
+        return _count == 0;
+    }
+
+    size_type max_size() const
+    {
+        return (size_t) -1;
+    }
+
+    // The chunks, in order, each holding a run of consecutive elements.
+    size_type segment_count() const
+    {
+        return _segments.size();
+    }
+
+    T* segment_begin(size_type s)
+    {
+        return _segments[s].data;
+    }
+
+    const T* segment_begin(size_type s) const
+    {
+        return _segments[s].data;
+    }
+
+    T* segment_end(size_type s)
+    {
+        return _segments[s].data + _segments[s].count;
+    }
+
+    const T* segment_end(size_type s) const
+    {
+        return _segments[s].data + _segments[s].count;
+    }
+
+    T& operator[](size_type n)
+    {
+        assert(n < _count);
+        return *element(n);
+    }
+
+    const T& operator[](size_type n) const
+    {
+        assert(n < _count);
+        return *element(n);
+    }
+
+    T& at(size_type n)
+    {
+        assert(n < _count);
+        return *element(n);
+    }
+
+    const T& at(size_type n) const
+    {
+        assert(n < _count);
+        return *element(n);
+    }
+
+    T& front()
+    {
+        assert(!empty());
+        return _segments[0].data[0];
+    }
+
+    const T& front() const
+    {
+        assert(!empty());
+        return _segments[0].data[0];
+    }
+
+    T& back()
+    {
+        assert(!empty());
+        return _segments.back().data[_segments.back().count - 1];
+    }
+
+    const T& back() const
+    {
+        assert(!empty());
+        return _segments.back().data[_segments.back().count - 1];
+    }
+
+    void push_back(const T& x)
+    {
+        emplace_back(x);
+    }
+
+    void push_back(T&& x)
+    {
+        emplace_back(std::move(x));
+    }
+
+    template <typename... Args> void emplace_back(Args&&... args)
+    {
+        if (_segments.empty() || _segments.back().count == N) {
+            // Nothing moves, so 'args' can't be left behind.
+            add_segment(_segments.size());
+        }
+
+        segment& last = _segments.back();
+        new (&last.data[last.count]) T(std::forward<Args>(args)...);
+        last.count++;
+        _count++;
+    }
+
+    void pop_back()
+    {
+        assert(!empty());
+        segment& last = _segments.back();
+        last.count--;
+        last.data[last.count].~T();
+        _count--;
+        if (last.count == 0)
+            remove_segment(_segments.size() - 1);
+    }
+
+    iterator insert(const_iterator p, const T& x)
+    {
+        return emplace(p, x);
+    }
+
+    iterator insert(const_iterator p, T&& x)
+    {
+        return emplace(p, std::move(x));
+    }
+
+    template <typename... Args> iterator emplace(const_iterator p, Args&&... args)
+    {
+        size_t index = p.index();
+        if (index == _count) {
+            emplace_back(std::forward<Args>(args)...);
+        } else {
+            // Build it first, since it may come from an element that's about
+            // to move.
+            T x(std::forward<Args>(args)...);
+            size_t s;
+            size_t offset;
+            locate(index, s, offset);
+            make_gap(s, offset);
+            new (element(index)) T(std::move(x));
+        }
+        return iterator_at(index);
+    }
+
+    iterator erase(const_iterator p)
+    {
+        return erase(p, p + 1);
+    }
+
+    iterator erase(const_iterator first, const_iterator last)
+    {
+        size_t index = first.index();
+        size_t n = last - first;
+        if (n == 0)
+            return iterator_at(index);
+
+        // A chunk at a time, from the back so nothing moves twice.
+        size_t end = index + n;
+        while (end > index) {
+            size_t s;
+            size_t offset;
+            locate(end - 1, s, offset);
+            segment& seg = _segments[s];
+            size_t from = std::max(index, seg.start) - seg.start;
+            size_t to = offset + 1;
+
+            for (size_t i=from; i < to; i++)
+                seg.data[i].~T();
+            relocate(&seg.data[from], &seg.data[to], seg.count - to);
+            seg.count -= to - from;
+            _count -= to - from;
+            end = seg.start + from;
+
+            if (seg.count == 0)
+                remove_segment(s);
+        }
+        renumber();
+        return iterator_at(index);
+    }
+
+    void swap(segmented_vector& v)
+    {
+        std::swap(_alloc, v._alloc);
+        _segments.swap(v._segments);
+        std::swap(_count, v._count);
+        std::swap(_packed, v._packed);
+    }
+
+    void clear()
+    {
+        while (!_segments.empty()) {
+            segment& last = _segments.back();
+            for (size_t i=0; i < last.count; i++)
+                last.data[i].~T();
+            alloc_traits::deallocate(_alloc, last.data, N);
+            _segments.pop_back();
+        }
+        _count = 0;
+        _packed = true;
+    }
+
+private:
+    template <typename V> friend class basic_iterator;
+
+    // Find the chunk element 'index' is in, and where in it. The end is just
+    // past the last element of the last chunk.
+    void locate(size_t index, size_t& s, size_t& offset) const
+    {
+        if (_segments.empty()) {
+            s = 0;
+            offset = 0;
+        } else if (_packed) {
+            s = index / N;
+            if (s == _segments.size())
+                s--;
+            offset = index - s * N;
+        } else {
+            // The last chunk that starts at or before it.
+            size_t lo = 0;
+            size_t hi = _segments.size();
+            while (hi - lo > 1) {
+                size_t middle = lo + (hi - lo) / 2;
+                if (_segments[middle].start <= index)
+                    lo = middle;
+                else
+                    hi = middle;
+            }
+            s = lo;
+            offset = index - _segments[lo].start;
+        }
+    }
+
+    T* element(size_t index) const
+    {
+        if (_packed)
+            return &_segments[index / N].data[index % N];
+        size_t s;
+        size_t offset;
+        locate(index, s, offset);
+        return &_segments[s].data[offset];
+    }
+
+    iterator iterator_at(size_t index)
+    {
+        size_t s;
+        size_t offset;
+        locate(index, s, offset);
+        return iterator(this, s, offset);
+    }
+
+    // Copy all of 'v' onto the end, filling each chunk before the next.
+    void append(segmented_vector const& v)
+    {
+        for (size_t s=0; s < v._segments.size(); s++) {
+            const T* p = v.segment_begin(s);
+            const T* end = v.segment_end(s);
+            while (p != end) {
+                if (_segments.empty() || _segments.back().count == N)
+                    add_segment(_segments.size());
+
+                segment& last = _segments.back();
+                size_t n = std::min(N - last.count, size_t(end - p));
+                std::uninitialized_copy(p, p + n, &last.data[last.count]);
+                last.count += n;
+                _count += n;
+                p += n;
+            }
+        }
+    }
+
+    // Put a new, empty chunk into the table at 's'.
+    void add_segment(size_t s)
+    {
+        segment seg;
+        seg.data = alloc_traits::allocate(_alloc, N);
+        seg.start = s < _segments.size() ? _segments[s].start : _count;
+        seg.count = 0;
+        try {
+            _segments.insert(_segments.begin() + s, seg);
+        } catch (...) {
+            alloc_traits::deallocate(_alloc, seg.data, N);
+            throw;
+        }
+    }
+
+    // Free chunk 's', which must be empty.
+    void remove_segment(size_t s)
+    {
+        alloc_traits::deallocate(_alloc, _segments[s].data, N);
+        _segments.erase(_segments.begin() + s);
+    }
+
+    // Leave an uninitialized hole at 'offset' in chunk 's', shifting what's
+    // after it in the chunk. A full chunk is split in half first.
+    void make_gap(size_t s, size_t offset)
+    {
+        if (_segments[s].count == N) {
+            add_segment(s + 1);
+            segment& full = _segments[s];
+            segment& half = _segments[s + 1];
+            size_t keep = N / 2;
+            relocate(half.data, &full.data[keep], N - keep);
+            half.count = N - keep;
+            full.count = keep;
+            if (offset > keep) {
+                s++;
+                offset -= keep;
+            }
+        }
+
+        segment& seg = _segments[s];
+        relocate_backward(&seg.data[offset + 1], &seg.data[offset], seg.count - offset);
+        seg.count++;
+        _count++;
+        renumber();
+    }
+
+    // Work out where each chunk starts, and whether they're still all full.
+    void renumber()
+    {
+        size_t start = 0;
+        _packed = true;
+        for (size_t s=0; s < _segments.size(); s++) {
+            _segments[s].start = start;
+            start += _segments[s].count;
+            if (_segments[s].count != N && s + 1 < _segments.size())
+                _packed = false;
+        }
+    }
+
+    Alloc _alloc;
+    vector<segment, SegmentAlloc> _segments;
+    size_t _count;
+    bool _packed;   // Every chunk but the last is full.
+};
+
+}  // namespace rtl
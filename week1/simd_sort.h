@@ -0,0 +1,597 @@
+// SIMD sorting kernels for plain numbers.
+//
+// quicksort and mergesort (see sort.h) hand arrays of 4 and 8 byte numbers
+// sorted by std::less or std::greater over to these. Every such type is first
+// mapped to a signed integer "key" whose ordering matches (unsigned values
+// get their top bit flipped, floats get their magnitude bits flipped when
+// negative, and descending order flips everything), so the kernels only have
+// to sort int32_t and int64_t.
+//
+// The kernels use AVX2, which is detected at runtime. On other CPUs (or
+// compilers), simd_sort_numbers just returns false and the caller carries on
+// with the generic code.
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <stdint.h>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RTL_SIMD_X86 1
+#include <immintrin.h>
+#define RTL_TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#else
+#define RTL_SIMD_X86 0
+#endif
+
+namespace rtl {
+
+inline bool simd_has_avx2()
+{
+#if RTL_SIMD_X86
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    return hasAvx2;
+#else
+    return false;
+#endif
+}
+
+// Maps a number type to the signed integer keys the kernels sort.
+template <typename T, typename Enable = void>
+struct simd_key_traits {
+    static const bool supported = false;
+};
+
+template <typename T>
+struct simd_key_traits<T, typename std::enable_if<std::is_integral<T>::value
+    && !std::is_same<T, bool>::value && (sizeof(T) == 4 || sizeof(T) == 8)>::type>
+{
+    static const bool supported = true;
+    typedef typename std::conditional<sizeof(T) == 4, int32_t, int64_t>::type key_type;
+
+    // Signed and unsigned versions of a type may alias each other, so those
+    // keys can be computed in place.
+    static const bool in_place = std::is_same<typename std::make_signed<T>::type, key_type>::value;
+
+    static key_type to_key(T x)
+    {
+        key_type key = key_type(x);
+        if (std::is_unsigned<T>::value)
+            key ^= std::numeric_limits<key_type>::min();
+        return key;
+    }
+
+    static T from_key(key_type key)
+    {
+        if (std::is_unsigned<T>::value)
+            key ^= std::numeric_limits<key_type>::min();
+        return T(key);
+    }
+};
+
+template <typename T>
+struct simd_key_traits<T, typename std::enable_if<std::is_floating_point<T>::value
+    && (sizeof(T) == 4 || sizeof(T) == 8)>::type>
+{
+    static const bool supported = true;
+    typedef typename std::conditional<sizeof(T) == 4, int32_t, int64_t>::type key_type;
+    static const bool in_place = false;
+
+    // IEEE floats order like sign-magnitude integers, so negative values
+    // need their magnitude bits flipped. NaNs end up at either end, which
+    // is as good a place as any.
+    static key_type to_key(T x)
+    {
+        key_type key;
+        memcpy(&key, &x, sizeof(key));
+        if (key < 0)
+            key ^= std::numeric_limits<key_type>::max();
+        return key;
+    }
+
+    static T from_key(key_type key)
+    {
+        if (key < 0)
+            key ^= std::numeric_limits<key_type>::max();
+        T x;
+        memcpy(&x, &key, sizeof(key));
+        return x;
+    }
+};
+
+#if RTL_SIMD_X86
+
+// Lookup tables for "compress": a permutation that moves the lanes whose
+// mask bit is clear to the front (in order), and the rest to the back.
+struct simd_compress_tables {
+    int32_t lanes8[256][8];
+    int32_t lanes4[16][8];
+
+    simd_compress_tables()
+    {
+        for (int mask=0; mask < 256; mask++) {
+            int out = 0;
+            for (int lane=0; lane < 8; lane++)
+                if (!(mask & (1 << lane)))
+                    lanes8[mask][out++] = lane;
+            for (int lane=0; lane < 8; lane++)
+                if (mask & (1 << lane))
+                    lanes8[mask][out++] = lane;
+        }
+
+        // 64-bit lanes are permuted as pairs of 32-bit lanes.
+        for (int mask=0; mask < 16; mask++) {
+            int out = 0;
+            for (int pass=0; pass < 2; pass++) {
+                for (int lane=0; lane < 4; lane++) {
+                    if (bool(mask & (1 << lane)) == bool(pass)) {
+                        lanes4[mask][out++] = lane * 2;
+                        lanes4[mask][out++] = lane * 2 + 1;
+                    }
+                }
+            }
+        }
+    }
+};
+
+inline simd_compress_tables const& simd_tables()
+{
+    static simd_compress_tables tables;
+    return tables;
+}
+
+RTL_TARGET_AVX2 inline __m256i simd_set1(int32_t x) { return _mm256_set1_epi32(x); }
+RTL_TARGET_AVX2 inline __m256i simd_set1(int64_t x) { return _mm256_set1_epi64x(x); }
+
+// Bitmask of the lanes of 'v' that belong right of 'pivot'. If 'strict',
+// that's everything >= pivot, otherwise everything > pivot.
+RTL_TARGET_AVX2 inline int simd_right_mask(int32_t, __m256i v, __m256i pivot, bool strict)
+{
+    if (strict)
+        return ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(pivot, v))) & 0xff;
+    return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, pivot)));
+}
+
+RTL_TARGET_AVX2 inline int simd_right_mask(int64_t, __m256i v, __m256i pivot, bool strict)
+{
+    if (strict)
+        return ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(pivot, v))) & 0xf;
+    return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, pivot)));
+}
+
+RTL_TARGET_AVX2 inline __m256i simd_compress(int32_t, __m256i v, int mask,
+    simd_compress_tables const& tables)
+{
+    __m256i perm = _mm256_loadu_si256((const __m256i*) tables.lanes8[mask]);
+    return _mm256_permutevar8x32_epi32(v, perm);
+}
+
+RTL_TARGET_AVX2 inline __m256i simd_compress(int64_t, __m256i v, int mask,
+    simd_compress_tables const& tables)
+{
+    __m256i perm = _mm256_loadu_si256((const __m256i*) tables.lanes4[mask]);
+    return _mm256_permutevar8x32_epi32(v, perm);
+}
+
+// Partition one vector's worth of keys: the left ones get written at
+// data[left], the right ones end just before data[right]. The two full-width
+// stores overlap the destination spans, so each side needs a full vector of
+// free space.
+template <typename Key>
+RTL_TARGET_AVX2 inline void simd_partition_vector(Key* data, __m256i v, __m256i pivot, bool strict,
+    size_t& left, size_t& right, simd_compress_tables const& tables)
+{
+    const size_t lanes = 32 / sizeof(Key);
+
+    int mask = simd_right_mask(Key(), v, pivot, strict);
+    size_t numRight = _mm_popcnt_u32(mask);
+    __m256i packed = simd_compress(Key(), v, mask, tables);
+
+    _mm256_storeu_si256((__m256i*) (data + left), packed);
+    _mm256_storeu_si256((__m256i*) (data + right - lanes), packed);
+
+    left += lanes - numRight;
+    right -= numRight;
+}
+
+// Same, for the last vectors, where the two stores would overwrite each
+// other.
+template <typename Key>
+RTL_TARGET_AVX2 inline void simd_partition_vector_exact(Key* data, __m256i v, __m256i pivot,
+    bool strict, size_t& left, size_t& right, simd_compress_tables const& tables)
+{
+    const size_t lanes = 32 / sizeof(Key);
+
+    int mask = simd_right_mask(Key(), v, pivot, strict);
+    size_t numRight = _mm_popcnt_u32(mask);
+    size_t numLeft = lanes - numRight;
+
+    Key packed[lanes];
+    _mm256_storeu_si256((__m256i*) packed, simd_compress(Key(), v, mask, tables));
+
+    memcpy(data + left, packed, numLeft * sizeof(Key));
+    memcpy(data + right - numRight, packed + numLeft, numRight * sizeof(Key));
+
+    left += numLeft;
+    right -= numRight;
+}
+
+// Partition data[0, n) in place so that keys < pivot (if 'strict') or
+// <= pivot (if not) come first. Returns how many that is.
+//
+// One vector from each end is held back in registers, which leaves a
+// vector's worth of free space at each end. Each step reads a vector from
+// whichever end has less free space, and writes its keys out to both ends.
+template <typename Key>
+RTL_TARGET_AVX2 size_t simd_partition(Key* data, size_t n, Key pivotValue, bool strict)
+{
+    const size_t lanes = 32 / sizeof(Key);
+
+    if (n < 2 * lanes) {
+        Key* middle = strict
+            ? std::partition(data, data + n, [=](Key x) { return x < pivotValue; })
+            : std::partition(data, data + n, [=](Key x) { return !(pivotValue < x); });
+        return middle - data;
+    }
+
+    simd_compress_tables const& tables = simd_tables();
+    __m256i pivot = simd_set1(pivotValue);
+
+    __m256i firstVector = _mm256_loadu_si256((const __m256i*) data);
+    __m256i lastVector = _mm256_loadu_si256((const __m256i*) (data + n - lanes));
+
+    size_t readLeft = lanes;
+    size_t readRight = n - lanes;
+    size_t writeLeft = 0;
+    size_t writeRight = n;
+
+    while (readRight - readLeft >= lanes) {
+        __m256i v;
+        if (readLeft - writeLeft <= writeRight - readRight) {
+            v = _mm256_loadu_si256((const __m256i*) (data + readLeft));
+            readLeft += lanes;
+        } else {
+            readRight -= lanes;
+            v = _mm256_loadu_si256((const __m256i*) (data + readRight));
+        }
+        simd_partition_vector(data, v, pivot, strict, writeLeft, writeRight, tables);
+    }
+
+    // Fewer than a vector's worth left in the middle. Once they're read,
+    // everything from writeLeft to writeRight is free.
+    Key rest[lanes];
+    size_t numRest = readRight - readLeft;
+    memcpy(rest, data + readLeft, numRest * sizeof(Key));
+
+    for (size_t i=0; i < numRest; i++) {
+        bool goesLeft = strict ? rest[i] < pivotValue : !(pivotValue < rest[i]);
+        if (goesLeft)
+            data[writeLeft++] = rest[i];
+        else
+            data[--writeRight] = rest[i];
+    }
+
+    simd_partition_vector_exact(data, firstVector, pivot, strict, writeLeft, writeRight, tables);
+    simd_partition_vector_exact(data, lastVector, pivot, strict, writeLeft, writeRight, tables);
+
+    return writeLeft;
+}
+
+// One step of a sorting network inside a vector of 8 keys: each lane is
+// compared with lane (i ^ partner), and the higher lane of each pair keeps
+// the larger key.
+RTL_TARGET_AVX2 inline __m256i simd_network_step(__m256i v, int partner)
+{
+    __m256i perm = _mm256_setr_epi32(0 ^ partner, 1 ^ partner, 2 ^ partner, 3 ^ partner,
+        4 ^ partner, 5 ^ partner, 6 ^ partner, 7 ^ partner);
+    __m256i takeMax = _mm256_setr_epi32(
+        0 > (0 ^ partner) ? -1 : 0, 1 > (1 ^ partner) ? -1 : 0,
+        2 > (2 ^ partner) ? -1 : 0, 3 > (3 ^ partner) ? -1 : 0,
+        4 > (4 ^ partner) ? -1 : 0, 5 > (5 ^ partner) ? -1 : 0,
+        6 > (6 ^ partner) ? -1 : 0, 7 > (7 ^ partner) ? -1 : 0);
+
+    __m256i other = _mm256_permutevar8x32_epi32(v, perm);
+    return _mm256_blendv_epi8(_mm256_min_epi32(v, other), _mm256_max_epi32(v, other), takeMax);
+}
+
+// Bitonic sort of the 8 keys in 'v'.
+RTL_TARGET_AVX2 inline __m256i simd_sort8(__m256i v)
+{
+    v = simd_network_step(v, 1);
+    v = simd_network_step(v, 3);
+    v = simd_network_step(v, 1);
+    v = simd_network_step(v, 7);
+    v = simd_network_step(v, 2);
+    v = simd_network_step(v, 1);
+    return v;
+}
+
+// Merge two sorted vectors of 8 keys: afterwards 'a' holds the smallest 8 and
+// 'b' the largest 8, both sorted.
+RTL_TARGET_AVX2 inline void simd_merge8x8(__m256i& a, __m256i& b)
+{
+    __m256i reversed = _mm256_permutevar8x32_epi32(b, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    __m256i lo = _mm256_min_epi32(a, reversed);
+    __m256i hi = _mm256_max_epi32(a, reversed);
+
+    // Both halves are now bitonic, and every key in 'lo' is <= every key in
+    // 'hi'. Finish each with a half-cleaner.
+    a = simd_network_step(simd_network_step(simd_network_step(lo, 4), 2), 1);
+    b = simd_network_step(simd_network_step(simd_network_step(hi, 4), 2), 1);
+}
+
+// Sort up to 16 keys with a bitonic network, padding out the empty lanes
+// with the largest key.
+RTL_TARGET_AVX2 inline void simd_small_sort(int32_t* data, size_t n)
+{
+    int32_t buffer[16];
+    for (size_t i=0; i < 16; i++)
+        buffer[i] = std::numeric_limits<int32_t>::max();
+    memcpy(buffer, data, n * sizeof(int32_t));
+
+    __m256i a = simd_sort8(_mm256_loadu_si256((const __m256i*) buffer));
+    if (n > 8) {
+        __m256i b = simd_sort8(_mm256_loadu_si256((const __m256i*) (buffer + 8)));
+        simd_merge8x8(a, b);
+        _mm256_storeu_si256((__m256i*) (buffer + 8), b);
+    }
+    _mm256_storeu_si256((__m256i*) buffer, a);
+
+    memcpy(data, buffer, n * sizeof(int32_t));
+}
+
+// 64-bit keys only fit 4 to a vector, which doesn't leave much for a network
+// to do, so small ranges just get insertion sort.
+inline void simd_small_sort(int64_t* data, size_t n)
+{
+    for (size_t i=1; i < n; i++) {
+        int64_t value = data[i];
+        size_t hole = i;
+        while (hole > 0 && value < data[hole - 1]) {
+            data[hole] = data[hole - 1];
+            hole--;
+        }
+        data[hole] = value;
+    }
+}
+
+template <typename Key>
+Key simd_median3(Key a, Key b, Key c)
+{
+    return std::max(std::min(a, b), std::min(std::max(a, b), c));
+}
+
+// Quicksort on keys, structured like quicksort_loop in sort.h.
+template <typename Key>
+RTL_TARGET_AVX2 void simd_quicksort_loop(Key* first, Key* last, size_t depthLimit)
+{
+    const ptrdiff_t smallSortThreshold = 16;
+
+    while (last - first > smallSortThreshold) {
+        size_t count = last - first;
+
+        if (depthLimit == 0) {
+            std::make_heap(first, last);
+            std::sort_heap(first, last);
+            return;
+        }
+        depthLimit--;
+
+        // Median of three, or ninther for big ranges.
+        size_t step = count / 8;
+        Key* middle = first + count / 2;
+        Key pivot;
+        if (count > 128) {
+            pivot = simd_median3(
+                simd_median3(first[0], first[step], first[step * 2]),
+                simd_median3(middle[-ptrdiff_t(step)], middle[0], middle[step]),
+                simd_median3(last[-1 - ptrdiff_t(step * 2)], last[-1 - ptrdiff_t(step)], last[-1]));
+        } else {
+            pivot = simd_median3(first[0], *middle, last[-1]);
+        }
+
+        Key* leftLast = first + simd_partition(first, count, pivot, true);
+        Key* rightFirst = leftLast;
+
+        if (leftLast == first) {
+            // Nothing was less than the pivot. Pull out everything equal to
+            // it too, those are done.
+            rightFirst = first + simd_partition(first, count, pivot, false);
+        }
+
+        // Recurse into the smaller side and loop on the larger one.
+        if (leftLast - first < last - rightFirst) {
+            simd_quicksort_loop(first, leftLast, depthLimit);
+            first = rightFirst;
+        } else {
+            simd_quicksort_loop(rightFirst, last, depthLimit);
+            last = leftLast;
+        }
+    }
+
+    simd_small_sort(first, last - first);
+}
+
+template <typename Key>
+RTL_TARGET_AVX2 void simd_quicksort_keys(Key* data, size_t n)
+{
+    size_t depthLimit = 0;
+    for (size_t i = n; i > 1; i /= 2)
+        depthLimit += 2;
+
+    simd_quicksort_loop(data, data + n, depthLimit);
+}
+
+// Merge sorted a[0, aCount) and b[0, bCount) into 'out'. While both sides
+// have a full vector left, the smallest 8 of the two vectors in hand go out
+// and the next vector comes from whichever side has the smaller next key.
+RTL_TARGET_AVX2 inline void simd_merge(const int32_t* a, size_t aCount, const int32_t* b,
+    size_t bCount, int32_t* out)
+{
+    const int32_t* aEnd = a + aCount;
+    const int32_t* bEnd = b + bCount;
+
+    int32_t held[8];
+    const int32_t* heldIt = held;
+    const int32_t* heldEnd = held;
+
+    if (aCount >= 8 && bCount >= 8) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*) a);
+        __m256i hi = _mm256_loadu_si256((const __m256i*) b);
+        a += 8;
+        b += 8;
+
+        simd_merge8x8(lo, hi);
+        _mm256_storeu_si256((__m256i*) out, lo);
+        out += 8;
+
+        while (aEnd - a >= 8 && bEnd - b >= 8) {
+            if (*a <= *b) {
+                lo = _mm256_loadu_si256((const __m256i*) a);
+                a += 8;
+            } else {
+                lo = _mm256_loadu_si256((const __m256i*) b);
+                b += 8;
+            }
+
+            simd_merge8x8(lo, hi);
+            _mm256_storeu_si256((__m256i*) out, lo);
+            out += 8;
+        }
+
+        _mm256_storeu_si256((__m256i*) held, hi);
+        heldEnd = held + 8;
+    }
+
+    // Finish off the held vector and whatever is left of each side.
+    while (true) {
+        const int32_t** smallest = NULL;
+        if (heldIt != heldEnd)
+            smallest = &heldIt;
+        if (a != aEnd && (smallest == NULL || *a < **smallest))
+            smallest = &a;
+        if (b != bEnd && (smallest == NULL || *b < **smallest))
+            smallest = &b;
+
+        if (smallest == NULL)
+            break;
+
+        *out++ = *(*smallest)++;
+    }
+}
+
+// Bottom-up mergesort on keys: sorted blocks of 16 from the network, then
+// merge passes between 'data' and one scratch buffer.
+RTL_TARGET_AVX2 inline void simd_mergesort_keys(int32_t* data, size_t n)
+{
+    const size_t blockSize = 16;
+
+    // Already sorted (or the reverse) input is common enough to check for.
+    size_t ascending = 1;
+    while (ascending < n && data[ascending - 1] <= data[ascending])
+        ascending++;
+    if (ascending == n)
+        return;
+
+    size_t descending = 1;
+    while (descending < n && data[descending - 1] > data[descending])
+        descending++;
+    if (descending == n) {
+        std::reverse(data, data + n);
+        return;
+    }
+
+    for (size_t start = 0; start < n; start += blockSize)
+        simd_small_sort(data + start, std::min(blockSize, n - start));
+
+    if (n <= blockSize)
+        return;
+
+    int32_t* scratch = (int32_t*) malloc(n * sizeof(int32_t));
+    int32_t* src = data;
+    int32_t* dst = scratch;
+
+    for (size_t width = blockSize; width < n; width *= 2) {
+        for (size_t lo = 0; lo < n; lo += width * 2) {
+            size_t mid = std::min(lo + width, n);
+            size_t hi = std::min(lo + width * 2, n);
+            simd_merge(src + lo, mid - lo, src + mid, hi - mid, dst + lo);
+        }
+        std::swap(src, dst);
+    }
+
+    if (src != data)
+        memcpy(data, src, n * sizeof(int32_t));
+    free(scratch);
+}
+
+// Equal 64-bit keys are indistinguishable, so stability doesn't matter and
+// there's no separate merge kernel for them.
+inline void simd_mergesort_keys(int64_t* data, size_t n)
+{
+    simd_quicksort_keys(data, n);
+}
+
+#endif  // RTL_SIMD_X86
+
+template <typename T>
+bool simd_sort_numbers(T*, size_t, bool, bool, std::false_type)
+{
+    return false;
+}
+
+template <typename T>
+bool simd_sort_numbers(T* data, size_t n, bool descending, bool stable, std::true_type)
+{
+#if RTL_SIMD_X86
+    typedef simd_key_traits<T> traits;
+    typedef typename traits::key_type key_type;
+
+    if (!simd_has_avx2())
+        return false;
+
+    // Floats have values that compare equal but aren't the same (0.0 and
+    // -0.0), so a stable sort can't go through keys.
+    if (stable && std::is_floating_point<T>::value)
+        return false;
+
+    key_type* keys = traits::in_place
+        ? (key_type*) data
+        : (key_type*) malloc(n * sizeof(key_type));
+
+    // Descending order is ascending order of the complemented keys.
+    key_type flip = descending ? key_type(-1) : key_type(0);
+
+    for (size_t i=0; i < n; i++)
+        keys[i] = traits::to_key(data[i]) ^ flip;
+
+    if (stable)
+        simd_mergesort_keys(keys, n);
+    else
+        simd_quicksort_keys(keys, n);
+
+    for (size_t i=0; i < n; i++)
+        data[i] = traits::from_key(keys[i] ^ flip);
+
+    if (!traits::in_place)
+        free(keys);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Sort data[0, n) with the SIMD kernels, if T is a supported number type and
+// the CPU can run them. Returns false without touching the data otherwise.
+template <typename T>
+bool simd_sort_numbers(T* data, size_t n, bool descending, bool stable)
+{
+    return simd_sort_numbers(data, n, descending, stable,
+        std::integral_constant<bool, simd_key_traits<T>::supported>());
+}
+
+}  // namespace rtl
@@ -0,0 +1,500 @@
+// A vector that keeps its first few elements inside itself.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <cassert>
+
+#include "vector.h"
+
+namespace rtl {
+
+// Same interface as rtl::vector, but up to N elements live in a buffer inside
+// the small_vector itself, so small ones never touch the allocator (and
+// copying them doesn't either). Past N the elements move out to the heap,
+// growing the way vector does; clear() brings them back inside. Moving a
+// small_vector takes its heap buffer, but inline elements have to be moved
+// one by one.
+template <typename T, size_t N, typename Alloc = std::allocator<T> >
+class small_vector {
+    typedef std::allocator_traits<Alloc> alloc_traits;
+    static_assert(N > 0, "small_vector needs room for at least one element");
+    static_assert(std::is_same<typename Alloc::value_type, T>::value,
+                  "the allocator's value_type must be T");
+
+public:
+    typedef T value_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef Alloc allocator_type;
+    typedef size_t size_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef T* reverse_iterator;
+    typedef const T* const_reverse_iterator;
+
+    small_vector()
+    {
+        init();
+    }
+
+    explicit small_vector(Alloc const& alloc)
+      : _alloc(alloc)
+    {
+        init();
+    }
+
+    explicit small_vector(size_type n, const T& x = T(), Alloc const& alloc = Alloc())
+      : _alloc(alloc)
+    {
+        init();
+        resize(n, x);
+    }
+
+    small_vector(const small_vector& v)
+      : _alloc(alloc_traits::select_on_container_copy_construction(v._alloc))
+    {
+        init();
+        assign(v.begin(), v.end());
+    }
+
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    small_vector(I first, I last, Alloc const& alloc = Alloc())
+      : _alloc(alloc)
+    {
+        init();
+        assign(first, last);
+    }
+
+    small_vector(small_vector&& v) noexcept(std::is_nothrow_move_constructible<T>::value)
+      : _alloc(v._alloc)
+    {
+        init();
+        take(v);
+    }
+
+    small_vector const& operator=(small_vector const& rhs)
+    {
+        if (this != &rhs)
+            assign(rhs.begin(), rhs.end());
+        return *this;
+    }
+
+    small_vector& operator=(small_vector&& rhs)
+    {
+        if (this == &rhs)
+            return *this;
+
+        clear();
+        if (!rhs.is_inline() && !alloc_traits::propagate_on_container_move_assignment::value &&
+            !(_alloc == rhs._alloc)) {
+            // Memory from another allocator can't be freed by ours.
+            assign(std::make_move_iterator(rhs.begin()), std::make_move_iterator(rhs.end()));
+            rhs.clear();
+            return *this;
+        }
+
+        if (alloc_traits::propagate_on_container_move_assignment::value)
+            _alloc = rhs._alloc;
+        take(rhs);
+        return *this;
+    }
+
+    ~small_vector()
+    {
+        clear();
+    }
+
+    allocator_type get_allocator() const
+    {
+        return _alloc;
+    }
+
+    // True while the elements are in the inline buffer.
+    bool is_inline() const
+    {
+        return _data == inline_data();
+    }
+
+    iterator begin()
+    {
+        return _data;
+    }
+
+    const_iterator begin() const
+    {
+        return _data;
+    }
+
+    iterator end()
+    {
+        return _data + _count;
+    }
+
+    const_iterator end() const
+    {
+        return _data + _count;
+    }
+
+    reverse_iterator rbegin()
+    {
+        return _data + _count - 1;
+    }
+    const_reverse_iterator rbegin() const
+    {
+        return _data + _count - 1;
+    }
+
+    reverse_iterator rend()
+    {
+        return _data - 1;
+    }
+    const_reverse_iterator rend() const
+    {
+        return _data - 1;
+    }
+
+    size_type size() const
+    {
+        return _count;
+    }
+
+    size_type max_size() const
+    {
+        return (size_t) -1;
+    }
+    void resize(size_type size, T const& copy = T())
+    {
+        if (size == 0) {
+            clear();
+            return;
+        }
+
+        // Growing would leave 'copy' behind if it's one of ours.
+        if (size > _capacity && contains(&copy)) {
+            T copyOfCopy(copy);
+            resize(size, copyOfCopy);
+            return;
+        }
+
+        reserve(size);
+
+        if (_count < size) {
+            for (size_t i=_count; i < size; i++)
+                new (&_data[i]) T(copy);
+        } else {
+            for (size_t i=size; i < _count; i++)
+                _data[i].~T();
+        }
+
+        _count = size;
+    }
+
+    size_type capacity() const
+    {
+        return _capacity;
+    }
+    bool empty() const
+    {
+        return _count == 0;
+    }
+    void reserve(size_type n)
+    {
+        if (n > _capacity) {
+            size_t newCapacity = vector_grow_capacity(_capacity, n);
+            T* newData = alloc_traits::allocate(_alloc, newCapacity);
+
+            relocate(newData, _data, _count);
+
+            free_heap();
+            _data = newData;
+            _capacity = newCapacity;
+        }
+    }
+
+    T& operator[](size_type n)
+    {
+        assert(n < _count);
+        return _data[n];
+    }
+    const T& operator[](size_type n) const
+    {
+        assert(n < _count);
+        return _data[n];
+    }
+    T& at(size_type n)
+    {
+        assert(n < _count);
+        return _data[n];
+    }
+    const T& at(size_type n) const
+    {
+        assert(n < _count);
+        return _data[n];
+    }
+    T& front()
+    {
+        assert(!empty());
+        return _data[0];
+    }
+    const T& front() const
+    {
+        assert(!empty());
+        return _data[0];
+    }
+    T& back()
+    {
+        assert(!empty());
+        return _data[_count - 1];
+    }
+    const T& back() const
+    {
+        assert(!empty());
+        return _data[_count - 1];
+    }
+
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    void assign(I first, I last)
+    {
+        clear();
+        insert_range(0, first, last, typename std::iterator_traits<I>::iterator_category());
+    }
+    void assign(size_type n, const T& x)
+    {
+        clear();
+        resize(n, x);
+    }
+
+    void push_back(const T& x)
+    {
+        emplace_back(x);
+    }
+    void push_back(T&& x)
+    {
+        emplace_back(std::move(x));
+    }
+    template <typename... Args> void emplace_back(Args&&... args)
+    {
+        if (_count < _capacity) {
+            new (&_data[_count]) T(std::forward<Args>(args)...);
+            _count++;
+            return;
+        }
+
+        // Build the new element before moving the old ones, which 'args'
+        // may refer to.
+        size_t newCapacity = vector_grow_capacity(_capacity, _count + 1);
+        T* newData = alloc_traits::allocate(_alloc, newCapacity);
+        try {
+            new (&newData[_count]) T(std::forward<Args>(args)...);
+        } catch (...) {
+            alloc_traits::deallocate(_alloc, newData, newCapacity);
+            throw;
+        }
+
+        relocate(newData, _data, _count);
+
+        free_heap();
+        _data = newData;
+        _capacity = newCapacity;
+        _count++;
+    }
+    void pop_back()
+    {
+        assert(!empty());
+        _count--;
+        _data[_count].~T();
+    }
+    iterator insert(iterator p, const T& x)
+    {
+        size_t index = p - _data;
+        insert(p, size_type(1), x);
+        return &_data[index];
+    }
+    iterator insert(iterator p, T&& x)
+    {
+        if (contains(&x))
+            return emplace(p, std::move(x));
+
+        size_t index = p - _data;
+        make_gap(index, 1);
+        new (&_data[index]) T(std::move(x));
+        _count++;
+        return &_data[index];
+    }
+    template <typename... Args> iterator emplace(iterator p, Args&&... args)
+    {
+        size_t index = p - _data;
+        if (index == _count) {
+            emplace_back(std::forward<Args>(args)...);
+        } else {
+            T x(std::forward<Args>(args)...);
+            make_gap(index, 1);
+            new (&_data[index]) T(std::move(x));
+            _count++;
+        }
+        return &_data[index];
+    }
+
+    void insert(iterator p, size_type insertCount, const T& x)
+    {
+        size_t insertLoc = p - _data;
+
+        if (contains(&x)) {
+            T copy(x);
+            insert(p, insertCount, copy);
+            return;
+        }
+
+        make_gap(insertLoc, insertCount);
+
+        for (size_t i=0; i < insertCount; i++)
+            new (&_data[insertLoc + i]) T(x);
+
+        _count += insertCount;
+    }
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    void insert(iterator p, I first, I last)
+    {
+        insert_range(p - _data, first, last, typename std::iterator_traits<I>::iterator_category());
+    }
+    iterator erase(iterator p)
+    {
+        size_t index = p - _data;
+        erase(p, p+1);
+        return &_data[index];
+    }
+    iterator erase(iterator first, iterator last)
+    {
+        size_t firstIndex = first - _data;
+        size_t lastIndex = last - _data;
+
+        for (size_t i=firstIndex; i < lastIndex; i++)
+            _data[i].~T();
+
+        if (lastIndex < _count)
+            relocate(&_data[firstIndex], &_data[lastIndex], _count - lastIndex);
+
+        _count -= lastIndex - firstIndex;
+
+        return &_data[firstIndex];
+    }
+
+    // Heap buffers just trade places. Inline elements have to be moved, so
+    // go through a temporary.
+    void swap(small_vector& v)
+    {
+        if (!is_inline() && !v.is_inline()) {
+            std::swap(_alloc, v._alloc);
+            std::swap(_data, v._data);
+            std::swap(_count, v._count);
+            std::swap(_capacity, v._capacity);
+            return;
+        }
+
+        small_vector temp(_alloc);
+        temp.take(*this);
+        _alloc = v._alloc;
+        take(v);
+        v._alloc = temp._alloc;
+        v.take(temp);
+    }
+    void clear()
+    {
+        for (size_t i=0; i < _count; i++)
+            _data[i].~T();
+        _count = 0;
+        free_heap();
+        _data = inline_data();
+        _capacity = N;
+    }
+
+private:
+    void init()
+    {
+        _data = inline_data();
+        _count = 0;
+        _capacity = N;
+    }
+
+    T* inline_data()
+    {
+        return reinterpret_cast<T*>(_inline);
+    }
+    const T* inline_data() const
+    {
+        return reinterpret_cast<const T*>(_inline);
+    }
+
+    void free_heap()
+    {
+        if (!is_inline())
+            alloc_traits::deallocate(_alloc, _data, _capacity);
+    }
+
+    bool contains(const T* p) const
+    {
+        return p >= _data && p < _data + _count;
+    }
+
+    void make_gap(size_t insertLoc, size_t insertCount)
+    {
+        reserve(_count + insertCount);
+        relocate_backward(&_data[insertLoc + insertCount], &_data[insertLoc],
+            _count - insertLoc);
+    }
+
+    template <typename I>
+    void insert_range(size_t insertLoc, I first, I last, std::forward_iterator_tag)
+    {
+        size_t insertCount = std::distance(first, last);
+        make_gap(insertLoc, insertCount);
+
+        size_t i = insertLoc;
+        for (I it = first; it != last; ++it)
+            new (&_data[i++]) T(*it);
+
+        _count += insertCount;
+    }
+
+    template <typename I>
+    void insert_range(size_t insertLoc, I first, I last, std::input_iterator_tag)
+    {
+        size_t oldCount = _count;
+        for (; first != last; ++first)
+            emplace_back(*first);
+        std::rotate(begin() + insertLoc, begin() + oldCount, end());
+    }
+
+    // Take over the elements of 'from', which is left empty. We must be
+    // empty and inline already, and a heap buffer must be one our allocator
+    // can free.
+    void take(small_vector& from)
+    {
+        if (from.is_inline()) {
+            relocate(_data, from._data, from._count);
+            _count = from._count;
+        } else {
+            _data = from._data;
+            _count = from._count;
+            _capacity = from._capacity;
+            from._data = from.inline_data();
+            from._capacity = N;
+        }
+        from._count = 0;
+    }
+
+    Alloc _alloc;
+    T* _data;
+    size_t _count;
+    size_t _capacity;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type _inline[N];
+};
+
+}  // namespace rtl
@@ -3,94 +3,769 @@
 #include <algorithm>
 #include <iterator>
 #include <sstream>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "instrument.h"
+#include "simd_sort.h"
+#include "vector.h"
 
 #pragma once
 
 namespace rtl {
     
+// Plain numbers sorted with std::less or std::greater can go to the SIMD
+// kernels in simd_sort.h. Anything else (or a CPU without the instructions)
+// gets a false, and the caller sorts it the usual way.
 template <typename Iter, typename Comp>
-void mergesort(Iter first, Iter last, Comp comp)
+bool sort_with_simd(Iter, Iter, Comp, bool)
 {
-    // 0 or 1 elements is already sorted.
-    if ((first + 1) >= last)
+    return false;
+}
+
+template <typename T>
+bool sort_with_simd(T* first, T* last, std::less<T>, bool stable)
+{
+    return simd_sort_numbers(first, last - first, false, stable);
+}
+
+template <typename T>
+bool sort_with_simd(T* first, T* last, std::greater<T>, bool stable)
+{
+    return simd_sort_numbers(first, last - first, true, stable);
+}
+
+// Swap two elements, counting it if 'comp' is instrumented.
+template <typename Iter, typename Comp>
+void sort_swap(Iter a, Iter b, Comp const& comp)
+{
+    instrument_swap(comp);
+    std::iter_swap(a, b);
+}
+
+// Stable insertion sort, for short ranges.
+template <typename Iter, typename Comp>
+void insertion_sort(Iter first, Iter last, Comp comp)
+{
+    if (first == last)
         return;
 
-    Iter middle = (first + (last - first) / 2);
+    for (Iter it = first + 1; it != last; ++it) {
+        typename std::iterator_traits<Iter>::value_type value = std::move(*it);
 
-    // Sort the left & right sides.
-    mergesort(first, middle, comp);
-    mergesort(middle, last, comp);
+        // Shift larger elements right until the hole is in the right spot.
+        Iter hole = it;
+        while (hole != first && comp(value, *(hole - 1))) {
+            *hole = std::move(*(hole - 1));
+            --hole;
+        }
+        *hole = std::move(value);
+        instrument_moves(comp, (it - hole) + 2);
+    }
+}
 
-    vector<typename std::iterator_traits<Iter>::value_type> temp;
-    temp.reserve(last - first);
+// Merge the sorted ranges [left, leftEnd) and [right, rightEnd) into 'out' by
+// moving elements. Ties are taken from the left, which keeps it stable.
+template <typename InLeft, typename InRight, typename Out, typename Comp>
+Out merge_move(InLeft left, InLeft leftEnd, InRight right, InRight rightEnd, Out out, Comp comp)
+{
+    instrument_moves(comp, (leftEnd - left) + (rightEnd - right));
+    while (left != leftEnd && right != rightEnd) {
+        if (comp(*right, *left))
+            *out++ = std::move(*right++);
+        else
+            *out++ = std::move(*left++);
+    }
+
+    // One side is exhausted, the rest of the other is already in order.
+    out = std::move(left, leftEnd, out);
+    return std::move(right, rightEnd, out);
+}
 
-    Iter leftIter = first;
-    Iter leftEnd = middle;
-    Iter rightIter = middle;
-    Iter rightEnd = last;
+// Find how many of the first 'k' elements of the stable merge of the sorted
+// ranges 'left' and 'right' come from 'left'. Lets a big merge be split into
+// independent pieces.
+template <typename InLeft, typename InRight, typename Comp>
+size_t merge_corank(size_t k, InLeft left, size_t leftCount, InRight right, size_t rightCount,
+    Comp comp)
+{
+    size_t lo = k > rightCount ? k - rightCount : 0;
+    size_t hi = std::min(k, leftCount);
 
-    while (leftIter != leftEnd || rightIter != rightEnd) {
+    while (lo < hi) {
+        size_t i = lo + (hi - lo) / 2;
+        size_t j = k - i;
 
-        if (leftIter == leftEnd) {
-            // Left list is exhausted.
-            temp.push_back(*(rightIter++));
-        } else if (rightIter == rightEnd) {
-            // Right list is exhausted.
-            temp.push_back(*(leftIter++));
-        } else if (comp(*leftIter, *rightIter)) {
-            temp.push_back(*(leftIter++));
+        // left[i] is among the first k if it's <= right[j-1] (ties go left).
+        if (!comp(right[j - 1], left[i]))
+            lo = i + 1;
+        else
+            hi = i;
+    }
+
+    return lo;
+}
+
+// Find the length of the sorted run at the start of [first, last). A strictly
+// descending run is reversed in place so that it's ascending. (A descending
+// run with equal elements would lose stability when reversed, so an equal
+// pair ends the run.)
+template <typename Iter, typename Comp>
+size_t mergesort_count_run(Iter first, Iter last, Comp comp)
+{
+    Iter it = first + 1;
+    if (it == last)
+        return 1;
+
+    if (comp(*it, *first)) {
+        while (++it != last && comp(*it, *(it - 1)))
+            ;
+        std::reverse(first, it);
+        for (ptrdiff_t i = (it - first) / 2; i > 0; i--)
+            instrument_swap(comp);
+    } else {
+        while (++it != last && !comp(*it, *(it - 1)))
+            ;
+    }
+
+    return it - first;
+}
+
+// One bottom-up pass: merge each pair of neighbouring runs from 'src' into the
+// same position in 'dst'. 'runs' holds the start offset of each run followed
+// by the total count, and is updated to describe the merged runs.
+template <typename Src, typename Dst, typename Runs, typename Comp>
+void mergesort_pass(Src src, Dst dst, Runs& runs, Comp comp)
+{
+    size_t numRuns = runs.size() - 1;
+    size_t total = runs[numRuns];
+    size_t merged = 0;
+
+    for (size_t i=0; i < numRuns; i += 2) {
+        size_t lo = runs[i];
+
+        if (i + 1 == numRuns) {
+            // Odd one out, carry it over unchanged.
+            std::move(src + lo, src + total, dst + lo);
+            instrument_moves(comp, total - lo);
         } else {
-            temp.push_back(*(rightIter++));
+            size_t mid = runs[i + 1];
+            size_t hi = runs[i + 2];
+
+            if (!comp(src[mid], src[mid - 1])) {
+                // Already in order with each other.
+                std::move(src + lo, src + hi, dst + lo);
+                instrument_moves(comp, hi - lo);
+            } else {
+                merge_move(src + lo, src + mid, src + mid, src + hi, dst + lo, comp);
+            }
         }
+
+        runs[merged++] = lo;
     }
 
-    // Insert sorted list.
-    for (Iter insertIter = first, tempIter = temp.begin(); insertIter != last; ++insertIter, ++tempIter)
-        std::swap(*insertIter, *tempIter);
+    runs[merged++] = total;
+    runs.resize(merged);
+}
+
+// Stable, bottom-up natural mergesort.
+//
+// The input is first split into runs that are already sorted (descending runs
+// get reversed), so sorted or reversed input finishes in linear time. Runs
+// shorter than a minimum length are extended with insertion sort. Then runs
+// are merged pairwise, moving back and forth between the input and a single
+// scratch buffer. Integers sorted with std::less or std::greater go to the
+// SIMD version instead, where the CPU supports it.
+//
+// The scratch buffer and run list come from 'alloc' (rebound as needed).
+// 'Instrument' counts what the sort does (see instrument.h); the depth it
+// reports is the number of merge passes.
+template <typename Instrument = default_instrument, typename Iter, typename Comp, typename Alloc>
+void mergesort(Iter first, Iter last, Comp userComp, Alloc const& alloc)
+{
+    typedef typename std::iterator_traits<Iter>::value_type T;
+    typedef std::allocator_traits<Alloc> alloc_traits;
+    typedef typename alloc_traits::template rebind_alloc<T> ScratchAlloc;
+    typedef typename alloc_traits::template rebind_alloc<size_t> RunsAlloc;
+
+    const size_t minRun = 32;
+    const size_t count = last - first;
+
+    // 0 or 1 elements is already sorted.
+    if (count < 2)
+        return;
+
+    if (sort_with_simd(first, last, userComp, true))
+        return;
+
+    auto comp = instrument_comparator<Instrument>::wrap(userComp);
+
+    vector<size_t, RunsAlloc> runs((RunsAlloc(alloc)));
+    for (size_t start = 0; start < count; ) {
+        size_t length = mergesort_count_run(first + start, last, comp);
+
+        if (length < minRun) {
+            length = std::min(minRun, count - start);
+            insertion_sort(first + start, first + start + length, comp);
+        }
+
+        runs.push_back(start);
+        start += length;
+    }
+    runs.push_back(count);
+
+    // A single run is already sorted.
+    if (runs.size() == 2)
+        return;
+
+    // The scratch buffer starts out holding the data, which leaves the input
+    // as the first destination.
+    vector<T, ScratchAlloc> scratch(std::make_move_iterator(first), std::make_move_iterator(last),
+                                    ScratchAlloc(alloc));
+    instrument_moves(comp, count);
+    bool inScratch = true;
+
+    for (size_t passes = 1; runs.size() > 2; passes++) {
+        if (inScratch)
+            mergesort_pass(scratch.begin(), first, runs, comp);
+        else
+            mergesort_pass(first, scratch.begin(), runs, comp);
+        inScratch = !inScratch;
+        instrument_depth(comp, passes);
+    }
+
+    if (inScratch) {
+        std::move(scratch.begin(), scratch.end(), first);
+        instrument_moves(comp, count);
+    }
+}
+
+template <typename Instrument = default_instrument, typename Iter, typename Comp>
+void mergesort(Iter first, Iter last, Comp comp)
+{
+    typedef typename std::iterator_traits<Iter>::value_type T;
+    mergesort<Instrument>(first, last, comp, std::allocator<T>());
+}
+
+// Move the element at 'root' of a max-heap (with respect to 'comp') down to
+// where it belongs. The heap occupies the first 'count' elements.
+template <typename Iter, typename Comp>
+void heap_sift_down(Iter first, size_t count, size_t root, Comp comp)
+{
+    typename std::iterator_traits<Iter>::value_type value = std::move(first[root]);
+
+    while (true) {
+        size_t child = root * 2 + 1;
+        if (child >= count)
+            break;
+
+        // Pick the larger child.
+        if (child + 1 < count && comp(first[child], first[child + 1]))
+            child++;
+
+        if (!comp(value, first[child]))
+            break;
+
+        first[root] = std::move(first[child]);
+        root = child;
+        instrument_moves(comp, 1);
+    }
+
+    first[root] = std::move(value);
+    instrument_moves(comp, 2);
+}
+
+// Rearrange [first, last) into a max-heap.
+template <typename Iter, typename Comp>
+void heapify(Iter first, Iter last, Comp comp)
+{
+    size_t count = last - first;
+    for (size_t i = count / 2; i > 0; i--)
+        heap_sift_down(first, count, i - 1, comp);
+}
+
+template <typename Iter, typename Comp>
+void heapsort(Iter first, Iter last, Comp comp)
+{
+    heapify(first, last, comp);
+
+    // Repeatedly swap the largest element to the end and shrink the heap.
+    for (size_t count = last - first; count > 1; count--) {
+        sort_swap(first, first + (count - 1), comp);
+        heap_sift_down(first, count - 1, 0, comp);
+    }
+}
+
+// Sort three elements in place.
+template <typename Iter, typename Comp>
+void sort3(Iter a, Iter b, Iter c, Comp comp)
+{
+    if (comp(*b, *a))
+        sort_swap(a, b, comp);
+    if (comp(*c, *b)) {
+        sort_swap(b, c, comp);
+        if (comp(*b, *a))
+            sort_swap(a, b, comp);
+    }
+}
+
+// Choose a pivot for [first, last) and move it to 'first'. The pivot is the
+// median of three elements, or for larger ranges the median of three
+// medians-of-three (Tukey's ninther). Either way, there's an element <= the
+// pivot and an element >= the pivot somewhere after 'first'.
+template <typename Iter, typename Comp>
+void quicksort_choose_pivot(Iter first, Iter last, Comp comp)
+{
+    const size_t nintherThreshold = 128;
+
+    size_t count = last - first;
+    Iter middle = first + count / 2;
+
+    if (count > nintherThreshold) {
+        sort3(first, middle, last - 1, comp);
+        sort3(first + 1, middle - 1, last - 2, comp);
+        sort3(first + 2, middle + 1, last - 3, comp);
+        sort3(middle - 1, middle, middle + 1, comp);
+        sort_swap(first, middle, comp);
+    } else {
+        sort3(middle, first, last - 1, comp);
+    }
+}
+
+// Choose a pivot and partition [first, last) around it. Returns the cut point:
+// everything before it is <= the pivot, everything from it on is >= the pivot.
+// Ranges must have at least 3 elements.
+//
+// The elements left around the pivot by quicksort_choose_pivot stop the scans
+// below, so they don't need bounds checks.
+template <typename Iter, typename Comp>
+Iter quicksort_partition(Iter first, Iter last, Comp comp)
+{
+    quicksort_choose_pivot(first, last, comp);
+
+    Iter pivot = first;
+    Iter left = first + 1;
+    Iter right = last;
+
+    while (true) {
+        while (comp(*left, *pivot))
+            ++left;
+
+        --right;
+        while (comp(*pivot, *right))
+            --right;
+
+        if (!(left < right))
+            return left;
+
+        sort_swap(left, right, comp);
+        ++left;
+    }
 }
 
 template <typename Iter, typename Comp>
-void quicksort(Iter first, Iter last, Comp comp)
+void quicksort_loop(Iter first, Iter last, size_t depthLimit, Comp comp)
+{
+    const ptrdiff_t insertionSortThreshold = 16;
+
+    while (last - first > insertionSortThreshold) {
+
+        if (depthLimit == 0) {
+            // Too many bad pivots, fall back to something with a guaranteed
+            // O(n log n).
+            heapsort(first, last, comp);
+            return;
+        }
+        depthLimit--;
+
+        Iter cut = quicksort_partition(first, last, comp);
+
+        // Recurse into the smaller side and loop on the larger one, so the
+        // stack never gets deeper than O(log n).
+        instrument_enter(comp);
+        if (cut - first < last - cut) {
+            quicksort_loop(first, cut, depthLimit, comp);
+            first = cut;
+        } else {
+            quicksort_loop(cut, last, depthLimit, comp);
+            last = cut;
+        }
+        instrument_leave(comp);
+    }
+
+    insertion_sort(first, last, comp);
+}
+
+// Introsort: quicksort with a median-of-three (or ninther) pivot, handing
+// small ranges to insertion sort, and bailing out to heapsort if the
+// recursion gets deeper than 2*log2(n). Numbers sorted with std::less or
+// std::greater go to the SIMD version instead, where the CPU supports it.
+//
+// 'Instrument' counts what the sort does (see instrument.h), including how
+// deep the recursion goes.
+template <typename Instrument = default_instrument, typename Iter, typename Comp>
+void quicksort(Iter first, Iter last, Comp userComp)
 {
     // 0 or 1 elements is already sorted.
-    if ((first + 1) >= last)
+    if (last - first < 2)
         return;
 
-    Iter pivot = (first + (last - first) / 2);
+    if (sort_with_simd(first, last, userComp, false))
+        return;
+
+    size_t depthLimit = 0;
+    for (size_t n = last - first; n > 1; n /= 2)
+        depthLimit += 2;
 
-    // Move elements according to pivot.
-    Iter insertLeft = first;
-    Iter insertRight = last - 1;
+    auto comp = instrument_comparator<Instrument>::wrap(userComp);
+    instrument_enter(comp);
+    quicksort_loop(first, last, depthLimit, comp);
+    instrument_leave(comp);
+}
 
-    while (insertLeft != insertRight) {
-        if (comp(*insertLeft, *pivot)) {
-            // Left side is on the correct side
-            ++insertLeft;
-            continue;
+// Gather the smallest 'middle - first' elements of [first, last) into a
+// max-heap at [first, middle), looking at each of the rest once. O(n log k).
+template <typename Iter, typename Comp>
+void heap_select(Iter first, Iter middle, Iter last, Comp comp)
+{
+    size_t k = middle - first;
+    heapify(first, middle, comp);
+    for (Iter it = middle; it != last; ++it) {
+        if (comp(*it, *first)) {
+            sort_swap(it, first, comp);
+            heap_sift_down(first, k, 0, comp);
         }
+    }
+}
+
+// Introselect: rearrange [first, last) so that 'nth' holds the element that
+// would be there if the range were sorted, with nothing after it less than it
+// and nothing before it greater. Partitions like quicksort, but only keeps
+// going on the side that holds 'nth', so it takes O(n) on average. Like
+// quicksort, it gives up on bad pivots after 2*log2(n) rounds, and then
+// finishes with a heap select, O(n log n) at worst.
+template <typename Iter, typename Comp>
+void nth_element(Iter first, Iter nth, Iter last, Comp comp)
+{
+    const ptrdiff_t insertionSortThreshold = 16;
+
+    if (nth == last)
+        return;
+
+    size_t depthLimit = 0;
+    for (size_t n = last - first; n > 1; n /= 2)
+        depthLimit += 2;
 
-        if (comp(*pivot, *insertRight)) {
-            // Right side is on the correct side
-            --insertRight;
-            continue;
+    while (last - first > insertionSortThreshold) {
+        if (depthLimit == 0) {
+            // The top of a heap of the smallest nth - first + 1 is the one.
+            heap_select(first, nth + 1, last, comp);
+            sort_swap(first, nth, comp);
+            return;
         }
+        depthLimit--;
 
-        // Both items are on wrong side, fix it.
-        std::swap(*insertLeft, *insertRight);
+        Iter cut = quicksort_partition(first, last, comp);
+        if (nth < cut)
+            last = cut;
+        else
+            first = cut;
+    }
+
+    insertion_sort(first, last, comp);
+}
 
-        // Follow the pivot value, if it just moved.
-        if (pivot == insertLeft)
-            pivot = insertRight;
-        else if (pivot == insertRight)
-            pivot = insertLeft;
+// Sort the smallest 'middle - first' elements of [first, last) into
+// [first, middle), leaving the rest after them in no particular order.
+//
+// Small prefixes are picked out with a max-heap of them, which only has to
+// look at most elements once. Bigger ones are cut out with nth_element and
+// then quicksorted, O(n + k log k) in all.
+template <typename Iter, typename Comp>
+void partial_sort(Iter first, Iter middle, Iter last, Comp comp)
+{
+    size_t k = middle - first;
+    size_t n = last - first;
+    if (k == 0)
+        return;
 
-        ++insertLeft;
+    if (k > n / 64) {
+        if (middle != last)
+            rtl::nth_element(first, middle, last, comp);
+        quicksort(first, middle, comp);
+        return;
+    }
+
+    // Keep the k smallest so far in a heap, with the largest of them on top.
+    heap_select(first, middle, last, comp);
+
+    for (size_t count = k; count > 1; count--) {
+        sort_swap(first, first + (count - 1), comp);
+        heap_sift_down(first, count - 1, 0, comp);
+    }
+}
+
+// Keeps the first 'k' elements (in 'comp' order) of everything it's given,
+// without holding on to the rest. Elements are collected in a buffer of up
+// to 2k; when it fills up, nth_element cuts it back to the best k, and the
+// worst of those becomes a threshold that turns away anything that can't
+// make the cut. That's O(1) time per element on average, and O(k) memory.
+// Of elements that tie at the cut, it's unspecified which are kept.
+template <typename T, typename Comp = std::less<T> >
+class top_k {
+public:
+    explicit top_k(size_t k, Comp comp = Comp())
+      : _k(k), _comp(comp), _pruned(false)
+    {
+        _buffer.reserve(2 * k);
+    }
+
+    void push(T const& x)
+    {
+        if (!accepts(x))
+            return;
+        _buffer.push_back(x);
+        if (_buffer.size() == 2 * _k)
+            prune();
     }
 
-    // Recurse
-    quicksort(first, pivot, comp);
-    quicksort(pivot, last, comp);
+    void push(T&& x)
+    {
+        if (!accepts(x))
+            return;
+        _buffer.push_back(std::move(x));
+        if (_buffer.size() == 2 * _k)
+            prune();
+    }
+
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    void push(I first, I last)
+    {
+        for (; first != last; ++first)
+            push(*first);
+    }
+
+    size_t k() const
+    {
+        return _k;
+    }
+
+    // How many elements are kept so far: up to k.
+    size_t size() const
+    {
+        return std::min(_k, _buffer.size());
+    }
+
+    // The kept elements, sorted.
+    vector<T> sorted() const
+    {
+        vector<T> result(_buffer);
+        rtl::partial_sort(result.begin(), result.begin() + size(), result.end(), _comp);
+        result.erase(result.begin() + size(), result.end());
+        return result;
+    }
+
+    void clear()
+    {
+        _buffer.erase(_buffer.begin(), _buffer.end());
+        _pruned = false;
+    }
+
+private:
+    // Once pruned, the threshold is the kth element, which stays put until
+    // the next prune.
+    bool accepts(T const& x) const
+    {
+        return _k > 0 && (!_pruned || _comp(x, _buffer[_k - 1]));
+    }
+
+    void prune()
+    {
+        rtl::nth_element(_buffer.begin(), _buffer.begin() + (_k - 1), _buffer.end(), _comp);
+        _buffer.erase(_buffer.begin() + _k, _buffer.end());
+        _pruned = true;
+    }
+
+    size_t _k;
+    Comp _comp;
+    vector<T> _buffer;
+    bool _pruned;
+};
+
+// The 8 bytes of 's' from 'depth' on as a big-endian number, padded with
+// zeros past the end. Comparing these compares those bytes of the strings.
+inline uint64_t string_chunk(std::string const& s, size_t depth)
+{
+    size_t size = s.size();
+    if (depth >= size)
+        return 0;
+
+    uint64_t chunk = 0;
+    if (size - depth >= 8) {
+        memcpy(&chunk, s.data() + depth, 8);
+    } else {
+        memcpy(&chunk, s.data() + depth, size - depth);
+    }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return chunk;
+#else
+    return __builtin_bswap64(chunk);
+#endif
+}
+
+// A string being sorted by string_sort, with the 8 bytes it's currently being
+// sorted on.
+struct string_sort_entry {
+    uint64_t chunk;
+    std::string* str;
+};
+
+// Compare two strings that match before 'depth', starting with their chunks.
+inline bool string_sort_less(string_sort_entry const& a, string_sort_entry const& b, size_t depth)
+{
+    if (a.chunk != b.chunk)
+        return a.chunk < b.chunk;
+    return a.str->compare(depth, std::string::npos, *b.str, depth, std::string::npos) < 0;
+}
+
+// How many bytes from 'depth' on all of [first, last) have in common.
+inline size_t string_sort_common_prefix(string_sort_entry* first, string_sort_entry* last,
+                                        size_t depth)
+{
+    std::string const& s = *first->str;
+    size_t common = s.size() - depth;
+    for (string_sort_entry* e = first + 1; e != last && common > 0; ++e) {
+        std::string const& other = *e->str;
+        size_t n = std::min(common, other.size() - depth);
+        size_t i = 0;
+        while (i < n && s[depth + i] == other[depth + i])
+            i++;
+        common = i;
+    }
+    return common;
+}
+
+struct string_sort_chunk_less {
+    bool operator()(string_sort_entry const& a, string_sort_entry const& b) const
+    {
+        return a.chunk < b.chunk;
+    }
+};
+
+// Multikey quicksort of entries whose strings all match before 'depth', and
+// whose chunks hold the 8 bytes from there. The entries are quicksorted on
+// their chunks alone, which leaves runs of strings that tie on those 8 bytes.
+// In each run, strings that ended within them come first, shortest first,
+// and the rest are sorted on from the end of the chunk, skipping whatever
+// else they all have in common. The biggest run is looped on rather than
+// recursed into, so the stack stays O(log n) however long the strings are.
+//
+// That's the same split as a three-way partition on each 8-byte digit, but
+// quicksort's two-way partition swaps less, and it's already tuned.
+inline void string_sort_loop(string_sort_entry* first, string_sort_entry* last, size_t depth)
+{
+    const ptrdiff_t insertionSortThreshold = 16;
+
+    while (last - first > insertionSortThreshold) {
+        quicksort(first, last, string_sort_chunk_less());
+
+        string_sort_entry* biggest = last;
+        string_sort_entry* biggestEnd = last;
+        size_t biggestDepth = depth;
+        for (string_sort_entry* run = first; run != last;) {
+            string_sort_entry* runEnd = run + 1;
+            while (runEnd != last && runEnd->chunk == run->chunk)
+                ++runEnd;
+            if (runEnd - run == 1) {
+                run = runEnd;
+                continue;
+            }
+
+            string_sort_entry* unfinished = std::partition(run, runEnd,
+                [depth](string_sort_entry const& e) { return e.str->size() <= depth + 8; });
+            quicksort(run, unfinished, [](string_sort_entry const& a, string_sort_entry const& b) {
+                return a.str->size() < b.str->size();
+            });
+
+            if (runEnd - unfinished > 1) {
+                size_t runDepth = depth + 8;
+                runDepth += string_sort_common_prefix(unfinished, runEnd, runDepth);
+                for (string_sort_entry* e = unfinished; e != runEnd; ++e)
+                    e->chunk = string_chunk(*e->str, runDepth);
+
+                // Hang on to the biggest run so far, and sort the others now.
+                if (biggest == last) {
+                    biggest = unfinished;
+                    biggestEnd = runEnd;
+                    biggestDepth = runDepth;
+                } else if (runEnd - unfinished > biggestEnd - biggest) {
+                    string_sort_loop(biggest, biggestEnd, biggestDepth);
+                    biggest = unfinished;
+                    biggestEnd = runEnd;
+                    biggestDepth = runDepth;
+                } else {
+                    string_sort_loop(unfinished, runEnd, runDepth);
+                }
+            }
+            run = runEnd;
+        }
+
+        first = biggest;
+        last = biggestEnd;
+        depth = biggestDepth;
+    }
+
+    insertion_sort(first, last, [depth](string_sort_entry const& a, string_sort_entry const& b) {
+        return string_sort_less(a, b, depth);
+    });
+}
+
+// Sort a range of std::strings into ascending order. On big ranges it's
+// about twice as fast as quicksort with std::less, and more when the strings
+// share long prefixes. Not stable (which can't be told apart for strings
+// anyway).
+//
+// Each string goes into a 16-byte entry with a pointer to it and 8 of its
+// bytes as a number, and the entries get a multikey quicksort
+// (string_sort_loop) that mostly just compares those numbers, and never
+// looks at the bytes all the strings in a range share. Then each string is
+// moved into place.
+template <typename Iter>
+void string_sort(Iter first, Iter last)
+{
+    // Small ranges aren't worth setting up the entries for.
+    const size_t comparisonSortThreshold = 64;
+
+    size_t count = last - first;
+    if (count < comparisonSortThreshold) {
+        quicksort(first, last, std::less<std::string>());
+        return;
+    }
+
+    vector<string_sort_entry> entries;
+    entries.reserve(count);
+    for (Iter it = first; it != last; ++it) {
+        string_sort_entry e = { 0, &*it };
+        entries.push_back(e);
+    }
+
+    string_sort_entry* begin = entries.begin();
+    string_sort_entry* end = entries.end();
+    size_t depth = string_sort_common_prefix(begin, end, 0);
+    for (string_sort_entry* e = begin; e != end; ++e)
+        e->chunk = string_chunk(*e->str, depth);
+
+    string_sort_loop(begin, end, depth);
+
+    vector<std::string> sorted;
+    sorted.reserve(count);
+    for (string_sort_entry* e = begin; e != end; ++e)
+        sorted.push_back(std::move(*e->str));
+    std::move(sorted.begin(), sorted.end(), first);
 }
 
 }  // namespace rtl
@@ -0,0 +1,268 @@
+// A work-stealing thread pool, for fork/join style parallelism.
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "vector.h"
+
+namespace rtl {
+
+// Each worker thread owns a queue of tasks. A worker pushes and pops tasks at
+// the back of its own queue (so recently forked work, which is likely still
+// in cache, runs first), and when its queue is empty it steals from the front
+// of the others' queues (which tends to grab the biggest pieces of work).
+//
+// Tasks are usually run through a task_group, which can wait for them.
+class thread_pool {
+public:
+    typedef std::function<void()> task;
+
+    // 'numThreads' of 0 means one per hardware thread.
+    explicit thread_pool(size_t numThreads = 0)
+    {
+        if (numThreads == 0)
+            numThreads = std::thread::hardware_concurrency();
+        if (numThreads == 0)
+            numThreads = 1;
+
+        _pending = 0;
+        _nextQueue = 0;
+        _stopping = false;
+
+        for (size_t i=0; i < numThreads; i++)
+            _queues.push_back(new worker_queue());
+
+        for (size_t i=0; i < numThreads; i++)
+            _threads.push_back(new std::thread(&thread_pool::worker_loop, this, i));
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_sleepMutex);
+            _stopping = true;
+        }
+        _wakeup.notify_all();
+
+        for (size_t i=0; i < _threads.size(); i++) {
+            _threads[i]->join();
+            delete _threads[i];
+        }
+
+        for (size_t i=0; i < _queues.size(); i++)
+            delete _queues[i];
+    }
+
+    // A pool shared by anyone who doesn't need their own, with one thread
+    // per core. Created on first use.
+    static thread_pool& shared()
+    {
+        static thread_pool pool;
+        return pool;
+    }
+
+    size_t size() const
+    {
+        return _threads.size();
+    }
+
+    // Queue a task. From one of our own workers it goes on that worker's
+    // queue, otherwise the queues take turns.
+    void submit(task t)
+    {
+        worker_info& self = current_worker();
+        size_t index;
+        if (self.pool == this)
+            index = self.index;
+        else
+            index = _nextQueue++ % _queues.size();
+
+        // Count it before it's visible, so _pending never goes negative.
+        _pending++;
+
+        {
+            std::lock_guard<std::mutex> lock(_queues[index]->mutex);
+            _queues[index]->tasks.push_back(std::move(t));
+        }
+
+        {
+            // Taking the lock orders this against a worker that's about to
+            // sleep, so the wakeup can't get lost.
+            std::lock_guard<std::mutex> lock(_sleepMutex);
+        }
+        _wakeup.notify_one();
+    }
+
+    // Run one queued task on the calling thread, if there is one. Returns
+    // false if there was nothing to do. Threads waiting on a task_group call
+    // this to help out rather than block.
+    bool run_one()
+    {
+        task t;
+        if (!take_task(t))
+            return false;
+        t();
+        return true;
+    }
+
+private:
+    struct worker_queue {
+        std::mutex mutex;
+        std::deque<task> tasks;
+    };
+
+    struct worker_info {
+        thread_pool* pool;
+        size_t index;
+    };
+
+    static worker_info& current_worker()
+    {
+        static thread_local worker_info info = { NULL, 0 };
+        return info;
+    }
+
+    bool take_task(task& t)
+    {
+        if (_pending == 0)
+            return false;
+
+        // Try our own queue first, newest task first.
+        worker_info& self = current_worker();
+        size_t start = 0;
+        if (self.pool == this) {
+            worker_queue* own = _queues[self.index];
+            std::lock_guard<std::mutex> lock(own->mutex);
+            if (!own->tasks.empty()) {
+                t = std::move(own->tasks.back());
+                own->tasks.pop_back();
+                _pending--;
+                return true;
+            }
+            start = self.index + 1;
+        }
+
+        // Steal the oldest task from someone else.
+        for (size_t i=0; i < _queues.size(); i++) {
+            worker_queue* victim = _queues[(start + i) % _queues.size()];
+            std::lock_guard<std::mutex> lock(victim->mutex);
+            if (!victim->tasks.empty()) {
+                t = std::move(victim->tasks.front());
+                victim->tasks.pop_front();
+                _pending--;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void worker_loop(size_t index)
+    {
+        worker_info& self = current_worker();
+        self.pool = this;
+        self.index = index;
+
+        while (true) {
+            if (run_one())
+                continue;
+
+            std::unique_lock<std::mutex> lock(_sleepMutex);
+            _wakeup.wait(lock, [this]() { return _stopping || _pending > 0; });
+
+            if (_stopping && _pending == 0)
+                return;
+        }
+    }
+
+    vector<worker_queue*> _queues;
+    vector<std::thread*> _threads;
+
+    std::atomic<size_t> _pending;
+    std::atomic<size_t> _nextQueue;
+
+    std::mutex _sleepMutex;
+    std::condition_variable _wakeup;
+    bool _stopping;
+};
+
+// A set of tasks that can be waited on together. Tasks may add more tasks to
+// their own group, so recursive algorithms can fork freely and wait once at
+// the top.
+//
+// If a task throws, the first exception is rethrown from wait().
+class task_group {
+public:
+    explicit task_group(thread_pool& pool = thread_pool::shared())
+      : _pool(pool)
+    {
+        _active = 0;
+    }
+
+    ~task_group()
+    {
+        // Tasks refer to the group, so they can't outlive it.
+        while (_active > 0)
+            help_or_yield();
+    }
+
+    thread_pool& pool()
+    {
+        return _pool;
+    }
+
+    template <typename F> void run(F f)
+    {
+        _active++;
+        _pool.submit([this, f]() mutable {
+            try {
+                f();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(_errorMutex);
+                if (!_error)
+                    _error = std::current_exception();
+            }
+            _active--;
+        });
+    }
+
+    // Wait for every task in the group to finish, running queued tasks on
+    // this thread in the meantime.
+    void wait()
+    {
+        while (_active > 0)
+            help_or_yield();
+
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock(_errorMutex);
+            std::swap(error, _error);
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    task_group(task_group const&);
+    task_group& operator=(task_group const&);
+
+    void help_or_yield()
+    {
+        if (!_pool.run_one())
+            std::this_thread::yield();
+    }
+
+    thread_pool& _pool;
+    std::atomic<size_t> _active;
+
+    std::mutex _errorMutex;
+    std::exception_ptr _error;
+};
+
+}  // namespace rtl
@@ -2,31 +2,157 @@
 #pragma once
 
 #include <cstddef>  // for size_t
+#include <algorithm>
+#include <cstring>  // for memmove
+#include <iterator>
+#include <memory>   // for std::allocator
+#include <new>
+#include <type_traits>
+#include <utility>
 
 #include <cassert>
 
+#include "instrument.h"
+
 // "Remedial Template Library"
 namespace rtl {
 
+// Whether a T can be moved to a new address with a plain memmove, leaving
+// nothing behind to destroy. True for trivially copyable types; specialize it
+// for your own types that don't care about their own address (most types that
+// just own a heap pointer qualify).
+template <typename T>
+struct is_trivially_relocatable
+  : std::integral_constant<bool, std::is_trivially_copyable<T>::value>
+{};
+
+// Move 'n' constructed elements from 'src' to the uninitialized space at
+// 'dest', destroying the originals. The ranges may overlap if dest < src.
+template <typename T>
+void relocate(T* dest, T* src, size_t n, std::true_type)
+{
+    if (n > 0)
+        memmove((void*) dest, (const void*) src, n * sizeof(T));
+}
+
+template <typename T>
+void relocate(T* dest, T* src, size_t n, std::false_type)
+{
+    for (size_t i=0; i < n; i++) {
+        // Falls back to copying if moving might throw.
+        new (&dest[i]) T(std::move_if_noexcept(src[i]));
+        src[i].~T();
+    }
+}
+
+template <typename T>
+void relocate(T* dest, T* src, size_t n)
+{
+    relocate(dest, src, n, is_trivially_relocatable<T>());
+}
+
+// Same as relocate(), but walks backwards, so the ranges may overlap if
+// dest > src.
+template <typename T>
+void relocate_backward(T* dest, T* src, size_t n, std::true_type)
+{
+    if (n > 0)
+        memmove((void*) dest, (const void*) src, n * sizeof(T));
+}
+
+template <typename T>
+void relocate_backward(T* dest, T* src, size_t n, std::false_type)
+{
+    for (size_t i=n; i > 0; i--) {
+        new (&dest[i - 1]) T(std::move_if_noexcept(src[i - 1]));
+        src[i - 1].~T();
+    }
+}
+
+template <typename T>
+void relocate_backward(T* dest, T* src, size_t n)
+{
+    relocate_backward(dest, src, n, is_trivially_relocatable<T>());
+}
+
+// The capacity for a vector to grow to from 'capacity', so that 'n' elements
+// fit.
+inline size_t vector_grow_capacity(size_t capacity, size_t n)
+{
+    // Minimum size is 8.
+    if (n <= 8)
+        return 8;
+
+    // Otherwise, keep doubling.
+    size_t newCapacity = capacity < 8 ? 8 : capacity;
+    while (newCapacity < n)
+        newCapacity *= 2;
+    return newCapacity;
+}
+
+// Whether 'Alloc' has reallocate(p, oldN, newN), which grows a block keeping
+// its bytes (see huge_page_allocator in allocator.h).
+template <typename A>
+std::true_type allocator_reallocate_test(
+    decltype(std::declval<A&>().reallocate((typename A::value_type*) NULL, size_t(0), size_t(0)))*);
+template <typename A>
+std::false_type allocator_reallocate_test(...);
+
+template <typename Alloc>
+struct allocator_can_reallocate : decltype(allocator_reallocate_test<Alloc>(NULL)) {};
+
+// Template parameter for things that take an iterator pair, so that (n, x)
+// with two integers doesn't end up there.
+template <typename I>
+struct enable_if_iterator : std::enable_if<!std::is_integral<I>::value> {};
+
 // Other than the typedef's at the top, I believe that this is pretty much
 // the STL's vector class. It seemed like a good starting point.
-template <typename T>
+//
+// Memory comes from 'Alloc', which can be any std-style allocator (see
+// allocator.h for some). Only the memory: elements are constructed in place
+// directly, and moved around with relocate(). If the allocator can
+// reallocate() and the elements are trivially relocatable, growing hands it
+// the whole buffer instead. Copy assignment keeps the
+// vector's own allocator, swap trades them, and moving takes the other
+// vector's buffer whenever the allocators allow it.
+//
+// 'Instrument' counts element copies and moves, and reallocations (see
+// instrument.h).
+template <typename T, typename Alloc = std::allocator<T>, typename Instrument = default_instrument>
 class vector {
+    typedef std::allocator_traits<Alloc> alloc_traits;
+    static_assert(std::is_same<typename Alloc::value_type, T>::value,
+                  "the allocator's value_type must be T");
+
 public:
+    typedef T value_type;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef Alloc allocator_type;
     typedef size_t size_type;
     typedef T* iterator;
     typedef const T* const_iterator;
     typedef T* reverse_iterator;
     typedef const T* const_reverse_iterator;
 
-    explicit vector()
+    vector()
+    {
+        _count = 0;
+        _capacity = 0;
+        _data = NULL;
+    }
+
+    explicit vector(Alloc const& alloc)
+      : _alloc(alloc)
     {
         _count = 0;
         _capacity = 0;
         _data = NULL;
     }
 
-    explicit vector(size_type n, const T& x = T())
+    explicit vector(size_type n, const T& x = T(), Alloc const& alloc = Alloc())
+      : _alloc(alloc)
     {
         _count = 0;
         _capacity = 0;
@@ -34,7 +160,8 @@ public:
         resize(n, x);
     }
 
-    vector(const vector<T>& v)
+    vector(const vector& v)
+      : _alloc(alloc_traits::select_on_container_copy_construction(v._alloc))
     {
         _count = 0;
         _capacity = 0;
@@ -45,9 +172,12 @@ public:
            new (&_data[i]) T(v[i]);
 
        _count = v.size();
+       Instrument::copy(_count);
     }
 
-    template <typename I> vector(I first, I last)
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    vector(I first, I last, Alloc const& alloc = Alloc())
+      : _alloc(alloc)
     {
         _count = 0;
         _capacity = 0;
@@ -55,9 +185,47 @@ public:
         assign(first, last);
     }
 
-    vector<T> const& operator=(vector const& rhs)
+    // Takes the buffer, leaving 'v' empty.
+    vector(vector&& v) noexcept
+      : _alloc(std::move(v._alloc))
     {
-        assign(rhs.begin(), rhs.end());
+        _data = v._data;
+        _count = v._count;
+        _capacity = v._capacity;
+        v._data = NULL;
+        v._count = 0;
+        v._capacity = 0;
+    }
+
+    vector const& operator=(vector const& rhs)
+    {
+        if (this != &rhs)
+            assign(rhs.begin(), rhs.end());
+        return *this;
+    }
+
+    vector& operator=(vector&& rhs)
+    {
+        if (this == &rhs)
+            return *this;
+
+        // Memory from another allocator can't be freed by ours, so then
+        // only the elements can move.
+        if (!alloc_traits::propagate_on_container_move_assignment::value && !(_alloc == rhs._alloc)) {
+            assign(std::make_move_iterator(rhs.begin()), std::make_move_iterator(rhs.end()));
+            rhs.clear();
+            return *this;
+        }
+
+        clear();
+        if (alloc_traits::propagate_on_container_move_assignment::value)
+            _alloc = std::move(rhs._alloc);
+        _data = rhs._data;
+        _count = rhs._count;
+        _capacity = rhs._capacity;
+        rhs._data = NULL;
+        rhs._count = 0;
+        rhs._capacity = 0;
         return *this;
     }
 
@@ -66,6 +234,11 @@ public:
         clear();
     }
 
+    allocator_type get_allocator() const
+    {
+        return _alloc;
+    }
+
     iterator begin()
     {
         return _data;
@@ -120,12 +293,20 @@ public:
             return;
         }
 
+        // Growing would leave 'copy' behind if it's one of ours.
+        if (size > _capacity && contains(&copy)) {
+            T copyOfCopy(copy);
+            resize(size, copyOfCopy);
+            return;
+        }
+
         reserve(size);
 
         if (_count < size) {
             // Not enough elements, initialize new ones.
             for (size_t i=_count; i < size; i++)
                 new (&_data[i]) T(copy);
+            Instrument::copy(size - _count);
 
         } else if (_count > size) {
             // Too many elements, destroy some.
@@ -146,34 +327,8 @@ public:
     }
     void reserve(size_type n)
     {
-        if (n > _capacity) {
-
-            size_t newCapacity;
-
-            // Figure out the next size.
-            if (n <= 8) {
-                // Minimum size is 8.
-                newCapacity = 8;
-            } else {
-                // Otherwise, round up to the next power of two.
-                newCapacity = _capacity;
-                while (newCapacity < n)
-                    newCapacity *= 2;
-            }
-
-            size_t mallocSize = newCapacity * sizeof(T);
-            T* newData = (T*) malloc(mallocSize);
-
-            // Copy-construct elements over to the new space.
-            for (size_t i=0; i < _count; i++) {
-                new (&newData[i]) T(_data[i]);
-                _data[i].~T();
-            }
-
-            free(_data);
-            _data = newData;
-            _capacity = newCapacity;
-        }
+        if (n > _capacity)
+            grow(vector_grow_capacity(_capacity, n), grows_in_place());
     }
 
     T& operator[](size_type n)
@@ -217,23 +372,11 @@ public:
         return _data[_count - 1];
     }
 
-    template <typename I> void assign(I first, I last)
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    void assign(I first, I last)
     {
         clear();
-
-        // Iterator pass to find out size.
-        size_t size = 0;
-        for (I it = first; it != last; ++it)
-            size++;
-
-        reserve(size);
-
-        // Now copy each element.
-        size_t my_it = 0;
-        for (I their_it = first; their_it != last; ++their_it, ++my_it)
-            new (&_data[my_it]) T(*their_it);
-
-        _count = size;
+        insert_range(0, first, last, typename std::iterator_traits<I>::iterator_category());
     }
     void assign(size_type n, const T& x)
     {
@@ -243,83 +386,140 @@ public:
 
     void push_back(const T& x)
     {
-        resize(_count + 1, x);
+        Instrument::copy(1);
+        emplace_back(x);
+    }
+    void push_back(T&& x)
+    {
+        Instrument::move(1);
+        emplace_back(std::move(x));
+    }
+    // Construct a new element at the end from 'args'.
+    template <typename... Args> void emplace_back(Args&&... args)
+    {
+        if (_count < _capacity) {
+            new (&_data[_count]) T(std::forward<Args>(args)...);
+            _count++;
+            return;
+        }
+
+        size_t newCapacity = vector_grow_capacity(_capacity, _count + 1);
+        if (grows_in_place::value) {
+            // The old buffer may be gone after growing, and 'args' with it.
+            T x(std::forward<Args>(args)...);
+            grow(newCapacity, grows_in_place());
+            new (&_data[_count]) T(std::move(x));
+            Instrument::move(1);
+            _count++;
+            return;
+        }
+
+        // Build the new element in the new buffer before moving the old ones
+        // over, in case 'args' refers to one of them.
+        T* newData = alloc_traits::allocate(_alloc, newCapacity);
+        try {
+            new (&newData[_count]) T(std::forward<Args>(args)...);
+        } catch (...) {
+            alloc_traits::deallocate(_alloc, newData, newCapacity);
+            throw;
+        }
+        Instrument::reallocation(newCapacity * sizeof(T));
+
+        relocate(newData, _data, _count);
+        Instrument::move(_count);
+
+        if (_data != NULL)
+            alloc_traits::deallocate(_alloc, _data, _capacity);
+        _data = newData;
+        _capacity = newCapacity;
+        _count++;
     }
     void pop_back()
     {
-        resize(_count - 1);
+        assert(!empty());
+        _count--;
+        _data[_count].~T();
     }
     iterator insert(iterator p, const T& x)
     {
-        int index = p - _data;
-        insert(p, 1, x);
+        size_t index = p - _data;
+        insert(p, size_type(1), x);
+        return &_data[index];
+    }
+    iterator insert(iterator p, T&& x)
+    {
+        if (contains(&x))
+            return emplace(p, std::move(x));
+
+        size_t index = p - _data;
+        make_gap(index, 1);
+        new (&_data[index]) T(std::move(x));
+        Instrument::move(1);
+        _count++;
+        return &_data[index];
+    }
+    // Construct a new element at 'p' from 'args'. Unless it's going at the
+    // end, it's built first and moved into place, since 'args' may refer to
+    // elements that are about to move.
+    template <typename... Args> iterator emplace(iterator p, Args&&... args)
+    {
+        size_t index = p - _data;
+        if (index == _count) {
+            emplace_back(std::forward<Args>(args)...);
+        } else {
+            T x(std::forward<Args>(args)...);
+            make_gap(index, 1);
+            new (&_data[index]) T(std::move(x));
+            Instrument::move(1);
+            _count++;
+        }
         return &_data[index];
     }
 
     void insert(iterator p, size_type insertCount, const T& x)
     {
-        int insertLoc = p - _data;
-
-        reserve(_count + insertCount);
-        // 'p' is now invalid.
+        size_t insertLoc = p - _data;
 
-        // Move existing elements to the right.
-        for (int i=_count - 1; i >= insertLoc; --i) {
-            new (&_data[i+insertCount]) T(_data[i]);
-            _data[i].~T();
+        if (contains(&x)) {
+            T copy(x);
+            insert(p, insertCount, copy);
+            return;
         }
 
+        make_gap(insertLoc, insertCount);
+
         // Copy inserted element.
-        for (int i=0; i < insertCount; i++)
+        for (size_t i=0; i < insertCount; i++)
             new (&_data[insertLoc + i]) T(x);
+        Instrument::copy(insertCount);
 
         _count += insertCount;
     }
-    template <typename I> void insert(iterator p, I first, I last)
+    template <typename I, typename = typename enable_if_iterator<I>::type>
+    void insert(iterator p, I first, I last)
     {
-        int insertLoc = p - _data;
-
-        // Iterator pass to find out size.
-        int insertCount = 0;
-        for (I it = first; it != last; ++it)
-            insertCount++;
-
-        reserve(_count + insertCount);
-        // 'p' is now invalid.
-
-        // Move existing elements to the right.
-        for (int i=_count - 1; i >= insertLoc; --i) {
-            new (&_data[i+insertCount]) T(_data[i]);
-            _data[i].~T();
-        }
-
-        // Copy inserted elements.
-        int i = insertLoc;
-        for (I it = first; it != last; ++it)
-            new (&_data[i++]) T(*it);
-
-        _count += insertCount;
+        insert_range(p - _data, first, last, typename std::iterator_traits<I>::iterator_category());
     }
     iterator erase(iterator p)
     {
-        int index = p - _data;
+        size_t index = p - _data;
         erase(p, p+1);
         return &_data[index];
     }
     iterator erase(iterator first, iterator last)
     {
-        int firstIndex = first - _data;
-        int lastIndex = last - _data;
+        size_t firstIndex = first - _data;
+        size_t lastIndex = last - _data;
 
         // Destruct the erased items.
-        for (int i=firstIndex; i < lastIndex; i++)
+        for (size_t i=firstIndex; i < lastIndex; i++)
             _data[i].~T();
 
         // Move existing items to the left.
-        int copyDistance = lastIndex - firstIndex;
-        for (int i=firstIndex; i < _count - copyDistance; i++) {
-            new (&_data[i]) T(_data[i + copyDistance]);
-            _data[i + copyDistance].~T();
+        size_t copyDistance = lastIndex - firstIndex;
+        if (lastIndex < _count) {
+            relocate(&_data[firstIndex], &_data[lastIndex], _count - lastIndex);
+            Instrument::move(_count - lastIndex);
         }
 
         _count -= copyDistance;
@@ -327,26 +527,107 @@ public:
         return &_data[firstIndex];
     }
 
-    void swap(vector<T>& v)
+    void swap(vector& v)
     {
+        std::swap(_alloc, v._alloc);
+
         T* temp_data = _data;
         size_t temp_count = _count;
+        size_t temp_capacity = _capacity;
         _data = v._data;
         _count = v._count;
+        _capacity = v._capacity;
         v._data = temp_data;
         v._count = temp_count;
+        v._capacity = temp_capacity;
     }
     void clear()
     {
         for (size_t i=0; i < _count; i++)
             _data[i].~T();
         _count = 0;
-        free(_data);
+        if (_data != NULL)
+            alloc_traits::deallocate(_alloc, _data, _capacity);
         _data = NULL;
         _capacity = 0;
     }
 
 private:
+    typedef std::integral_constant<bool,
+        is_trivially_relocatable<T>::value && allocator_can_reallocate<Alloc>::value> grows_in_place;
+
+    bool contains(const T* p) const
+    {
+        return p >= _data && p < _data + _count;
+    }
+
+    // Grow the buffer to 'newCapacity'. The allocator moves the bytes itself,
+    // without touching the elements.
+    void grow(size_t newCapacity, std::true_type)
+    {
+        _data = _alloc.reallocate(_data, _capacity, newCapacity);
+        _capacity = newCapacity;
+        Instrument::reallocation(newCapacity * sizeof(T));
+    }
+
+    // Otherwise the elements move over to a new buffer.
+    void grow(size_t newCapacity, std::false_type)
+    {
+        T* newData = alloc_traits::allocate(_alloc, newCapacity);
+        Instrument::reallocation(newCapacity * sizeof(T));
+
+        relocate(newData, _data, _count);
+        Instrument::move(_count);
+
+        if (_data != NULL)
+            alloc_traits::deallocate(_alloc, _data, _capacity);
+        _data = newData;
+        _capacity = newCapacity;
+    }
+
+    // Make room for 'insertCount' elements at 'insertLoc', moving the
+    // elements after it to the right. The gap is left uninitialized and
+    // _count unchanged.
+    void make_gap(size_t insertLoc, size_t insertCount)
+    {
+        reserve(_count + insertCount);
+
+        // Move existing elements to the right.
+        relocate_backward(&_data[insertLoc + insertCount], &_data[insertLoc],
+            _count - insertLoc);
+        Instrument::move(_count - insertLoc);
+    }
+
+    // Forward iterators can be counted up front, so there's a single
+    // reserve and the elements after 'insertLoc' move once.
+    template <typename I>
+    void insert_range(size_t insertLoc, I first, I last, std::forward_iterator_tag)
+    {
+        size_t insertCount = std::distance(first, last);
+        make_gap(insertLoc, insertCount);
+
+        // Copy inserted elements.
+        size_t i = insertLoc;
+        for (I it = first; it != last; ++it)
+            new (&_data[i++]) T(*it);
+        Instrument::copy(insertCount);
+
+        _count += insertCount;
+    }
+
+    // Input iterators can only be read once: add them at the end, then
+    // rotate them into place.
+    template <typename I>
+    void insert_range(size_t insertLoc, I first, I last, std::input_iterator_tag)
+    {
+        size_t oldCount = _count;
+        for (; first != last; ++first)
+            emplace_back(*first);
+        Instrument::copy(_count - oldCount);
+        std::rotate(begin() + insertLoc, begin() + oldCount, end());
+    }
+
+    Alloc _alloc;
     T* _data;
     size_t _count;
     size_t _capacity;